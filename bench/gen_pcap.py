@@ -0,0 +1,188 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+#	Copyright (c) 2009 Plecno s.r.l. All Rights Reserved
+#	info@plecno.com
+#	via Giovio 8, 20144 Milano, Italy
+#	Released under the terms of the GPLv3 or later
+#	Author: Oreste Notelli <oreste.notelli@plecno.com>
+
+# deterministic synthetic HTTP traffic for the justniffer benchmarks.
+# The same options and seed always produce the same file; a <output>.json
+# next to it describes what was generated (packets, bytes, requests)
+
+from __future__ import print_function
+import sys
+import json
+import random
+import struct
+from optparse import OptionParser
+
+ETH_IP = b'\x08\x00'
+ETH_IP6 = b'\x86\xdd'
+SYN, FIN, PSH, ACK = 0x02, 0x01, 0x08, 0x10
+
+
+def checksum(data):
+  if len(data) % 2:
+    data += b'\0'
+  s = sum(struct.unpack('!%dH' % (len(data) // 2), data))
+  s = (s >> 16) + (s & 0xffff)
+  s += s >> 16
+  return (~s) & 0xffff
+
+
+class flow:
+  "the packets (without timestamps) of one keep-alive connection"
+  def __init__(self, options, rnd, index):
+    self.options = options
+    self.rnd = rnd
+    self.ipv6 = rnd.random() < options.ipv6
+    self.client = (10, ((index + 1) >> 16) & 0xff, ((index + 1) >> 8) & 0xff, (index + 1) & 0xff)
+    self.server = (192, 168, 0, 1 + index % options.servers)
+    self.cport = 1024 + index % 60000
+    self.sport = 80
+    self.ip_id = index & 0xffff
+    self.packets = []
+    self.requests = 0
+    self.build(index)
+
+  def ip_addr(self, addr):
+    if self.ipv6:
+      return b'\xfd\0' + b'\0' * 10 + struct.pack('!4B', *addr)
+    return struct.pack('!4B', *addr)
+
+  def tcp(self, src, dst, sport, dport, seq, ack, flags, data):
+    header = struct.pack('!HHIIBBHHH', sport, dport, seq & 0xffffffff, ack & 0xffffffff, 5 << 4, flags, 65535, 0, 0)
+    if self.ipv6:
+      pseudo = src + dst + struct.pack('!IxxxB', len(header) + len(data), 6)
+    else:
+      pseudo = src + dst + struct.pack('!BBH', 0, 6, len(header) + len(data))
+    sum_ = checksum(pseudo + header + data)
+    return header[:16] + struct.pack('!H', sum_) + header[18:] + data
+
+  def ip(self, src, dst, payload, frag_offset = 0, more = False, ip_id = 0):
+    flags = (0x2000 if more else 0) | (frag_offset >> 3)
+    header = struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(payload), ip_id, flags, 64, 6, 0, src, dst)
+    return header[:10] + struct.pack('!H', checksum(header)) + header[12:] + payload
+
+  def send(self, from_client, seq, ack, flags, data = b''):
+    src, dst = self.ip_addr(self.client), self.ip_addr(self.server)
+    sport, dport = self.cport, self.sport
+    if not from_client:
+      src, dst, sport, dport = dst, src, dport, sport
+    segment = self.tcp(src, dst, sport, dport, seq, ack, flags, data)
+    if self.ipv6:
+      header = struct.pack('!IHBB', 6 << 28, len(segment), 6, 64) + src + dst
+      self.packets.append(ETH_IP6 + header + segment)
+      return
+    self.ip_id = (self.ip_id + 1) & 0xffff
+    if data and self.rnd.random() < self.options.fragment:
+      cut = max(8, (len(segment) // 2) & ~7)
+      self.packets.append(ETH_IP + self.ip(src, dst, segment[:cut], 0, True, self.ip_id))
+      self.packets.append(ETH_IP + self.ip(src, dst, segment[cut:], cut, False, self.ip_id))
+    else:
+      self.packets.append(ETH_IP + self.ip(src, dst, segment, ip_id = self.ip_id))
+
+  def request(self, n):
+    o = self.options
+    head = 'GET /bench/%d/%d HTTP/1.1\r\nHost: bench.example\r\nUser-Agent: justniffer-bench\r\nAccept: */*\r\nReferer: http://bench.example/\r\n' % (self.cport, n)
+    pad = max(0, o.request_size - len(head) - 11)
+    return (head + 'X-Pad: ' + 'p' * pad + '\r\n\r\n').encode('ascii')
+
+  def response(self):
+    o = self.options
+    return ('HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %d\r\n\r\n' % o.response_size).encode('ascii') + b'r' * o.response_size
+
+  def data(self, from_client, seq, ack, payload):
+    "segments of payload, with the configured loss and reordering"
+    mss = self.options.mss
+    segments = []
+    for i in range(0, len(payload), mss):
+      segments.append((seq + i, payload[i:i + mss]))
+    if len(segments) > 1 and self.rnd.random() < self.options.reorder:
+      i = self.rnd.randrange(len(segments) - 1)
+      segments[i], segments[i + 1] = segments[i + 1], segments[i]
+    for s, chunk in segments:
+      if self.rnd.random() < self.options.loss:
+        continue
+      self.send(from_client, s, ack, PSH | ACK, chunk)
+    return seq + len(payload)
+
+  def build(self, index):
+    cs, ss = 1000 + index * 7, 500000 + index * 13
+    self.send(True, cs, 0, SYN)
+    self.send(False, ss, cs + 1, SYN | ACK)
+    cs += 1
+    ss += 1
+    self.send(True, cs, ss, ACK)
+    for n in range(self.options.keepalive):
+      cs = self.data(True, cs, ss, self.request(n))
+      ss = self.data(False, ss, cs, self.response())
+      self.send(True, cs, ss, ACK)
+      self.requests += 1
+    self.send(True, cs, ss, FIN | ACK)
+    self.send(False, ss, cs + 1, FIN | ACK)
+    self.send(True, cs + 1, ss + 1, ACK)
+
+
+def generate(options, output):
+  rnd = random.Random(options.seed)
+  out = open(output, 'wb')
+  out.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535, 1))
+  usec = 1000000000 * 1000000
+  stats = {'packets': 0, 'bytes': 0, 'requests': 0, 'connections': options.connections}
+  active = []
+  next_flow = 0
+  # round robin over "concurrency" open connections, one packet each
+  while active or next_flow < options.connections:
+    while len(active) < options.concurrency and next_flow < options.connections:
+      f = flow(options, rnd, next_flow)
+      stats['requests'] += f.requests
+      active.append([f, 0])
+      next_flow += 1
+    still = []
+    for item in active:
+      f, pos = item
+      frame = b'\0\0\0\0\0\2' + b'\0\0\0\0\0\1' + f.packets[pos]
+      usec += options.gap
+      out.write(struct.pack('<IIII', usec // 1000000, usec % 1000000, len(frame), len(frame)) + frame)
+      stats['packets'] += 1
+      stats['bytes'] += len(frame)
+      item[1] += 1
+      if item[1] < len(f.packets):
+        still.append(item)
+    active = still
+  out.close()
+  stats['options'] = dict((k, getattr(options, k)) for k in ('connections', 'concurrency', 'keepalive', 'request_size', 'response_size', 'loss', 'reorder', 'fragment', 'ipv6', 'seed'))
+  json.dump(stats, open(output + '.json', 'w'), indent = 1, sort_keys = True)
+  return stats
+
+
+def option_parser():
+  parser = OptionParser(usage = 'usage: %prog [options] output.pcap')
+  parser.add_option('--connections', type = 'int', default = 10000, help = 'tcp connections [%default]')
+  parser.add_option('--concurrency', type = 'int', default = 100, help = 'connections open at the same time [%default]')
+  parser.add_option('--keepalive', type = 'int', default = 1, help = 'requests per connection [%default]')
+  parser.add_option('--request-size', type = 'int', default = 300, help = 'bytes of every request [%default]')
+  parser.add_option('--response-size', type = 'int', default = 2000, help = 'body bytes of every response [%default]')
+  parser.add_option('--loss', type = 'float', default = 0, help = 'probability that a data segment is lost [%default]')
+  parser.add_option('--reorder', type = 'float', default = 0, help = 'probability that two segments of a message are swapped [%default]')
+  parser.add_option('--fragment', type = 'float', default = 0, help = 'probability that an ipv4 data packet is split in two fragments [%default]')
+  parser.add_option('--ipv6', type = 'float', default = 0, help = 'fraction of the connections over ipv6 [%default]')
+  parser.add_option('--servers', type = 'int', default = 16, help = 'distinct server addresses [%default]')
+  parser.add_option('--mss', type = 'int', default = 1460, help = 'max tcp payload per packet [%default]')
+  parser.add_option('--gap', type = 'int', default = 10, help = 'microseconds between two packets [%default]')
+  parser.add_option('--seed', type = 'int', default = 1, help = 'random seed [%default]')
+  return parser
+
+
+def main():
+  parser = option_parser()
+  (options, args) = parser.parse_args()
+  if len(args) != 1:
+    parser.error('missing output file')
+  stats = generate(options, args[0])
+  print('%s: %d packets, %d bytes, %d requests' % (args[0], stats['packets'], stats['bytes'], stats['requests']))
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,66 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+/* LD_PRELOAD shim counting the heap allocations of a process (glibc only).
+   At exit it writes "allocations <n>\nbytes <n>\n" to $MALLOC_COUNT_FILE */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+
+static unsigned long long allocations = 0;
+static unsigned long long bytes = 0;
+
+static void count(size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	__sync_fetch_and_add(&bytes, size);
+}
+
+void *malloc(size_t size)
+{
+	count(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	count(n * size);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count(size);
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	count(size);
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : 12; /* ENOMEM */
+}
+
+static void report(void) __attribute__((destructor));
+
+static void report(void)
+{
+	const char *name = getenv("MALLOC_COUNT_FILE");
+	FILE *out;
+	if (name == NULL || (out = fopen(name, "w")) == NULL)
+		return;
+	fprintf(out, "allocations %llu\nbytes %llu\n", allocations, bytes);
+	fclose(out);
+}
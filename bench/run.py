@@ -0,0 +1,132 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+#	Copyright (c) 2009 Plecno s.r.l. All Rights Reserved
+#	info@plecno.com
+#	via Giovio 8, 20144 Milano, Italy
+#	Released under the terms of the GPLv3 or later
+#	Author: Oreste Notelli <oreste.notelli@plecno.com>
+
+# end to end throughput benchmark: runs justniffer on the generated pcaps
+# with the canonical formats and reports packets/s, Gbit/s, requests/s,
+# peak RSS and heap allocations per request (with the malloc_count shim)
+
+from __future__ import print_function
+import os
+import sys
+import json
+import time
+import tempfile
+import subprocess
+from optparse import OptionParser
+
+import gen_pcap
+
+FORMATS = [
+  ('apache', []),
+  ('raw', ['-r']),
+  ('headers', ['-l', '%source.ip %dest.ip "%request.method %request.url %request.protocol" %response.code %request.header.host() %request.header.user-agent() %request.header.accept() %request.header.referer() %request.header.connection() %response.header.content-type() %response.header.content-length() %response.header.server() %response.header.date()']),
+  ('timing', ['-l', '%connection.time %request.time %response.time %idle.time.0 %idle.time.1 %close.time %session.time']),
+]
+
+SCENARIOS = [
+  ('simple', []),
+  ('keepalive', ['--keepalive', '10', '--connections', '2000']),
+  ('concurrent', ['--concurrency', '2000']),
+  ('large', ['--response-size', '60000', '--connections', '2000']),
+  ('impaired', ['--loss', '0.001', '--reorder', '0.05', '--fragment', '0.05', '--ipv6', '0.1']),
+]
+
+
+def scenario_options(args, scale):
+  options, _ = gen_pcap.option_parser().parse_args(args)
+  options.connections = int(options.connections * scale)
+  return options
+
+
+def run(justniffer, pcap, args, shim):
+  "returns wall seconds, peak rss (KiB) and allocations"
+  env = dict(os.environ)
+  count_file = None
+  if shim:
+    fd, count_file = tempfile.mkstemp(prefix = 'malloc_count')
+    os.close(fd)
+    env['LD_PRELOAD'] = shim
+    env['MALLOC_COUNT_FILE'] = count_file
+  devnull = open(os.devnull, 'w')
+  start = time.time()
+  child = subprocess.Popen([justniffer, '-f', pcap] + args, stdout = devnull, env = env)
+  _, status, usage = os.wait4(child.pid, 0)
+  wall = time.time() - start
+  devnull.close()
+  if status != 0:
+    raise Exception('%s failed with status %d' % (' '.join([justniffer, '-f', pcap] + args), status))
+  allocations = None
+  if count_file:
+    values = dict(line.split() for line in open(count_file))
+    os.unlink(count_file)
+    allocations = int(values.get('allocations', 0))
+  return wall, usage.ru_maxrss, allocations
+
+
+def main():
+  parser = OptionParser(usage = 'usage: %prog [options]')
+  parser.add_option('--justniffer', default = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'src', 'justniffer'), help = 'justniffer binary [%default]')
+  parser.add_option('--shim', default = None, help = 'malloc_count.so, to count the allocations')
+  parser.add_option('--dir', default = 'bench-data', help = 'where the pcaps are generated (and reused) [%default]')
+  parser.add_option('--scale', type = 'float', default = 1, help = 'multiplies the number of connections [%default]')
+  parser.add_option('--runs', type = 'int', default = 3, help = 'runs of every case, the fastest is reported [%default]')
+  parser.add_option('--scenario', action = 'append', help = 'run only this scenario (%s)' % ', '.join(s[0] for s in SCENARIOS))
+  parser.add_option('--format', action = 'append', help = 'run only this format (%s)' % ', '.join(f[0] for f in FORMATS))
+  parser.add_option('--json', default = None, help = 'also write the results to this file')
+  (options, args) = parser.parse_args()
+  if not os.path.isdir(options.dir):
+    os.makedirs(options.dir)
+  empty = os.path.join(options.dir, 'empty.pcap')
+  gen_pcap.generate(scenario_options(['--connections', '0'], 1), empty)
+  results = []
+  print('%-12s %-8s %10s %12s %8s %12s %10s %12s' % ('scenario', 'format', 'seconds', 'packets/s', 'Gbit/s', 'requests/s', 'rss KiB', 'allocs/req'))
+  for name, gen_args in SCENARIOS:
+    if options.scenario and name not in options.scenario:
+      continue
+    gen_options = scenario_options(gen_args, options.scale)
+    pcap = os.path.join(options.dir, '%s-%d.pcap' % (name, gen_options.connections))
+    if os.path.exists(pcap + '.json'):
+      stats = json.load(open(pcap + '.json'))
+    else:
+      stats = gen_pcap.generate(gen_options, pcap)
+    for format_name, format_args in FORMATS:
+      if options.format and format_name not in options.format:
+        continue
+      best = None
+      for i in range(options.runs):
+        wall, rss, _ = run(options.justniffer, pcap, format_args, None)
+        if best is None or wall < best[0]:
+          best = (wall, rss)
+      wall, rss = best
+      allocs_per_request = None
+      if options.shim:
+        # the startup allocations are measured on an empty capture and left out
+        _, _, baseline = run(options.justniffer, empty, format_args, options.shim)
+        _, _, allocations = run(options.justniffer, pcap, format_args, options.shim)
+        allocs_per_request = float(allocations - baseline) / max(1, stats['requests'])
+      result = {
+        'scenario': name,
+        'format': format_name,
+        'seconds': wall,
+        'packets_per_second': stats['packets'] / wall,
+        'gbit_per_second': stats['bytes'] * 8 / wall / 1e9,
+        'requests_per_second': stats['requests'] / wall,
+        'peak_rss_kib': rss,
+        'allocations_per_request': allocs_per_request,
+        'packets': stats['packets'],
+        'requests': stats['requests'],
+      }
+      results.append(result)
+      print('%-12s %-8s %10.3f %12.0f %8.3f %12.0f %10d %12s' % (name, format_name, wall, result['packets_per_second'], result['gbit_per_second'],
+        result['requests_per_second'], rss, '-' if allocs_per_request is None else '%.1f' % allocs_per_request))
+      sys.stdout.flush()
+  if options.json:
+    json.dump(results, open(options.json, 'w'), indent = 1, sort_keys = True)
+
+if __name__ == '__main__':
+  main()
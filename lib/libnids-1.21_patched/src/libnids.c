@@ -72,6 +72,24 @@ char nids_errbuf[PCAP_ERRBUF_SIZE];
 struct pcap_pkthdr * nids_last_pcap_header = NULL;
 u_char *nids_last_pcap_data = NULL;
 u_int nids_linkoffset = 0;
+static u_int64_t nids_packets = 0;
+static u_int64_t nids_bytes = 0;
+u_int nids_profile_every = 0;
+static u_int profile_seed = 2463534242U;
+static u_int64_t pcap_read_start = 0;
+static struct nids_stage stages[NIDS_STAGES] = {
+    {"pcap read (and idle)"},
+    {"nids_pcap_handler"},
+    {"gen_ip_frag_proc"},
+    {"process_tcp"},
+    {"process_udp"}
+};
+
+/* time the enclosed calls of stage n, see nids_profile() */
+#define STAGE_BEGIN(n) \
+    u_int64_t span_##n = nids_profile_every ? nids_span_begin(&stages[n]) : 0
+#define STAGE_END(n) \
+    if (span_##n) nids_span_end(&stages[n], span_##n)
 
 char *nids_warnings[] = {
     "Murphy - you never should see this message !",
@@ -216,7 +234,22 @@ static void call_ip_frag_procs(void *data,bpf_u_int32 caplen, struct timeval* ts
 #define LLC_OFFSET_TO_TYPE_FIELD 6
 #define ETHERTYPE_IP 0x0800
 
+static void pcap_handler_body(u_char *, struct pcap_pkthdr *, u_char *);
+
 void nids_pcap_handler(u_char * par, struct pcap_pkthdr *hdr, u_char * data)
+{
+    STAGE_BEGIN(NIDS_STAGE_PCAP_HANDLER);
+    if (pcap_read_start) {
+	nids_span_end(&stages[NIDS_STAGE_PCAP], pcap_read_start);
+	pcap_read_start = 0;
+    }
+    pcap_handler_body(par, hdr, data);
+    STAGE_END(NIDS_STAGE_PCAP_HANDLER);
+    if (nids_profile_every)
+	pcap_read_start = nids_span_begin(&stages[NIDS_STAGE_PCAP]);
+}
+
+static void pcap_handler_body(u_char * par, struct pcap_pkthdr *hdr, u_char * data)
 {
     u_char *data_aligned;
 #ifdef HAVE_LIBGTHREAD_2_0
@@ -237,6 +270,8 @@ void nids_pcap_handler(u_char * par, struct pcap_pkthdr *hdr, u_char * data)
 
     nids_last_pcap_header = hdr;
     nids_last_pcap_data = data;
+    nids_packets++;
+    nids_bytes += hdr->caplen;
     (void)par; /* warnings... */
     switch (linktype) {
     case DLT_EN10MB:
@@ -344,7 +379,16 @@ void nids_pcap_handler(u_char * par, struct pcap_pkthdr *hdr, u_char * data)
  #endif
 }
 
+static void ip_frag_body(u_char *, int, struct timeval *);
+
 static void gen_ip_frag_proc(u_char * data, int len, struct timeval* ts)
+{
+    STAGE_BEGIN(NIDS_STAGE_IP_FRAG);
+    ip_frag_body(data, len, ts);
+    STAGE_END(NIDS_STAGE_IP_FRAG);
+}
+
+static void ip_frag_body(u_char * data, int len, struct timeval* ts)
 {
     struct proc_node *i;
     struct ip *iph = (struct ip *) data;
@@ -426,7 +470,7 @@ static void process_udp(char *data, struct timeval* ts)
     addr.daddr = iph->ip_dst.s_addr;
     while (ipp) {
 	ipp->item(&addr, ((char *) udph) + sizeof(struct udphdr),
-		  ulen - sizeof(struct udphdr), data);
+		  ulen - sizeof(struct udphdr), data, ts);
 	ipp = ipp->next;
     }
 }
@@ -434,12 +478,18 @@ static void process_udp(char *data, struct timeval* ts)
 static void gen_ip_proc(u_char * data, int skblen, struct timeval* ts)
 {
 	switch (((struct ip *) data)->ip_p) {
-    case IPPROTO_TCP:
+    case IPPROTO_TCP: {
+	STAGE_BEGIN(NIDS_STAGE_TCP);
 	process_tcp(data, skblen,  ts);
+	STAGE_END(NIDS_STAGE_TCP);
 	break;
-    case IPPROTO_UDP:
+    }
+    case IPPROTO_UDP: {
+	STAGE_BEGIN(NIDS_STAGE_UDP);
 	process_udp(data,  ts);
+	STAGE_END(NIDS_STAGE_UDP);
 	break;
+    }
     case IPPROTO_ICMP:
 	if (nids_params.n_tcp_streams)
 	    process_icmp(data, ts);
@@ -678,6 +728,24 @@ int nids_run()
     return 0;
 }
 
+int nids_loop()
+{
+    if (!desc) {
+	strcpy(nids_errbuf, "Libnids not initialized");
+	return 0;
+    }
+    START_CAP_QUEUE_PROCESS_THREAD(); /* threading... */
+    pcap_loop(desc, -1, (pcap_handler) nids_pcap_handler, 0);
+    STOP_CAP_QUEUE_PROCESS_THREAD(); 
+    return 1;
+}
+
+void nids_stop()
+{
+    if (desc)
+	pcap_breakloop(desc);
+}
+
 void nids_exit()
 {
     if (!desc) {
@@ -703,6 +771,117 @@ void nids_exit()
     desc = NULL;
 }
 
+int nids_datalink()
+{
+    return linktype;
+}
+
+/* the filter set by nids_setfilter, for the next files too */
+static char *current_filter = NULL;
+
+static int apply_filter(pcap_t * p, char *filter)
+{
+    u_int mask = 0;
+    struct bpf_program fcode;
+
+    if (pcap_compile(p, &fcode, filter, 1, mask) < 0) {
+	strncpy(nids_errbuf, pcap_geterr(p), PCAP_ERRBUF_SIZE - 1);
+	return 0;
+    }
+    if (pcap_setfilter(p, &fcode) == -1) {
+	strncpy(nids_errbuf, pcap_geterr(p), PCAP_ERRBUF_SIZE - 1);
+	pcap_freecode(&fcode);
+	return 0;
+    }
+    pcap_freecode(&fcode);
+    return 1;
+}
+
+int nids_setfilter(char *filter)
+{
+    char *copy;
+
+    if (!desc) {
+	strcpy(nids_errbuf, "capture not started");
+	return 0;
+    }
+    if (!apply_filter(desc, filter))
+	return 0;
+    if ((copy = strdup(filter))) {
+	free(current_filter);
+	current_filter = copy;
+    }
+    return 1;
+}
+
+int nids_next_file(char *filename)
+{
+    pcap_t *next;
+    char *filter = current_filter ? current_filter : nids_params.pcap_filter;
+
+    if (!desc || nids_params.pcap_desc || !nids_params.filename) {
+	strcpy(nids_errbuf, "not reading a capture file");
+	return 0;
+    }
+    if ((next = pcap_open_offline(filename, nids_errbuf)) == NULL)
+	return 0;
+    /* the offsets of the link layer were computed for the first file */
+    if (pcap_datalink(next) != linktype) {
+	strcpy(nids_errbuf, "link type differs from the previous files");
+	pcap_close(next);
+	return 0;
+    }
+    if (filter && !apply_filter(next, filter)) {
+	pcap_close(next);
+	return 0;
+    }
+    /* they point into the previous file */
+    nids_last_pcap_header = NULL;
+    nids_last_pcap_data = NULL;
+    pcap_close(desc);
+    desc = next;
+    return 1;
+}
+
+void nids_get_stats(struct nids_stats *stats)
+{
+    struct pcap_stat ps;
+
+    memset(stats, 0, sizeof(struct nids_stats));
+    stats->packets = nids_packets;
+    stats->bytes = nids_bytes;
+    tcp_stats(&stats->tcp_streams, &stats->tcp_ooo_bytes);
+    if (desc && !nids_params.filename && pcap_stats(desc, &ps) == 0) {
+	stats->pcap_received = ps.ps_recv;
+	stats->pcap_dropped = ps.ps_drop;
+	stats->pcap_ifdropped = ps.ps_ifdrop;
+    }
+}
+
+/* starts (or with 0 stops) timing about one call every "every" in each
+   stage; the calls are always counted while profiling */
+void nids_profile(u_int every)
+{
+    nids_profile_every = every;
+    pcap_read_start = 0;
+}
+
+struct nids_stage *nids_get_stages()
+{
+    return stages;
+}
+
+/* a random gap between 1 and 2 * nids_profile_every - 1 (xorshift) */
+u_int nids_span_interval()
+{
+    profile_seed ^= profile_seed << 13;
+    profile_seed ^= profile_seed >> 17;
+    profile_seed ^= profile_seed << 5;
+    if (nids_profile_every <= 1)
+	return 1;
+    return 1 + profile_seed % (2 * nids_profile_every - 1);
+}
+
 int nids_getfd()
 {
     if (!desc) {
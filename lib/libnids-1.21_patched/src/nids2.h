@@ -12,6 +12,8 @@
 # include <netinet/ip.h>
 # include <netinet/tcp.h>
 # include <pcap.h>
+# include <time.h>
+# include <stdio.h>
 
 # ifdef __cplusplus
 extern "C" {
@@ -135,6 +137,37 @@ struct nids_prm
   pcap_t *pcap_desc;
 };
 
+struct nids_stats
+{
+  u_int64_t packets;		/* packets read from pcap */
+  u_int64_t bytes;		/* captured bytes */
+  int tcp_streams;		/* tcp streams currently tracked */
+  int tcp_ooo_bytes;		/* bytes queued waiting for missing segments */
+  u_int pcap_received;		/* pcap_stats(), zero when reading a file */
+  u_int pcap_dropped;
+  u_int pcap_ifdropped;
+};
+
+/* sampled cycle counters of a processing stage, see nids_profile() */
+struct nids_stage
+{
+  const char *name;
+  u_int64_t events;		/* calls */
+  u_int64_t sampled;		/* calls that were timed */
+  u_int64_t cycles;		/* cycles spent in the timed calls */
+  u_int countdown;		/* calls left before the next timed one */
+};
+
+enum
+{
+  NIDS_STAGE_PCAP = 0,		/* between two packets: pcap read and idle */
+  NIDS_STAGE_PCAP_HANDLER,
+  NIDS_STAGE_IP_FRAG,
+  NIDS_STAGE_TCP,
+  NIDS_STAGE_UDP,
+  NIDS_STAGES
+};
+
 struct tcp_timeout
 {
   struct tcp_stream *a_tcp;
@@ -147,6 +180,7 @@ int nids_init (void);
 void nids_register_ip_frag (void (*));
 void nids_register_ip (void (*));
 void nids_register_tcp (void (*));
+/* void (*)(struct tuple4 *, char *data, int len, char *iphdr, struct timeval *ts) */
 void nids_register_udp (void (*));
 void nids_killtcp (struct tcp_stream *);
 void nids_discard (struct tcp_stream *, int);
@@ -158,6 +192,26 @@ int nids_next (void);
 void nids_pcap_handler(u_char *, struct pcap_pkthdr *, u_char *);
 struct tcp_stream *nids_find_tcp_stream(struct tuple4 *);
 void nids_free_tcp_stream(struct tcp_stream *);
+void nids_get_stats(struct nids_stats *);
+void nids_profile(u_int);
+struct nids_stage *nids_get_stages(void);
+u_int nids_span_interval(void);
+/* the link type of the capture (DLT_*), after nids_init */
+int nids_datalink(void);
+/* like nids_run, but the streams are left open: nids_tcp_checkpoint can save them */
+int nids_loop(void);
+/* ends nids_run or nids_loop after the packet being processed, from a signal handler too */
+void nids_stop(void);
+/* writes the tcp streams (state, data not read yet, out of order packets), returns how many or -1 */
+int nids_tcp_checkpoint(FILE *);
+/* adds the streams written by nids_tcp_checkpoint, after nids_init and nids_register_tcp;
+   the tcp callbacks are not called. Returns how many or -1 (see nids_errbuf) */
+int nids_tcp_restore(FILE *);
+/* replaces the filter of the capture (e.g. on a reload), 0 on error (see nids_errbuf) */
+int nids_setfilter(char *);
+/* goes on with another capture file after nids_loop returned at the end of
+   the previous one: the streams are kept. 0 on error (see nids_errbuf) */
+int nids_next_file(char *);
 
 extern struct nids_prm nids_params;
 extern char *nids_warnings[];
@@ -166,6 +220,41 @@ extern struct pcap_pkthdr *nids_last_pcap_header;
 extern u_char *nids_last_pcap_data;
 extern u_int nids_linkoffset;
 extern struct tcp_timeout *nids_tcp_timeouts;
+extern u_int nids_profile_every;
+
+/* the TSC where available, nanoseconds otherwise */
+static __inline__ u_int64_t nids_cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+  u_int lo, hi;
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((u_int64_t) hi << 32) | lo;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (u_int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+/* counts a call of the stage, returns its start time if it has to be timed,
+   0 otherwise. The timed calls are spaced randomly so that periodic
+   patterns in the traffic don't bias the sample */
+static __inline__ u_int64_t nids_span_begin(struct nids_stage *stage)
+{
+  stage->events++;
+  if (stage->countdown > 1) {
+    stage->countdown--;
+    return 0;
+  }
+  stage->countdown = nids_span_interval();
+  return nids_cycles();
+}
+
+static __inline__ void nids_span_end(struct nids_stage *stage, u_int64_t start)
+{
+  stage->sampled++;
+  stage->cycles += nids_cycles() - start;
+}
 
 struct nids_chksum_ctl {
 	u_int netaddr;
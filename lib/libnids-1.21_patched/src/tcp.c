@@ -52,6 +52,7 @@ extern struct proc_node *tcp_procs;
 static struct tcp_stream **tcp_stream_table;
 static struct tcp_stream *streams_pool;
 static int tcp_num = 0;
+static int tcp_ooo_bytes = 0;
 static int tcp_stream_table_size;
 static int max_stream;
 static struct tcp_stream *tcp_latest = 0, *tcp_oldest = 0;
@@ -70,20 +71,19 @@ static void purge_queue(struct half_stream * h)
     p = tmp;
   }
   h->list = h->listtail = 0;
+  tcp_ooo_bytes -= h->rmem_alloc;
   h->rmem_alloc = 0;
 }
 
 static void
-add_tcp_closing_timeout(struct tcp_stream * a_tcp)
+insert_tcp_closing_timeout(struct tcp_stream * a_tcp, time_t when)
 {
   struct tcp_timeout *to;
   struct tcp_timeout *newto;
 
-  if (!nids_params.tcp_workarounds)
-    return;
   newto = malloc(sizeof (struct tcp_timeout));
   newto->a_tcp = a_tcp;
-  newto->timeout.tv_sec = nids_last_pcap_header->ts.tv_sec + 10;
+  newto->timeout.tv_sec = when;
   newto->prev = 0;
   for (newto->next = to = nids_tcp_timeouts; to; newto->next = to = to->next) {
     if (to->a_tcp == a_tcp) {
@@ -102,6 +102,14 @@ add_tcp_closing_timeout(struct tcp_stream * a_tcp)
     newto->next->prev = newto;
 }
 
+static void
+add_tcp_closing_timeout(struct tcp_stream * a_tcp)
+{
+  if (!nids_params.tcp_workarounds)
+    return;
+  insert_tcp_closing_timeout(a_tcp, nids_last_pcap_header->ts.tv_sec + 10);
+}
+
 static void
 del_tcp_closing_timeout(struct tcp_stream * a_tcp)
 {
@@ -521,6 +529,7 @@ tcp_queue(struct tcp_stream * a_tcp, struct tcphdr * this_tcphdr,
 		       pakiet->len, pakiet->seq, pakiet->fin, pakiet->urg,
 		       pakiet->urg_ptr + pakiet->seq - 1, t);
 	  rcv->rmem_alloc -= pakiet->truesize;
+	  tcp_ooo_bytes -= pakiet->truesize;
 	  if (pakiet->prev)
 	    pakiet->prev->next = pakiet->next;
 	  else
@@ -547,6 +556,7 @@ tcp_queue(struct tcp_stream * a_tcp, struct tcphdr * this_tcphdr,
     pakiet = mknew(struct skbuff);
     pakiet->truesize = skblen;
     rcv->rmem_alloc += pakiet->truesize;
+    tcp_ooo_bytes += pakiet->truesize;
     pakiet->len = datalen;
     pakiet->data = malloc(datalen);
     if (!pakiet->data)
@@ -608,6 +618,7 @@ prune_queue(struct half_stream * rcv, struct tcphdr * this_tcphdr)
     p = tmp;
   }
   rcv->list = rcv->listtail = 0;
+  tcp_ooo_bytes -= rcv->rmem_alloc;
   rcv->rmem_alloc = 0;
 }
 
@@ -948,6 +959,338 @@ process_tcp(u_char * data, int skblen, struct timeval* ts)
     nids_free_tcp_stream(a_tcp);
 }
 
+/*
+ * Checkpoint: the streams from the oldest to the latest, then the closing
+ * timeouts in their order. A half stream is its state, the data not read
+ * yet and the out of order packets. The layout is the one of this build:
+ * the header has the sizes of the records, a file of another layout is
+ * refused
+ */
+
+#define CHECKPOINT_MAGIC 0x4e49444b	/* NIDK */
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header {
+  u_int magic;
+  u_int version;
+  u_int stream_size;
+  u_int half_size;
+  u_int skb_size;
+  u_int streams;
+  u_int timeouts;
+};
+
+struct checkpoint_stream {
+  struct tuple4 addr;
+  char nids_state;
+  char whatto;			/* of the listeners together */
+};
+
+struct checkpoint_half {
+  char state;
+  char collect;
+  char collect_urg;
+  u_char urgdata;
+  u_char count_new_urg;
+  u_char urg_seen;
+  u_char ts_on;
+  u_char wscale_on;
+  int count;
+  int urg_count;
+  u_int acked;
+  u_int seq;
+  u_int ack_seq;
+  u_int first_data_seq;
+  u_int urg_ptr;
+  u_short window;
+  u_int curr_ts;
+  u_int wscale;
+  u_int data_len;		/* count - offset bytes follow */
+  u_int skbs;			/* then the out of order packets */
+};
+
+struct checkpoint_skb {
+  u_int len;
+  u_int truesize;
+  u_int urg_ptr;
+  char fin;
+  char urg;
+  u_int seq;
+  u_int ack;
+};
+
+struct checkpoint_timeout {
+  struct tuple4 addr;
+  time_t sec;
+};
+
+static int
+write_half(FILE * f, struct half_stream * h)
+{
+  struct checkpoint_half c;
+  struct checkpoint_skb cs;
+  struct skbuff *p;
+
+  memset(&c, 0, sizeof(c));
+  c.state = h->state;
+  c.collect = h->collect;
+  c.collect_urg = h->collect_urg;
+  c.urgdata = h->urgdata;
+  c.count_new_urg = h->count_new_urg;
+  c.urg_seen = h->urg_seen;
+  c.ts_on = h->ts_on;
+  c.wscale_on = h->wscale_on;
+  c.count = h->count;
+  c.urg_count = h->urg_count;
+  c.acked = h->acked;
+  c.seq = h->seq;
+  c.ack_seq = h->ack_seq;
+  c.first_data_seq = h->first_data_seq;
+  c.urg_ptr = h->urg_ptr;
+  c.window = h->window;
+  c.curr_ts = h->curr_ts;
+  c.wscale = h->wscale;
+  c.data_len = h->data ? h->count - h->offset : 0;
+  for (p = h->list; p; p = p->next)
+    c.skbs++;
+  if (fwrite(&c, sizeof(c), 1, f) != 1)
+    return 0;
+  if (c.data_len && fwrite(h->data, c.data_len, 1, f) != 1)
+    return 0;
+  for (p = h->list; p; p = p->next) {
+    memset(&cs, 0, sizeof(cs));
+    cs.len = p->len;
+    cs.truesize = p->truesize;
+    cs.urg_ptr = p->urg_ptr;
+    cs.fin = p->fin;
+    cs.urg = p->urg;
+    cs.seq = p->seq;
+    cs.ack = p->ack;
+    if (fwrite(&cs, sizeof(cs), 1, f) != 1)
+      return 0;
+    if (p->len && fwrite(p->data, p->len, 1, f) != 1)
+      return 0;
+  }
+  return 1;
+}
+
+int
+nids_tcp_checkpoint(FILE * f)
+{
+  struct checkpoint_header header;
+  struct checkpoint_stream cs;
+  struct checkpoint_timeout ct;
+  struct tcp_stream *a_tcp;
+  struct tcp_timeout *to;
+  struct lurker_node *i;
+
+  if (!tcp_stream_table)
+    return -1;
+  memset(&header, 0, sizeof(header));
+  header.magic = CHECKPOINT_MAGIC;
+  header.version = CHECKPOINT_VERSION;
+  header.stream_size = sizeof(struct checkpoint_stream);
+  header.half_size = sizeof(struct checkpoint_half);
+  header.skb_size = sizeof(struct checkpoint_skb);
+  header.streams = tcp_num;
+  for (to = nids_tcp_timeouts; to; to = to->next)
+    header.timeouts++;
+  if (fwrite(&header, sizeof(header), 1, f) != 1)
+    return -1;
+  for (a_tcp = tcp_oldest; a_tcp; a_tcp = a_tcp->prev_time) {
+    memset(&cs, 0, sizeof(cs));
+    cs.addr = a_tcp->addr;
+    cs.nids_state = a_tcp->nids_state;
+    for (i = a_tcp->listeners; i; i = i->next)
+      cs.whatto |= i->whatto;
+    if (fwrite(&cs, sizeof(cs), 1, f) != 1 ||
+	!write_half(f, &a_tcp->client) || !write_half(f, &a_tcp->server))
+      return -1;
+  }
+  for (to = nids_tcp_timeouts; to; to = to->next) {
+    memset(&ct, 0, sizeof(ct));
+    ct.addr = to->a_tcp->addr;
+    ct.sec = to->timeout.tv_sec;
+    if (fwrite(&ct, sizeof(ct), 1, f) != 1)
+      return -1;
+  }
+  return header.streams;
+}
+
+/* h is NULL to skip the half stream */
+static int
+read_half(FILE * f, struct half_stream * h)
+{
+  struct checkpoint_half c;
+  struct checkpoint_skb cs;
+  struct skbuff *p;
+  u_int n;
+
+  if (fread(&c, sizeof(c), 1, f) != 1)
+    return 0;
+  if (!h) {
+    if (c.data_len && fseek(f, c.data_len, SEEK_CUR))
+      return 0;
+    for (n = 0; n < c.skbs; n++)
+      if (fread(&cs, sizeof(cs), 1, f) != 1 ||
+	  (cs.len && fseek(f, cs.len, SEEK_CUR)))
+	return 0;
+    return 1;
+  }
+  h->state = c.state;
+  h->collect = c.collect;
+  h->collect_urg = c.collect_urg;
+  h->urgdata = c.urgdata;
+  h->count_new_urg = c.count_new_urg;
+  h->urg_seen = c.urg_seen;
+  h->ts_on = c.ts_on;
+  h->wscale_on = c.wscale_on;
+  h->count = c.count;
+  h->offset = c.count - c.data_len;
+  h->urg_count = c.urg_count;
+  h->acked = c.acked;
+  h->seq = c.seq;
+  h->ack_seq = c.ack_seq;
+  h->first_data_seq = c.first_data_seq;
+  h->urg_ptr = c.urg_ptr;
+  h->window = c.window;
+  h->curr_ts = c.curr_ts;
+  h->wscale = c.wscale;
+  if (c.data_len) {
+    h->bufsize = c.data_len < 2048 ? 4096 : c.data_len * 2;
+    h->data = malloc(h->bufsize);
+    if (!h->data)
+      nids_params.no_mem("nids_tcp_restore");
+    if (fread(h->data, c.data_len, 1, f) != 1)
+      return 0;
+  }
+  for (n = 0; n < c.skbs; n++) {
+    if (fread(&cs, sizeof(cs), 1, f) != 1)
+      return 0;
+    p = mknew(struct skbuff);
+    p->len = cs.len;
+    p->truesize = cs.truesize;
+    p->urg_ptr = cs.urg_ptr;
+    p->fin = cs.fin;
+    p->urg = cs.urg;
+    p->seq = cs.seq;
+    p->ack = cs.ack;
+    p->data = malloc(cs.len ? cs.len : 1);
+    if (!p->data)
+      nids_params.no_mem("nids_tcp_restore");
+    p->next = 0;
+    p->prev = h->listtail;
+    if (h->listtail)
+      h->listtail->next = p;
+    else
+      h->list = p;
+    h->listtail = p;
+    h->rmem_alloc += p->truesize;
+    tcp_ooo_bytes += p->truesize;
+    if (cs.len && fread(p->data, cs.len, 1, f) != 1)
+      return 0;
+  }
+  return 1;
+}
+
+int
+nids_tcp_restore(FILE * f)
+{
+  struct checkpoint_header header;
+  struct checkpoint_stream cs;
+  struct checkpoint_timeout ct;
+  struct tcp_stream *a_tcp;
+  struct tcp_timeout *last, *to;
+  struct proc_node *p;
+  struct lurker_node *j;
+  int restored = 0;
+  u_int n;
+
+  if (!tcp_stream_table) {
+    strcpy(nids_errbuf, "libnids not initialized");
+    return -1;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION ||
+      header.stream_size != sizeof(struct checkpoint_stream) ||
+      header.half_size != sizeof(struct checkpoint_half) ||
+      header.skb_size != sizeof(struct checkpoint_skb)) {
+    strcpy(nids_errbuf, "not a checkpoint of this version");
+    return -1;
+  }
+  for (n = 0; n < header.streams; n++) {
+    if (fread(&cs, sizeof(cs), 1, f) != 1)
+      goto truncated;
+    /* the table is full, or the stream is there already */
+    if (tcp_num > max_stream || !free_streams || nids_find_tcp_stream(&cs.addr)) {
+      if (!read_half(f, 0) || !read_half(f, 0))
+	goto truncated;
+      continue;
+    }
+    a_tcp = free_streams;
+    free_streams = a_tcp->next_free;
+    tcp_num++;
+    memset(a_tcp, 0, sizeof(struct tcp_stream));
+    a_tcp->addr = cs.addr;
+    a_tcp->nids_state = cs.nids_state;
+    a_tcp->hash_index = mk_hash_index(cs.addr);
+    a_tcp->next_node = tcp_stream_table[a_tcp->hash_index];
+    if (a_tcp->next_node)
+      a_tcp->next_node->prev_node = a_tcp;
+    tcp_stream_table[a_tcp->hash_index] = a_tcp;
+    a_tcp->next_time = tcp_latest;
+    if (!tcp_oldest)
+      tcp_oldest = a_tcp;
+    if (tcp_latest)
+      tcp_latest->prev_time = a_tcp;
+    tcp_latest = a_tcp;
+    /* the callbacks of this process listen to what the old ones did */
+    if (cs.whatto)
+      for (p = tcp_procs; p; p = p->next) {
+	j = mknew(struct lurker_node);
+	j->item = p->item;
+	j->data = 0;
+	j->whatto = cs.whatto;
+	j->next = a_tcp->listeners;
+	a_tcp->listeners = j;
+      }
+    restored++;
+    if (!read_half(f, &a_tcp->client) || !read_half(f, &a_tcp->server))
+      goto truncated;
+  }
+  for (last = nids_tcp_timeouts; last && last->next; last = last->next);
+  for (n = 0; n < header.timeouts; n++) {
+    if (fread(&ct, sizeof(ct), 1, f) != 1)
+      goto truncated;
+    if (!(a_tcp = nids_find_tcp_stream(&ct.addr)))
+      continue;
+    /* in order, at the end */
+    to = mknew(struct tcp_timeout);
+    to->a_tcp = a_tcp;
+    to->timeout.tv_sec = ct.sec;
+    to->timeout.tv_usec = 0;
+    to->next = 0;
+    to->prev = last;
+    if (last)
+      last->next = to;
+    else
+      nids_tcp_timeouts = to;
+    last = to;
+  }
+  return restored;
+
+ truncated:
+  strcpy(nids_errbuf, "truncated checkpoint");
+  return -1;
+}
+
+void
+tcp_stats(int *streams, int *ooo_bytes)
+{
+  *streams = tcp_num;
+  *ooo_bytes = tcp_ooo_bytes;
+}
+
 void
 nids_discard(struct tcp_stream * a_tcp, int num)
 {
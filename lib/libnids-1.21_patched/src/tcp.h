@@ -26,5 +26,6 @@ void tcp_exit(void);
 void process_tcp(u_char *, int, struct timeval* );
 void process_icmp(u_char *, struct timeval* );
 void tcp_check_timeouts(struct timeval *);
+void tcp_stats(int *, int *);
 
 #endif /* _NIDS_TCP_H */
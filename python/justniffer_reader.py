@@ -0,0 +1,167 @@
+# -*- coding: utf-8 -*-
+#	Copyright (c) 2009 Plecno s.r.l. All Rights Reserved
+#	info@plecno.com
+#	via Giovio 8, 20144 Milano, Italy
+#	Released under the terms of the GPLv3 or later
+#	Author: Oreste Notelli <oreste.notelli@plecno.com>
+
+# offline analysis of pcap files with libjustniffer, without the justniffer
+# program: the records have a column for every keyword of the format
+#
+#   for batch in justniffer_reader.read_file("dump.pcap", "%source.ip %response.time"):
+#       for source_ip, response_time in batch:
+#           ...
+#
+# the file is analyzed by a thread of libjustniffer: only one file at a time
+# can be read in a process, a reader must be closed (or read to the end)
+# before the next one is opened
+
+import array
+import ctypes
+import ctypes.util
+import os
+
+DEFAULT_FORMAT = "%source.ip - - [%request.timestamp(%d/%b/%Y:%T %z)] \"%request.line\" %response.code %response.header.content-length(0) \"%request.header.referer()\" \"%request.header.user-agent()\""
+
+_lib = None
+
+
+class Error(Exception):
+    pass
+
+
+def _library():
+    global _lib
+    if _lib is None:
+        name = os.environ.get("JUSTNIFFER_LIBRARY") or ctypes.util.find_library("justniffer") or "libjustniffer.so.0"
+        lib = ctypes.CDLL(name)
+        lib.justniffer_open.restype = ctypes.c_void_p
+        lib.justniffer_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_char_p, ctypes.c_uint]
+        lib.justniffer_columns.restype = ctypes.c_uint
+        lib.justniffer_columns.argtypes = [ctypes.c_void_p]
+        lib.justniffer_column.restype = ctypes.c_char_p
+        lib.justniffer_column.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+        lib.justniffer_read.restype = ctypes.c_int
+        lib.justniffer_read.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+        lib.justniffer_data.restype = ctypes.c_void_p
+        lib.justniffer_data.argtypes = [ctypes.c_void_p, ctypes.c_uint, ctypes.POINTER(ctypes.c_uint)]
+        lib.justniffer_offsets.restype = ctypes.c_void_p
+        lib.justniffer_offsets.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+        lib.justniffer_error.restype = ctypes.c_char_p
+        lib.justniffer_error.argtypes = [ctypes.c_void_p]
+        lib.justniffer_close.restype = None
+        lib.justniffer_close.argtypes = [ctypes.c_void_p]
+        _lib = lib
+    return _lib
+
+
+def _bytes(value):
+    if value is None or isinstance(value, bytes):
+        return value
+    return value.encode("utf-8")
+
+
+def _str(value):
+    if isinstance(value, str):
+        return value
+    return value.decode("utf-8")
+
+
+class Batch(object):
+    """records of a file, by column: the value of the record i in the
+    column c is data(c)[offsets(c)[i]:offsets(c)[i + 1]]"""
+
+    def __init__(self, columns, data, offsets):
+        self.columns = columns
+        self._data = data
+        self._offsets = offsets
+
+    def __len__(self):
+        if not self._offsets:
+            return 0
+        return len(self._offsets[0]) - 1
+
+    def _index(self, column):
+        if isinstance(column, int):
+            return column
+        return self.columns.index(column)
+
+    def data(self, column):
+        return self._data[self._index(column)]
+
+    def offsets(self, column):
+        return self._offsets[self._index(column)]
+
+    def column(self, column):
+        c = self._index(column)
+        data, offsets = self._data[c], self._offsets[c]
+        return [data[offsets[i]:offsets[i + 1]] for i in range(len(offsets) - 1)]
+
+    def __iter__(self):
+        return iter(zip(*[self.column(c) for c in range(len(self.columns))]))
+
+
+class Reader(object):
+    def __init__(self, filename, format=DEFAULT_FORMAT, filter=None, batch_size=1024, truncated=False):
+        self._lib = _library()
+        self._batch_size = batch_size
+        error = ctypes.create_string_buffer(1024)
+        self._reader = self._lib.justniffer_open(_bytes(filename), _bytes(format), _bytes(filter), int(truncated), error, len(error))
+        if not self._reader:
+            raise Error(_str(error.value))
+        self.columns = [_str(self._lib.justniffer_column(self._reader, c)) for c in range(self._lib.justniffer_columns(self._reader))]
+
+    def read(self):
+        """the next batch, None at the end of the file"""
+        if not self._reader:
+            return None
+        lib = self._lib
+        records = lib.justniffer_read(self._reader, self._batch_size)
+        if records < 0:
+            error = _str(lib.justniffer_error(self._reader))
+            self.close()
+            raise Error(error)
+        if records == 0:
+            self.close()
+            return None
+        data = []
+        offsets = []
+        size = ctypes.c_uint()
+        for c in range(len(self.columns)):
+            pointer = lib.justniffer_data(self._reader, c, ctypes.byref(size))
+            data.append(ctypes.string_at(pointer, size.value) if size.value else b"")
+            column_offsets = array.array("I")
+            raw = ctypes.string_at(lib.justniffer_offsets(self._reader, c), column_offsets.itemsize * (records + 1))
+            if hasattr(column_offsets, "frombytes"):
+                column_offsets.frombytes(raw)
+            else:
+                column_offsets.fromstring(raw)
+            offsets.append(column_offsets)
+        return Batch(self.columns, data, offsets)
+
+    def __iter__(self):
+        while True:
+            batch = self.read()
+            if batch is None:
+                break
+            yield batch
+
+    def close(self):
+        if self._reader:
+            self._lib.justniffer_close(self._reader)
+            self._reader = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+
+def read_file(filename, format=DEFAULT_FORMAT, filter=None, batch_size=1024, truncated=False):
+    """the records of a pcap file, in batches of up to batch_size (see Batch);
+    filter is a pcap filter, truncated includes the connections not closed"""
+    return Reader(filename, format, filter, batch_size, truncated)
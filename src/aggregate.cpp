@@ -0,0 +1,270 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "aggregate.h"
+#include <cstring>
+#include <cstdio>
+
+using namespace std;
+
+static u_int64_t to_usec(const timeval& t)
+{
+	if (t.tv_sec < 0)
+		return 0;
+	return u_int64_t(t.tv_sec) * 1000000 + t.tv_usec;
+}
+
+///// histogram /////
+
+void histogram::reset()
+{
+	memset(_buckets, 0, sizeof(_buckets));
+	_count = _sum = _max = 0;
+}
+
+unsigned histogram::index(u_int64_t usec)
+{
+	if (usec < sub_buckets)
+		return unsigned(usec);
+	if (usec >= (u_int64_t(1) << max_bits))
+		usec = (u_int64_t(1) << max_bits) - 1;
+	unsigned msb = 63 - __builtin_clzll(usec);
+	unsigned shift = msb - sub_bits;
+	return (shift + 1) * sub_buckets + unsigned((usec >> shift) & (sub_buckets - 1));
+}
+
+u_int64_t histogram::upper_bound(unsigned idx)
+{
+	if (idx < sub_buckets)
+		return idx;
+	unsigned shift = idx / sub_buckets - 1;
+	return ((u_int64_t(sub_buckets + idx % sub_buckets) + 1) << shift) - 1;
+}
+
+void histogram::add(u_int64_t usec, u_int32_t weight)
+{
+	_buckets[index(usec)] += weight;
+	_count += weight;
+	_sum += usec * weight;
+	if (usec > _max)
+		_max = usec;
+}
+
+u_int64_t histogram::percentile(double perc) const
+{
+	if (_count == 0)
+		return 0;
+	u_int64_t rank = u_int64_t(perc * _count / 100 + 0.5);
+	if (rank == 0)
+		rank = 1;
+	u_int64_t seen = 0;
+	for (unsigned i = 0; i < buckets; i++)
+	{
+		seen += _buckets[i];
+		if (seen >= rank)
+			return upper_bound(i) < _max ? upper_bound(i) : _max;
+	}
+	return _max;
+}
+
+u_int64_t histogram::count_below(u_int64_t usec) const
+{
+	u_int64_t result = 0;
+	unsigned last = index(usec);
+	for (unsigned i = 0; i <= last; i++)
+		result += _buckets[i];
+	return result;
+}
+
+///// transaction_metrics /////
+
+transaction_metrics::transaction_metrics():
+	request_started(false), response_started(false), connecting(false), connected(false), weight(1),
+	request_size(0), response_size(0)
+{
+	opening.tv_sec = open.tv_sec = request_first.tv_sec = request_last.tv_sec = response_last.tv_sec = 0;
+	opening.tv_usec = open.tv_usec = request_first.tv_usec = request_last.tv_usec = response_last.tv_usec = 0;
+}
+
+void transaction_metrics::onOpening(tcp_stream* pstream, const timeval* t)
+{
+	if (!connecting)
+		opening = *t;
+	connecting = true;
+}
+
+void transaction_metrics::onOpen(tcp_stream* pstream, const timeval* t)
+{
+	open = *t;
+	connected = true;
+}
+
+void transaction_metrics::onRequest(tcp_stream* pstream, const timeval* t)
+{
+	if (!request_started)
+		request_first = *t;
+	weight = ((stream*) pstream)->sample_weight;
+	request_last = *t;
+	request_started = true;
+	request_size += pstream->server.count_new;
+}
+
+void transaction_metrics::onResponse(tcp_stream* pstream, const timeval* t)
+{
+	response_last = *t;
+	response_started = true;
+	response_size += pstream->client.count_new;
+}
+
+transaction_metrics* transaction_metrics::get(handlers::iterator start, handlers::iterator end)
+{
+	if (start == end)
+		return NULL;
+	return dynamic_cast<transaction_metrics*>((end - 1)->get());
+}
+
+double transaction_metrics::response_time() const
+{
+	if (!response_started)
+		return 0;
+	return to_double(response_last - request_last);
+}
+
+///// snapshot_clock /////
+
+snapshot_clock::snapshot_clock(int interval): _interval(interval)
+{
+	_due.tv_sec = _next.tv_sec = _last.tv_sec = 0;
+	_due.tv_usec = _next.tv_usec = _last.tv_usec = 0;
+}
+
+bool snapshot_clock::tick(const timeval* t)
+{
+	if (t == NULL)
+		return false;
+	bool expired = false;
+	if (_interval > 0)
+	{
+		if (_next.tv_sec == 0)
+			_next.tv_sec = (t->tv_sec / _interval + 1) * _interval;
+		if (t->tv_sec >= _next.tv_sec)
+		{
+			_due = _next;
+			_next.tv_sec = (t->tv_sec / _interval + 1) * _interval;
+			expired = true;
+		}
+	}
+	_last = *t;
+	return expired;
+}
+
+///// aggregate_table /////
+
+void aggregate_entry::add(const transaction_metrics& metrics)
+{
+	requests += metrics.weight;
+	request_size += metrics.request_size * metrics.weight;
+	response_size += metrics.response_size * metrics.weight;
+	request_time.add(to_usec(metrics.request_last - metrics.request_first), metrics.weight);
+	if (metrics.response_started)
+		response_time.add(to_usec(metrics.response_last - metrics.request_last), metrics.weight);
+	if (metrics.connecting && metrics.connected)
+		connection_time.add(to_usec(metrics.open - metrics.opening), metrics.weight);
+}
+
+const char* aggregate_table::other_key = "(other)";
+
+aggregate_entry* aggregate_table::find(const string& key)
+{
+	entries::iterator it = _entries.find(key);
+	if (it != _entries.end())
+		return it->second;
+	if (_entries.size() >= _max_keys)
+	{
+		it = _entries.find(other_key);
+		if (it != _entries.end())
+			return it->second;
+		return _entries[other_key] = new aggregate_entry();
+	}
+	return _entries[key] = new aggregate_entry();
+}
+
+void aggregate_table::clear()
+{
+	for (entries::iterator it = _entries.begin(); it != _entries.end(); it++)
+		delete it->second;
+	_entries.clear();
+}
+
+string aggregation_key(handlers::iterator start, handlers::iterator end, const timeval* t)
+{
+	ostringstream key;
+	for (handlers::iterator i = start; i != end - 1; i++)
+		(*i)->append(key, t);
+	return key.str();
+}
+
+///// aggregate_printer /////
+
+aggregate_printer::aggregate_printer(Out out, const string& eol, int interval, unsigned max_keys):
+	_out(out), _eol(eol), _clock(interval), _entries(max_keys)
+{
+	_out.setf(ios_base::fixed);
+}
+
+void aggregate_printer::doit(handlers::iterator start, handlers::iterator end, const timeval*t)
+{
+	transaction_metrics* metrics = transaction_metrics::get(start, end);
+	if (metrics == NULL || !metrics->request_started)
+		return;
+	if (_clock.tick(t))
+	{
+		dump(&_clock.due());
+		_entries.clear();
+	}
+	_entries.find(aggregation_key(start, end, t))->add(*metrics);
+}
+
+void aggregate_printer::print_histogram(const char* name, const histogram& h)
+{
+	if (h.count() == 0)
+		return;
+	_out << std::setprecision(6)
+	     << " " << name << ".mean=" << double(h.sum()) / h.count() / 1000000
+	     << " " << name << ".p50=" << double(h.percentile(50)) / 1000000
+	     << " " << name << ".p90=" << double(h.percentile(90)) / 1000000
+	     << " " << name << ".p99=" << double(h.percentile(99)) / 1000000
+	     << " " << name << ".max=" << double(h.max()) / 1000000;
+}
+
+void aggregate_printer::dump(const timeval* t)
+{
+	for (aggregate_table::const_iterator it = _entries.begin(); it != _entries.end(); it++)
+	{
+		aggregate_entry* e = it->second;
+		_out << std::setprecision(6) << to_double(*t)
+		     << " \"" << it->first << "\""
+		     << " requests=" << e->requests
+		     << " request.size=" << e->request_size
+		     << " response.size=" << e->response_size;
+		print_histogram("request.time", e->request_time);
+		print_histogram("response.time", e->response_time);
+		print_histogram("connection.time", e->connection_time);
+		_out << _eol;
+	}
+	_out << std::flush;
+	fflush(stdout);
+}
+
+void aggregate_printer::on_exit()
+{
+	dump(&_clock.last());
+	_entries.clear();
+}
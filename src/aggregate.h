@@ -0,0 +1,123 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_aggregate_h
+#define _sniffer_aggregate_h
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include "formatter.h"
+
+// log-linear histogram of microsecond values: 16 linear sub-buckets for every
+// power of two, so the relative error of a percentile is below 1/16 and the
+// size is fixed whatever the number of samples
+class histogram
+{
+public:
+	enum {sub_bits = 4, sub_buckets = 1 << sub_bits, max_bits = 36, buckets = (max_bits - sub_bits + 1) * sub_buckets};
+	histogram(){reset();}
+	void reset();
+	void add(u_int64_t usec, u_int32_t weight = 1);
+	u_int64_t count() const {return _count;}
+	u_int64_t max() const {return _max;}
+	u_int64_t sum() const {return _sum;}
+	// upper bound of the bucket holding the requested percentile (0-100)
+	u_int64_t percentile(double perc) const;
+	// samples not greater than usec, within the bucket resolution
+	u_int64_t count_below(u_int64_t usec) const;
+private:
+	static unsigned index(u_int64_t usec);
+	static u_int64_t upper_bound(unsigned idx);
+	u_int32_t _buckets[buckets];
+	u_int64_t _count, _sum, _max;
+};
+
+// collects the timings and the sizes of one transaction, it is always the last
+// handler of an aggregation section
+class transaction_metrics : public basic_handler
+{
+public:
+	transaction_metrics();
+	virtual void onOpening(tcp_stream* pstream, const timeval* t);
+	virtual void onOpen(tcp_stream* pstream, const timeval* t);
+	virtual void onRequest(tcp_stream* pstream, const timeval* t);
+	virtual void onResponse(tcp_stream* pstream, const timeval* t);
+
+	// the metrics handler closing the [start, end) section, NULL if missing
+	static transaction_metrics* get(handlers::iterator start, handlers::iterator end);
+	double response_time() const;
+	bool request_started, response_started, connecting, connected;
+	// the sample weight of the stream
+	unsigned weight;
+	timeval opening, open, request_first, request_last, response_last;
+	u_int64_t request_size, response_size;
+};
+
+// tells when a snapshot is due; the snapshots end on capture time multiples of the interval
+class snapshot_clock
+{
+public:
+	snapshot_clock(int interval);
+	// true if the snapshot ending at due() must be printed before accounting t
+	bool tick(const timeval* t);
+	const timeval& due() const {return _due;}
+	const timeval& last() const {return _last;}
+private:
+	int _interval;
+	timeval _due, _next, _last;
+};
+
+class aggregate_entry
+{
+public:
+	aggregate_entry(): requests(0), request_size(0), response_size(0){}
+	void add(const transaction_metrics& metrics);
+	u_int64_t requests, request_size, response_size;
+	histogram response_time, request_time, connection_time;
+};
+
+// the per-key entries, bounded: once full the new keys are accounted all together to other_key
+class aggregate_table
+{
+public:
+	typedef std::map<std::string, aggregate_entry*> entries;
+	typedef entries::const_iterator const_iterator;
+	static const char* other_key;
+	aggregate_table(unsigned max_keys): _max_keys(max_keys){}
+	~aggregate_table(){clear();}
+	aggregate_entry* find(const std::string& key);
+	void clear();
+	const_iterator begin() const {return _entries.begin();}
+	const_iterator end() const {return _entries.end();}
+private:
+	unsigned _max_keys;
+	entries _entries;
+};
+
+// renders the key from the handlers of [start, end) but the last (the metrics one)
+std::string aggregation_key(handlers::iterator start, handlers::iterator end, const timeval* t);
+
+class aggregate_printer : public printer
+{
+public:
+	typedef std::basic_ostream<char>& Out;
+	aggregate_printer(Out out, const string& eol, int interval, unsigned max_keys);
+	void doit(handlers::iterator start, handlers::iterator end, const timeval*t);
+	virtual void on_exit();
+private:
+	void dump(const timeval* t);
+	void print_histogram(const char* name, const histogram& h);
+	Out _out;
+	string _eol;
+	snapshot_clock _clock;
+	aggregate_table _entries;
+};
+
+#endif// _sniffer_aggregate_h
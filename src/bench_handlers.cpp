@@ -0,0 +1,379 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+// microbenchmark of the format keyword handlers: a sequence of tcp_stream
+// events (synthetic, or recorded once from a pcap through libnids) is replayed
+// directly on the stream objects built by parser::parse, without libnids in
+// the timed loop. For every format it prints one JSON line with ns,
+// allocations and allocated bytes per transaction
+
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <streambuf>
+#include <time.h>
+#include <boost/program_options.hpp>
+#include <nids2.h>
+#include "formatter.h"
+
+using namespace std;
+namespace po = boost::program_options;
+
+///// allocation counters /////
+
+static unsigned long long allocations = 0;
+static unsigned long long allocated_bytes = 0;
+
+__attribute__((noinline)) void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+	allocations++;
+	allocated_bytes += size;
+	void* p = malloc(size ? size : 1);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) throw()
+{
+	free(p);
+}
+
+///// events /////
+
+struct event
+{
+	enum type_enum {opening, open, request, response, close};
+	type_enum type;
+	unsigned connection;
+	timeval t;
+	string data;
+};
+
+typedef vector<event> events;
+
+static void add_event(events& sequence, event::type_enum type, unsigned connection, const timeval& t, const string& data = string())
+{
+	event e;
+	e.type = type;
+	e.connection = connection;
+	e.t = t;
+	e.data = data;
+	sequence.push_back(e);
+}
+
+static const timeval& tick(timeval& t)
+{
+	t.tv_usec += 1000;
+	if (t.tv_usec >= 1000000)
+	{
+		t.tv_sec++;
+		t.tv_usec -= 1000000;
+	}
+	return t;
+}
+
+// keep-alive HTTP connections, every response in two segments
+static void synthetic(events& sequence, unsigned connections, unsigned keepalive, unsigned response_size)
+{
+	timeval t;
+	t.tv_sec = 1000000000;
+	t.tv_usec = 0;
+	for (unsigned c = 0; c < connections; c++)
+	{
+		add_event(sequence, event::opening, c, tick(t));
+		add_event(sequence, event::open, c, tick(t));
+		for (unsigned r = 0; r < keepalive; r++)
+		{
+			ostringstream request;
+			request << "GET /bench/" << c << "/" << r << "?q=" << r << " HTTP/1.1\r\nHost: bench.example\r\nUser-Agent: justniffer-bench\r\n"
+			        << "Accept: */*\r\nReferer: http://bench.example/\r\nCookie: session=" << c << "\r\n\r\n";
+			add_event(sequence, event::request, c, tick(t), request.str());
+			ostringstream response;
+			response << "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: " << response_size << "\r\nServer: bench\r\n\r\n";
+			string body(response_size, 'r');
+			add_event(sequence, event::response, c, tick(t), response.str() + body.substr(0, response_size / 2));
+			add_event(sequence, event::response, c, tick(t), body.substr(response_size / 2));
+		}
+		add_event(sequence, event::close, c, tick(t));
+	}
+}
+
+static events* recording = NULL;
+static map<tuple4, unsigned> recorded_connections;
+
+static void record(struct tcp_stream* ts, void** yoda, struct timeval* t, unsigned char* packet)
+{
+	map<tuple4, unsigned>::iterator it = recorded_connections.find(ts->addr);
+	switch (ts->nids_state)
+	{
+		case NIDS_OPENING:
+			if (it != recorded_connections.end())
+				return;
+			it = recorded_connections.insert(make_pair(ts->addr, recorded_connections.size())).first;
+			add_event(*recording, event::opening, it->second, *t);
+			break;
+		case NIDS_JUST_EST:
+			if (it == recorded_connections.end())
+				return;
+			ts->server.collect = 1;
+			ts->client.collect = 1;
+			add_event(*recording, event::open, it->second, *t);
+			break;
+		case NIDS_DATA:
+			if (it == recorded_connections.end())
+				return;
+			if (ts->server.count_new)
+				add_event(*recording, event::request, it->second, *t, string(ts->server.data, ts->server.count_new));
+			if (ts->client.count_new)
+				add_event(*recording, event::response, it->second, *t, string(ts->client.data, ts->client.count_new));
+			break;
+		default:
+			if (it == recorded_connections.end())
+				return;
+			// no time when libnids is exiting
+			add_event(*recording, event::close, it->second, t ? *t : recording->back().t);
+			recorded_connections.erase(it);
+			break;
+	}
+}
+
+static void record_pcap(events& sequence, const string& filename)
+{
+	recording = &sequence;
+	nids_params.filename = const_cast<char*>(filename.c_str());
+	nids_params.device = NULL;
+	nids_params.scan_num_hosts = 0;
+	check(nids_init() != 0, common_exception(nids_errbuf));
+	union
+	{
+		void (*func) (struct tcp_stream *ts, void **yoda, struct timeval* t, unsigned char* packet);
+		void* ptr;
+	} un;
+	un.func = record;
+	nids_register_tcp(un.ptr);
+	nids_chksum_ctl chksumctl[1];
+	chksumctl[0].netaddr = 0;
+	chksumctl[0].mask = 0;
+	chksumctl[0].action = NIDS_DONT_CHKSUM;
+	nids_register_chksum_ctl(chksumctl, 1);
+	nids_run();
+	recording = NULL;
+}
+
+///// replay /////
+
+class null_buffer : public streambuf
+{
+protected:
+	int overflow(int c){return c;}
+	streamsize xsputn(const char* s, streamsize n){return n;}
+};
+
+class counting_listener : public stream_listener
+{
+public:
+	counting_listener(): transactions(0){}
+	void on_print(void){transactions++;}
+	unsigned long long transactions;
+};
+
+struct connection
+{
+	tcp_stream ts;
+	stream::ptr pstream;
+};
+
+static void replay(const events& sequence, const sections& format_sections, stream_listener* listener, vector<connection>& connections)
+{
+	for (events::const_iterator e = sequence.begin(); e != sequence.end(); e++)
+	{
+		if (e->connection >= connections.size())
+			connections.resize(e->connection + 1);
+		connection& c = connections[e->connection];
+		switch (e->type)
+		{
+			case event::opening:
+				memset(&c.ts, 0, sizeof(tcp_stream));
+				c.ts.addr.saddr = 0x0100000a + (e->connection << 8);
+				c.ts.addr.daddr = 0x0100a8c0;
+				c.ts.addr.source = 1024 + e->connection % 60000;
+				c.ts.addr.dest = 80;
+				c.ts.nids_state = NIDS_OPENING;
+				c.pstream = stream::ptr(new stream(listener, format_sections));
+				c.pstream->onOpening(&c.ts, &e->t);
+				break;
+			case event::open:
+				c.ts.nids_state = NIDS_JUST_EST;
+				c.pstream->onOpen(&c.ts, &e->t);
+				break;
+			case event::request:
+				c.ts.nids_state = NIDS_DATA;
+				c.ts.server.data = const_cast<char*>(e->data.data());
+				c.ts.server.count_new = e->data.size();
+				c.ts.server.count += e->data.size();
+				c.pstream->onRequest(&c.ts, &e->t);
+				c.ts.server.count_new = 0;
+				break;
+			case event::response:
+				c.ts.nids_state = NIDS_DATA;
+				c.ts.client.data = const_cast<char*>(e->data.data());
+				c.ts.client.count_new = e->data.size();
+				c.ts.client.count += e->data.size();
+				c.pstream->onResponse(&c.ts, &e->t);
+				c.ts.client.count_new = 0;
+				break;
+			case event::close:
+				c.ts.nids_state = NIDS_CLOSE;
+				c.pstream->onClose(&c.ts, &e->t, NULL);
+				c.pstream.reset();
+				break;
+		}
+	}
+}
+
+static string json_escape(const string& value)
+{
+	string result;
+	for (string::const_iterator it = value.begin(); it != value.end(); it++)
+	{
+		if (*it == '"' || *it == '\\')
+			result += '\\';
+		result += *it;
+	}
+	return result;
+}
+
+static void run(const string& name, const string& format, const events& sequence, unsigned iterations)
+{
+	null_buffer buffer;
+	ostream out(&buffer);
+	outstream_printer printer(out, "\n");
+	counting_listener listener;
+	parser p;
+	p.set_printer(&printer);
+	try
+	{
+		p.parse(format.c_str());
+	}
+	catch (unknown_keyword& e)
+	{
+		cerr << name << ": skipped, " << e.what() << "\n";
+		return;
+	}
+	vector<connection> connections;
+	// the first pass warms up the caches and the allocator
+	replay(sequence, p.get_sections(), &listener, connections);
+	listener.transactions = 0;
+	unsigned long long start_allocations = allocations, start_bytes = allocated_bytes;
+	timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned i = 0; i < iterations; i++)
+		replay(sequence, p.get_sections(), &listener, connections);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	double ns = double(stop.tv_sec - start.tv_sec) * 1000000000 + double(stop.tv_nsec - start.tv_nsec);
+	double transactions = listener.transactions ? double(listener.transactions) : 1;
+	cout << "{\"name\": \"" << json_escape(name) << "\", \"format\": \"" << json_escape(format) << "\""
+	     << ", \"transactions\": " << listener.transactions
+	     << setiosflags(ios_base::fixed) << setprecision(1)
+	     << ", \"ns_per_transaction\": " << ns / transactions
+	     << ", \"allocations_per_transaction\": " << double(allocations - start_allocations) / transactions
+	     << ", \"bytes_per_transaction\": " << double(allocated_bytes - start_bytes) / transactions
+	     << "}" << endl;
+}
+
+// each keyword alone, then the usual combinations
+static const char* default_formats[][2] = {
+	{"(empty)", ""},
+	{"source.ip", "%source.ip"},
+	{"dest.port", "%dest.port"},
+	{"connection", "%connection"},
+	{"connection.time", "%connection.time"},
+	{"request.timestamp", "%request.timestamp"},
+	{"request.time", "%request.time"},
+	{"request.size", "%request.size"},
+	{"request.line", "%request.line"},
+	{"request.method", "%request.method"},
+	{"request.url", "%request.url"},
+	{"request.url.path", "%request.url.path"},
+	{"request.header.host", "%request.header.host"},
+	{"request.header.cookie", "%request.header.cookie"},
+	{"request.header.value", "%request.header.value(Referer)"},
+	{"request.grep", "%request.grep(\\?q=([0-9]+))"},
+	{"request.part", "%request.part(0 16)"},
+	{"request", "%request"},
+	{"response.code", "%response.code"},
+	{"response.header.content-type", "%response.header.content-type"},
+	{"response.grep", "%response.grep(Server: ([a-z]+))"},
+	{"response.body.grep", "%response.body.grep(<title>([^<]*))"},
+	{"response.time", "%response.time"},
+	{"response.size", "%response.size"},
+	{"response", "%response"},
+	{"session.time", "%session.time"},
+	{"session.requests", "%session.requests"},
+	{"idle.time.0", "%idle.time.0"},
+	{"close.time", "%close.time"},
+	{"close.originator", "%close.originator"},
+	{"apache", "%source.ip - - [%request.timestamp(%d/%b/%Y:%T %z)] \"%request.line\" %response.code %response.header.content-length(0) \"%request.header.referer()\" \"%request.header.user-agent()\""},
+	{"raw", "%request%response"},
+	{"timing", "%connection.time %request.time %response.time %idle.time.0 %idle.time.1 %close.time %session.time"},
+	{"headers", "%request.header.host %request.header.user-agent %request.header.accept %request.header.referer %request.header.cookie %response.header.content-type %response.header.content-length %response.header.server"},
+	{"greps", "%request.grep(\\?q=([0-9]+)) %request.grep(session=([0-9]+)) %request.header.grep(Referer: ([^\r]*)) %response.grep(Server: ([a-z]+)) %response.grep(<title>([^<]*)) %response.grep(token=([a-z]+)) %response.header.grep(Content-Length: ([0-9]+))"},
+};
+
+int main(int argc, char*argv [])
+{
+	try
+	{
+		unsigned iterations, connections, keepalive, response_size;
+		po::options_description desc("justniffer-bench, microbenchmark of the format keywords.\nIt prints a JSON line per format");
+		desc.add_options()
+			("help", "help")
+			("format", po::value<vector<string> >()->composing(), "format to measure, it can be repeated (default: every keyword alone and some combinations)")
+			("pcap", po::value<string>(), "replay the tcp events recorded from this capture instead of the synthetic ones")
+			("iterations", po::value<unsigned>(&iterations)->default_value(20), "times the event sequence is replayed")
+			("connections", po::value<unsigned>(&connections)->default_value(1000), "synthetic connections")
+			("keepalive", po::value<unsigned>(&keepalive)->default_value(3), "requests per synthetic connection")
+			("response-size", po::value<unsigned>(&response_size)->default_value(2000), "body bytes of the synthetic responses")
+		;
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+		if (vm.count("help"))
+		{
+			cout << desc << "\n";
+			return 0;
+		}
+		events sequence;
+		if (vm.count("pcap"))
+			record_pcap(sequence, vm["pcap"].as<string>());
+		else
+			synthetic(sequence, connections, keepalive, response_size);
+		if (vm.count("format"))
+		{
+			vector<string> formats = vm["format"].as<vector<string> >();
+			for (vector<string>::const_iterator it = formats.begin(); it != formats.end(); it++)
+				run(*it, *it, sequence, iterations);
+		}
+		else
+			for (unsigned i = 0; i < sizeof(default_formats) / sizeof(default_formats[0]); i++)
+				run(default_formats[i][0], default_formats[i][1], sequence, iterations);
+	}
+	catch (exception& e)
+	{
+		cerr << e.what() << "\n";
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,370 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <nids2.h>
+#include "utilities.h"
+#include "capture.h"
+
+using namespace std;
+
+// the memory of a flow and of a packet besides the bytes of the packets
+static const unsigned flow_overhead = 128;
+static const unsigned packet_overhead = 32;
+// seconds of capture time a triggered flow is kept after its end (as the
+// closing timeout of libnids, for the last acks), or while idle
+static const time_t closing_timeout = 10;
+static const time_t idle_timeout = 300;
+// the files of the triggered flows kept open together
+static const size_t max_open_files = 256;
+
+///// flow_history /////
+
+flow_history* flow_history::theOnlyHistory = NULL;
+
+flow_history::flow_history(const string& directory, unsigned max_packets, u_int64_t max_memory):
+	_directory(directory), _max_packets(max_packets), _max_memory(max_memory), _memory(0), _triggered(0), _last_expire(0)
+{
+}
+
+void flow_history::start()
+{
+	check(theOnlyHistory == NULL, common_exception("the flow history is already started"));
+	theOnlyHistory = this;
+	union
+	{
+		void (*func) (struct ip* iph, int len, struct timeval* t);
+		void* ptr;
+	} un;
+	un.func = on_packet;
+	// before the tcp reassembly: the packet is in the history when the trigger is evaluated
+	nids_register_ip(un.ptr);
+}
+
+void flow_history::on_packet(struct ip* iph, int len, struct timeval* t)
+{
+	if (theOnlyHistory && iph->ip_p == IPPROTO_TCP && nids_last_pcap_header)
+		theOnlyHistory->add(iph);
+}
+
+string flow_history::key(u_int32_t saddr, u_int16_t sport, u_int32_t daddr, u_int16_t dport)
+{
+	// the same for both directions
+	if (saddr > daddr || (saddr == daddr && sport > dport))
+	{
+		swap(saddr, daddr);
+		swap(sport, dport);
+	}
+	char k[12];
+	memcpy(k, &saddr, 4);
+	memcpy(k + 4, &daddr, 4);
+	memcpy(k + 8, &sport, 2);
+	memcpy(k + 10, &dport, 2);
+	return string(k, sizeof(k));
+}
+
+void flow_history::add(struct ip* iph)
+{
+	unsigned header_len = iph->ip_hl * 4;
+	if (ntohs(iph->ip_len) < header_len + sizeof(tcphdr))
+		return;
+	const tcphdr* tcph = (const tcphdr*) ((const char*) iph + header_len);
+	u_int32_t saddr = iph->ip_src.s_addr, daddr = iph->ip_dst.s_addr;
+	u_int16_t sport = ntohs(tcph->source), dport = ntohs(tcph->dest);
+	time_t now = nids_last_pcap_header->ts.tv_sec;
+	if (now != _last_expire)
+		expire(now);
+	string k = key(saddr, sport, daddr, dport);
+	flows::iterator it = _flows.find(k);
+	// a new connection with the addresses of a triggered one
+	if (it != _flows.end() && it->second.triggered && tcph->syn && !tcph->ack)
+	{
+		forget(it);
+		it = _flows.end();
+	}
+	if (it == _flows.end())
+	{
+		it = _flows.insert(make_pair(k, flow())).first;
+		it->second.lru = _lru.insert(_lru.end(), k);
+		_memory += flow_overhead;
+	}
+	else if (!it->second.triggered)
+		_lru.splice(_lru.end(), _lru, it->second.lru);
+	flow& f = it->second;
+	packet p;
+	p.ts = nids_last_pcap_header->ts;
+	p.len = nids_last_pcap_header->len;
+	if (f.triggered)
+	{
+		f.last = now;
+		deque<packet> one(1, p);
+		one.front().data.assign((const char*) nids_last_pcap_data, nids_last_pcap_header->caplen);
+		if (open(f, "ab"))
+			write(f, one.begin(), one.end());
+		bool lower = saddr < daddr || (saddr == daddr && sport <= dport);
+		if (tcph->fin)
+			f.fin[lower ? 0 : 1] = true;
+		if (!f.ended && (tcph->rst || (f.fin[0] && f.fin[1])))
+			f.ended = now;
+		return;
+	}
+	f.packets.push_back(p);
+	f.packets.back().data.assign((const char*) nids_last_pcap_data, nids_last_pcap_header->caplen);
+	u_int64_t size = nids_last_pcap_header->caplen + packet_overhead;
+	f.bytes += size;
+	_memory += size;
+	if (f.packets.size() > _max_packets)
+	{
+		size = f.packets.front().data.size() + packet_overhead;
+		f.bytes -= size;
+		_memory -= size;
+		f.packets.pop_front();
+	}
+	trim();
+}
+
+void flow_history::trim()
+{
+	// the flow just added is the last one, it is kept
+	while (_memory > _max_memory && _lru.size() > 1)
+		forget(_flows.find(_lru.front()));
+}
+
+void flow_history::forget(flows::iterator it)
+{
+	flow& f = it->second;
+	if (f.triggered)
+	{
+		close(f);
+		_open.erase(f.open);
+	}
+	else
+		_lru.erase(f.lru);
+	_memory -= f.bytes + flow_overhead;
+	_flows.erase(it);
+}
+
+void flow_history::expire(time_t now)
+{
+	_last_expire = now;
+	for (list<string>::iterator i = _open.begin(); i != _open.end();)
+	{
+		flows::iterator it = _flows.find(*i++);
+		const flow& f = it->second;
+		if ((f.ended && now - f.ended >= closing_timeout) || now - f.last >= idle_timeout)
+			forget(it);
+	}
+}
+
+bool flow_history::trigger(const tuple4& addr, const timeval* t)
+{
+	string k = key(addr.saddr, addr.source, addr.daddr, addr.dest);
+	flows::iterator it = _flows.find(k);
+	if (it == _flows.end())
+	{
+		// forgotten: only the packets still to come are written
+		it = _flows.insert(make_pair(k, flow())).first;
+		it->second.lru = _lru.insert(_lru.end(), k);
+		_memory += flow_overhead;
+	}
+	flow& f = it->second;
+	if (f.triggered)
+		return !f.failed;
+	ostringstream file;
+	file << _directory << "/";
+	if (t)
+		file << t->tv_sec << "." << setw(6) << setfill('0') << t->tv_usec << setfill(' ') << "-";
+	file << ip_to_str(addr.saddr) << "." << addr.source << "-" << ip_to_str(addr.daddr) << "." << addr.dest << ".pcap";
+	// out of the history: only the flow itself stays in memory
+	_memory -= f.bytes;
+	_lru.erase(f.lru);
+	f.open = _open.insert(_open.end(), k);
+	f.file = file.str();
+	f.triggered = true;
+	f.last = nids_last_pcap_header ? nids_last_pcap_header->ts.tv_sec : (t ? t->tv_sec : 0);
+	_triggered++;
+	bool ok = open(f, "wb");
+	if (ok)
+	{
+		// the pcap file header: magic, version 2.4, gmt offset, accuracy, snaplen, link type
+		u_int32_t magic = 0xa1b2c3d4;
+		u_int16_t version[2] = {2, 4};
+		int32_t zone = 0;
+		u_int32_t header[3] = {0, 262144, u_int32_t(nids_datalink())};
+		ok = fwrite(&magic, 4, 1, f.out) == 1 && fwrite(version, 4, 1, f.out) == 1 && fwrite(&zone, 4, 1, f.out) == 1 && fwrite(header, 12, 1, f.out) == 1;
+		if (!ok)
+		{
+			close(f);
+			f.failed = true;
+		}
+	}
+	if (ok)
+		ok = write(f, f.packets.begin(), f.packets.end());
+	else
+		cerr << "WARNING: cannot write " << f.file << endl;
+	f.bytes = 0;
+	f.packets.clear();
+	return ok;
+}
+
+bool flow_history::open(flow& f, const char* mode)
+{
+	if (f.out)
+	{
+		_files.splice(_files.end(), _files, f.open_file);
+		return true;
+	}
+	if (f.failed)
+		return false;
+	if (_files.size() >= max_open_files)
+		close(_flows.find(_files.front())->second);
+	f.out = fopen(f.file.c_str(), mode);
+	if (!f.out)
+	{
+		f.failed = true;
+		return false;
+	}
+	f.open_file = _files.insert(_files.end(), *f.open);
+	return true;
+}
+
+void flow_history::close(flow& f)
+{
+	if (!f.out)
+		return;
+	fclose(f.out);
+	f.out = NULL;
+	_files.erase(f.open_file);
+}
+
+bool flow_history::write(flow& f, deque<packet>::const_iterator begin, deque<packet>::const_iterator end)
+{
+	bool ok = true;
+	for (deque<packet>::const_iterator i = begin; ok && i != end; i++)
+	{
+		u_int32_t record[4] = {u_int32_t(i->ts.tv_sec), u_int32_t(i->ts.tv_usec), u_int32_t(i->data.size()), i->len};
+		ok = fwrite(record, sizeof(record), 1, f.out) == 1 && fwrite(i->data.data(), i->data.size(), 1, f.out) == 1;
+	}
+	if (!ok)
+	{
+		// the rest of the flow is not written
+		close(f);
+		f.failed = true;
+		cerr << "WARNING: cannot write " << f.file << endl;
+	}
+	return ok;
+}
+
+///// flow_address /////
+
+flow_address* flow_address::get(handlers::iterator start, handlers::iterator end)
+{
+	if (start == end)
+		return NULL;
+	return dynamic_cast<flow_address*>((end - 1)->get());
+}
+
+///// flow_trigger_printer /////
+
+static string trim_right(const string& s)
+{
+	string::size_type last = s.find_last_not_of(' ');
+	return last == string::npos ? string() : s.substr(0, last + 1);
+}
+
+flow_trigger_printer::flow_trigger_printer(const string& condition, flow_history* history): _history(history), _number(0)
+{
+	string rest = trim_right(condition);
+	string::size_type space = rest.find_last_of(' ');
+	check(space != string::npos, common_exception(string("invalid trigger '").append(condition).append("', it must be <format> <operator> <value>")));
+	_value = rest.substr(space + 1);
+	rest = trim_right(rest.substr(0, space));
+	space = rest.find_last_of(' ');
+	check(space != string::npos, common_exception(string("invalid trigger '").append(condition).append("', it must be <format> <operator> <value>")));
+	string op = rest.substr(space + 1);
+	_format = trim_right(rest.substr(0, space));
+	check(!_format.empty(), common_exception(string("invalid trigger '").append(condition).append("', the format is missing")));
+	if (op == "<")
+		_operator = less;
+	else if (op == "<=")
+		_operator = less_equal;
+	else if (op == ">")
+		_operator = greater;
+	else if (op == ">=")
+		_operator = greater_equal;
+	else if (op == "==")
+		_operator = equal;
+	else if (op == "!=")
+		_operator = not_equal;
+	else if (op == "=~")
+		_operator = matches;
+	else
+		throw common_exception(string("invalid trigger operator '").append(op).append("', it must be <, <=, >, >=, ==, != or =~"));
+	if (_operator == matches)
+		_re = boost::regex(_value);
+	else if (_operator != equal && _operator != not_equal)
+	{
+		char* end;
+		_number = strtod(_value.c_str(), &end);
+		check(*end == 0, common_exception(string("invalid trigger value '").append(_value).append("', it must be a number")));
+	}
+}
+
+bool flow_trigger_printer::holds(const string& text) const
+{
+	switch (_operator)
+	{
+		case equal:
+			return text == _value;
+		case not_equal:
+			return text != _value;
+		case matches:
+			return boost::regex_search(text, _re);
+		default:
+			break;
+	}
+	// not found (e.g. no response) is not a number
+	char* end;
+	double number = strtod(text.c_str(), &end);
+	if (text.empty() || *end)
+		return false;
+	switch (_operator)
+	{
+		case less:
+			return number < _number;
+		case less_equal:
+			return number <= _number;
+		case greater:
+			return number > _number;
+		default:
+			return number >= _number;
+	}
+}
+
+void flow_trigger_printer::doit(handlers::iterator start, handlers::iterator end, const timeval* t)
+{
+	flow_address* address = flow_address::get(start, end);
+	if (address == NULL || !address->seen)
+		return;
+	ostringstream text;
+	text.setf(ios_base::fixed);
+	for (handlers::iterator i = start; i != end - 1; i++)
+		(*i)->append(text, t);
+	if (holds(text.str()))
+		_history->trigger(address->addr, t);
+}
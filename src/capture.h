@@ -0,0 +1,131 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_capture_h
+#define _sniffer_capture_h
+#include <string>
+#include <cstdio>
+#include <deque>
+#include <list>
+#include <boost/regex.hpp>
+#include <boost/unordered_map.hpp>
+#include "formatter.h"
+
+// the last packets of every tcp flow, as captured (with the link layer
+// header), so that the flows selected by a trigger can be written to a pcap
+// file with their history. A flow keeps at most max_packets, all the flows
+// together at most max_memory bytes: the flows idle for the longest time are
+// forgotten first. Once triggered, the flow is written to
+// <directory>/<trigger time>-<client>.<port>-<server>.<port>.pcap, the
+// history first, then every new packet. At most max_open_files files are
+// kept open: the least recently written is closed, and reopened for append
+// by its next packet. The triggered flow ends (the file is closed) closing_timeout seconds after a
+// RST or the FINs of both sides, at once when a new connection reuses its
+// addresses, or when it has been idle for idle_timeout seconds (capture time)
+class flow_history
+{
+public:
+	flow_history(const std::string& directory, unsigned max_packets, u_int64_t max_memory);
+	// hooks the capture loop
+	void start();
+	// writes the flow of the connection, false if the file cannot be written
+	bool trigger(const tuple4& addr, const timeval* t);
+	// called for every ip packet, after the ip reassembly
+	static void on_packet(struct ip* iph, int len, struct timeval* t);
+	u_int64_t triggered() const {return _triggered;}
+private:
+	struct packet
+	{
+		timeval ts;
+		u_int32_t len;
+		std::string data;
+	};
+	struct flow
+	{
+		flow(): bytes(0), triggered(false), out(NULL), failed(false), ended(0){fin[0] = fin[1] = false;}
+		std::deque<packet> packets;
+		u_int64_t bytes;
+		bool triggered;
+		std::string file;
+		// the history of a flow not triggered, in _lru
+		std::list<std::string>::iterator lru;
+		// a triggered flow, in _open, and in _files while out is open
+		FILE* out;
+		bool failed;
+		std::list<std::string>::iterator open, open_file;
+		time_t last, ended;
+		// sent by the side with the lower address, by the other one
+		bool fin[2];
+	};
+	typedef boost::unordered_map<std::string, flow> flows;
+	static std::string key(u_int32_t saddr, u_int16_t sport, u_int32_t daddr, u_int16_t dport);
+	void add(struct ip* iph);
+	void trim();
+	void forget(flows::iterator it);
+	// forgets the triggered flows ended or idle, once a second of capture time
+	void expire(time_t now);
+	// opens the file of a triggered flow, closing the least recently written
+	// one beyond max_open_files, false if it cannot be opened
+	bool open(flow& f, const char* mode);
+	void close(flow& f);
+	// appends the packets to the file, false (and the file closed) on error
+	bool write(flow& f, std::deque<packet>::const_iterator begin, std::deque<packet>::const_iterator end);
+	static flow_history* theOnlyHistory;
+	std::string _directory;
+	unsigned _max_packets;
+	u_int64_t _max_memory, _memory, _triggered;
+	flows _flows;
+	// least recently active first
+	std::list<std::string> _lru;
+	// the triggered flows
+	std::list<std::string> _open;
+	// the triggered flows with the file open, least recently written first
+	std::list<std::string> _files;
+	time_t _last_expire;
+};
+
+// the connection of the transaction, closing the sections of the triggers
+class flow_address : public basic_handler
+{
+public:
+	flow_address(): seen(false){}
+	virtual void onOpening(tcp_stream* pstream, const timeval* t){set(pstream);}
+	virtual void onOpen(tcp_stream* pstream, const timeval* t){set(pstream);}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t){set(pstream);}
+	virtual void onResponse(tcp_stream* pstream, const timeval* t){set(pstream);}
+	static flow_address* get(handlers::iterator start, handlers::iterator end);
+	bool seen;
+	tuple4 addr;
+private:
+	void set(tcp_stream* pstream){addr = pstream->addr; seen = true;}
+};
+
+// a trigger condition "<format> <operator> <value>": the format (see FORMAT
+// KEYWORDS) is rendered for every transaction and compared to the value,
+// numerically with <, <=, > and >=, as text with == and !=, as a regular
+// expression with =~. When it holds the flow is written by the history
+class flow_trigger_printer : public printer
+{
+public:
+	// throws common_exception if the condition is not valid
+	flow_trigger_printer(const std::string& condition, flow_history* history);
+	const std::string& format() const {return _format;}
+	void doit(handlers::iterator start, handlers::iterator end, const timeval* t);
+private:
+	enum operator_enum {less, less_equal, greater, greater_equal, equal, not_equal, matches};
+	bool holds(const std::string& text) const;
+	flow_history* _history;
+	std::string _format, _value;
+	operator_enum _operator;
+	double _number;
+	boost::regex _re;
+};
+
+#endif// _sniffer_capture_h
@@ -0,0 +1,79 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/time.h>
+#include <nids2.h>
+#include "utilities.h"
+#include "checkpoint.h"
+
+using namespace std;
+
+// the streams are many small records
+static const size_t io_buffer = 1 << 20;
+
+static double elapsed(const timeval& start)
+{
+	timeval now;
+	gettimeofday(&now, NULL);
+	return to_double(now) - to_double(start);
+}
+
+void checkpoint::save(const string& path, parser& p)
+{
+	timeval start;
+	gettimeofday(&start, NULL);
+	string temp = string(path).append(".tmp");
+	FILE* f = fopen(temp.c_str(), "wb");
+	check(f != NULL, common_exception(string("cannot create ").append(temp).append(": ").append(strerror(errno))));
+	setvbuf(f, NULL, _IOFBF, io_buffer);
+	int streams = nids_tcp_checkpoint(f);
+	bool ok = streams >= 0 && p.checkpoint(f);
+	if (fflush(f) != 0 || fdatasync(fileno(f)) != 0)
+		ok = false;
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok || rename(temp.c_str(), path.c_str()) != 0)
+	{
+		unlink(temp.c_str());
+		throw common_exception(string("cannot write the checkpoint ").append(path));
+	}
+	cerr << "checkpoint: " << streams << " streams written to " << path << " in " << elapsed(start) << "s" << endl;
+}
+
+bool checkpoint::restore(const string& path, parser& p)
+{
+	timeval start;
+	gettimeofday(&start, NULL);
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == NULL)
+	{
+		check(errno == ENOENT, common_exception(string("cannot open the checkpoint ").append(path).append(": ").append(strerror(errno))));
+		return false;
+	}
+	setvbuf(f, NULL, _IOFBF, io_buffer);
+	int streams = nids_tcp_restore(f);
+	if (streams < 0)
+	{
+		fclose(f);
+		throw common_exception(string("cannot restore the checkpoint ").append(path).append(": ").append(nids_errbuf));
+	}
+	int connections = p.restore(f);
+	fclose(f);
+	check(connections >= 0, common_exception(string("cannot restore the checkpoint ").append(path).append(": truncated or not valid")));
+	// the state lives in the process now, a crash must not bring it back
+	unlink(path.c_str());
+	cerr << "checkpoint: " << streams << " streams, " << connections << " connections restored from " << path << " in " << elapsed(start) << "s" << endl;
+	return true;
+}
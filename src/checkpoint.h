@@ -0,0 +1,31 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_checkpoint_h
+#define _sniffer_checkpoint_h
+#include <string>
+#include "formatter.h"
+
+// the open connections saved at exit and restored at start, so that a
+// restart (e.g. an upgrade) does not lose them: the libnids streams (tcp
+// state, data not read yet, out of order packets) then the parser streams
+// (counters and the journal of the transaction in progress, replayed on new
+// handlers). The file is written aside, synced and renamed; it is removed
+// once restored
+class checkpoint
+{
+public:
+	// throws common_exception if the file cannot be written
+	static void save(const std::string& path, parser& p);
+	// false if there is no file; throws common_exception if it is not valid
+	static bool restore(const std::string& path, parser& p);
+};
+
+#endif// _sniffer_checkpoint_h
@@ -0,0 +1,1110 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "db.h"
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+
+using namespace std;
+
+static unsigned le16(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned le32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (unsigned(p[3]) << 24);
+}
+
+static unsigned be32(const unsigned char* p)
+{
+	return (unsigned(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// appends the text, with the control characters as spaces
+static void append_text(string& out, const char* text, unsigned len)
+{
+	for (unsigned i = 0; i < len; i++)
+		out += (unsigned char) text[i] < ' ' || text[i] == 127 ? ' ' : text[i];
+}
+
+// the text up to the NUL (or the end) starting at pos, pos is moved past the NUL
+static void nul_terminated(const string& data, unsigned& pos, string& out)
+{
+	unsigned end = pos;
+	while (end < data.size() && data[end] != 0)
+		end++;
+	if (pos < data.size())
+		append_text(out, data.data() + pos, end - pos);
+	pos = end + 1;
+}
+
+static string number(u_int64_t value)
+{
+	ostringstream s;
+	s << value;
+	return s.str();
+}
+
+///// db_framer /////
+
+void db_framer::cutter::cut(unsigned pos, bool unanswered, int64_t rows)
+{
+	message_segment s = {_data + _begin, pos - _begin, !_in_message, true, _interim, unanswered, rows, 0};
+	_result->push_back(s);
+	_begin = pos;
+	_in_message = false;
+	_interim = false;
+}
+
+void db_framer::cutter::finish(unsigned len)
+{
+	if (len > _begin)
+	{
+		message_segment s = {_data + _begin, len - _begin, !_in_message, false, _interim, false, -1, 0};
+		_result->push_back(s);
+		_in_message = true;
+	}
+}
+
+///// mysql_framer /////
+
+namespace
+{
+	// capability flags
+	const unsigned client_compress = 0x00000020;
+	const unsigned client_ssl = 0x00000800;
+	const unsigned client_deprecate_eof = 0x01000000;
+	// status flags
+	const unsigned server_more_results_exists = 0x0008;
+	// the commands that are referred to
+	enum
+	{
+		com_quit = 0x01, com_init_db = 0x02, com_query = 0x03, com_field_list = 0x04, com_statistics = 0x09,
+		com_change_user = 0x11, com_binlog_dump = 0x12, com_stmt_prepare = 0x16, com_stmt_execute = 0x17,
+		com_stmt_send_long_data = 0x18, com_stmt_close = 0x19, com_stmt_reset = 0x1a, com_stmt_fetch = 0x1c,
+		com_binlog_dump_gtid = 0x1e
+	};
+	const unsigned max_packet = 0xffffff;
+}
+
+// a length encoded integer, 0 if it does not fit
+static u_int64_t length_encoded(const unsigned char* p, unsigned len, unsigned& pos)
+{
+	if (pos >= len)
+		return 0;
+	unsigned char first = p[pos++];
+	unsigned size = first == 0xfc ? 2 : first == 0xfd ? 3 : first == 0xfe ? 8 : 0;
+	if (size == 0)
+		return first < 0xfb ? first : 0;
+	if (pos + size > len)
+		return 0;
+	u_int64_t value = 0;
+	for (unsigned i = 0; i < size; i++)
+		value |= u_int64_t(p[pos + i]) << (8 * i);
+	pos += size;
+	return value;
+}
+
+mysql_framer::mysql_framer():
+	_greeting(false), _handshake(false), _connected(false), _tunnel(false), _compress(false), _deprecate_eof(false),
+	_server_capabilities(0), _state(first), _count(0), _rows(-1)
+{
+}
+
+bool mysql_framer::read(reader& r, const unsigned char* data, unsigned& pos, unsigned len)
+{
+	while (pos < len)
+	{
+		if (r.header_len < 4)
+		{
+			r.header[r.header_len++] = data[pos++];
+			if (r.header_len < 4)
+				continue;
+			r.remaining = r.header[0] | (r.header[1] << 8) | (r.header[2] << 16);
+			if (!r.continued)
+			{
+				r.length = 0;
+				r.prefix_len = 0;
+			}
+			r.length += r.remaining;
+			r.continued = r.remaining == max_packet;
+		}
+		else
+		{
+			unsigned count = min(r.remaining, len - pos);
+			unsigned copied = min(count, unsigned(sizeof(r.prefix)) - r.prefix_len);
+			memcpy(r.prefix + r.prefix_len, data + pos, copied);
+			r.prefix_len += copied;
+			r.remaining -= count;
+			pos += count;
+		}
+		if (r.remaining == 0)
+		{
+			r.header_len = 0;
+			if (!r.continued)
+				return true;
+		}
+	}
+	return false;
+}
+
+void mysql_framer::requests(const char* data, unsigned len, message_segments& result)
+{
+	// the server speaks first
+	if (!_greeting)
+	{
+		_failed = true;
+		return;
+	}
+	const unsigned char* bytes = (const unsigned char*) data;
+	_requests.begin(data, result);
+	unsigned pos = 0;
+	while (pos < len)
+	{
+		if (_tunnel)
+		{
+			_requests.continuation();
+			break;
+		}
+		// the packets of the connection phase, and the ones the server
+		// asks for, belong to the current transaction
+		if (_client.header_len == 0 && !_client.continued && (!_connected || _state == auth || _state == infile))
+			_requests.continuation();
+		if (!read(_client, bytes, pos, len))
+			break;
+		on_request(pos);
+	}
+	_requests.finish(len);
+}
+
+void mysql_framer::on_request(unsigned pos)
+{
+	const unsigned char* p = _client.prefix;
+	if (!_connected)
+	{
+		// the handshake response, or the SSL request that precedes it
+		if (!_handshake && _client.prefix_len >= 4)
+		{
+			_handshake = true;
+			unsigned capabilities = le32(p);
+			_compress = capabilities & client_compress;
+			_deprecate_eof = capabilities & _server_capabilities & client_deprecate_eof;
+			if ((capabilities & client_ssl) && _client.length == 32)
+				_tunnel = true;
+		}
+		_requests.cut(pos);
+		return;
+	}
+	if (_state == auth || _state == infile || _client.prefix_len == 0)
+	{
+		_requests.cut(pos);
+		return;
+	}
+	unsigned char command = p[0];
+	bool unanswered = command == com_quit || command == com_stmt_send_long_data || command == com_stmt_close;
+	if (!unanswered)
+		expect(_pending, command);
+	_requests.cut(pos, unanswered);
+	// the replication stream does not end
+	if (command == com_binlog_dump || command == com_binlog_dump_gtid)
+		_tunnel = true;
+}
+
+void mysql_framer::responses(const char* data, unsigned len, message_segments& result)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	_responses.begin(data, result);
+	unsigned pos = 0;
+	while (pos < len && !_tunnel)
+	{
+		// e.g. the error sent before the server closes an idle connection
+		if (_server.header_len == 0 && !_server.continued && _connected && _pending.empty())
+			_responses.interim();
+		if (!read(_server, bytes, pos, len))
+		{
+			// the greeting is the short packet 0
+			if (!_greeting && _server.header_len == 4 && (_server.header[3] != 0 || _server.length > 1024))
+				_failed = true;
+			break;
+		}
+		on_response(pos);
+		if (_failed)
+			return;
+	}
+	if (_failed)
+		return;
+	_responses.finish(len);
+}
+
+unsigned mysql_framer::status_flags() const
+{
+	const unsigned char* p = _server.prefix;
+	unsigned len = _server.prefix_len;
+	// EOF: header, warnings, status
+	if (p[0] == 0xfe && _server.length < 9)
+		return len >= 5 ? le16(p + 3) : 0;
+	// OK: header, affected rows, last insert id, status
+	unsigned pos = 1;
+	length_encoded(p, len, pos);
+	length_encoded(p, len, pos);
+	return pos + 2 <= len ? le16(p + pos) : 0;
+}
+
+void mysql_framer::end_response(unsigned pos, bool more)
+{
+	_state = first;
+	if (more)
+		return;
+	_responses.cut(pos, false, _rows);
+	_rows = -1;
+	_pending.pop_front();
+}
+
+void mysql_framer::on_response(unsigned pos)
+{
+	const unsigned char* p = _server.prefix;
+	unsigned len = _server.prefix_len;
+	unsigned char type = len ? p[0] : 0;
+	if (!_connected)
+	{
+		if (!_greeting)
+		{
+			_greeting = true;
+			// refused before the handshake
+			if (type == 0xff)
+			{
+				_responses.cut(pos);
+				return;
+			}
+			if (type != 0x0a)
+			{
+				_failed = true;
+				return;
+			}
+			// protocol version, server version, connection id, auth data, filler,
+			// capabilities (lower), character set, status, capabilities (upper)
+			const unsigned char* end = (const unsigned char*) memchr(p + 1, 0, len - 1);
+			unsigned caps = end ? end - p + 1 + 4 + 8 + 1 : len;
+			if (caps + 2 <= len)
+				_server_capabilities = le16(p + caps);
+			if (caps + 7 <= len)
+				_server_capabilities |= le16(p + caps + 5) << 16;
+			return;
+		}
+		// the authentication goes on until OK or ERR
+		if (type == 0x00)
+		{
+			_connected = true;
+			_tunnel = _compress;
+			_responses.cut(pos);
+		}
+		else if (type == 0xff)
+			_responses.cut(pos);
+		return;
+	}
+	if (_pending.empty())
+	{
+		_responses.cut(pos);
+		return;
+	}
+	unsigned char command = _pending.front();
+	unsigned field = 1;
+	switch (_state)
+	{
+		case first:
+			if (type == 0xff || command == com_statistics)
+				end_response(pos, false);
+			else if (type == 0x00 && command == com_stmt_prepare)
+			{
+				// the definitions of the parameters and of the columns follow
+				unsigned columns = len >= 7 ? le16(p + 5) : 0;
+				unsigned params = len >= 9 ? le16(p + 7) : 0;
+				_count = columns + params;
+				if (!_deprecate_eof)
+					_count += (columns ? 1 : 0) + (params ? 1 : 0);
+				if (_count)
+					_state = definitions;
+				else
+					end_response(pos, false);
+			}
+			else if (type == 0x00)
+			{
+				add_rows(length_encoded(p, len, field));
+				end_response(pos, status_flags() & server_more_results_exists);
+			}
+			else if (type == 0xfe && _server.length < max_packet && command != com_change_user)
+				end_response(pos, status_flags() & server_more_results_exists);
+			else if (command == com_change_user)
+				_state = auth;
+			else if (type == 0xfb && command == com_query)
+				_state = infile;
+			else if (command == com_stmt_fetch || command == com_field_list)
+			{
+				add_rows(1);
+				_state = rows;
+			}
+			else
+			{
+				// a result set: its column count
+				field = 0;
+				_count = length_encoded(p, len, field);
+				add_rows(0);
+				_state = _count ? columns : rows;
+			}
+			break;
+		case columns:
+			if (--_count == 0)
+				_state = _deprecate_eof ? rows : column_eof;
+			break;
+		case column_eof:
+			if (type == 0xff)
+				end_response(pos, false);
+			else
+				_state = rows;
+			break;
+		case rows:
+			if (type == 0xff)
+				end_response(pos, false);
+			else if (type == 0xfe && _server.length < max_packet)
+				end_response(pos, status_flags() & server_more_results_exists);
+			else
+				add_rows(1);
+			break;
+		case definitions:
+			if (--_count == 0)
+				end_response(pos, false);
+			break;
+		case auth:
+		case infile:
+			if (type == 0x00)
+			{
+				if (_state == infile)
+					add_rows(length_encoded(p, len, field));
+				end_response(pos, false);
+			}
+			else if (type == 0xff)
+				end_response(pos, false);
+			break;
+	}
+}
+
+static const char* mysql_command_name(unsigned char command)
+{
+	static const char* names[] =
+	{
+		"Sleep", "Quit", "InitDB", "Query", "FieldList", "CreateDB", "DropDB", "Refresh", "Shutdown", "Statistics",
+		"ProcessInfo", "Connect", "ProcessKill", "Debug", "Ping", "Time", "DelayedInsert", "ChangeUser", "BinlogDump",
+		"TableDump", "ConnectOut", "RegisterSlave", "StmtPrepare", "StmtExecute", "StmtSendLongData", "StmtClose",
+		"StmtReset", "SetOption", "StmtFetch", "Daemon", "BinlogDumpGtid", "ResetConnection"
+	};
+	return command < sizeof(names) / sizeof(names[0]) ? names[command] : NULL;
+}
+
+void mysql_framer::describe(const string& request, string& command, string& statement) const
+{
+	if (request.size() < 5)
+		return;
+	const unsigned char* p = (const unsigned char*) request.data();
+	// the connection phase: the user of the handshake response
+	if (p[3] != 0)
+	{
+		command = "Connect";
+		unsigned pos = 4 + 32;
+		nul_terminated(request, pos, statement);
+		return;
+	}
+	unsigned char code = p[4];
+	const char* name = mysql_command_name(code);
+	command = name ? name : "0x" + number(code);
+	unsigned pos = 5;
+	switch (code)
+	{
+		case com_query:
+		case com_stmt_prepare:
+		case com_init_db:
+			append_text(statement, request.data() + pos, request.size() - pos);
+			break;
+		case com_field_list:
+			nul_terminated(request, pos, statement);
+			break;
+		case com_stmt_execute:
+		case com_stmt_send_long_data:
+		case com_stmt_close:
+		case com_stmt_reset:
+		case com_stmt_fetch:
+			// the statement id
+			if (request.size() >= pos + 4)
+				statement = number(le32(p + pos));
+			break;
+	}
+}
+
+///// postgres_framer /////
+
+namespace
+{
+	// the codes of the untyped messages
+	const unsigned protocol_3 = 196608;
+	const unsigned cancel_request = 80877102;
+	const unsigned ssl_request = 80877103;
+	const unsigned gssenc_request = 80877104;
+	// the longest startup message accepted
+	const unsigned max_startup = 10000;
+}
+
+postgres_framer::postgres_framer(): _startup(true), _in_request(false), _tunnel(false), _data_rows(0), _tag_rows(-1)
+{
+}
+
+bool postgres_framer::read(reader& r, const unsigned char* data, unsigned& pos, unsigned len, unsigned header_size)
+{
+	while (pos < len)
+	{
+		if (r.header_len < header_size)
+		{
+			r.header[r.header_len++] = data[pos++];
+			if (r.header_len < header_size)
+				continue;
+			// the length follows the type, it counts itself and the code of the startup messages
+			bool startup = header_size == 8;
+			unsigned length = be32(r.header + (startup ? 0 : 1));
+			unsigned counted = startup ? 8 : 4;
+			bool valid = startup ? length >= 8 && length <= max_startup : length >= 4;
+			if (!valid)
+			{
+				if (r.seen)
+					_tunnel = true;
+				else
+					_failed = true;
+				return false;
+			}
+			r.remaining = length - counted;
+			r.body_len = 0;
+		}
+		else
+		{
+			unsigned count = min(r.remaining, len - pos);
+			unsigned copied = min(count, unsigned(sizeof(r.body)) - r.body_len);
+			memcpy(r.body + r.body_len, data + pos, copied);
+			r.body_len += copied;
+			r.remaining -= count;
+			pos += count;
+		}
+		if (r.remaining == 0)
+		{
+			r.header_len = 0;
+			r.seen = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+void postgres_framer::requests(const char* data, unsigned len, message_segments& result)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	_requests.begin(data, result);
+	unsigned pos = 0;
+	while (pos < len)
+	{
+		if (_tunnel)
+		{
+			_requests.continuation();
+			break;
+		}
+		if (_client.header_len == 0 && !_startup && !_in_request)
+		{
+			// the password and copy messages are a part of the current transaction
+			unsigned char type = bytes[pos];
+			if (type == 'p' || type == 'd' || type == 'c' || type == 'f')
+				_requests.continuation();
+		}
+		if (!read(_client, bytes, pos, len, _startup ? 8 : 5))
+			break;
+		on_request(pos);
+		if (_failed)
+			return;
+	}
+	_requests.finish(len);
+}
+
+void postgres_framer::on_request(unsigned pos)
+{
+	if (_startup)
+	{
+		unsigned code = be32(_client.header + 4);
+		if (code == ssl_request || code == gssenc_request)
+		{
+			expect(_pending, encryption);
+			_requests.cut(pos);
+		}
+		else if (code == cancel_request)
+			_requests.cut(pos, true);
+		else if (code == protocol_3)
+		{
+			_startup = false;
+			expect(_pending, ready);
+			_requests.cut(pos);
+		}
+		else
+			_failed = true;
+		return;
+	}
+	unsigned char type = _client.header[0];
+	if (type == 'X')
+	{
+		_in_request = false;
+		_requests.cut(pos, true);
+	}
+	else if (type == 'Q' || type == 'S' || type == 'F')
+	{
+		_in_request = false;
+		expect(_pending, ready);
+		_requests.cut(pos);
+	}
+	else if (_in_request)
+		return;
+	else if (type == 'p' || type == 'd' || type == 'c' || type == 'f')
+		_requests.cut(pos);
+	else
+		_in_request = true;
+}
+
+void postgres_framer::responses(const char* data, unsigned len, message_segments& result)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	_responses.begin(data, result);
+	unsigned pos = 0;
+	while (pos < len && !_tunnel)
+	{
+		if (_server.header_len == 0)
+		{
+			if (!_pending.empty() && _pending.front() == encryption)
+			{
+				// S or G: the rest is encrypted
+				unsigned char answer = bytes[pos++];
+				if (answer != 'N')
+				{
+					if (answer != 'S' && answer != 'G' && answer != 'E')
+					{
+						_failed = true;
+						return;
+					}
+					_tunnel = true;
+					break;
+				}
+				_server.seen = true;
+				_pending.pop_front();
+				_responses.cut(pos);
+				continue;
+			}
+			if (!_server.seen && bytes[pos] != 'R' && bytes[pos] != 'E')
+			{
+				_failed = true;
+				return;
+			}
+			// notices, notifications and parameter changes between the transactions
+			if (_pending.empty())
+				_responses.interim();
+		}
+		if (!read(_server, bytes, pos, len, 5))
+			break;
+		on_response(pos);
+	}
+	if (_failed)
+		return;
+	_responses.finish(len);
+}
+
+void postgres_framer::on_response(unsigned pos)
+{
+	if (_responses.is_interim() || _pending.empty())
+	{
+		_responses.cut(pos);
+		return;
+	}
+	switch (_server.header[0])
+	{
+		case 'D':
+			_data_rows++;
+			break;
+		case 'C':
+		{
+			// the tag: the count, if any, is its last word
+			const char* tag = (const char*) _server.body;
+			unsigned len = strnlen(tag, _server.body_len);
+			unsigned start = len;
+			while (start > 0 && tag[start - 1] >= '0' && tag[start - 1] <= '9')
+				start--;
+			if (start < len && start > 0 && tag[start - 1] == ' ')
+				_tag_rows = (_tag_rows < 0 ? 0 : _tag_rows) + strtoull(tag + start, NULL, 10);
+			break;
+		}
+		case 'Z':
+			_responses.cut(pos, false, _tag_rows >= 0 ? _tag_rows : _data_rows > 0 ? _data_rows : -1);
+			_pending.pop_front();
+			_data_rows = 0;
+			_tag_rows = -1;
+			break;
+	}
+}
+
+static const char* postgres_message_name(unsigned char type)
+{
+	switch (type)
+	{
+		case 'Q': return "Query";
+		case 'P': return "Parse";
+		case 'B': return "Bind";
+		case 'D': return "Describe";
+		case 'E': return "Execute";
+		case 'C': return "Close";
+		case 'H': return "Flush";
+		case 'S': return "Sync";
+		case 'F': return "FunctionCall";
+		case 'X': return "Terminate";
+		case 'p': return "Password";
+		case 'd': return "CopyData";
+		case 'c': return "CopyDone";
+		case 'f': return "CopyFail";
+	}
+	return NULL;
+}
+
+void postgres_framer::describe(const string& request, string& command, string& statement) const
+{
+	if (request.size() < 5)
+		return;
+	const unsigned char* p = (const unsigned char*) request.data();
+	// the startup messages begin with their length, the others with a letter
+	if (p[0] == 0)
+	{
+		if (request.size() < 8)
+			return;
+		unsigned code = be32(p + 4);
+		switch (code)
+		{
+			case ssl_request: command = "SSLRequest"; return;
+			case gssenc_request: command = "GSSENCRequest"; return;
+			case cancel_request: command = "CancelRequest"; return;
+		}
+		command = "Startup";
+		// the parameters: name and value pairs, the user is printed
+		for (unsigned pos = 8; pos < request.size() && request[pos] != 0;)
+		{
+			string name, value;
+			nul_terminated(request, pos, name);
+			nul_terminated(request, pos, value);
+			if (name == "user")
+			{
+				statement = value;
+				break;
+			}
+		}
+		return;
+	}
+	const char* name = postgres_message_name(p[0]);
+	command = name ? name : string(1, p[0]);
+	unsigned pos = 5;
+	string skipped;
+	switch (p[0])
+	{
+		case 'Q':
+			nul_terminated(request, pos, statement);
+			break;
+		case 'P':
+			// the name of the prepared statement, then the query
+			nul_terminated(request, pos, skipped);
+			nul_terminated(request, pos, statement);
+			break;
+		case 'B':
+			// the portal, then the prepared statement
+			nul_terminated(request, pos, skipped);
+			nul_terminated(request, pos, statement);
+			break;
+	}
+}
+
+///// redis_framer /////
+
+redis_framer::redis_framer(): _command_len(0), _capture(0), _pending(0), _subscribe(-1), _started(false), _tunnel(false)
+{
+}
+
+void redis_framer::on_value(parser& p, bool& complete)
+{
+	for (;;)
+	{
+		if (p.depth == 0)
+		{
+			complete = true;
+			return;
+		}
+		if (--p.left[p.depth - 1] > 0)
+			return;
+		p.depth--;
+		// an attribute annotates the value that follows
+		if (p.attribute[p.depth])
+			return;
+	}
+}
+
+bool redis_framer::on_line(parser& p, bool& complete, bool request)
+{
+	p.text[p.text_len] = 0;
+	switch (p.value_type)
+	{
+		case '+': case '-': case ':': case ',': case '#': case '_': case '(':
+			on_value(p, complete);
+			return true;
+		case '$': case '!': case '=':
+		{
+			if (p.text[0] == '?')
+				return false;
+			long long size = atoll(p.text);
+			if (size < 0)
+			{
+				on_value(p, complete);
+				return true;
+			}
+			// the first element of a command is its name
+			_capture = 0;
+			if (request && p.depth == 1 && p.left[0] == u_int64_t(p.elements))
+			{
+				_command_len = 0;
+				_capture = min(size, (long long)(sizeof(_command) - 1));
+			}
+			p.remaining = size + 2;
+			p.state = parser::bulk;
+			return true;
+		}
+		case '*': case '~': case '>': case '%': case '|':
+		{
+			if (p.text[0] == '?')
+				return false;
+			long long size = atoll(p.text);
+			bool attribute = p.value_type == '|';
+			if (p.depth == 0 && !attribute)
+				p.elements = size < 0 ? -1 : size;
+			if (p.value_type == '%' || attribute)
+				size *= 2;
+			if (size <= 0)
+			{
+				if (!attribute)
+					on_value(p, complete);
+				return true;
+			}
+			if (p.depth == max_depth)
+				return false;
+			p.left[p.depth] = size;
+			p.attribute[p.depth] = attribute;
+			p.depth++;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool redis_framer::parse(parser& p, const unsigned char* data, unsigned& pos, unsigned len, bool& complete, bool request)
+{
+	while (pos < len && !complete)
+	{
+		switch (p.state)
+		{
+			case parser::type:
+			{
+				unsigned char c = data[pos++];
+				// a command that is not an array is an inline one, up to the end of line
+				if (request && !p.started && c != '*')
+				{
+					if (c < ' ' && c != '\r' && c != '\n')
+						return false;
+					_command_len = 0;
+					p.text_len = 0;
+					p.state = parser::inline_line;
+					pos--;
+					break;
+				}
+				if (!strchr("+-:$*_#,(!=%~>|", c) || c == 0)
+					return false;
+				p.started = true;
+				p.value_type = c;
+				p.text_len = 0;
+				p.state = parser::line;
+				break;
+			}
+			case parser::line:
+			{
+				unsigned char c = data[pos++];
+				if (c == '\n')
+				{
+					p.state = parser::type;
+					if (!on_line(p, complete, request))
+						return false;
+				}
+				else if (c != '\r' && p.text_len < sizeof(p.text) - 1)
+					p.text[p.text_len++] = c;
+				break;
+			}
+			case parser::bulk:
+			{
+				unsigned count = min(p.remaining, u_int64_t(len - pos));
+				if (_command_len < _capture)
+				{
+					unsigned copied = min(count, _capture - _command_len);
+					memcpy(_command + _command_len, data + pos, copied);
+					_command_len += copied;
+				}
+				pos += count;
+				p.remaining -= count;
+				if (p.remaining == 0)
+				{
+					_capture = 0;
+					p.state = parser::type;
+					on_value(p, complete);
+				}
+				break;
+			}
+			case parser::inline_line:
+			{
+				unsigned char c = data[pos++];
+				if (c == '\n')
+				{
+					p.state = parser::type;
+					complete = true;
+				}
+				else if (c == ' ' || c == '\r')
+					p.started = p.started || _command_len > 0;
+				else if (!p.started && _command_len < sizeof(_command) - 1)
+					_command[_command_len++] = c;
+				break;
+			}
+		}
+	}
+	if (complete)
+	{
+		p.started = false;
+		p.depth = 0;
+	}
+	return true;
+}
+
+static bool subscription(const char* command, unsigned len)
+{
+	static const char* names[] = {"SUBSCRIBE", "PSUBSCRIBE", "SSUBSCRIBE", "MONITOR"};
+	for (unsigned i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (len == strlen(names[i]) && strncasecmp(command, names[i], len) == 0)
+			return true;
+	return false;
+}
+
+void redis_framer::requests(const char* data, unsigned len, message_segments& result)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	_requests.begin(data, result);
+	unsigned pos = 0;
+	while (pos < len)
+	{
+		if (_tunnel)
+		{
+			_requests.continuation();
+			break;
+		}
+		bool complete = false;
+		if (!parse(_client, bytes, pos, len, complete, true))
+		{
+			if (!_started)
+			{
+				_failed = true;
+				return;
+			}
+			_tunnel = true;
+			continue;
+		}
+		if (!complete)
+			break;
+		_client.elements = -1;
+		// an empty line is not a command
+		bool unanswered = _command_len == 0;
+		_requests.cut(pos, unanswered);
+		if (unanswered)
+			continue;
+		// the pushed messages of a subscription are not responses
+		if (subscription(_command, _command_len))
+		{
+			_subscribe = _pending;
+			_tunnel = true;
+		}
+		_pending++;
+	}
+	_requests.finish(len);
+}
+
+void redis_framer::responses(const char* data, unsigned len, message_segments& result)
+{
+	const unsigned char* bytes = (const unsigned char*) data;
+	_responses.begin(data, result);
+	unsigned pos = 0;
+	while (pos < len && _subscribe != 0)
+	{
+		// the RESP3 push messages (and the values nobody asked for) are out of band
+		if (!_server.started && _server.state == parser::type && (_pending == 0 || bytes[pos] == '>'))
+			_responses.interim();
+		bool complete = false;
+		if (!parse(_server, bytes, pos, len, complete, false))
+		{
+			if (!_started)
+			{
+				_failed = true;
+				return;
+			}
+			_subscribe = 0;
+			break;
+		}
+		if (!complete)
+			break;
+		_started = true;
+		if (_responses.is_interim())
+			_responses.cut(pos);
+		else
+		{
+			_responses.cut(pos, false, _server.elements);
+			_pending--;
+			if (_subscribe > 0)
+				_subscribe--;
+		}
+		_server.elements = -1;
+	}
+	_responses.finish(len);
+}
+
+void redis_framer::describe(const string& request, string& command, string& statement) const
+{
+	if (request.empty())
+		return;
+	if (request[0] != '*')
+	{
+		// inline: the line, the command is its first word
+		string::size_type end = request.find_first_of("\r\n");
+		if (end == string::npos)
+			end = request.size();
+		string::size_type start = request.find_first_not_of(' ');
+		if (start == string::npos || start >= end)
+			return;
+		append_text(statement, request.data() + start, end - start);
+		command = statement.substr(0, statement.find(' '));
+	}
+	else
+	{
+		// the bulk strings of the array, separated by spaces
+		string::size_type pos = request.find('\n');
+		while (pos != string::npos && pos + 1 < request.size() && request[pos + 1] == '$')
+		{
+			long long size = atoll(request.c_str() + pos + 2);
+			string::size_type start = request.find('\n', pos + 1);
+			if (start == string::npos || size < 0)
+				break;
+			start++;
+			string::size_type count = min(string::size_type(size), request.size() - start);
+			if (command.empty())
+				command = request.substr(start, count);
+			else
+				statement += ' ';
+			append_text(statement, request.data() + start, count);
+			if (start + count + 2 >= request.size())
+				break;
+			pos = start + count + 1;
+		}
+	}
+	for (string::iterator i = command.begin(); i != command.end(); i++)
+		*i = toupper(*i);
+}
+
+///// db_handler /////
+
+unsigned db_handler::_max_statement = 256;
+
+db_handler::db_handler(const string& not_found, field_enum field):
+	_not_found(not_found), _field(field), _started(false), _complete(false), _rows(-1)
+{
+}
+
+void db_handler::onRequest(tcp_stream* pstream, const timeval* t)
+{
+	stream* s = static_cast<stream*>(pstream);
+	if (s->segment == NULL)
+		return;
+	if (!_framer)
+		_framer = s->framer();
+	if (dynamic_cast<const db_framer*>(_framer.get()) == NULL)
+		return;
+	if (!_started)
+	{
+		_started = true;
+		_start = *t;
+	}
+	if (_field != command && _field != statement)
+		return;
+	// the framing bytes of the arguments are kept too
+	unsigned limit = 4 * _max_statement + 64;
+	if (_request.size() < limit)
+	{
+		if (_request.empty())
+			_request.reserve(limit);
+		_request.append(s->segment->data, min(s->segment->len, unsigned(limit - _request.size())));
+	}
+}
+
+void db_handler::onResponse(tcp_stream* pstream, const timeval* t)
+{
+	stream* s = static_cast<stream*>(pstream);
+	if (s->segment == NULL || !s->segment->end)
+		return;
+	_complete = true;
+	_end = *t;
+	_rows = s->segment->rows;
+}
+
+void db_handler::append(std::basic_ostream<char>& out, const timeval* t)
+{
+	switch (_field)
+	{
+		case command:
+		case statement:
+		{
+			string command_name, statement_text;
+			// the request was framed, even if the framing stopped later
+			const db_framer* framer = dynamic_cast<const db_framer*>(_framer.get());
+			if (framer != NULL)
+				framer->describe(_request, command_name, statement_text);
+			const string& value = _field == command ? command_name : statement_text;
+			if (value.empty())
+				out << _not_found;
+			else
+				out << value.substr(0, _max_statement);
+			break;
+		}
+		case rows:
+			if (_complete && _rows >= 0)
+				out << _rows;
+			else
+				out << _not_found;
+			break;
+		case latency:
+			if (_started && _complete)
+				out << to_double(_end - _start);
+			else
+				out << _not_found;
+			break;
+	}
+}
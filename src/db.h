@@ -0,0 +1,218 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_db_h
+#define _sniffer_db_h
+#include <string>
+#include <deque>
+#include "formatter.h"
+
+// the framers of the database protocols: they follow the messages of both
+// directions in constant space (a few bytes of every message header are
+// buffered), end a request at the command boundary and a response at the end
+// of its result, counting the rows
+class db_framer : public message_framer
+{
+public:
+	db_framer(): _failed(false){}
+	virtual bool failed() const {return _failed;}
+	// the command and the statement of a request, from its first bytes
+	virtual void describe(const std::string& request, std::string& command, std::string& statement) const = 0;
+protected:
+	// the segments of one direction, cut at the message ends
+	class cutter
+	{
+	public:
+		cutter(): _in_message(false), _interim(false), _data(NULL), _begin(0), _result(NULL){}
+		void begin(const char* data, message_segments& result){_data = data; _begin = 0; _result = &result;}
+		// the message ends before pos
+		void cut(unsigned pos, bool unanswered = false, int64_t rows = -1);
+		// the rest of the data is a part of the current message
+		void finish(unsigned len);
+		// the data that follows belongs to the previous message
+		void continuation(){_in_message = true;}
+		// the message that follows is not a response to a request (skipped)
+		void interim(){_interim = true;}
+		bool is_interim() const {return _interim;}
+	private:
+		bool _in_message, _interim;
+		const char* _data;
+		unsigned _begin;
+		message_segments* _result;
+	};
+	// keeps what a request expects of its response: past max_pipeline
+	// requests waiting for one the framing fails
+	template <class T> void expect(std::deque<T>& pending, T what)
+	{
+		if (pending.size() < max_pipeline)
+			pending.push_back(what);
+		else
+			_failed = true;
+	}
+	bool _failed;
+};
+
+// MySQL client/server protocol: the connection phase (greeting, handshake
+// response and authentication) is the first transaction, then every
+// command packet is a request. Connections switching to TLS or to
+// compression become a single transaction
+class mysql_framer : public db_framer
+{
+public:
+	mysql_framer();
+	virtual void requests(const char* data, unsigned len, message_segments& result);
+	virtual void responses(const char* data, unsigned len, message_segments& result);
+	virtual void describe(const std::string& request, std::string& command, std::string& statement) const;
+private:
+	enum state_enum {first, columns, column_eof, rows, definitions, auth, infile};
+	// the packets of one direction, with the first bytes of their payload
+	struct reader
+	{
+		reader(): header_len(0), remaining(0), length(0), prefix_len(0), continued(false){}
+		unsigned char header[4];
+		unsigned header_len, remaining, length, prefix_len;
+		unsigned char prefix[96];
+		// the last part was 0xffffff bytes long: the payload goes on in the next one
+		bool continued;
+	};
+	// consumes data up to the end of a packet, true if it is complete
+	static bool read(reader& r, const unsigned char* data, unsigned& pos, unsigned len);
+	void on_request(unsigned pos);
+	void on_response(unsigned pos);
+	// the response is complete unless more results follow
+	void end_response(unsigned pos, bool more);
+	// the status flags of the OK or EOF packet just read
+	unsigned status_flags() const;
+	void add_rows(u_int64_t count){_rows = (_rows < 0 ? 0 : _rows) + count;}
+	reader _client, _server;
+	cutter _requests, _responses;
+	bool _greeting, _handshake, _connected, _tunnel, _compress, _deprecate_eof;
+	unsigned _server_capabilities;
+	// the commands waiting for their response
+	std::deque<unsigned char> _pending;
+	state_enum _state;
+	u_int64_t _count;
+	int64_t _rows;
+};
+
+// PostgreSQL frontend/backend protocol 3: a request is the messages up to a
+// Query, Sync or FunctionCall, answered by the backend messages up to the
+// ReadyForQuery. The startup (with the authentication) and the SSL requests
+// are requests too; after SSL or GSS encryption the connection is a single
+// transaction
+class postgres_framer : public db_framer
+{
+public:
+	postgres_framer();
+	virtual void requests(const char* data, unsigned len, message_segments& result);
+	virtual void responses(const char* data, unsigned len, message_segments& result);
+	virtual void describe(const std::string& request, std::string& command, std::string& statement) const;
+private:
+	struct reader
+	{
+		reader(): header_len(0), remaining(0), body_len(0), seen(false){}
+		unsigned char header[8];
+		unsigned header_len, remaining;
+		// the first bytes of the body
+		unsigned char body[64];
+		unsigned body_len;
+		// a message has been read
+		bool seen;
+	};
+	// what the backend answers to a request: up to ReadyForQuery or the
+	// single byte of the encryption requests
+	enum pending_enum {ready, encryption};
+	// consumes data up to the end of a message, true if it is complete.
+	// The startup messages have no type byte, their header is 8 bytes long
+	bool read(reader& r, const unsigned char* data, unsigned& pos, unsigned len, unsigned header_size);
+	void on_request(unsigned pos);
+	void on_response(unsigned pos);
+	reader _client, _server;
+	cutter _requests, _responses;
+	bool _startup, _in_request, _tunnel;
+	std::deque<pending_enum> _pending;
+	int64_t _data_rows, _tag_rows;
+};
+
+// Redis serialization protocol (RESP2 and RESP3): every command, an array of
+// bulk strings or an inline line, is answered by one value. Pub/sub and
+// MONITOR turn the rest of the connection into a single transaction
+class redis_framer : public db_framer
+{
+public:
+	redis_framer();
+	virtual void requests(const char* data, unsigned len, message_segments& result);
+	virtual void responses(const char* data, unsigned len, message_segments& result);
+	virtual void describe(const std::string& request, std::string& command, std::string& statement) const;
+	static const unsigned max_depth = 32;
+private:
+	// a value, parsed a byte at a time
+	struct parser
+	{
+		parser(): state(type), started(false), text_len(0), remaining(0), depth(0), elements(-1){}
+		enum state_enum {type, line, bulk, inline_line} state;
+		bool started;
+		unsigned char value_type;
+		char text[32];
+		unsigned text_len;
+		u_int64_t remaining;
+		// the elements left of the open aggregates, and whether they are attributes
+		u_int64_t left[max_depth];
+		bool attribute[max_depth];
+		unsigned depth;
+		// the elements of the top level aggregate, -1 for the other values
+		int64_t elements;
+	};
+	// consumes data up to the end of a message (complete is set), false on a
+	// protocol error. The requests capture their first element in _command
+	bool parse(parser& p, const unsigned char* data, unsigned& pos, unsigned len, bool& complete, bool request);
+	bool on_line(parser& p, bool& complete, bool request);
+	static void on_value(parser& p, bool& complete);
+	parser _client, _server;
+	cutter _requests, _responses;
+	char _command[16];
+	unsigned _command_len, _capture;
+	// the responses not received yet, the ones before the subscription (-1 if none)
+	unsigned _pending;
+	int _subscribe;
+	bool _started, _tunnel;
+};
+
+// %db keywords, on the connections framed by a db_framer
+class db_handler : public basic_handler
+{
+public:
+	enum field_enum {command, statement, rows, latency};
+	db_handler(const std::string& not_found, field_enum field);
+	virtual void onRequest(tcp_stream* pstream, const timeval* t);
+	virtual void onResponse(tcp_stream* pstream, const timeval* t);
+	virtual void append(std::basic_ostream<char>& out, const timeval* t);
+	// the bytes printed by %db.statement
+	static void set_max_statement(unsigned max_statement){_max_statement = max_statement;}
+	static unsigned max_statement(){return _max_statement;}
+private:
+	std::string _not_found;
+	field_enum _field;
+	// kept alive: the stream drops a framer that fails
+	boost::shared_ptr<message_framer> _framer;
+	std::string _request;
+	bool _started, _complete;
+	timeval _start, _end;
+	int64_t _rows;
+	static unsigned _max_statement;
+};
+
+template <int field> class db_field_handler : public db_handler
+{
+public:
+	db_field_handler(const std::string& not_found): db_handler(not_found, field_enum(field)){}
+};
+
+#endif// _sniffer_db_h
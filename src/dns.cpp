@@ -0,0 +1,381 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "dns.h"
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+// the fixed header of a message: id, flags and the four section counts
+static const unsigned header_size = 12;
+
+static u_int64_t mix(u_int64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static unsigned u16(const unsigned char* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static bool before(const timeval& a, const timeval& b)
+{
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_usec < b.tv_usec);
+}
+
+///// dns_tracker /////
+
+dns_tracker* dns_tracker::theOnlyTracker = NULL;
+
+dns_tracker::dns_tracker(stream_listener* listener, const sections& _sections, u_short port, unsigned timeout, unsigned max_pending):
+	_listener(listener), _sections(_sections), _port(port), _timeout(timeout), _oldest(-1), _newest(-1), _free(-1)
+{
+	check(theOnlyTracker == NULL, common_exception("dns_tracker::dns_tracker(): I am not the only tracker"));
+	theOnlyTracker = this;
+	if (max_pending == 0)
+		max_pending = 1;
+	_pool.resize(max_pending);
+	_streams.resize(max_pending);
+	for (int i = max_pending - 1; i >= 0; i--)
+	{
+		_pool[i].newer = _free;
+		_free = i;
+	}
+	// at most half full, so that the probes stay short
+	unsigned size = 1;
+	while (size < 2 * max_pending)
+		size *= 2;
+	_table.assign(size, -1);
+	_mask = size - 1;
+	memset(&_datagram, 0, sizeof(_datagram));
+	_datagram.nids_state = NIDS_DATA;
+	_now.tv_sec = 0;
+	_now.tv_usec = 0;
+}
+
+void dns_tracker::nids_handler(struct tuple4* addr, char* data, int len, char* packet, struct timeval* t)
+{
+	if (theOnlyTracker != NULL && len >= int(header_size))
+		theOnlyTracker->process(*addr, data, len, t);
+}
+
+void dns_tracker::process(const tuple4& addr, const char* data, unsigned len, const timeval* t)
+{
+	const unsigned char* header = (const unsigned char*) data;
+	bool response = header[2] & 0x80;
+	// the queries go to the port, the responses come from it
+	if ((response ? addr.source : addr.dest) != _port)
+		return;
+	_now = *t;
+	expire(t);
+	// the transaction is identified by the addresses of the query
+	tuple4 key = addr;
+	if (response)
+	{
+		key.saddr = addr.daddr;
+		key.daddr = addr.saddr;
+		key.source = addr.dest;
+		key.dest = addr.source;
+	}
+	u_short id = u16(header);
+	int index = find(key, id);
+	_datagram.addr = key;
+	if (!response)
+	{
+		// a retransmission goes to the pending query
+		if (index < 0)
+		{
+			index = insert(key, id, t);
+			stream_of(index).opening_time = *t;
+		}
+		_datagram.server.data = const_cast<char*>(data);
+		_datagram.server.count = _datagram.server.count_new = len;
+		_datagram.client.count = _datagram.client.count_new = 0;
+		stream_of(index).onRequest(&_datagram, t);
+	}
+	else if (index >= 0)
+	{
+		_datagram.client.data = const_cast<char*>(data);
+		_datagram.client.count = _datagram.client.count_new = len;
+		_datagram.server.count = _datagram.server.count_new = 0;
+		stream_of(index).onResponse(&_datagram, t);
+		close(index, t);
+	}
+}
+
+void dns_tracker::flush()
+{
+	while (_oldest >= 0)
+		close(_oldest, &_now);
+}
+
+void dns_tracker::expire(const timeval* t)
+{
+	while (_oldest >= 0 && !before(*t, _pool[_oldest].deadline))
+	{
+		timeval deadline = _pool[_oldest].deadline;
+		close(_oldest, &deadline);
+	}
+}
+
+unsigned dns_tracker::hash(const tuple4& addr, u_short id) const
+{
+	u_int64_t a = (u_int64_t(addr.saddr) << 32) | addr.daddr;
+	u_int64_t b = (u_int64_t(addr.source) << 32) | (u_int64_t(addr.dest) << 16) | id;
+	return mix(mix(a) ^ b) & _mask;
+}
+
+int dns_tracker::find(const tuple4& addr, u_short id) const
+{
+	for (unsigned slot = hash(addr, id); _table[slot] >= 0; slot = (slot + 1) & _mask)
+	{
+		const pending& p = _pool[_table[slot]];
+		if (p.id == id && p.addr.saddr == addr.saddr && p.addr.daddr == addr.daddr && p.addr.source == addr.source && p.addr.dest == addr.dest)
+			return _table[slot];
+	}
+	return -1;
+}
+
+int dns_tracker::insert(const tuple4& addr, u_short id, const timeval* t)
+{
+	// full: the oldest query is given up
+	if (_free < 0)
+		close(_oldest, t);
+	int index = _free;
+	pending& p = _pool[index];
+	_free = p.newer;
+	p.addr = addr;
+	p.id = id;
+	p.deadline = *t;
+	p.deadline.tv_sec += _timeout;
+	p.older = _newest;
+	p.newer = -1;
+	if (_newest >= 0)
+		_pool[_newest].newer = index;
+	else
+		_oldest = index;
+	_newest = index;
+	unsigned slot = hash(addr, id);
+	while (_table[slot] >= 0)
+		slot = (slot + 1) & _mask;
+	_table[slot] = index;
+	return index;
+}
+
+void dns_tracker::remove(int index)
+{
+	pending& p = _pool[index];
+	unsigned slot = hash(p.addr, p.id);
+	while (_table[slot] != index)
+		slot = (slot + 1) & _mask;
+	// backward shift: the following entries of the cluster that would not be
+	// found anymore take the hole, no tombstones are left
+	for (unsigned next = (slot + 1) & _mask; _table[next] >= 0; next = (next + 1) & _mask)
+	{
+		const pending& moved = _pool[_table[next]];
+		unsigned home = hash(moved.addr, moved.id);
+		if (((next - home) & _mask) >= ((next - slot) & _mask))
+		{
+			_table[slot] = _table[next];
+			slot = next;
+		}
+	}
+	_table[slot] = -1;
+	if (p.older >= 0)
+		_pool[p.older].newer = p.newer;
+	else
+		_oldest = p.newer;
+	if (p.newer >= 0)
+		_pool[p.newer].older = p.older;
+	else
+		_newest = p.older;
+	p.newer = _free;
+	_free = index;
+}
+
+void dns_tracker::close(int index, const timeval* t)
+{
+	_datagram.addr = _pool[index].addr;
+	_datagram.server.count = _datagram.server.count_new = 0;
+	_datagram.client.count = _datagram.client.count_new = 0;
+	remove(index);
+	// printed here, the handlers of the next transaction are created by print
+	stream_of(index).onClose(&_datagram, t, NULL);
+}
+
+stream& dns_tracker::stream_of(int index)
+{
+	if (!_streams[index])
+	{
+		_streams[index] = stream::ptr(new stream(_listener, _sections));
+		_streams[index]->init(&_datagram);
+	}
+	return *_streams[index];
+}
+
+///// dns_handler /////
+
+static const char* type_name(unsigned type)
+{
+	switch (type)
+	{
+		case 1: return "A";
+		case 2: return "NS";
+		case 5: return "CNAME";
+		case 6: return "SOA";
+		case 12: return "PTR";
+		case 15: return "MX";
+		case 16: return "TXT";
+		case 28: return "AAAA";
+		case 33: return "SRV";
+		case 35: return "NAPTR";
+		case 43: return "DS";
+		case 46: return "RRSIG";
+		case 48: return "DNSKEY";
+		case 64: return "SVCB";
+		case 65: return "HTTPS";
+		case 252: return "AXFR";
+		case 255: return "ANY";
+	}
+	return NULL;
+}
+
+static const char* rcode_name(unsigned rcode)
+{
+	static const char* names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE"};
+	return rcode < sizeof(names) / sizeof(names[0]) ? names[rcode] : NULL;
+}
+
+// the first question: its name in dotted form (the bytes that are not
+// printable or are dots are escaped as \ddd) and its type
+static bool parse_question(const unsigned char* data, unsigned len, string& name, unsigned& type)
+{
+	if (len < header_size || u16(data + 4) == 0)
+		return false;
+	unsigned pos = header_size;
+	for (;;)
+	{
+		if (pos >= len)
+			return false;
+		unsigned label = data[pos++];
+		if (label == 0)
+			break;
+		// compression pointers and extended labels are not expected in the question
+		if (label > 63 || pos + label > len)
+			return false;
+		if (!name.empty())
+			name += '.';
+		for (unsigned i = 0; i < label; i++)
+		{
+			unsigned char c = data[pos + i];
+			if (c > ' ' && c < 127 && c != '.' && c != '\\')
+				name += c;
+			else
+			{
+				ostringstream escaped;
+				escaped << '\\' << setw(3) << setfill('0') << unsigned(c);
+				name += escaped.str();
+			}
+		}
+		pos += label;
+	}
+	if (name.empty())
+		name = ".";
+	if (pos + 2 > len)
+		return false;
+	type = u16(data + pos);
+	return true;
+}
+
+dns_handler::dns_handler(const string& not_found, field_enum field):
+	_not_found(not_found), _field(field), _query(false), _response(false), _found(false), _number(0)
+{
+}
+
+void dns_handler::onRequest(tcp_stream* pstream, const timeval* t)
+{
+	if (_query)
+		return;
+	_query = true;
+	_query_time = *t;
+	const unsigned char* data = (const unsigned char*) pstream->server.data;
+	unsigned len = pstream->server.count_new;
+	if (_field == qname || _field == qtype)
+		_found = parse_question(data, len, _name, _number);
+	else if (_field == id)
+	{
+		_found = true;
+		_number = u16(data);
+	}
+}
+
+void dns_handler::onResponse(tcp_stream* pstream, const timeval* t)
+{
+	if (_response)
+		return;
+	_response = true;
+	_response_time = *t;
+	const unsigned char* data = (const unsigned char*) pstream->client.data;
+	if (_field == rcode)
+	{
+		_found = true;
+		_number = data[3] & 0x0f;
+	}
+	else if (_field == answers)
+	{
+		_found = true;
+		_number = u16(data + 6);
+	}
+}
+
+void dns_handler::append(std::basic_ostream<char>& out, const timeval* t)
+{
+	if (_field == latency)
+	{
+		if (_query && _response)
+			out << to_double(_response_time - _query_time);
+		else
+			out << _not_found;
+		return;
+	}
+	if (!_found)
+	{
+		out << _not_found;
+		return;
+	}
+	switch (_field)
+	{
+		case qname:
+			out << _name;
+			break;
+		case qtype:
+			if (type_name(_number))
+				out << type_name(_number);
+			else
+				out << "TYPE" << _number;
+			break;
+		case rcode:
+			if (rcode_name(_number))
+				out << rcode_name(_number);
+			else
+				out << _number;
+			break;
+		default:
+			out << _number;
+	}
+}
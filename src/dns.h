@@ -0,0 +1,89 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_dns_h
+#define _sniffer_dns_h
+#include <string>
+#include <vector>
+#include "formatter.h"
+
+// pairs the UDP DNS queries with their responses by addresses, ports and
+// transaction id, and logs every transaction through the handlers of its
+// sections, as a request/response of a connection: the query is the request,
+// the response the response. The pending queries are kept in a fixed size
+// hash table; the ones not answered within the timeout, or evicted when the
+// table is full, are logged without response. The streams of the table slots
+// are reused from a transaction to the next one
+class dns_tracker
+{
+public:
+	dns_tracker(stream_listener* listener, const sections& _sections, u_short port, unsigned timeout, unsigned max_pending);
+	static void nids_handler(struct tuple4* addr, char* data, int len, char* packet, struct timeval* t);
+	// logs the pending queries as not answered (e.g. at the end of the capture file)
+	void flush();
+private:
+	struct pending
+	{
+		tuple4 addr;
+		u_short id;
+		timeval deadline;
+		// insertion order (oldest first), -1 at the ends; the free list uses newer
+		int older, newer;
+	};
+	void process(const tuple4& addr, const char* data, unsigned len, const timeval* t);
+	unsigned hash(const tuple4& addr, u_short id) const;
+	int find(const tuple4& addr, u_short id) const;
+	int insert(const tuple4& addr, u_short id, const timeval* t);
+	void remove(int index);
+	// logs the transaction of the slot and frees it
+	void close(int index, const timeval* t);
+	void expire(const timeval* t);
+	stream& stream_of(int index);
+	stream_listener* _listener;
+	const sections& _sections;
+	u_short _port;
+	unsigned _timeout;
+	std::vector<pending> _pool;
+	std::vector<stream::ptr> _streams;
+	// pool indices by open addressing (linear probing), -1 for empty
+	std::vector<int> _table;
+	unsigned _mask;
+	int _oldest, _newest, _free;
+	// the datagram handed to the stream handlers
+	tcp_stream _datagram;
+	// the time of the last datagram
+	timeval _now;
+	static dns_tracker* theOnlyTracker;
+};
+
+class dns_handler : public basic_handler
+{
+public:
+	enum field_enum {qname, qtype, rcode, latency, id, answers};
+	dns_handler(const std::string& not_found, field_enum field);
+	virtual void onRequest(tcp_stream* pstream, const timeval* t);
+	virtual void onResponse(tcp_stream* pstream, const timeval* t);
+	virtual void append(std::basic_ostream<char>& out, const timeval* t);
+private:
+	std::string _not_found, _name;
+	field_enum _field;
+	bool _query, _response, _found;
+	// the type, rcode, id or answer count
+	unsigned _number;
+	timeval _query_time, _response_time;
+};
+
+template <int field> class dns_field_handler : public dns_handler
+{
+public:
+	dns_field_handler(const std::string& not_found): dns_handler(not_found, field_enum(field)){}
+};
+
+#endif// _sniffer_dns_h
@@ -0,0 +1,363 @@
+/*
+	Copyright (c) 2007-2012 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+
+*/
+
+#include <iostream>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "utilities.h"
+#include "extract.h"
+
+using namespace std;
+
+// the buffer of a body written to a temporary file
+static const size_t write_size = 64 * 1024;
+
+static bool write_all(int fd, const char* data, size_t len)
+{
+	while (len)
+	{
+		ssize_t n = ::write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool make_directory(const string& path)
+{
+	return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+///// sha1 /////
+
+static inline u_int32_t rotate(u_int32_t x, unsigned n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+sha1::sha1(): _used(0), _size(0)
+{
+	_h[0] = 0x67452301;
+	_h[1] = 0xefcdab89;
+	_h[2] = 0x98badcfe;
+	_h[3] = 0x10325476;
+	_h[4] = 0xc3d2e1f0;
+}
+
+void sha1::block(const unsigned char* p)
+{
+	u_int32_t w[80];
+	for (unsigned i = 0; i < 16; i++)
+		w[i] = (u_int32_t(p[i * 4]) << 24) | (p[i * 4 + 1] << 16) | (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (unsigned i = 16; i < 80; i++)
+		w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	u_int32_t a = _h[0], b = _h[1], c = _h[2], d = _h[3], e = _h[4];
+	for (unsigned i = 0; i < 80; i++)
+	{
+		u_int32_t f, k;
+		if (i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		}
+		else if (i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		u_int32_t t = rotate(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotate(b, 30);
+		b = a;
+		a = t;
+	}
+	_h[0] += a;
+	_h[1] += b;
+	_h[2] += c;
+	_h[3] += d;
+	_h[4] += e;
+}
+
+void sha1::update(const char* data, unsigned len)
+{
+	const unsigned char* p = (const unsigned char*) data;
+	_size += len;
+	if (_used)
+	{
+		unsigned n = min(len, 64 - _used);
+		memcpy(_block + _used, p, n);
+		_used += n;
+		p += n;
+		len -= n;
+		if (_used < 64)
+			return;
+		block(_block);
+		_used = 0;
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		block(p);
+	memcpy(_block, p, len);
+	_used = len;
+}
+
+string sha1::hex()
+{
+	u_int64_t bits = _size * 8;
+	unsigned char padding[72];
+	unsigned len = (_used < 56 ? 56 : 120) - _used;
+	memset(padding, 0, sizeof(padding));
+	padding[0] = 0x80;
+	for (unsigned i = 0; i < 8; i++)
+		padding[len + i] = (unsigned char)(bits >> (56 - 8 * i));
+	update((const char*) padding, len + 8);
+	static const char digits[] = "0123456789abcdef";
+	string result;
+	for (unsigned i = 0; i < 5; i++)
+		for (int shift = 28; shift >= 0; shift -= 4)
+			result += digits[(_h[i] >> shift) & 0xf];
+	return result;
+}
+
+///// blob_store /////
+
+string blob_store::_directory;
+set<string> blob_store::_subdirectories;
+unsigned blob_store::_temp_count = 0;
+blob_store::counters blob_store::_counters;
+
+void blob_store::set_directory(const string& directory)
+{
+	string dir(directory);
+	while (dir.size() > 1 && dir[dir.size() - 1] == '/')
+		dir.erase(dir.size() - 1);
+	if (!make_directory(dir) || !make_directory(dir + "/blobs") || !make_directory(dir + "/tmp"))
+		throw common_exception(string("cannot create the extract directory ").append(dir).append(": ").append(strerror(errno)));
+	_directory = dir;
+}
+
+int blob_store::create_temp(string& path)
+{
+	for (unsigned attempt = 0; attempt < 16; attempt++)
+	{
+		ostringstream name;
+		name << _directory << "/tmp/" << getpid() << "." << ++_temp_count;
+		int fd = open(name.str().c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd >= 0 || errno != EEXIST)
+		{
+			path = name.str();
+			return fd;
+		}
+	}
+	return -1;
+}
+
+bool blob_store::store(const string& hash, u_int64_t size, const string& body, const string& temp)
+{
+	_counters.bodies++;
+	string subdirectory = string(_directory).append("/blobs/").append(hash, 0, 2);
+	string path = string(subdirectory).append("/").append(hash);
+	struct stat st;
+	// by a previous run too
+	if (stat(path.c_str(), &st) == 0)
+	{
+		if (!temp.empty())
+			unlink(temp.c_str());
+		_counters.duplicates++;
+		_counters.bytes_saved += size;
+		return true;
+	}
+	if (!_subdirectories.count(subdirectory))
+	{
+		if (!make_directory(subdirectory))
+		{
+			if (!temp.empty())
+				unlink(temp.c_str());
+			_counters.failures++;
+			return false;
+		}
+		_subdirectories.insert(subdirectory);
+	}
+	string written(temp);
+	if (written.empty())
+	{
+		int fd = create_temp(written);
+		bool ok = fd >= 0 && write_all(fd, body.data(), body.size());
+		if (fd >= 0 && close(fd) != 0)
+			ok = false;
+		if (!ok)
+		{
+			if (fd >= 0)
+				unlink(written.c_str());
+			_counters.failures++;
+			return false;
+		}
+	}
+	if (rename(written.c_str(), path.c_str()) != 0)
+	{
+		unlink(written.c_str());
+		_counters.failures++;
+		return false;
+	}
+	_counters.blobs++;
+	_counters.bytes_written += size;
+	return true;
+}
+
+///// blob_handler /////
+
+unsigned blob_handler::_max_memory = 256 * 1024;
+
+blob_handler::blob_handler(bool request, const string& not_found):
+	_decoder(request, this), _not_found(not_found), _size(0), _fd(-1), _failed(false), _finished(false)
+{
+}
+
+blob_handler::~blob_handler()
+{
+	// never printed
+	if (_fd >= 0)
+		close(_fd);
+	if (!_temp.empty())
+		unlink(_temp.c_str());
+}
+
+bool blob_handler::on_decoded(const char* data, unsigned len)
+{
+	_hash.update(data, len);
+	_size += len;
+	if (!blob_store::enabled() || _failed)
+		return true;
+	_body.append(data, len);
+	if (_fd < 0 && _body.size() > _max_memory)
+	{
+		_fd = blob_store::create_temp(_temp);
+		if (_fd < 0)
+		{
+			_temp.clear();
+			_failed = true;
+			_body.clear();
+			return true;
+		}
+	}
+	if (_fd >= 0 && _body.size() >= write_size)
+		flush();
+	return true;
+}
+
+bool blob_handler::flush()
+{
+	if (write_all(_fd, _body.data(), _body.size()))
+	{
+		_body.clear();
+		return true;
+	}
+	_failed = true;
+	_body.clear();
+	return false;
+}
+
+void blob_handler::finish()
+{
+	_finished = true;
+	if (_size == 0)
+		return;
+	_result = _hash.hex();
+	if (!blob_store::enabled())
+		return;
+	if (_fd >= 0)
+	{
+		if (!_failed)
+			flush();
+		if (close(_fd) != 0)
+			_failed = true;
+		_fd = -1;
+	}
+	if (_failed || !blob_store::store(_result, _size, _body, _temp))
+	{
+		if (!_temp.empty())
+			unlink(_temp.c_str());
+		_result.clear();
+	}
+	_temp.clear();
+	_body.clear();
+}
+
+void blob_handler::onClose(tcp_stream* pstream, const timeval* t, unsigned char* packet)
+{
+	// a body delimited by the close is complete, not by a reset
+	if (pstream->nids_state == NIDS_CLOSE)
+		_decoder.on_close();
+}
+
+void blob_handler::append(std::basic_ostream<char>& out, const timeval* t)
+{
+	if (!_finished)
+		finish();
+	if (_result.empty())
+		out << _not_found;
+	else
+		out << _result;
+}
+
+///// extract_printer /////
+
+const char* extract_printer::index_format = "%request.timestamp2%tab%source.ip%tab%source.port%tab%dest.ip%tab%dest.port%tab%request.method%tab%request.header.host%tab%request.url%tab%response.code%tab%response.header.content-type%tab%request.body.blob%tab%response.body.blob";
+
+extract_printer::extract_printer(const string& directory)
+{
+	blob_store::set_directory(directory);
+	string path = string(blob_store::directory()).append("/index");
+	_index.open(path.c_str(), ios_base::out | ios_base::app);
+	if (!_index)
+		throw common_exception(string("cannot open the extract index ").append(path));
+	_index.setf(ios_base::fixed);
+}
+
+void extract_printer::doit(handlers::iterator start, handlers::iterator end, const timeval* t)
+{
+	string truncated;
+	for (handlers::iterator i = start; i != end; i++)
+	{
+		(*i)->append(_index, t);
+		blob_handler* blob = dynamic_cast<blob_handler*>(i->get());
+		if (blob && blob->truncated())
+			truncated.append(truncated.empty() ? "" : ",").append(dynamic_cast<blob_handler_request*>(blob) ? "request" : "response");
+	}
+	_index << '\t' << (truncated.empty() ? "-" : truncated) << '\n';
+}
+
+void extract_printer::on_exit()
+{
+	_index.flush();
+	const blob_store::counters& stats = blob_store::stats();
+	cerr << "extract: " << stats.bodies << " bodies, " << stats.blobs << " blobs written (" << stats.bytes_written << " bytes), "
+		<< stats.duplicates << " duplicates (" << stats.bytes_saved << " bytes not written), " << stats.failures << " failed" << endl;
+}
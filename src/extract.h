@@ -0,0 +1,135 @@
+/*
+	Copyright (c) 2007-2012 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+
+*/
+
+#ifndef _sniffer_extract_h
+#define _sniffer_extract_h
+
+#include <string>
+#include <fstream>
+#include <set>
+#include "formatter.h"
+#include "http.h"
+
+// FIPS 180-1, fed while the body arrives
+class sha1
+{
+public:
+	sha1();
+	void update(const char* data, unsigned len);
+	// 40 hexadecimal digits, the hash cannot be updated anymore
+	std::string hex();
+private:
+	void block(const unsigned char* p);
+	u_int32_t _h[5];
+	unsigned char _block[64];
+	unsigned _used;
+	u_int64_t _size;
+};
+
+// the extracted bodies, stored once by their sha1 in
+// <directory>/blobs/<first two digits>/<sha1>. A body is written to
+// <directory>/tmp and renamed, so a blob is never seen half written; the
+// repeated bodies are not written again (the blob is already there)
+class blob_store
+{
+public:
+	struct counters
+	{
+		counters(): bodies(0), blobs(0), duplicates(0), failures(0), bytes_written(0), bytes_saved(0){}
+		u_int64_t bodies, blobs, duplicates, failures, bytes_written, bytes_saved;
+	};
+	// throws common_exception if the directories cannot be created
+	static void set_directory(const std::string& directory);
+	static bool enabled(){return !_directory.empty();}
+	static const std::string& directory(){return _directory;}
+	// a new file in <directory>/tmp, -1 on error (path is its name)
+	static int create_temp(std::string& path);
+	// stores the body, kept in memory (body) or already written to the
+	// temporary file temp, which is renamed or removed. False on error
+	static bool store(const std::string& hash, u_int64_t size, const std::string& body, const std::string& temp);
+	static const counters& stats(){return _counters;}
+private:
+	static std::string _directory;
+	static std::set<std::string> _subdirectories;
+	static unsigned _temp_count;
+	static counters _counters;
+};
+
+// %request.body.blob and %response.body.blob: the sha1 of the decoded body
+// (dechunked and inflated, see http_body_decoder), stored in the blob_store
+// with --extract-dir. Small bodies are kept in memory until the transaction
+// is printed, the larger ones are written to a temporary file while they
+// arrive, with few large writes
+class blob_handler : public basic_handler, protected http_body_sink
+{
+public:
+	blob_handler(bool request, const std::string& not_found);
+	virtual ~blob_handler();
+	virtual void append(std::basic_ostream<char>& out, const timeval* t);
+	virtual void onClose(tcp_stream* pstream, const timeval* t, unsigned char* packet);
+	// the body has been cut before its end, by the capture or a decoding error
+	bool truncated() const {return _size && !_decoder.complete();}
+	static void set_max_memory(unsigned max_memory){_max_memory = max_memory;}
+protected:
+	virtual bool on_decoded(const char* data, unsigned len);
+	void finish();
+	bool flush();
+	http_body_decoder _decoder;
+	std::string _not_found;
+	sha1 _hash;
+	u_int64_t _size;
+	// the body, or the part not written yet to the temporary file
+	std::string _body;
+	std::string _temp;
+	int _fd;
+	bool _failed, _finished;
+	std::string _result;
+	static unsigned _max_memory;
+};
+
+class blob_handler_request : public blob_handler
+{
+public:
+	blob_handler_request(const std::string& not_found): blob_handler(true, not_found){}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t)
+	{
+		_decoder.feed(pstream->server.data, pstream->server.count_new, static_cast<stream*>(pstream)->segment);
+	}
+};
+
+class blob_handler_response : public blob_handler
+{
+public:
+	blob_handler_response(const std::string& not_found): blob_handler(false, not_found){}
+	virtual void onResponse(tcp_stream* pstream, const timeval* t)
+	{
+		_decoder.feed(pstream->client.data, pstream->client.count_new, static_cast<stream*>(pstream)->segment);
+	}
+};
+
+// the index of --extract-dir: a line for every transaction in
+// <directory>/index, with the blobs of its bodies and the ones truncated
+// ("request", "response", "request,response", "-" if none). The index is not flushed
+// every line, the counters of the store are printed on stderr at exit
+class extract_printer : public printer
+{
+public:
+	// the tab separated fields of the index
+	static const char* index_format;
+	// throws common_exception if the index cannot be opened
+	extract_printer(const std::string& directory);
+	void doit(handlers::iterator start, handlers::iterator end, const timeval* t);
+	virtual void on_exit();
+private:
+	std::ofstream _index;
+};
+
+#endif // _sniffer_extract_h
@@ -13,10 +13,21 @@
 #include <sstream>
 #include <map>
 #include "regex.h"
+#include "tls.h"
+#include "dns.h"
+#include "db.h"
+#include "h2.h"
+#include "extract.h"
 #include <cstdio>
+#include <cstring>
 #include <ext/stdio_filebuf.h>
 #include <signal.h>
-#include "python.h"
+#include <time.h>
+#include "sampling.h"
+#include "profile.h"
+#include <cxxabi.h>
+#include <typeinfo>
+#include <cstdlib>
 using namespace std;
 
 parser* parser::theOnlyParser= NULL;
@@ -24,6 +35,9 @@ const char parser::_key_word_id='%';
 
 parser::parser()
 {
+    _sections.push_back(section::ptr(new section(NULL)));
+    _sampler = NULL;
+    _http_framing = false;
     _already_init = false;
     _counter=0;
     _max_lines = -1;
@@ -37,8 +51,11 @@ parser::parser()
     }
 }
 
-parser::parser(printer* printer):_printer(printer)
+parser::parser(printer* printer)
 {
+    _sections.push_back(section::ptr(new section(printer)));
+    _sampler = NULL;
+    _http_framing = false;
     _max_lines = -1;
     _counter = 0;
     _already_init = false;
@@ -48,11 +65,38 @@ parser::parser(printer* printer):_printer(printer)
 
 void parser::on_exit()
 {
+    if (theOnlyParser != NULL)
+        for (sections::iterator it = theOnlyParser->_sections.begin(); it != theOnlyParser->_sections.end(); it++)
+            if ((*it)->_printer)
+                (*it)->_printer->on_exit();
     for (modules::iterator it = _modules.begin(); it != _modules.end(); it++)
     {
         Module* module = *it;
         module->on_exit();
     }
+    if (profiler::enabled())
+        profiler::dump(cerr);
+}
+
+void parser::idle()
+{
+    if (theOnlyParser == NULL)
+        return;
+    // a quiet capture calls no handler, the reload cannot wait for a packet
+    reload_if_requested();
+    for (sections::iterator it = theOnlyParser->_sections.begin(); it != theOnlyParser->_sections.end(); it++)
+        if ((*it)->_printer)
+            (*it)->_printer->on_idle();
+}
+
+void parser::reload_if_requested()
+{
+	if (_reload_requested)
+	{
+		_reload_requested = 0;
+		if (_reload_callback)
+			_reload_callback(*theOnlyParser);
+	}
 }
 
 void parser::register_module(Module* module)
@@ -63,6 +107,23 @@ void parser::register_module(Module* module)
 void parser::nids_handler(struct tcp_stream *ts, void **yoda, struct timeval* t, unsigned char* packet)
 {
 	check(theOnlyParser != NULL, parser_not_initialized());
+	reload_if_requested();
+	profiler::poll();
+	profile_span span(profiler::dispatch_stage);
+	if (_handler_timing)
+	{
+		timespec start, stop;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		theOnlyParser->dispatch(ts, t, packet);
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		_handler_time += double(stop.tv_sec - start.tv_sec) + double(stop.tv_nsec - start.tv_nsec) / 1000000000;
+	}
+	else
+		theOnlyParser->dispatch(ts, t, packet);
+}
+
+void parser::dispatch(struct tcp_stream *ts, struct timeval* t, unsigned char* packet)
+{
 	//string flag ="";
 	//if (packet)
 	//{
@@ -74,44 +135,60 @@ void parser::nids_handler(struct tcp_stream *ts, void **yoda, struct timeval* t,
 	{
         
         case NIDS_JUST_EST:
+			// flows left out by the sampler: without collect libnids drops them
+			if (connections.find(ts->addr) == connections.end())
+				break;
 			ts->server.collect = 1;
 			ts->client.collect = 1;
-			theOnlyParser->process_open_connection(ts, t, packet);
+			process_open_connection(ts, t, packet);
 			break;
 			
 		case NIDS_DATA:
 			if (ts->server.count_new)
 			{
-				theOnlyParser->process_client(ts, t, packet);
+				process_client(ts, t, packet);
 			}
 			if (ts->client.count_new)
 			{
-				theOnlyParser->process_server(ts, t, packet);
+				process_server(ts, t, packet);
 			}
 			break;
 		case NIDS_EXITING:
-			theOnlyParser->process_end_data(ts);
+			process_end_data(ts);
 			break;
 		case NIDS_OPENING:
-			theOnlyParser->process_opening_connection(ts, t, packet);
+			process_opening_connection(ts, t, packet);
 			break;
 		default:
-			theOnlyParser->process_close_connection(ts, t, packet);
+			process_close_connection(ts, t, packet);
 			break;
 	}
 	//cout << "nids_handler end "<< (int)ts->nids_state << "\n";
 }
 
 parser::modules parser::_modules=parser::modules();
+parser::reload_callback parser::_reload_callback = NULL;
+volatile sig_atomic_t parser::_reload_requested = 0;
+bool parser::_handler_timing = false;
+double parser::_handler_time = 0;
+unsigned parser::_python_batch_events = 1;
+unsigned parser::_python_batch_time = 0;
+unsigned parser::_python_queue_events = 0;
+unsigned parser::_python_queue_bytes = 16 << 20;
+parser::python_overflow_enum parser::_python_overflow = parser::python_block;
 
-const char* parser::_parse_element(const char* input)
+const char* parser::_parse_element(const char* input, section& psection)
 {
 	init_parse_elements();
 	const char* new_pos = input;
 	for (parse_elements::iterator it = elements.begin(); it!= elements.end(); it++)
 	{
-		new_pos  = (*it).second->parse(input, (*it).first, factories);
-		if (new_pos != input) break;
+		new_pos  = (*it).second->parse(input, (*it).first, psection.factories);
+		if (new_pos != input)
+		{
+			psection.keywords.resize(psection.factories.size(), string(1, _key_word_id).append((*it).first));
+			break;
+		}
 	}
 	if (new_pos == input)
 	{
@@ -132,6 +209,63 @@ const char* parser::_parse_element(const char* input)
 
 void parser::parse(const char* input)
 {
+	_parse(input, *_sections.front());
+	_snapshot.reset();
+}
+
+section::ptr parser::add_section(printer* printer, const char* input)
+{
+	section::ptr psection = create_section(printer, input);
+	_sections.push_back(psection);
+	_snapshot.reset();
+	return psection;
+}
+
+void parser::reload(const char* input)
+{
+	// the section of the open streams is left as it is; with an invalid
+	// format the modules keep their state too
+	section::ptr psection = create_section(_sections.front()->_printer, input);
+	for (modules::iterator it = _modules.begin(); it != _modules.end(); it++)
+		(*it)->reload();
+	_sections.front() = psection;
+	_snapshot.reset();
+}
+
+const boost::shared_ptr<const sections>& parser::snapshot()
+{
+	if (!_snapshot)
+		_snapshot.reset(new sections(_sections));
+	return _snapshot;
+}
+
+section::ptr parser::create_section(printer* printer, const char* input)
+{
+	section::ptr psection(new section(printer));
+	_parse(input, *psection);
+	return psection;
+}
+
+// groups the keywords of a section consuming the text of a direction
+static void link_captures(handler_factories& factories)
+{
+	boost::shared_ptr<grep_group> request(new grep_group()), response(new grep_group());
+	for (handler_factories::iterator i = factories.begin(); i != factories.end(); i++)
+	{
+		grep_member* member = dynamic_cast<grep_member*>(i->get());
+		if (!member || member->grep_scope() == grep_none)
+			continue;
+		grep_scope_enum scope = member->grep_scope();
+		boost::shared_ptr<grep_group> group = scope == grep_request_headers || scope == grep_request ? request : response;
+		member->join(group, member->grep_add(*group));
+	}
+	request->compile();
+	response->compile();
+}
+
+void parser::_parse(const char* input, section& psection)
+{
+	handler_factories& factories = psection.factories;
 	const char* cursor = input;
 	string w;
 	for (; *cursor != 0;)
@@ -142,9 +276,10 @@ void parser::parse(const char* input)
 				if (w.size())
 				{
 					factories.push_back(handler_factory::ptr(new string_handler_factory(w)));
+					psection.keywords.push_back("");
 					w = "";
 				}
-				cursor = _parse_element(cursor);
+				cursor = _parse_element(cursor, psection);
 				if ((*cursor) == 0) break;
 				continue;
 			default:
@@ -157,8 +292,10 @@ void parser::parse(const char* input)
 	if (w.size())
 	{
 		factories.push_back(handler_factory::ptr( new string_handler_factory(w)));
+		psection.keywords.push_back("");
 		w = "";
 	}
+	link_captures(factories);
 }
 
 typedef keyword_arg_and_optional_not_found<header_handler_factory_t<regex_handler_request> > req_header;
@@ -190,15 +327,44 @@ void parser::init_parse_elements()
     elements["request.line"] = pelem(new keyword<handler_factory_t<request_first_line> >());
     elements["request.method"] = pelem(new keyword_arg_and_optional_params<regex_handler_factory_t<regex_handler_request_line> >(string("(^[^\\s]*)"),_default_not_found ));
     elements["request.url"] = pelem(new keyword_arg_and_optional_params<regex_handler_factory_t<regex_handler_request_line> >(string("^[^\\s]*\\s*([^\\s]*)"),_default_not_found ));
+    elements["request.url.path"] = pelem(new keyword_arg_and_optional_params<regex_handler_factory_t<regex_handler_request_line> >(string("^[^\\s]*\\s*([^\\s?#;]*)"),_default_not_found ));
     elements["request.protocol"] = pelem(new keyword_arg_and_optional_params<regex_handler_factory_t<regex_handler_request_line> >(string("^[^\\s]*\\s*[^\\s]*\\s*([^\\s]*)"),_default_not_found ));
     elements["request.grep"] = pelem(new keyword_params_and_arg<regex_handler_factory_t<regex_handler_all_request> >(_default_not_found));
+    elements["request.body.grep"] = pelem(new keyword_params_and_arg<regex_handler_factory_t<regex_handler_body_request> >(_default_not_found));
+    elements["request.body.blob"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, blob_handler_request> >(_default_not_found));
     elements["request.header"] = pelem(new keyword_arg<string, regex_handler_factory_t<regex_handler_request> >(string(".*")));
     
-    elements["request.part"] = pelem(new keyword_params<handler_factory_t_arg<string, request_part> >());
+    elements["request.part"] = pelem(new keyword_params<window_handler_factory_t<request_part, false> >());
+    elements["request.tail"] = pelem(new keyword_params<window_handler_factory_t<request_part, true> >());
 
     elements["session.time"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, session_time_handler> >(_default_not_found));
     elements["session.requests"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, session_request_counter> >(_default_not_found));
     
+    elements["tls.sni"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, tls_field_handler<tls_handler::sni> > >(_default_not_found));
+    elements["tls.alpn"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, tls_field_handler<tls_handler::alpn> > >(_default_not_found));
+    elements["tls.version"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, tls_field_handler<tls_handler::version> > >(_default_not_found));
+    elements["tls.cipher"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, tls_field_handler<tls_handler::cipher> > >(_default_not_found));
+    elements["tls.fingerprint"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, tls_field_handler<tls_handler::fingerprint> > >(_default_not_found));
+    elements["tls.hello.time"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, tls_field_handler<tls_handler::hello_time> > >(_default_not_found));
+    elements["tls.handshake.time"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, tls_field_handler<tls_handler::handshake_time> > >(_default_not_found));
+
+    elements["dns.qname"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, dns_field_handler<dns_handler::qname> > >(_default_not_found));
+    elements["dns.qtype"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, dns_field_handler<dns_handler::qtype> > >(_default_not_found));
+    elements["dns.rcode"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, dns_field_handler<dns_handler::rcode> > >(_default_not_found));
+    elements["dns.latency"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, dns_field_handler<dns_handler::latency> > >(_default_not_found));
+    elements["dns.id"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, dns_field_handler<dns_handler::id> > >(_default_not_found));
+    elements["dns.answers"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, dns_field_handler<dns_handler::answers> > >(_default_not_found));
+    elements["db.command"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, db_field_handler<db_handler::command> > >(_default_not_found));
+    elements["db.statement"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, db_field_handler<db_handler::statement> > >(_default_not_found));
+    elements["db.rows"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, db_field_handler<db_handler::rows> > >(_default_not_found));
+    elements["db.latency"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, db_field_handler<db_handler::latency> > >(_default_not_found));
+    elements["h2.stream"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, h2_field_handler<h2_handler::stream_id> > >(_default_not_found));
+    elements["h2.reset"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, h2_field_handler<h2_handler::reset> > >(_default_not_found));
+    elements["grpc.status"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, h2_field_handler<h2_handler::grpc_status> > >(_default_not_found));
+    elements["grpc.message"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, h2_field_handler<h2_handler::grpc_message> > >(_default_not_found));
+
+    elements["sample.weight"] = pelem(new keyword<handler_factory_t<sample_weight_handler> >());
+
     elements["complete_truncated"]= pelem(new keyword<handler_factory_t<complete_truncated> >());
     
     REQUEST_HEADER("request.header.host","Host");
@@ -234,6 +400,8 @@ void parser::init_parse_elements()
     elements["response.code"] = pelem(new keyword_arg_and_optional_params<regex_handler_factory_t<regex_handler_response_line> >(string("^[^\\s]*\\s*([^\\s]*)"), _default_not_found));
     elements["response.message"] = pelem(new keyword_arg_and_optional_params<regex_handler_factory_t<regex_handler_response_line> >(string("^[^\\s]*\\s*[^\\s]*\\s*([^\\r]*)"), _default_not_found));
     elements["response.grep"] = pelem(new keyword_params_and_arg<regex_handler_factory_t<regex_handler_all_response> >(_default_not_found));
+    elements["response.body.grep"] = pelem(new keyword_params_and_arg<regex_handler_factory_t<regex_handler_body_response> >(_default_not_found));
+    elements["response.body.blob"] = pelem(new keyword_optional_params<handler_factory_t_arg<string, blob_handler_response> >(_default_not_found));
     elements["response.header"] = pelem(new keyword_arg<string, regex_handler_factory_t<regex_handler_response> >(string(".*")));
     RESPONSE_HEADER("response.header.allow","Allow");
     RESPONSE_HEADER("response.header.server","Server");
@@ -260,7 +428,8 @@ void parser::init_parse_elements()
     RESPONSE_HEADER("response.header.via","Via");
     RESPONSE_HEADER("response.header.www-authenticate","WWW-Authenticate");
 
-    elements["response.part"] = pelem(new keyword_params<handler_factory_t_arg<string, response_part> >());
+    elements["response.part"] = pelem(new keyword_params<window_handler_factory_t<response_part, false> >());
+    elements["response.tail"] = pelem(new keyword_params<window_handler_factory_t<response_part, true> >());
     
     elements["response.header.value"] = pelem(new keyword_params<header_handler_factory_t<regex_handler_response> >());
     //elements["response.header.grep"] = pelem(new keyword_params_and_arg<regex_handler_factory_t<regex_handler_response> >());
@@ -298,17 +467,183 @@ void parser::on_print(void)
     }
 }
     
+static message_framer* create_framer(framing_enum framing)
+{
+	switch (framing)
+	{
+		case mysql_framing:
+			return new mysql_framer();
+		case postgres_framing:
+			return new postgres_framer();
+		case redis_framing:
+			return new redis_framer();
+		case h2_framing:
+			return new h2_framer();
+		default:
+			return new http_framer();
+	}
+}
+
+void parser::add_framing(const string& spec)
+{
+	string protocol = spec.substr(0, spec.find(':'));
+	framing_enum framing;
+	u_short port;
+	if (protocol == "http")
+	{
+		framing = http_framing;
+		port = 80;
+	}
+	else if (protocol == "mysql")
+	{
+		framing = mysql_framing;
+		port = 3306;
+	}
+	else if (protocol == "postgres")
+	{
+		framing = postgres_framing;
+		port = 5432;
+	}
+	else if (protocol == "redis")
+	{
+		framing = redis_framing;
+		port = 6379;
+	}
+	else if (protocol == "h2")
+	{
+		framing = h2_framing;
+		port = 80;
+	}
+	else
+		throw invalid_framing(spec);
+	if (protocol.size() < spec.size())
+	{
+		istringstream s(spec.substr(protocol.size() + 1));
+		unsigned value;
+		if (!(s >> value) || !s.eof() || value == 0 || value > 65535)
+			throw invalid_framing(spec);
+		port = value;
+	}
+	_framing[port] = framing;
+}
+
 void parser::process_opening_connection(tcp_stream *ts, struct timeval* t, unsigned char* packet)
 {
 	streams::const_iterator it = connections.find(ts->addr);
 	if (it == connections.end())
 	{
-		stream::ptr pstream(new stream(this, factories.begin(), factories.end(), _printer));
+		if (_sampler && !_sampler->keep(ts->addr))
+			return;
+		stream::ptr pstream = create_stream(ts->addr);
+		if (_sampler)
+			pstream->sample_weight = _sampler->rate();
 		pstream->onOpening( ts, t);
 		connections[ts->addr]= pstream;
 	}	
 }
 
+stream::ptr parser::create_stream(const tuple4& addr)
+{
+	stream::ptr pstream(new stream(this, snapshot()));
+	std::map<u_short, framing_enum>::const_iterator framing = _framing.find(addr.dest);
+	if (framing != _framing.end())
+		pstream->set_framer(create_framer(framing->second));
+	else if (_http_framing)
+		pstream->set_framer(new http_framer());
+	return pstream;
+}
+
+// the connections of a checkpoint: a header (magic, version, count), then
+// for every connection its tuple4 and its stream (see stream::save). The
+// fields have a fixed width and are little endian; the version changes with
+// the records
+static const u_int32_t checkpoint_magic = 0x4a4e434b; // JNCK
+static const u_int32_t checkpoint_version = 2;
+
+// a record of the checkpoint, built or read as a whole
+class checkpoint_record
+{
+public:
+	checkpoint_record(): _size(0), _pos(0){}
+	void put(u_int64_t value, unsigned bytes)
+	{
+		for (unsigned i = 0; i < bytes; i++, value >>= 8)
+			_data[_size++] = (unsigned char) value;
+	}
+	u_int64_t get(unsigned bytes)
+	{
+		u_int64_t value = 0;
+		for (unsigned i = 0; i < bytes; i++)
+			value |= u_int64_t(_data[_pos++]) << (8 * i);
+		return value;
+	}
+	bool write(FILE* f)
+	{
+		bool ok = fwrite(_data, _size, 1, f) == 1;
+		_size = 0;
+		return ok;
+	}
+	bool read(FILE* f, unsigned size)
+	{
+		_pos = 0;
+		return fread(_data, size, 1, f) == 1;
+	}
+	enum {header_size = 12, addr_size = 12, stream_size = 26, event_size = 18};
+private:
+	unsigned char _data[32];
+	unsigned _size, _pos;
+};
+
+bool parser::checkpoint(FILE* f) const
+{
+	checkpoint_record record;
+	record.put(checkpoint_magic, 4);
+	record.put(checkpoint_version, 4);
+	record.put(connections.size(), 4);
+	if (!record.write(f))
+		return false;
+	for (streams::const_iterator i = connections.begin(); i != connections.end(); i++)
+	{
+		record.put(i->first.saddr, 4);
+		record.put(i->first.daddr, 4);
+		record.put(i->first.source, 2);
+		record.put(i->first.dest, 2);
+		if (!record.write(f) || !i->second->save(f))
+			return false;
+	}
+	return true;
+}
+
+int parser::restore(FILE* f)
+{
+	checkpoint_record record;
+	if (!record.read(f, checkpoint_record::header_size) || record.get(4) != checkpoint_magic || record.get(4) != checkpoint_version)
+		return -1;
+	u_int32_t count = record.get(4);
+	int restored = 0;
+	for (u_int32_t n = 0; n < count; n++)
+	{
+		if (!record.read(f, checkpoint_record::addr_size))
+			return -1;
+		tuple4 addr;
+		addr.saddr = record.get(4);
+		addr.daddr = record.get(4);
+		addr.source = record.get(2);
+		addr.dest = record.get(2);
+		// not restored by libnids (e.g. a smaller table): read and dropped
+		tcp_stream* ts = nids_find_tcp_stream(&addr);
+		stream::ptr pstream = create_stream(addr);
+		if (!pstream->restore(f))
+			return -1;
+		if (ts == NULL)
+			continue;
+		// written in the order of the map: each one goes at the end
+		connections.insert(connections.end(), streams::value_type(addr, pstream));
+		restored++;
+	}
+	return restored;
+}
+
 void parser::process_server(tcp_stream *ts, struct timeval* t, unsigned char* packet)
 {
 	connections[ts->addr]->onResponse(ts, t);
@@ -540,6 +875,13 @@ void cmd_execute_printer::doit(handlers::iterator start, handlers::iterator end,
 
 void outstream_printer::doit(handlers::iterator start, handlers::iterator end,const timeval*t)
 {
+	if (!_lines.empty() || ordered_lines::deferred(start, end))
+	{
+		// the line waits for its fields, after the ones before it
+		_lines.add(start, end, t, _eol);
+		write_lines(false);
+		return;
+	}
     for (handlers::iterator i= start; i!= end; i++)
 		(*i)->append(_out, t);
 	_out<<_eol<<std::flush;
@@ -547,15 +889,136 @@ void outstream_printer::doit(handlers::iterator start, handlers::iterator end,co
 	fflush(stdout);
 }
 
+void outstream_printer::write_lines(bool wait)
+{
+	ordered_lines::line l;
+	bool written = false;
+	while (_lines.next(l, wait))
+	{
+		_out << l.text;
+		written = true;
+	}
+	if (written)
+	{
+		_out << std::flush;
+		fflush(stdout);
+	}
+}
+
+void outstream_printer::on_exit()
+{
+	write_lines(true);
+}
+
+///// ordered_lines /////
+
+bool ordered_lines::deferred(handlers::iterator start, handlers::iterator end)
+{
+	for (handlers::iterator i = start; i != end; i++)
+		if ((*i)->deferred())
+			return true;
+	return false;
+}
+
+void ordered_lines::add(handlers::iterator start, handlers::iterator end, const timeval* t, const string& eol)
+{
+	_lines.push_back(pending_line());
+	pending_line& l = _lines.back();
+	l.has_time = t != NULL;
+	if (t)
+		l.time = *t;
+	ostringstream text;
+	text.setf(ios_base::fixed);
+	for (handlers::iterator i = start; i != end; i++)
+	{
+		deferred_field::ptr field = (*i)->defer(t);
+		if (!field)
+		{
+			(*i)->append(text, t);
+			continue;
+		}
+		l.parts.push_back(make_pair(text.str(), field));
+		text.str("");
+	}
+	text << eol;
+	l.parts.push_back(make_pair(text.str(), deferred_field::ptr()));
+}
+
+bool ordered_lines::next(line& result, bool wait)
+{
+	if (_lines.empty())
+		return false;
+	pieces& parts = _lines.front().parts;
+	for (pieces::iterator i = parts.begin(); i != parts.end(); i++)
+		if (i->second && !i->second->ready())
+		{
+			if (!wait)
+				return false;
+			i->second->wait();
+		}
+	result.text.clear();
+	for (pieces::iterator i = parts.begin(); i != parts.end(); i++)
+	{
+		result.text.append(i->first);
+		if (i->second)
+			result.text.append(i->second->text);
+	}
+	result.has_time = _lines.front().has_time;
+	result.time = _lines.front().time;
+	_lines.pop_front();
+	return true;
+}
+
+///// section /////
+
+static string type_name(const std::type_info& type)
+{
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(type.name(), NULL, NULL, &status);
+	if (demangled == NULL)
+		return type.name();
+	string result(demangled);
+	free(demangled);
+	return result;
+}
+
+void section::init_stages(handlers::const_iterator first)
+{
+	static unsigned text_stage = profiler::add_stage("text");
+	if (printer_stage == 0 && _printer != NULL)
+		printer_stage = profiler::add_stage("printer " + type_name(typeid(*_printer)));
+	for (handler_factories::size_type i = stages.size(); i < factories.size(); i++)
+	{
+		if (i < keywords.size() && keywords[i].empty())
+			stages.push_back(text_stage);
+		else
+		{
+			// the factories added outside of the format (e.g. transaction_metrics) are named by type
+			string type = type_name(typeid(**(first + i)));
+			stages.push_back(profiler::add_stage(i < keywords.size() ? keywords[i] + " (" + type + ")" : type));
+		}
+	}
+}
+
 ///// stream /////
 
 int stream::id = 0;
+unsigned stream::_max_journal = 0;
 
-stream::stream(stream_listener* pStream_listener, handler_factories::iterator _begin, handler_factories::iterator _end, printer* printer):
-		tot_requests(0), status(unknown),
-        _printer(printer), 
+stream::stream(stream_listener* pStream_listener, const sections& _sections):
+		tot_requests(0), sample_weight(1), segment(NULL), status(unknown),
         _pStream_listener(pStream_listener),
-		begin(_begin), end(_end)
+		_sections(_sections), _journal_bytes(0), _journal_lost(false), _transactions(0), _restored(false)
+        {
+		    id++;
+		    _id=id;
+		}
+
+stream::stream(stream_listener* pStream_listener, const boost::shared_ptr<const sections>& snapshot):
+		tot_requests(0), sample_weight(1), segment(NULL), status(unknown),
+        _pStream_listener(pStream_listener),
+		_snapshot(snapshot),
+		_sections(*snapshot), _journal_bytes(0), _journal_lost(false), _transactions(0), _restored(false)
         {
 		    id++;
 		    _id=id;
@@ -567,29 +1030,52 @@ void stream::onOpening(tcp_stream* pstream, const timeval* t)
 	//cout<<"stream::onOpen\n";
 	init(pstream);
 	opening_time = *t;
-	for (handlers::iterator i= _handlers.begin(); i!= _handlers.end(); i++)
+	for (handlers::iterator i= _handlers.set.begin(); i!= _handlers.set.end(); i++)
+	{
+		profile_span span(stage(_handlers, i - _handlers.set.begin()));
 		(*i)->onOpening(this, t);
+	}
 	status = opening;
+	record(journal_event::opening, t, NULL, 0);
 }
 
 
 void stream::onOpen(tcp_stream* pstream, const timeval* t)
 {
+	if (_restored)
+		resume(pstream);
 	copy_tcp_stream(pstream);
-	for (handlers::iterator i= _handlers.begin(); i!= _handlers.end(); i++)
+	for (handlers::iterator i= _handlers.set.begin(); i!= _handlers.set.end(); i++)
+	{
+		profile_span span(stage(_handlers, i - _handlers.set.begin()));
 		(*i)->onOpen(this, t);
+	}
 	status = open;
+	record(journal_event::open, t, NULL, 0);
 }
 
 void stream::onExit(tcp_stream* pstream)
 {
+	if (_restored)
+		resume(pstream);
 	copy_tcp_stream(pstream);
-	for (handlers::iterator i= _handlers.begin(); i!= _handlers.end(); i++)
-    {
-        (*i)->onExit(this);
-    }
-	if (status!=open)
-	  print(0);
+	for (std::map<u_int32_t, transaction>::iterator i = _multiplexed.begin(); i != _multiplexed.end(); i++)
+	{
+		exit_handlers(i->second);
+		print_handlers(i->second, 0);
+	}
+	_multiplexed.clear();
+	// the pipelined requests still waiting for a response are logged too
+	for (;;)
+	{
+		bool queued = !_queued.empty();
+		exit_handlers(_handlers);
+		if (status!=open)
+		  print(0);
+		if (!queued || status == open)
+			break;
+		status = request;
+	}
 	//cout<<"stream::onClose end\n";
 	tot_requests = 0;
 	status=exit;
@@ -597,12 +1083,27 @@ void stream::onExit(tcp_stream* pstream)
 
 void stream::onClose(tcp_stream* pstream, const timeval* t,unsigned char* packet)
 {
+	if (_restored)
+		resume(pstream);
 	copy_tcp_stream(pstream);
-	for (handlers::iterator i= _handlers.begin(); i!= _handlers.end(); i++)
-		(*i)->onClose(this, t,packet);
-	// don't print log for only open connection. (hmmmm, i should think more about it)
-	if (status!=open)
-	  print(t);
+	// the multiplexed transactions still open, in stream id order
+	for (std::map<u_int32_t, transaction>::iterator i = _multiplexed.begin(); i != _multiplexed.end(); i++)
+	{
+		close_handlers(i->second, t, packet);
+		print_handlers(i->second, t);
+	}
+	_multiplexed.clear();
+	for (;;)
+	{
+		bool queued = !_queued.empty();
+		close_handlers(_handlers, t, packet);
+		// don't print log for only open connection. (hmmmm, i should think more about it)
+		if (status!=open)
+		  print(t);
+		if (!queued || status == open)
+			break;
+		status = request;
+	}
 	//cout<<"stream::onClose end\n";
 	tot_requests = 0;
 	status=close;
@@ -610,7 +1111,24 @@ void stream::onClose(tcp_stream* pstream, const timeval* t,unsigned char* packet
 
 void stream::onRequest(tcp_stream* pstream, const timeval* t)
 {
+	if (_restored)
+		resume(pstream);
 	copy_tcp_stream(pstream);
+	if (_framer)
+	{
+		unsigned transactions = _transactions;
+		_segments.clear();
+		_framer->requests(server.data, server.count_new, _segments);
+		if (!_framer->failed())
+		{
+			onRequestSegments(_segments, t);
+			record_framed(journal_event::request, transactions, t, pstream->server.data, pstream->server.count_new);
+			if (_queued.size() >= message_framer::max_pipeline)
+				stop_framing(t);
+			return;
+		}
+		stop_framing(t);
+	}
 	
 	if (status == response)
 	{
@@ -618,19 +1136,199 @@ void stream::onRequest(tcp_stream* pstream, const timeval* t)
 	}
     if (status != request)
 	    tot_requests++;
-	for (handlers::iterator i= _handlers.begin(); i!= _handlers.end(); i++)
-	{
-		(*i)->onRequest(this, t);
-	}
+	request_handlers(_handlers, t);
 	status=request;
+	record(journal_event::request, t, server.data, server.count_new);
 }
 
 void stream::onResponse(tcp_stream* pstream, const timeval* t)
 {
+	if (_restored)
+		resume(pstream);
 	copy_tcp_stream(pstream);
-	for (handlers::iterator i= _handlers.begin(); i!= _handlers.end(); i++)
-		(*i)->onResponse(this, t);
+	if (_framer)
+	{
+		unsigned transactions = _transactions;
+		_segments.clear();
+		_framer->responses(client.data, client.count_new, _segments);
+		if (!_framer->failed())
+		{
+			onResponseSegments(_segments, t);
+			record_framed(journal_event::response, transactions, t, pstream->client.data, pstream->client.count_new);
+			return;
+		}
+		stop_framing(t);
+	}
+	response_handlers(_handlers, t);
 	status=response;
+	record(journal_event::response, t, client.data, client.count_new);
+}
+
+// a request that starts while the current transaction already has one is
+// queued behind it, the continuations go to the last request. A request
+// without response is logged as soon as it is complete and comes first
+void stream::onRequestSegments(const message_segments& segments, const timeval* t)
+{
+	for (message_segments::const_iterator i = segments.begin(); i != segments.end(); i++)
+	{
+		if (i->id)
+		{
+			onMultiplexedSegment(*i, true, t);
+			continue;
+		}
+		if (i->start)
+		{
+			tot_requests++;
+			if (status == request || status == response)
+			{
+				_queued.push_back(queued_transaction());
+				create_handlers(_queued.back());
+			}
+		}
+		server.data = const_cast<char*>(i->data);
+		server.count_new = i->len;
+		segment = &*i;
+		if (_queued.empty())
+		{
+			request_handlers(_handlers, t);
+			if (status != response)
+				status = request;
+			if (i->unanswered)
+				print_framed(t);
+		}
+		else
+		{
+			request_handlers(_queued.back(), t);
+			_queued.back().complete = i->unanswered;
+		}
+		segment = NULL;
+	}
+}
+
+// responses go to the oldest transaction, that is logged when its response
+// is complete; the interim (1xx) responses are skipped
+void stream::onResponseSegments(const message_segments& segments, const timeval* t)
+{
+	for (message_segments::const_iterator i = segments.begin(); i != segments.end(); i++)
+	{
+		if (i->interim)
+			continue;
+		if (i->id)
+		{
+			onMultiplexedSegment(*i, false, t);
+			continue;
+		}
+		client.data = const_cast<char*>(i->data);
+		client.count_new = i->len;
+		segment = &*i;
+		response_handlers(_handlers, t);
+		segment = NULL;
+		status = response;
+		if (i->end)
+			print_framed(t);
+	}
+}
+
+// every multiplexed stream is a transaction, logged when its response is
+// complete (or its request, if it has no response)
+void stream::onMultiplexedSegment(const message_segment& s, bool request, const timeval* t)
+{
+	std::map<u_int32_t, transaction>::iterator i = _multiplexed.find(s.id);
+	if (i == _multiplexed.end())
+	{
+		i = _multiplexed.insert(std::make_pair(s.id, transaction())).first;
+		create_handlers(i->second);
+	}
+	segment = &s;
+	if (request)
+	{
+		if (s.start)
+			tot_requests++;
+		server.data = const_cast<char*>(s.data);
+		server.count_new = s.len;
+		request_handlers(i->second, t);
+	}
+	else
+	{
+		client.data = const_cast<char*>(s.data);
+		client.count_new = s.len;
+		response_handlers(i->second, t);
+	}
+	segment = NULL;
+	if (s.end && (!request || s.unanswered))
+	{
+		print_handlers(i->second, t);
+		_multiplexed.erase(i);
+		// a replay would log it again
+		_journal_lost = true;
+	}
+}
+
+// logs the first transaction, and the queued ones behind it that are complete
+void stream::print_framed(const timeval* t)
+{
+	for (bool complete = true; complete;)
+	{
+		bool queued = !_queued.empty();
+		complete = queued && _queued.front().complete;
+		print(t);
+		status = queued ? request : open;
+	}
+}
+
+// the rest of the connection is split by direction: the requests queued
+// behind the current transaction, and the multiplexed ones, are logged now
+// with what they have, the current one goes on with the data to come
+void stream::stop_framing(const timeval* t)
+{
+	if (!_queued.empty() || !_multiplexed.empty())
+	{
+		for (std::list<queued_transaction>::iterator i = _queued.begin(); i != _queued.end(); i++)
+			print_handlers(*i, t);
+		for (std::map<u_int32_t, transaction>::iterator i = _multiplexed.begin(); i != _multiplexed.end(); i++)
+			print_handlers(i->second, t);
+		_queued.clear();
+		_multiplexed.clear();
+		// a replay would log them again
+		_journal_lost = true;
+	}
+	_framer.reset();
+}
+
+void stream::request_handlers(transaction& tr, const timeval* t)
+{
+	for (handlers::size_type i = 0; i < tr.set.size(); i++)
+	{
+		profile_span span(stage(tr, i));
+		tr.set[i]->onRequest(this, t);
+	}
+}
+
+void stream::response_handlers(transaction& tr, const timeval* t)
+{
+	for (handlers::size_type i = 0; i < tr.set.size(); i++)
+	{
+		profile_span span(stage(tr, i));
+		tr.set[i]->onResponse(this, t);
+	}
+}
+
+void stream::close_handlers(transaction& tr, const timeval* t, unsigned char* packet)
+{
+	for (handlers::size_type i = 0; i < tr.set.size(); i++)
+	{
+		profile_span span(stage(tr, i));
+		tr.set[i]->onClose(this, t, packet);
+	}
+}
+
+void stream::exit_handlers(transaction& tr)
+{
+	for (handlers::size_type i = 0; i < tr.set.size(); i++)
+	{
+		profile_span span(stage(tr, i));
+		tr.set[i]->onExit(this);
+	}
 }
 
 void stream::copy_tcp_stream(tcp_stream* pstream)
@@ -656,17 +1354,75 @@ void stream::init(tcp_stream* pstream)
 	this->reinit();
 }
 
+void stream::transaction::swap(transaction& other)
+{
+	snapshot.swap(other.snapshot);
+	std::swap(format, other.format);
+	set.swap(other.set);
+	stages.swap(other.stages);
+}
+
+void stream::create_handlers(transaction& result)
+{
+	// a stream of the parser takes its sections current now, the others
+	// (e.g. dns) keep their own
+	if (_snapshot && _pStream_listener)
+		result.snapshot = _pStream_listener->current_sections();
+	if (!result.snapshot)
+		result.snapshot = _snapshot;
+	result.format = result.snapshot ? result.snapshot.get() : &_sections;
+	for (sections::const_iterator s = result.format->begin(); s != result.format->end(); s++)
+		for ( handler_factories::iterator i= (*s)->factories.begin(); i!= (*s)->factories.end();i++)
+			result.set.push_back((*i)->create_handler());
+	if (profiler::enabled())
+	{
+		handlers::const_iterator first = result.set.begin();
+		for (sections::const_iterator s = result.format->begin(); s != result.format->end(); s++)
+		{
+			(*s)->init_stages(first);
+			result.stages.insert(result.stages.end(), (*s)->stages.begin(), (*s)->stages.end());
+			first += (*s)->factories.size();
+		}
+	}
+}
+
 void stream::reinit()
 {
-	_handlers.erase(_handlers.begin(), _handlers.end());
-	for ( handler_factories::iterator i= begin; i!= end;i++)
-		_handlers.push_back((*i)->create_handler());
+	_transactions++;
+	_journal.clear();
+	_journal_bytes = 0;
+	_journal_lost = false;
+	_handlers.set.clear();
+	_handlers.stages.clear();
+	create_handlers(_handlers);
 }
 
-void stream::print(const timeval* t)
+void stream::print_handlers(transaction& tr, const timeval* t)
 {
-	_printer->doit(_handlers.begin(), _handlers.end(), t);
+	handlers::iterator first = tr.set.begin();
+	for (sections::const_iterator s = tr.format->begin(); s != tr.format->end(); s++)
+	{
+		handlers::iterator last = first + (*s)->factories.size();
+		if ((*s)->_printer)
+		{
+			profile_span span((*s)->printer_stage);
+			(*s)->_printer->doit(first, last, t);
+		}
+		first = last;
+	}
     _pStream_listener->on_print();
+}
+
+void stream::print(const timeval* t)
+{
+	print_handlers(_handlers, t);
+	if (!_queued.empty())
+	{
+		// the next pipelined transaction, with the handlers already created
+		_handlers.swap(_queued.front());
+		_queued.pop_front();
+		return;
+	}
 /*	for (handlers::iterator i= _handlers.begin(); i!= _handlers.end(); i++)
 		(*i)->append(_out, t);
 	_out<<std::endl;
@@ -674,6 +1430,169 @@ void stream::print(const timeval* t)
 	reinit();
 }
 
+void stream::record(journal_event::type_enum type, const timeval* t, const char* data, unsigned len)
+{
+	// the events with no data replay nothing (a restore counts on it)
+	if (_max_journal == 0 || _journal_lost || (len == 0 && (type == journal_event::request || type == journal_event::response)))
+		return;
+	if (_journal_bytes + len > _max_journal)
+	{
+		_journal_lost = true;
+		_journal.clear();
+		_journal_bytes = 0;
+		return;
+	}
+	_journal.push_back(journal_event());
+	journal_event& e = _journal.back();
+	e.type = type;
+	e.has_time = t != NULL;
+	if (t)
+		e.time = *t;
+	e.data.assign(data, len);
+	_journal_bytes += len;
+}
+
+void stream::record_framed(journal_event::type_enum type, unsigned transactions, const timeval* t, const char* data, unsigned len)
+{
+	if (transactions == _transactions)
+		record(type, t, data, len);
+	// the messages logged and the ones still open share the data
+	else if (status != open || !_queued.empty() || !_multiplexed.empty())
+		_journal_lost = true;
+}
+
+// a stream in a checkpoint: status (1 byte), tot_requests (4),
+// sample_weight (4), opening_time (8 + 4), flags (1: framed, 2: lost), the
+// number of events (4), then every event: type (1), has_time (1), time
+// (8 + 4), length (4) and its data
+enum {saved_framed = 1, saved_lost = 2};
+
+bool stream::save(FILE* f) const
+{
+	checkpoint_record record;
+	u_int32_t events = _journal_lost ? 0 : _journal.size();
+	record.put(status, 1);
+	record.put(tot_requests, 4);
+	record.put(sample_weight, 4);
+	record.put(opening_time.tv_sec, 8);
+	record.put(opening_time.tv_usec, 4);
+	record.put((_framer.get() != NULL ? saved_framed : 0) | (_journal_lost ? saved_lost : 0), 1);
+	record.put(events, 4);
+	if (!record.write(f))
+		return false;
+	for (u_int32_t i = 0; i < events; i++)
+	{
+		const journal_event& e = _journal[i];
+		record.put(e.type, 1);
+		record.put(e.has_time, 1);
+		record.put(e.has_time ? e.time.tv_sec : 0, 8);
+		record.put(e.has_time ? e.time.tv_usec : 0, 4);
+		record.put(e.data.size(), 4);
+		if (!record.write(f) || (!e.data.empty() && fwrite(e.data.data(), e.data.size(), 1, f) != 1))
+			return false;
+	}
+	return true;
+}
+
+// the journal is bounded as when it was recorded: the opening, the open and
+// the events with data, up to _max_journal bytes in all
+bool stream::restore(FILE* f)
+{
+	checkpoint_record record;
+	if (!record.read(f, checkpoint_record::stream_size))
+		return false;
+	unsigned saved_status = record.get(1);
+	unsigned saved_requests = record.get(4);
+	unsigned saved_weight = record.get(4);
+	timeval saved_opening;
+	saved_opening.tv_sec = time_t(int64_t(record.get(8)));
+	saved_opening.tv_usec = record.get(4);
+	unsigned flags = record.get(1);
+	u_int32_t events = record.get(4);
+	if (saved_status > exit || events > u_int64_t(_max_journal) + 2)
+		return false;
+	if (!(flags & saved_framed))
+		_framer.reset();
+	_journal.clear();
+	_journal.reserve(events);
+	unsigned bytes = 0;
+	for (u_int32_t i = 0; i < events; i++)
+	{
+		if (!record.read(f, checkpoint_record::event_size))
+			return false;
+		_journal.push_back(journal_event());
+		journal_event& e = _journal.back();
+		unsigned type = record.get(1);
+		e.has_time = record.get(1) != 0;
+		e.time.tv_sec = time_t(int64_t(record.get(8)));
+		e.time.tv_usec = record.get(4);
+		u_int32_t len = record.get(4);
+		if (type > journal_event::response || len > _max_journal - bytes)
+			return false;
+		e.type = journal_event::type_enum(type);
+		bytes += len;
+		e.data.resize(len);
+		if (len && fread(&e.data[0], len, 1, f) != 1)
+			return false;
+	}
+	// without the events (e.g. between the transactions) the stream is as it was
+	status = status_enum((flags & saved_lost) ? open : saved_status);
+	tot_requests = saved_requests;
+	sample_weight = saved_weight;
+	opening_time = saved_opening;
+	_restored = true;
+	return true;
+}
+
+// the handlers are created, and the journal replayed, with the first event
+// after the restore: the restore does not wait for them
+void stream::resume(tcp_stream* pstream)
+{
+	_restored = false;
+	std::vector<journal_event> journal;
+	journal.swap(_journal);
+	status_enum restored_status = status;
+	unsigned restored_requests = tot_requests;
+	timeval restored_opening = opening_time;
+	// the first transaction starts with its opening, that creates the handlers;
+	// the events replayed find the stream as a new one
+	if (journal.empty() || journal.front().type != journal_event::opening)
+		init(pstream);
+	status = unknown;
+	for (std::vector<journal_event>::const_iterator i = journal.begin(); i != journal.end(); i++)
+		replay(pstream, *i);
+	if (journal.empty())
+		status = restored_status;
+	tot_requests = restored_requests;
+	opening_time = restored_opening;
+}
+
+void stream::replay(tcp_stream* pstream, const journal_event& e)
+{
+	tcp_stream replayed = *pstream;
+	replayed.server.count_new = replayed.client.count_new = 0;
+	const timeval* t = e.has_time ? &e.time : NULL;
+	switch (e.type)
+	{
+		case journal_event::opening:
+			onOpening(&replayed, t);
+			break;
+		case journal_event::open:
+			onOpen(&replayed, t);
+			break;
+		case journal_event::request:
+			replayed.server.data = const_cast<char*>(e.data.data());
+			replayed.server.count_new = e.data.size();
+			onRequest(&replayed, t);
+			break;
+		case journal_event::response:
+			replayed.client.data = const_cast<char*>(e.data.data());
+			replayed.client.count_new = e.data.size();
+			onResponse(&replayed, t);
+			break;
+	}
+}
+
 /////////////////
 
 void close_originator::append(std::basic_ostream<char>& out, const timeval* t)
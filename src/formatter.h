@@ -12,16 +12,21 @@
 #define _sniffer_formatter_h
 #include <vector>
 #include <map>
+#include <list>
 #include <ostream>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <csignal>
+#include <cstdio>
 #include <nids2.h>
 #include <boost/shared_ptr.hpp>
 #include <boost/iostreams/categories.hpp> 
 #include <boost/iostreams/operations.hpp> 
 #include <boost/iostreams/concepts.hpp>
 #include "utilities.h"
+#include "http.h"
+#include "grep.h"
 
 class ascii_filter :public boost::iostreams::output_filter 
 {
@@ -59,6 +64,18 @@ public:
       
 };
 
+// the output of a field rendered off the capture thread (see handler::defer):
+// text is complete once ready() is true
+class deferred_field
+{
+public:
+	typedef boost::shared_ptr<deferred_field> ptr;
+	virtual ~deferred_field(){}
+	virtual bool ready() = 0;
+	virtual void wait() = 0;
+	std::string text;
+};
+
 class handler: public shared_obj<handler>
 {
 public:
@@ -69,6 +86,9 @@ public:
 	virtual void append(std::basic_ostream<char>& out, const timeval* t) = 0;
 	virtual void onClose(tcp_stream* pstream, const timeval* ,unsigned char* packet) = 0;
 	virtual void onExit(tcp_stream* pstream) = 0;
+	// the log line can take the output later, from defer instead of append
+	virtual bool deferred() const {return false;}
+	virtual deferred_field::ptr defer(const timeval* t) {return deferred_field::ptr();}
 	virtual ~handler(){}
 };
 
@@ -294,9 +314,40 @@ class printer : public shared_obj<printer>
 {
 public:
 	virtual void doit(handlers::iterator start, handlers::iterator end, const timeval*t) = 0;
+	virtual void on_exit(){};
+	// called by the capture loop between the packets, and when there are none
+	virtual void on_idle(){};
 	virtual ~printer(){};
 };
 
+// the log lines with deferred fields, kept in order until they are complete
+class ordered_lines
+{
+public:
+	struct line
+	{
+		std::string text;
+		bool has_time;
+		timeval time;
+	};
+	// some of the handlers render their field later
+	static bool deferred(handlers::iterator start, handlers::iterator end);
+	bool empty() const {return _lines.empty();}
+	void add(handlers::iterator start, handlers::iterator end, const timeval* t, const string& eol);
+	// the first line, once its fields are complete (with wait, it waits for them)
+	bool next(line& result, bool wait);
+private:
+	// the text before the field
+	typedef std::vector<std::pair<std::string, deferred_field::ptr> > pieces;
+	struct pending_line
+	{
+		pieces parts;
+		bool has_time;
+		timeval time;
+	};
+	std::list<pending_line> _lines;
+};
+
 class outstream_printer : public printer
 {
 public:
@@ -304,9 +355,13 @@ public:
 	//typedef T& Out;
 	outstream_printer(Out out, const string& eol): _out(out), _eol(eol){_out.setf(ios_base::fixed);}
 	void doit(handlers::iterator start, handlers::iterator end,const timeval*t);
+	virtual void on_exit();
+	virtual void on_idle(){write_lines(false);}
 private :
+	void write_lines(bool wait);
 	Out _out;
     string _eol;
+	ordered_lines _lines;
 };
 
 
@@ -322,10 +377,44 @@ private:
 	std::string _command, _user;
 };
 
+// a format (the log line or an analysis stage key) with the printer that renders it
+class section : public shared_obj<section>
+{
+public:
+	section(printer* printer): _printer(printer), printer_stage(0){}
+	// registers the profiler stages of the factories added since the last call
+	void init_stages(handlers::const_iterator first);
+	handler_factories factories;
+	printer* _printer;
+	// the keyword that created each factory (empty for plain text)
+	std::vector<std::string> keywords;
+	// profiler stages, parallel to factories
+	std::vector<unsigned> stages;
+	unsigned printer_stage;
+};
+
+typedef std::vector<section::ptr> sections;
+
 class stream_listener
 {
 public:
     virtual void on_print(void) = 0;
+    // the sections of the transactions that start now, empty to keep the
+    // ones the stream was created with
+    virtual boost::shared_ptr<const sections> current_sections(){return boost::shared_ptr<const sections>();}
+};
+
+class tls_session;
+
+// with a checkpoint, an event of the transaction in progress: a restored
+// stream replays them on new handlers
+struct journal_event
+{
+	enum type_enum {opening, open, request, response};
+	type_enum type;
+	bool has_time;
+	timeval time;
+	std::string data;
 };
 
 class stream : public shared_obj<stream>, public tcp_stream
@@ -334,8 +423,15 @@ enum status_enum{unknown, opening, open, request, response, close, exit};
 public:
     timeval opening_time;
     unsigned tot_requests;
+    // how many flows this one stands for (see flow_sampler)
+    unsigned sample_weight;
+    // the TLS handshake, when a tls keyword is used (see tls_session)
+    boost::shared_ptr<tls_session> tls;
     void copy_tcp_stream(tcp_stream* pstream);
-	stream(stream_listener*, handler_factories::iterator _begin, handler_factories::iterator _end, printer* printer);
+	stream(stream_listener*, const sections& _sections);
+	// every transaction keeps the sections current when it starts (see
+	// stream_listener::current_sections), even if the parser reloads meanwhile
+	stream(stream_listener*, const boost::shared_ptr<const sections>& snapshot);
 	virtual void onOpening(tcp_stream* pstream, const timeval* t);
 	virtual void onOpen(tcp_stream* pstream, const timeval* t);
 	virtual void onClose(tcp_stream* pstream, const timeval* t,unsigned char* packet);
@@ -346,28 +442,99 @@ public:
 	virtual void init(tcp_stream* pstream);
 	virtual void reinit();
 	virtual void print(const timeval* t);
+	// splits the data in messages (e.g. http_framer), so that pipelined
+	// requests are paired with their responses (falls back when the
+	// connection does not follow the protocol)
+	void set_framer(message_framer* framer){_framer.reset(framer);}
+	const boost::shared_ptr<message_framer>& framer() const {return _framer;}
+	// with a framer, the segment the handlers are called for (NULL otherwise)
+	const message_segment* segment;
+	// keeps the events of the transaction in progress, up to max_bytes of
+	// payload per stream (0, the default, keeps none)
+	static void set_journal(unsigned max_bytes){_max_journal = max_bytes;}
+	// writes the state of the stream and its journal, false on error
+	bool save(FILE* f) const;
+	// reads what save wrote, the journal is replayed with the next event of
+	// the connection. False if the file is truncated, or not valid (e.g. a
+	// journal bigger than the one set)
+	bool restore(FILE* f);
 
 private:
+	// the handlers of a transaction, with the sections that created them
+	struct transaction
+	{
+		transaction(): format(NULL){}
+		void swap(transaction& other);
+		// keeps format alive after a reload (empty with the sections given
+		// to the constructor)
+		boost::shared_ptr<const sections> snapshot;
+		const sections* format;
+		handlers set;
+		// profiler stage of each handler, empty when not profiling
+		std::vector<unsigned> stages;
+	};
+	static unsigned stage(const transaction& tr, handlers::size_type i) {return tr.stages.empty() ? 0 : tr.stages[i];}
+	void create_handlers(transaction& result);
+	void request_handlers(transaction& tr, const timeval* t);
+	void response_handlers(transaction& tr, const timeval* t);
+	void close_handlers(transaction& tr, const timeval* t, unsigned char* packet);
+	void exit_handlers(transaction& tr);
+	void onRequestSegments(const message_segments& segments, const timeval* t);
+	void onResponseSegments(const message_segments& segments, const timeval* t);
+	void onMultiplexedSegment(const message_segment& s, bool request, const timeval* t);
+	void print_framed(const timeval* t);
+	void stop_framing(const timeval* t);
+	void print_handlers(transaction& tr, const timeval* t);
+	void record(journal_event::type_enum type, const timeval* t, const char* data, unsigned len);
+	// records an event split in messages, unless they were logged meanwhile
+	void record_framed(journal_event::type_enum type, unsigned transactions, const timeval* t, const char* data, unsigned len);
+	void resume(tcp_stream* pstream);
+	void replay(tcp_stream* pstream, const journal_event& e);
 	status_enum status;
-	printer* _printer;
     stream_listener* _pStream_listener;
-    handler_factories::iterator begin, end;
+	// the sections the stream was created with
+	boost::shared_ptr<const sections> _snapshot;
+	const sections& _sections;
 	static int id;
     int _id;
-	handlers _handlers;
-    
+	transaction _handlers;
+	boost::shared_ptr<message_framer> _framer;
+	message_segments _segments;
+	// a pipelined request waiting behind _handlers, complete when it has no response
+	struct queued_transaction : public transaction
+	{
+		queued_transaction(): complete(false){}
+		bool complete;
+	};
+	// with framing, the pipelined requests waiting behind _handlers (a list:
+	// nothing is allocated for the streams that never pipeline)
+	std::list<queued_transaction> _queued;
+	// with a multiplexing framer, the transactions by stream id
+	std::map<u_int32_t, transaction> _multiplexed;
+	static unsigned _max_journal;
+	std::vector<journal_event> _journal;
+	unsigned _journal_bytes;
+	// the transaction cannot be replayed (too big, or split by the framer)
+	bool _journal_lost;
+	// how many times the handlers were created
+	unsigned _transactions;
+	// restored, the journal is still to replay
+	bool _restored;
 };
 
 typedef std::basic_ostream<char>& Out;
 // typedef std::basic_ostream<char>* pOut;
 
 class parser;
+class flow_sampler;
 typedef parse_element::ptr pelem;
 class Module
 {
 public:
     virtual void init(parser*) = 0;
     virtual void on_exit(void){};
+    // the configuration is reloaded (SIGHUP), e.g. the scripts are read again
+    virtual void reload(void){};
 };
 
 #define REGISTER_MODULE(name) static name module;\
@@ -391,21 +558,66 @@ public:
 	parse_elements::iterator keywords_end() {init_parse_elements();return elements.end();}
 	static void nids_handler(struct tcp_stream *ts, void **yoda, struct timeval* t, unsigned char* packet);
 	void parse(const char* format);
+	section::ptr add_section(printer* printer, const char* format);
+	// a section that is not logged with the connections (e.g. the dns transactions)
+	section::ptr create_section(printer* printer, const char* format);
+	// replaces the log format for the connections opened from now on, the
+	// connections already open finish with the old one. Throws (e.g.
+	// unknown_keyword) leaving the old format if the new one is not valid
+	void reload(const char* format);
+	// the reload asked by a signal, done by the capture loop with the callback
+	typedef void (*reload_callback)(parser&);
+	static void set_reload_callback(reload_callback callback){_reload_callback = callback;}
+	static void request_reload(){_reload_requested = 1;}
+	// writes the open connections (see stream::save) after the libnids
+	// streams, false on error
+	bool checkpoint(FILE* f) const;
+	// reads what checkpoint wrote, after nids_tcp_restore: the connections
+	// restored in libnids are open again. The number restored, -1 on error
+	int restore(FILE* f);
 	virtual ~parser(){theOnlyParser = NULL;};
-	void set_printer(printer* printer){_printer=printer;}
+	void set_printer(printer* printer){_sections.front()->_printer=printer;}
+	const sections& get_sections() const {return _sections;}
     void set_max_lines(int max_lines){_max_lines = max_lines;}
     void set_handle_truncated(bool value){handle_truncated=value;}
     void set_default_not_found( const std::string& default_not_found) {_default_not_found = default_not_found;}
+    void set_sampler(flow_sampler* sampler){_sampler = sampler;}
+    void set_http_framing(bool value){_http_framing = value;}
+    // frames the connections to the port with the protocol, e.g. "mysql" or "redis:6380"
+    void add_framing(const std::string& spec);
     void add_parse_element(const std::string& key, parse_element::ptr);
 	static void register_module(Module* module);
     static void on_exit();
+    // the work of the capture loop that does not wait for a packet
+    static void idle();
+    // wall time spent in the stream handlers, measured only if enabled
+    static void set_handler_timing(bool enable){_handler_timing = enable;}
+    static double handler_time(){return _handler_time;}
+    // the Python handlers with handle_batch get their events every <events>
+    // events or <milliseconds> of capture time (if not 0)
+    static void set_python_batch(unsigned events, unsigned milliseconds){_python_batch_events = events; _python_batch_time = milliseconds;}
+    static unsigned python_batch_events(){return _python_batch_events;}
+    static unsigned python_batch_time(){return _python_batch_time;}
+    // with a queue of <events> (and <bytes> of payloads) the python handlers
+    // run on a worker thread, see python_worker
+    enum python_overflow_enum {python_block, python_drop, python_sample};
+    static void set_python_queue(unsigned events, unsigned bytes, python_overflow_enum overflow){_python_queue_events = events; _python_queue_bytes = bytes; _python_overflow = overflow;}
+    static unsigned python_queue_events(){return _python_queue_events;}
+    static unsigned python_queue_bytes(){return _python_queue_bytes;}
+    static python_overflow_enum python_overflow(){return _python_overflow;}
     virtual void on_print(void);
 
 private:
     bool handle_truncated;
 	bool _already_init;
-	const char* _parse_element(const char* format);
+	const char* _parse_element(const char* format, section& psection);
+	void _parse(const char* format, section& psection);
 	void init_parse_elements();
+	void dispatch(struct tcp_stream *ts, struct timeval* t, unsigned char* packet);
+	// runs the reload asked by a signal, from the capture thread
+	static void reload_if_requested();
+	// a stream for the connection, with the framing of its server port
+	stream::ptr create_stream(const tuple4& addr);
 	void process_opening_connection(tcp_stream *ts, struct timeval* t, unsigned char* packet);
 	void process_open_connection(tcp_stream *ts, struct timeval* t, unsigned char* packet);
 	void process_server(tcp_stream *ts, struct timeval* t, unsigned char* packet);
@@ -414,11 +626,25 @@ private:
 	void process_end_data(tcp_stream *ts);
 	static parser* theOnlyParser;
     static modules _modules;
+    static reload_callback _reload_callback;
+    static volatile sig_atomic_t _reload_requested;
+    static bool _handler_timing;
+    static double _handler_time;
+    static unsigned _python_batch_events, _python_batch_time;
+    static unsigned _python_queue_events, _python_queue_bytes;
+    static python_overflow_enum _python_overflow;
     int _max_lines, _counter;
 	parse_elements elements;
 	streams connections;
-	handler_factories factories;
-	printer* _printer;
+	sections _sections;
+	// the sections given to the new transactions, shared until the next change
+	boost::shared_ptr<const sections> _snapshot;
+	const boost::shared_ptr<const sections>& snapshot();
+	boost::shared_ptr<const sections> current_sections(){return snapshot();}
+	flow_sampler* _sampler;
+	bool _http_framing;
+	// framing by server port
+	std::map<u_short, framing_enum> _framing;
 	std::string _default_not_found;
 public:
 	
@@ -431,6 +657,12 @@ public:
 	unknown_keyword(const string& str): common_exception(string("unknown keyword '").append(str).append("'")){}
 };
 
+class invalid_framing: public common_exception
+{
+public:
+	invalid_framing(const string& str): common_exception(string("invalid framing '").append(str).append("', it must be http, h2, mysql, postgres or redis, optionally followed by :<port>")){}
+};
+
 class parser_not_initialized: public common_exception
 {
 public:
@@ -1026,6 +1258,19 @@ private:
 
 
 
+class sample_weight_handler : public basic_handler
+{
+public:
+	sample_weight_handler():_pstream(0){}
+	virtual void append(std::basic_ostream<char>& out, const timeval* ) {out << (_pstream ? _pstream->sample_weight : 1);}
+	virtual void onOpening(tcp_stream* pstream, const timeval* t){ _pstream=((stream*) pstream);}
+	virtual void onOpen(tcp_stream* pstream, const timeval* t){ _pstream=((stream*) pstream);}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t){ _pstream=((stream*) pstream);}
+	virtual void onResponse(tcp_stream* pstream, const timeval* t){ _pstream=((stream*) pstream);}
+private:
+	stream* _pstream;
+};
+
 class response_size_handler : public basic_handler
 {
 public:
@@ -1049,32 +1294,78 @@ private:
 	int size;
 };
 
-class request_part : public request_collector<basic_handler>
+// a keyword consuming the text of one direction: the text is kept by the
+// grep_scan shared with the other ones of the section, fed by the first of them
+class capture_handler: public basic_handler
+{
+public:
+	capture_handler(): _member(0){}
+	void join(grep_scan::ptr scan, unsigned member){_scan = scan; _member = member;}
+protected:
+	void feed(const char* data, unsigned len)
+	{
+		if (_scan && _member == 0)
+			_scan->feed(data, len);
+	}
+	grep_scan::ptr _scan;
+	unsigned _member;
+};
+
+inline void grep_join(basic_handler*, grep_scan::ptr, unsigned){}
+inline void grep_join(capture_handler* handler, grep_scan::ptr scan, unsigned member){handler->join(scan, member);}
+
+template <class handler_t, bool tail>
+class window_handler_factory_t: public handler_factory, public grep_member
 {
 public:
-    request_part(const string& keyword){
-        std::istringstream s(keyword) ;
-        s>> start;
-        s>> length;
-    }
-	virtual void append(std::basic_ostream<char>& out, const timeval* ) {out <<text.substr(start, length);}
+	window_handler_factory_t(const string& params): _window(params, tail){}
+	virtual handler::ptr create_handler()
+	{
+		handler_t* h = new handler_t(_window);
+		handler::ptr result(h);
+		if (_group)
+			h->join(_group->scan(_member), _member);
+		return result;
+	}
+	virtual grep_scope_enum grep_scope() const {return grep_scope_enum(handler_t::grep_scope);}
+	virtual unsigned grep_add(grep_group& group) const {return group.add(_window);}
 private:
-	int start;
-	int length;
+	capture_window _window;
 };
 
-class response_part : public response_collector<basic_handler>
+class window_handler: public capture_handler
 {
 public:
-    response_part(const string& keyword){
-        std::istringstream s(keyword) ;
-        s>> start;
-        s>> length;
-    }
-	virtual void append(std::basic_ostream<char>& out, const timeval* ) {out <<text.substr(start, length);}
+	window_handler(const capture_window& window): _window(window){}
+	virtual void append(std::basic_ostream<char>& out, const timeval* )
+	{
+		if (_scan)
+			out << (_window.tail ? _scan->tail(_window.length) : _scan->part(_window.offset, _window.length));
+	}
 private:
-	int start;
-	int length;
+	capture_window _window;
+};
+
+class request_part : public window_handler
+{
+public:
+	enum {grep_scope = grep_request};
+	request_part(const capture_window& window): window_handler(window){}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t)
+	{
+		feed(pstream->server.data, pstream->server.count_new);
+	}
+};
+
+class response_part : public window_handler
+{
+public:
+	enum {grep_scope = grep_response};
+	response_part(const capture_window& window): window_handler(window){}
+	virtual void onResponse(tcp_stream* pstream, const timeval* t)
+	{
+		feed(pstream->client.data, pstream->client.count_new);
+	}
 };
 
 #endif// _sniffer_formatter_h
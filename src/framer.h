@@ -0,0 +1,50 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_framer_h
+#define _sniffer_framer_h
+#include <vector>
+#include <sys/types.h>
+
+// a piece of the data of one direction that belongs to a single message
+struct message_segment
+{
+	const char* data;
+	unsigned len;
+	bool start;	// it begins a message
+	bool end;	// it completes a message
+	bool interim;	// the message is a 1xx response other than 101
+	bool unanswered;	// it completes a request that has no response
+	int64_t rows;	// in the segment that completes a response: the rows of its result, -1 if unknown
+	u_int32_t id;	// the multiplexed stream (e.g. the HTTP/2 stream id) it belongs to, 0 if the messages are in order
+};
+
+typedef std::vector<message_segment> message_segments;
+
+// splits the two directions of a connection in request and response
+// messages, so that every request is logged with its own response
+// (see stream::set_framer). The segments returned must stay valid until the
+// next call
+class message_framer
+{
+public:
+	virtual ~message_framer(){}
+	virtual void requests(const char* data, unsigned len, message_segments& result) = 0;
+	virtual void responses(const char* data, unsigned len, message_segments& result) = 0;
+	// the first message was not of the protocol, or more than max_pipeline
+	// requests wait for a response: the caller should stop framing
+	virtual bool failed() const = 0;
+	// the pipelined requests kept, beyond them a connection is not framed
+	static const unsigned max_pipeline = 256;
+};
+
+enum framing_enum {http_framing, mysql_framing, postgres_framing, redis_framing, h2_framing};
+
+#endif// _sniffer_framer_h
@@ -0,0 +1,415 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "grep.h"
+#include "utilities.h"
+#include <deque>
+#include <cctype>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+///// grep_automaton /////
+
+unsigned grep_automaton::add(const string& literal)
+{
+	string folded(literal);
+	for (string::iterator i = folded.begin(); i != folded.end(); i++)
+		*i = tolower((unsigned char) *i);
+	_literals.push_back(folded);
+	return _literals.size() - 1;
+}
+
+void grep_automaton::compile()
+{
+	// the trie, -1 where there is no edge
+	vector<int> trie(256, -1);
+	_matches.assign(1, vector<unsigned>());
+	for (unsigned p = 0; p < _literals.size(); p++)
+	{
+		unsigned state = 0;
+		for (string::const_iterator i = _literals[p].begin(); i != _literals[p].end(); i++)
+		{
+			unsigned edge = state * 256 + (unsigned char) *i;
+			if (trie[edge] < 0)
+			{
+				trie[edge] = _matches.size();
+				_matches.push_back(vector<unsigned>());
+				trie.resize(trie.size() + 256, -1);
+			}
+			state = trie[edge];
+		}
+		_matches[state].push_back(p);
+	}
+	// the failure links, breadth first, folded in the transition table
+	unsigned states = _matches.size();
+	_next.assign(states * 256, 0);
+	vector<unsigned> fail(states, 0);
+	deque<unsigned> queue;
+	for (unsigned c = 0; c < 256; c++)
+		if (trie[c] > 0)
+		{
+			_next[c] = trie[c];
+			queue.push_back(trie[c]);
+		}
+	while (!queue.empty())
+	{
+		unsigned state = queue.front();
+		queue.pop_front();
+		for (unsigned c = 0; c < 256; c++)
+		{
+			int target = trie[state * 256 + c];
+			if (target < 0)
+			{
+				_next[state * 256 + c] = _next[fail[state] * 256 + c];
+				continue;
+			}
+			fail[target] = _next[fail[state] * 256 + c];
+			const vector<unsigned>& inherited = _matches[fail[target]];
+			_matches[target].insert(_matches[target].end(), inherited.begin(), inherited.end());
+			_next[state * 256 + c] = target;
+			queue.push_back(target);
+		}
+	}
+	// case insensitive: the upper case letters move as the lower case ones
+	for (unsigned state = 0; state < states; state++)
+		for (unsigned c = 'A'; c <= 'Z'; c++)
+			_next[state * 256 + c] = _next[state * 256 + tolower(c)];
+}
+
+///// required_literal /////
+
+static void commit(string& run, string& best)
+{
+	if (run.size() > best.size())
+		best = run;
+	run.clear();
+}
+
+string required_literal(const string& expression)
+{
+	string best, run;
+	int depth = 0;
+	for (string::size_type i = 0; i < expression.size(); i++)
+	{
+		char c = expression[i];
+		switch (c)
+		{
+			case '\\':
+			{
+				if (++i == expression.size())
+					return string();
+				char escaped = expression[i];
+				if (escaped == 'n')
+					c = '\n';
+				else if (escaped == 'r')
+					c = '\r';
+				else if (escaped == 't')
+					c = '\t';
+				else if (!isalnum((unsigned char) escaped))
+					c = escaped;
+				else if (strchr("sSdDwWbBAzZG", escaped))
+				{
+					commit(run, best);
+					continue;
+				}
+				else // hexadecimal, octal, back references...: not worth it
+					return string();
+				break;
+			}
+			case '[':
+				// a class: skipped
+				if (i + 1 < expression.size() && expression[i + 1] == '^')
+					i++;
+				if (i + 1 < expression.size() && expression[i + 1] == ']')
+					i++;
+				for (i++; i < expression.size() && expression[i] != ']'; i++)
+					if (expression[i] == '\\')
+						i++;
+				commit(run, best);
+				continue;
+			case '(':
+				// the literals of the groups are not considered
+				depth++;
+				commit(run, best);
+				continue;
+			case ')':
+				depth--;
+				commit(run, best);
+				continue;
+			case '|':
+				if (depth == 0)
+					return string();
+				continue;
+			case '*':
+			case '?':
+				// the previous atom is optional
+				if (!run.empty())
+					run.erase(run.size() - 1);
+				commit(run, best);
+				continue;
+			case '{':
+				if (i + 1 < expression.size() && expression[i + 1] == '0' && !run.empty())
+					run.erase(run.size() - 1);
+				commit(run, best);
+				while (i < expression.size() && expression[i] != '}')
+					i++;
+				continue;
+			case '+':
+			case '.':
+			case '^':
+			case '$':
+				commit(run, best);
+				continue;
+		}
+		if (depth == 0)
+			run += tolower((unsigned char) c);
+	}
+	commit(run, best);
+	return best;
+}
+
+///// grep_scan /////
+
+grep_scan::grep_scan(const grep_group& group):
+	_group(group), _state(0), _hits(group.automaton().patterns(), string::npos),
+	_total(0), _headers_length(0), _headers_complete(false), _confirmed(string::npos)
+{
+}
+
+void grep_scan::feed(const char* data, unsigned len)
+{
+	u_int64_t limit = _group.prefix();
+	if (!_headers_complete && _group.headers_needed())
+	{
+		const char* stop = headers_end(data, data + len);
+		_headers_length += stop - data;
+		_headers_complete = stop != data + len;
+		limit = max(limit, _total + (stop - data));
+	}
+	u_int64_t max_capture = grep_group::max_capture();
+	if (max_capture && limit > max_capture)
+		limit = max_capture;
+	// the prefix is contiguous: once stopped, it is complete
+	if (_text.size() == _total && limit > _total)
+	{
+		unsigned kept = min(u_int64_t(len), limit - _total);
+		const grep_automaton& automaton = _group.automaton();
+		if (automaton.patterns())
+		{
+			string::size_type offset = _text.size();
+			for (unsigned i = 0; i < kept; i++)
+			{
+				_state = automaton.next(_state, data[i]);
+				const vector<unsigned>& matches = automaton.matches(_state);
+				for (vector<unsigned>::const_iterator m = matches.begin(); m != matches.end(); m++)
+					if (_hits[*m] == string::npos)
+						_hits[*m] = offset + i + 1;
+			}
+		}
+		_text.append(data, kept);
+	}
+	if (_group.tail())
+	{
+		_tail.append(data, len);
+		// trimmed once it doubles, not at every feed
+		if (_tail.size() > 2 * _group.tail())
+			_tail.erase(0, _tail.size() - _group.tail());
+	}
+	_total += len;
+}
+
+bool grep_scan::found(unsigned member) const
+{
+	int pattern = _group.pattern(member);
+	if (pattern < 0)
+		return true;
+	return _hits[pattern] <= length(member);
+}
+
+bool grep_scan::match(unsigned member, boost::smatch& what)
+{
+	if (!found(member))
+		return false;
+	if (!_group.combined(member))
+	{
+		string::const_iterator begin = _text.begin();
+		return boost::regex_search(begin, begin + length(member), what, _group.expression(member));
+	}
+	confirm();
+	if (_matches[member].empty())
+		return false;
+	what = _matches[member];
+	return true;
+}
+
+// the alternation tells the first position where one of the members
+// matches: the members still without match are tried there, anchored, and
+// the search goes on after it. A member matches first where it matches
+// alone, since no member matches between the positions found
+void grep_scan::confirm()
+{
+	if (_confirmed == _text.size())
+		return;
+	_confirmed = _text.size();
+	_matches.assign(_group.combined_members().back() + 1, boost::smatch());
+	vector<unsigned> pending;
+	for (vector<unsigned>::const_iterator i = _group.combined_members().begin(); i != _group.combined_members().end(); i++)
+		if (found(*i))
+			pending.push_back(*i);
+	string::const_iterator begin = _text.begin(), end = _text.end(), start = begin;
+	boost::smatch candidate;
+	while (!pending.empty())
+	{
+		boost::match_flag_type flags = start == begin ? boost::match_default : boost::match_prev_avail;
+		if (!boost::regex_search(start, end, candidate, _group.combined(), flags))
+			break;
+		string::const_iterator at = candidate[0].first;
+		flags = at == begin ? boost::match_continuous : boost::match_continuous | boost::match_prev_avail;
+		for (vector<unsigned>::iterator i = pending.begin(); i != pending.end();)
+		{
+			boost::smatch what;
+			if (boost::regex_search(at, end, what, _group.expression(*i), flags))
+			{
+				_matches[*i] = what;
+				i = pending.erase(i);
+			}
+			else
+				i++;
+		}
+		if (at == end)
+			break;
+		start = at + 1;
+	}
+}
+
+string::size_type grep_scan::length(unsigned member) const
+{
+	return _group.headers(member) ? min(_headers_length, _text.size()) : _text.size();
+}
+
+string grep_scan::part(u_int64_t offset, u_int64_t length) const
+{
+	if (offset >= _text.size())
+		return string();
+	return _text.substr(offset, min(length, u_int64_t(_text.size() - offset)));
+}
+
+string grep_scan::tail(u_int64_t length) const
+{
+	if (length >= _tail.size())
+		return _tail;
+	return _tail.substr(_tail.size() - length);
+}
+
+///// capture_window /////
+
+capture_window::capture_window(const string& params, bool tail): offset(0), length(u_int64_t(-1)), tail(tail)
+{
+	istringstream s(params);
+	if (!tail)
+		s >> offset;
+	// without length, till the end
+	if (!(s >> length))
+		length = u_int64_t(-1);
+}
+
+///// grep_group /////
+
+u_int64_t grep_group::_max_capture = 0;
+
+unsigned grep_group::add(const boost::regex& expression, bool headers)
+{
+	string literal = required_literal(expression.str());
+	_patterns.push_back(literal.empty() ? -1 : int(_automaton.add(literal)));
+	_headers.push_back(headers);
+	_expressions.push_back(expression);
+	if (headers)
+		_headers_needed = true;
+	else
+		_all = true;
+	return _patterns.size() - 1;
+}
+
+unsigned grep_group::add(const capture_window& window)
+{
+	_patterns.push_back(-1);
+	_headers.push_back(false);
+	_expressions.push_back(boost::regex());
+	if (window.tail)
+		_tail = max(_tail, unsigned(min(window.length, u_int64_t(~0u >> 1))));
+	else if (window.length > u_int64_t(-1) - window.offset)
+		_all = true;
+	else
+		_prefix = max(_prefix, window.offset + window.length);
+	return _patterns.size() - 1;
+}
+
+// the numbered references of an expression do not survive the alternation
+static bool has_references(const string& expression)
+{
+	for (string::size_type i = 0; i + 1 < expression.size(); i++)
+	{
+		if (expression[i] == '\\')
+		{
+			char c = expression[++i];
+			if (isdigit((unsigned char) c) || c == 'g' || c == 'k')
+				return true;
+		}
+		else if (expression.compare(i, 2, "(?") == 0 && i + 2 < expression.size() && strchr("P&R(+-0123456789", expression[i + 2]))
+			return true;
+	}
+	return false;
+}
+
+// the expressions on the whole text with a literal (the others match about
+// everywhere) are confirmed together
+void grep_group::compile()
+{
+	_automaton.compile();
+	_combined_member.assign(_patterns.size(), false);
+	string alternation;
+	for (unsigned m = 0; m < _patterns.size(); m++)
+	{
+		const boost::regex& expression = _expressions[m];
+		if (expression.empty() || _headers[m] || _patterns[m] < 0 || has_references(expression.str()))
+			continue;
+		_combined_members.push_back(m);
+		if (!alternation.empty())
+			alternation += '|';
+		alternation.append("(?:").append(expression.str()).append(")");
+	}
+	if (_combined_members.size() < 2)
+	{
+		_combined_members.clear();
+		return;
+	}
+	for (vector<unsigned>::const_iterator i = _combined_members.begin(); i != _combined_members.end(); i++)
+		_combined_member[*i] = true;
+	_combined.assign(alternation, boost::regex::icase);
+}
+
+u_int64_t grep_group::prefix() const
+{
+	return _all ? u_int64_t(-1) : _prefix;
+}
+
+grep_scan::ptr grep_group::scan(unsigned member)
+{
+	grep_scan::ptr scan = _current.lock();
+	if (member == 0 || !scan)
+	{
+		scan = grep_scan::ptr(new grep_scan(*this));
+		_current = scan;
+	}
+	return scan;
+}
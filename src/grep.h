@@ -0,0 +1,159 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_grep_h
+#define _sniffer_grep_h
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/regex.hpp>
+#include <sys/types.h>
+
+// Aho-Corasick automaton of case insensitive literals, as a complete
+// transition table: one lookup per byte
+class grep_automaton
+{
+public:
+	unsigned add(const std::string& literal);
+	void compile();
+	unsigned patterns() const {return _literals.size();}
+	unsigned next(unsigned state, unsigned char c) const {return _next[state * 256 + c];}
+	// the patterns ending in state (through the failure links too)
+	const std::vector<unsigned>& matches(unsigned state) const {return _matches[state];}
+private:
+	std::vector<std::string> _literals;
+	std::vector<unsigned> _next;
+	std::vector<std::vector<unsigned> > _matches;
+};
+
+// the longest literal that every match of the regular expression contains,
+// empty if none is found (only the top level of the expression is examined)
+std::string required_literal(const std::string& expression);
+
+class grep_group;
+
+// the text of one direction of a transaction, shared by all the keywords of
+// the section that consume it (see grep_group). Only the bytes some keyword
+// needs are kept: a prefix, bounded by the largest window or by the max
+// capture, and a tail. The grep literals are searched once for all in the
+// kept prefix while it arrives, a regular expression is run only if its
+// literal was seen. The expressions on the whole text are confirmed
+// together, in a single pass of their alternation
+class grep_scan
+{
+public:
+	typedef boost::shared_ptr<grep_scan> ptr;
+	grep_scan(const grep_group& group);
+	void feed(const char* data, unsigned len);
+	// the literal of the member was found in its text (always true without literal)
+	bool found(unsigned member) const;
+	// the first match of the expression of a grep member in its text
+	bool match(unsigned member, boost::smatch& what);
+	// the kept prefix
+	const std::string& text() const {return _text;}
+	// how much of text is searched by the member: the part that
+	// request_header_collector would collect or everything
+	std::string::size_type length(unsigned member) const;
+	// length bytes from offset (as far as they were kept)
+	std::string part(u_int64_t offset, u_int64_t length) const;
+	// the last length bytes (at most the largest tail of the group)
+	std::string tail(u_int64_t length) const;
+private:
+	// the first match of every combined member
+	void confirm();
+	const grep_group& _group;
+	unsigned _state;
+	// end of the first occurrence of each literal
+	std::vector<std::string::size_type> _hits;
+	std::string _text;
+	std::string _tail;
+	u_int64_t _total;
+	std::string::size_type _headers_length;
+	bool _headers_complete;
+	// by member (empty without match), valid while the text has _confirmed bytes
+	std::vector<boost::smatch> _matches;
+	std::string::size_type _confirmed;
+};
+
+// the bytes of a direction printed by a keyword: length bytes from offset,
+// or the last length bytes
+struct capture_window
+{
+	// "offset [length]" or "length" for a tail
+	capture_window(const std::string& params, bool tail);
+	u_int64_t offset, length;
+	bool tail;
+};
+
+// the keywords of a section consuming the text of one direction: the grep
+// keywords and the windows
+class grep_group
+{
+public:
+	grep_group(): _all(false), _headers_needed(false), _prefix(0), _tail(0){}
+	// a grep keyword on the headers or on everything, returns the member index
+	unsigned add(const boost::regex& expression, bool headers);
+	unsigned add(const capture_window& window);
+	void compile();
+	// the scan of the handler set being created: member 0 starts a new one
+	grep_scan::ptr scan(unsigned member);
+	// the bytes of the prefix that are kept, once the headers are complete
+	u_int64_t prefix() const;
+	bool headers_needed() const {return _headers_needed;}
+	unsigned tail() const {return _tail;}
+	bool headers(unsigned member) const {return _headers[member];}
+	// the literal of the member, -1 if it has none
+	int pattern(unsigned member) const {return _patterns[member];}
+	const grep_automaton& automaton() const {return _automaton;}
+	const boost::regex& expression(unsigned member) const {return _expressions[member];}
+	// the members on the whole text confirmed together, if at least two
+	bool combined(unsigned member) const {return _combined_member[member];}
+	const std::vector<unsigned>& combined_members() const {return _combined_members;}
+	// the alternation of their expressions
+	const boost::regex& combined() const {return _combined;}
+	// caps the prefix kept for every direction of every transaction, 0 is unlimited
+	static void set_max_capture(u_int64_t max_capture){_max_capture = max_capture;}
+	static u_int64_t max_capture(){return _max_capture;}
+private:
+	grep_automaton _automaton;
+	std::vector<int> _patterns;
+	std::vector<bool> _headers;
+	std::vector<boost::regex> _expressions;
+	std::vector<bool> _combined_member;
+	std::vector<unsigned> _combined_members;
+	boost::regex _combined;
+	bool _all, _headers_needed;
+	u_int64_t _prefix;
+	unsigned _tail;
+	boost::weak_ptr<grep_scan> _current;
+	static u_int64_t _max_capture;
+};
+
+// the keywords whose text is kept by a grep_scan, by direction
+enum grep_scope_enum {grep_none, grep_request_headers, grep_request, grep_response_headers, grep_response};
+
+// a factory of a keyword consuming the text of a direction, linked to the
+// grep_group of its section and direction when the section is parsed
+class grep_member
+{
+public:
+	grep_member(): _member(0){}
+	virtual ~grep_member(){}
+	virtual grep_scope_enum grep_scope() const = 0;
+	// adds itself to group, returns the member index
+	virtual unsigned grep_add(grep_group& group) const = 0;
+	void join(boost::shared_ptr<grep_group> group, unsigned member){_group = group; _member = member;}
+protected:
+	boost::shared_ptr<grep_group> _group;
+	unsigned _member;
+};
+
+#endif// _sniffer_grep_h
@@ -0,0 +1,881 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "h2.h"
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std;
+
+///// hpack_decoder /////
+
+namespace
+{
+	struct header_entry
+	{
+		const char* name;
+		const char* value;
+	};
+
+	// RFC 7541 appendix A
+	static const header_entry static_table[] =
+	{
+		{":authority", ""},
+		{":method", "GET"},
+		{":method", "POST"},
+		{":path", "/"},
+		{":path", "/index.html"},
+		{":scheme", "http"},
+		{":scheme", "https"},
+		{":status", "200"},
+		{":status", "204"},
+		{":status", "206"},
+		{":status", "304"},
+		{":status", "400"},
+		{":status", "404"},
+		{":status", "500"},
+		{"accept-charset", ""},
+		{"accept-encoding", "gzip, deflate"},
+		{"accept-language", ""},
+		{"accept-ranges", ""},
+		{"accept", ""},
+		{"access-control-allow-origin", ""},
+		{"age", ""},
+		{"allow", ""},
+		{"authorization", ""},
+		{"cache-control", ""},
+		{"content-disposition", ""},
+		{"content-encoding", ""},
+		{"content-language", ""},
+		{"content-length", ""},
+		{"content-location", ""},
+		{"content-range", ""},
+		{"content-type", ""},
+		{"cookie", ""},
+		{"date", ""},
+		{"etag", ""},
+		{"expect", ""},
+		{"expires", ""},
+		{"from", ""},
+		{"host", ""},
+		{"if-match", ""},
+		{"if-modified-since", ""},
+		{"if-none-match", ""},
+		{"if-range", ""},
+		{"if-unmodified-since", ""},
+		{"last-modified", ""},
+		{"link", ""},
+		{"location", ""},
+		{"max-forwards", ""},
+		{"proxy-authenticate", ""},
+		{"proxy-authorization", ""},
+		{"range", ""},
+		{"referer", ""},
+		{"refresh", ""},
+		{"retry-after", ""},
+		{"server", ""},
+		{"set-cookie", ""},
+		{"strict-transport-security", ""},
+		{"transfer-encoding", ""},
+		{"user-agent", ""},
+		{"vary", ""},
+		{"via", ""},
+		{"www-authenticate", ""}
+	};
+
+	// RFC 7541 appendix B: the lengths of the canonical codes, the symbols 0-255 and EOS
+	static const unsigned char huffman_lengths[257] =
+	{
+		13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+		28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+		6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+		5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+		13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+		7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+		15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+		6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+		20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+		24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+		22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+		21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+		26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+		19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+		20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+		26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+		30
+	};
+
+	const unsigned static_size = sizeof(static_table) / sizeof(static_table[0]);
+	// the overhead of a dynamic table entry
+	const unsigned entry_overhead = 32;
+	const unsigned default_table_size = 4096;
+	// the table sizes accepted from SETTINGS
+	const unsigned max_table_size = 1 << 20;
+
+	// the codes of each length are consecutive (canonical Huffman code)
+	struct huffman_code
+	{
+		huffman_code()
+		{
+			unsigned index = 0;
+			u_int32_t code = 0;
+			for (unsigned length = 1; length <= 30; length++)
+			{
+				first[length] = code;
+				offset[length] = index;
+				count[length] = 0;
+				for (unsigned symbol = 0; symbol < 257; symbol++)
+					if (huffman_lengths[symbol] == length)
+					{
+						symbols[index++] = symbol;
+						count[length]++;
+					}
+				code = (code + count[length]) << 1;
+			}
+		}
+		u_int32_t first[31];
+		unsigned offset[31], count[31];
+		unsigned short symbols[257];
+	};
+
+	const huffman_code huffman;
+}
+
+static bool huffman_decode(const unsigned char* data, unsigned len, string& result)
+{
+	u_int32_t code = 0;
+	unsigned bits = 0;
+	for (unsigned i = 0; i < len; i++)
+		for (int bit = 7; bit >= 0; bit--)
+		{
+			code = (code << 1) | ((data[i] >> bit) & 1);
+			bits++;
+			if (bits > 30)
+				return false;
+			if (huffman.count[bits] && code >= huffman.first[bits] && code - huffman.first[bits] < huffman.count[bits])
+			{
+				unsigned symbol = huffman.symbols[huffman.offset[bits] + code - huffman.first[bits]];
+				// EOS
+				if (symbol == 256)
+					return false;
+				result += char(symbol);
+				code = 0;
+				bits = 0;
+			}
+		}
+	// the padding is the start of EOS: up to 7 bits, all ones
+	return bits < 8 && code == (1u << bits) - 1;
+}
+
+// an integer with a prefix of the given bits
+static bool integer(const unsigned char* data, unsigned len, unsigned& pos, unsigned bits, u_int64_t& value)
+{
+	unsigned max = (1 << bits) - 1;
+	value = data[pos++] & max;
+	if (value < max)
+		return true;
+	for (unsigned shift = 0; pos < len && shift <= 28; shift += 7)
+	{
+		unsigned char byte = data[pos++];
+		value += u_int64_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static bool literal(const unsigned char* data, unsigned len, unsigned& pos, string& result)
+{
+	if (pos >= len)
+		return false;
+	bool huffman = data[pos] & 0x80;
+	u_int64_t size;
+	if (!integer(data, len, pos, 7, size) || size > len - pos)
+		return false;
+	result.clear();
+	bool valid = true;
+	if (huffman)
+		valid = huffman_decode(data + pos, size, result);
+	else
+		result.assign((const char*) data + pos, size);
+	pos += size;
+	return valid;
+}
+
+hpack_decoder::hpack_decoder(): _size(0), _max_size(default_table_size), _limit(default_table_size)
+{
+}
+
+void hpack_decoder::set_limit(unsigned limit)
+{
+	_limit = min(limit, max_table_size);
+	if (_max_size > _limit)
+	{
+		_max_size = _limit;
+		evict();
+	}
+}
+
+bool hpack_decoder::lookup(u_int64_t index, field& result) const
+{
+	if (index == 0)
+		return false;
+	if (index <= static_size)
+	{
+		result.first = static_table[index - 1].name;
+		result.second = static_table[index - 1].value;
+		return true;
+	}
+	index -= static_size + 1;
+	if (index >= _table.size())
+		return false;
+	result = _table[index];
+	return true;
+}
+
+void hpack_decoder::evict()
+{
+	while (_size > _max_size)
+	{
+		_size -= _table.back().first.size() + _table.back().second.size() + entry_overhead;
+		_table.pop_back();
+	}
+}
+
+void hpack_decoder::insert(const field& f)
+{
+	unsigned size = f.first.size() + f.second.size() + entry_overhead;
+	// an entry larger than the table empties it
+	if (size > _max_size)
+	{
+		_table.clear();
+		_size = 0;
+		return;
+	}
+	_table.push_front(f);
+	_size += size;
+	evict();
+}
+
+bool hpack_decoder::decode(const unsigned char* data, unsigned len, fields& result)
+{
+	unsigned pos = 0;
+	while (pos < len)
+	{
+		unsigned char first = data[pos];
+		u_int64_t index;
+		field f;
+		if (first & 0x80)
+		{
+			// indexed
+			if (!integer(data, len, pos, 7, index) || !lookup(index, f))
+				return false;
+		}
+		else if ((first & 0xe0) == 0x20)
+		{
+			// dynamic table size update
+			if (!integer(data, len, pos, 5, index) || index > _limit)
+				return false;
+			_max_size = index;
+			evict();
+			continue;
+		}
+		else
+		{
+			// literal, with incremental indexing, without indexing or never indexed
+			bool indexing = (first & 0xc0) == 0x40;
+			if (!integer(data, len, pos, indexing ? 6 : 4, index))
+				return false;
+			if (index ? !lookup(index, f) : !literal(data, len, pos, f.first))
+				return false;
+			if (!literal(data, len, pos, f.second))
+				return false;
+			if (indexing)
+				insert(f);
+		}
+		result.push_back(f);
+	}
+	return true;
+}
+
+///// h2_framer /////
+
+namespace
+{
+	enum
+	{
+		data_frame = 0, headers_frame = 1, rst_stream_frame = 3, settings_frame = 4, push_promise_frame = 5,
+		continuation_frame = 9
+	};
+	const unsigned end_stream_flag = 0x1;
+	const unsigned ack_flag = 0x1;
+	const unsigned end_headers_flag = 0x4;
+	const unsigned padded_flag = 0x8;
+	const unsigned priority_flag = 0x20;
+	const unsigned settings_header_table_size = 1;
+	const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+	const unsigned preface_size = sizeof(preface) - 1;
+	const char switching[] = "HTTP/1.1 101";
+	const unsigned switching_size = sizeof(switching) - 1;
+	const char end_of_header[] = "\r\n\r\n";
+	// the longest first request header waited for before taking it as HTTP/1
+	const unsigned max_first = 8192;
+	// the longest frame buffered (DATA is not) and header block
+	const unsigned max_payload = 1 << 20;
+	const unsigned max_block = 1 << 20;
+}
+
+static u_int32_t be32(const unsigned char* p)
+{
+	return (u_int32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// grpc-message is percent-encoded
+static string percent_decode(const string& value)
+{
+	string result;
+	for (string::size_type i = 0; i < value.size(); i++)
+	{
+		if (value[i] == '%' && i + 2 < value.size() && isxdigit(value[i + 1]) && isxdigit(value[i + 2]))
+		{
+			result += char(strtol(value.substr(i + 1, 2).c_str(), NULL, 16));
+			i += 2;
+		}
+		else
+			result += value[i];
+	}
+	return result;
+}
+
+// the first line is complete and it is not an HTTP/1.1 request line
+static bool not_request(const char* data, unsigned len)
+{
+	const char* end = search(data, data + len, end_of_header, end_of_header + 2);
+	if (end == data + len)
+		return false;
+	return string(data, end - data).find(" HTTP/1.1") == string::npos;
+}
+
+// an HTTP/1.1 request header with Upgrade: h2c
+static bool upgrade_h2c(const char* data, unsigned len)
+{
+	string header(data, len);
+	transform(header.begin(), header.end(), header.begin(), ::tolower);
+	string::size_type upgrade = header.find("\nupgrade:");
+	if (upgrade == string::npos)
+		return false;
+	string::size_type end = header.find('\n', upgrade + 1);
+	return header.substr(upgrade, end == string::npos ? string::npos : end - upgrade).find("h2c") != string::npos;
+}
+
+h2_framer::h2_framer(): _mode(detect), _failed(false), _broken_started(false), _client(true), _server(false)
+{
+}
+
+bool h2_framer::failed() const
+{
+	return _failed || (_http && _http->failed());
+}
+
+h2_stream_info* h2_framer::find(u_int32_t id)
+{
+	map<u_int32_t, h2_stream_info>::iterator i = _streams.find(id);
+	return i == _streams.end() ? NULL : &i->second;
+}
+
+const h2_stream_info* h2_framer::info(u_int32_t id) const
+{
+	map<u_int32_t, h2_stream_info>::const_iterator i = _streams.find(id);
+	if (i != _streams.end())
+		return &i->second;
+	for (vector<pair<u_int32_t, h2_stream_info> >::const_iterator c = _closed.begin(); c != _closed.end(); c++)
+		if (c->first == id)
+			return &c->second;
+	return NULL;
+}
+
+void h2_framer::close(u_int32_t id)
+{
+	map<u_int32_t, h2_stream_info>::iterator i = _streams.find(id);
+	if (i == _streams.end())
+		return;
+	_closed.push_back(*i);
+	_streams.erase(i);
+}
+
+void h2_framer::begin(direction& d, message_segments& result)
+{
+	_closed.clear();
+	d.result = &result;
+	d.text.clear();
+	d.texts.clear();
+}
+
+// the decoded headers are appended to text while parsing, their segments
+// point to it once it does not grow anymore
+void h2_framer::finish(direction& d)
+{
+	for (vector<pair<unsigned, unsigned> >::const_iterator i = d.texts.begin(); i != d.texts.end(); i++)
+		(*d.result)[i->first].data = d.text.data() + i->second;
+}
+
+void h2_framer::emit(direction& d, u_int32_t id, const char* data, unsigned len, bool start, bool end, bool interim)
+{
+	// the streams already logged, the pushed ones and the ones not tracked are skipped
+	h2_stream_info* info = find(id);
+	if (info == NULL || info->pushed)
+		return;
+	// a reset request has no response
+	bool unanswered = d.request && end && info->reset >= 0;
+	message_segment s = {data, len, start, end, interim, unanswered, -1, id};
+	d.result->push_back(s);
+}
+
+void h2_framer::emit_text(direction& d, u_int32_t id, unsigned offset, bool start, bool end, bool interim)
+{
+	unsigned index = d.result->size();
+	emit(d, id, NULL, d.text.size() - offset, start, end, interim);
+	if (d.result->size() > index)
+		d.texts.push_back(make_pair(index, offset));
+}
+
+void h2_framer::fail(direction& d, const char* data, unsigned pos, unsigned len)
+{
+	_mode = broken;
+	if (pos >= len)
+		return;
+	bool start = d.request && !_broken_started;
+	if (d.request)
+		_broken_started = true;
+	message_segment s = {data + pos, len - pos, start, false, false, false, -1, 0};
+	d.result->push_back(s);
+}
+
+void h2_framer::requests(const char* data, unsigned len, message_segments& result)
+{
+	// the segments of the previous call may point to it
+	if (_mode != detect && !_first.empty())
+		string().swap(_first);
+	if (_http)
+	{
+		_http->requests(data, len, result);
+		return;
+	}
+	begin(_client, result);
+	unsigned pos = 0;
+	if (_mode == detect)
+	{
+		// the first bytes are kept until they tell the preface, an h2c
+		// upgrade request and HTTP/1 apart
+		_first.append(data, len);
+		data = _first.data();
+		len = _first.size();
+		if (memcmp(data, preface, min(len, preface_size)) == 0)
+		{
+			if (len < preface_size)
+				return;
+			_mode = frames;
+		}
+		else
+		{
+			const char* end = search(data, data + len, end_of_header, end_of_header + 4);
+			if (end == data + len && len < max_first && !not_request(data, len))
+				return;
+			if (end == data + len || !upgrade_h2c(data, end - data))
+			{
+				// HTTP/1
+				_mode = frames;
+				_http.reset(new http_framer());
+				_http->requests(data, len, result);
+				return;
+			}
+			// the upgrade request is the stream 1, its response comes in HTTP/2
+			_mode = upgrade;
+			pos = end + 4 - data;
+			_streams[1].request_headers = true;
+			emit(_client, 1, data, pos, true, true);
+		}
+	}
+	parse(_client, (const unsigned char*) data, pos, len);
+	finish(_client);
+}
+
+void h2_framer::responses(const char* data, unsigned len, message_segments& result)
+{
+	if (_http)
+	{
+		_http->responses(data, len, result);
+		return;
+	}
+	// the server does not speak first
+	if (_mode == detect)
+	{
+		_failed = true;
+		return;
+	}
+	begin(_server, result);
+	unsigned pos = 0;
+	if (_mode == upgrade)
+	{
+		// 101 Switching Protocols, up to the end of its header
+		while (pos < len && _server.preface < switching_size + 4)
+		{
+			char c = data[pos++];
+			if (_server.preface < switching_size)
+			{
+				if (c != switching[_server.preface])
+				{
+					_failed = true;
+					return;
+				}
+				_server.preface++;
+			}
+			else if (c == end_of_header[_server.preface - switching_size])
+				_server.preface++;
+			else
+				_server.preface = switching_size + (c == '\r' ? 1 : 0);
+		}
+		emit(_server, 1, data, pos, true, false, true);
+		if (_server.preface == switching_size + 4)
+			_mode = frames;
+	}
+	parse(_server, (const unsigned char*) data, pos, len);
+	finish(_server);
+}
+
+void h2_framer::parse(direction& d, const unsigned char* data, unsigned& pos, unsigned len)
+{
+	while (pos < len)
+	{
+		if (_mode == broken)
+		{
+			fail(d, (const char*) data, pos, len);
+			return;
+		}
+		if (d.request && d.preface < preface_size)
+		{
+			if (data[pos] != (unsigned char) preface[d.preface])
+				_mode = broken;
+			else
+			{
+				d.preface++;
+				pos++;
+			}
+			continue;
+		}
+		if (d.header_len < 9)
+		{
+			d.header[d.header_len++] = data[pos++];
+			if (d.header_len < 9)
+				continue;
+			d.length = (d.header[0] << 16) | (d.header[1] << 8) | d.header[2];
+			d.type = d.header[3];
+			d.flags = d.header[4];
+			d.id = be32(d.header + 5) & 0x7fffffff;
+			d.remaining = d.length;
+			d.pad = 0;
+			d.padded = d.type == data_frame && (d.flags & padded_flag);
+			d.payload.clear();
+			// the CONTINUATION frames follow their header block without interruption
+			if (d.continuation != (d.type == continuation_frame) || (d.type != data_frame && d.length > max_payload) || (d.padded && d.length == 0))
+			{
+				_mode = broken;
+				continue;
+			}
+		}
+		else if (d.type == data_frame)
+		{
+			if (d.padded)
+			{
+				d.pad = data[pos++];
+				d.padded = false;
+				d.remaining--;
+				if (d.pad > d.remaining)
+				{
+					_mode = broken;
+					continue;
+				}
+			}
+			else
+			{
+				// the payload goes to the handlers as it is, then the padding is skipped
+				unsigned content = d.remaining > d.pad ? d.remaining - d.pad : 0;
+				unsigned count = min(content ? content : d.remaining, len - pos);
+				if (content)
+					emit(d, d.id, (const char*) data + pos, count, false, false);
+				pos += count;
+				d.remaining -= count;
+			}
+		}
+		else
+		{
+			unsigned count = min(d.remaining, len - pos);
+			d.payload.append((const char*) data + pos, count);
+			pos += count;
+			d.remaining -= count;
+		}
+		if (d.remaining == 0 && !d.padded)
+		{
+			d.header_len = 0;
+			on_frame(d);
+		}
+	}
+}
+
+void h2_framer::on_frame(direction& d)
+{
+	const unsigned char* p = (const unsigned char*) d.payload.data();
+	unsigned len = d.payload.size();
+	switch (d.type)
+	{
+		case data_frame:
+			if (d.flags & end_stream_flag)
+			{
+				emit(d, d.id, "", 0, false, true);
+				if (!d.request)
+					close(d.id);
+			}
+			break;
+		case headers_frame:
+		case push_promise_frame:
+		{
+			unsigned skip = 0, pad = 0;
+			if (d.flags & padded_flag)
+			{
+				if (len < 1)
+				{
+					_mode = broken;
+					return;
+				}
+				pad = p[0];
+				skip = 1;
+			}
+			if (d.type == headers_frame && (d.flags & priority_flag))
+				skip += 5;
+			d.promised = 0;
+			if (d.type == push_promise_frame)
+			{
+				if (skip + 4 > len)
+				{
+					_mode = broken;
+					return;
+				}
+				d.promised = be32(p + skip) & 0x7fffffff;
+				skip += 4;
+			}
+			if (skip + pad > len)
+			{
+				_mode = broken;
+				return;
+			}
+			d.block.assign((const char*) p + skip, len - skip - pad);
+			d.block_id = d.id;
+			d.block_flags = d.flags;
+			if (d.flags & end_headers_flag)
+				on_headers(d);
+			else
+				d.continuation = true;
+			break;
+		}
+		case continuation_frame:
+			if (d.id != d.block_id || d.block.size() + len > max_block)
+			{
+				_mode = broken;
+				return;
+			}
+			d.block.append((const char*) p, len);
+			if (d.flags & end_headers_flag)
+			{
+				d.continuation = false;
+				on_headers(d);
+			}
+			break;
+		case rst_stream_frame:
+		{
+			h2_stream_info* info = find(d.id);
+			if (info != NULL && len >= 4)
+			{
+				info->reset = be32(p);
+				// the transaction is logged, a reset request as without response
+				emit(d, d.id, "", 0, false, true);
+				close(d.id);
+			}
+			break;
+		}
+		case settings_frame:
+			if (!(d.flags & ack_flag))
+				on_settings(d);
+			break;
+	}
+}
+
+// the table size that the peer can decode bounds the encoder of the other direction
+void h2_framer::on_settings(const direction& d)
+{
+	const unsigned char* p = (const unsigned char*) d.payload.data();
+	for (unsigned i = 0; i + 6 <= d.payload.size(); i += 6)
+		if (((p[i] << 8) | p[i + 1]) == settings_header_table_size)
+			(d.request ? _server : _client).decoder.set_limit(be32(p + i + 2));
+}
+
+void h2_framer::on_headers(direction& d)
+{
+	d.fields.clear();
+	bool valid = d.decoder.decode((const unsigned char*) d.block.data(), d.block.size(), d.fields);
+	d.block.clear();
+	if (!valid)
+	{
+		_mode = broken;
+		return;
+	}
+	// the pushed streams are not logged, their block is decoded for the table
+	if (d.promised)
+	{
+		if (_streams.size() < max_streams)
+			_streams[d.promised].pushed = true;
+		return;
+	}
+	u_int32_t id = d.block_id;
+	bool end = d.block_flags & end_stream_flag;
+	h2_stream_info* info = find(id);
+	if (info == NULL)
+	{
+		// a new stream is opened by the client only
+		if (!d.request || _streams.size() >= max_streams)
+			return;
+		info = &_streams[id];
+	}
+	string method, path, authority, status;
+	unsigned offset = d.text.size();
+	string regular;
+	for (hpack_decoder::fields::const_iterator f = d.fields.begin(); f != d.fields.end(); f++)
+	{
+		if (f->first == ":method")
+			method = f->second;
+		else if (f->first == ":path")
+			path = f->second;
+		else if (f->first == ":authority")
+			authority = f->second;
+		else if (f->first == ":status")
+			status = f->second;
+		else if (f->first[0] != ':')
+		{
+			regular.append(f->first).append(": ").append(f->second).append("\r\n");
+			if (!d.request && f->first == "grpc-status")
+				info->grpc_status = atoi(f->second.c_str());
+			else if (!d.request && f->first == "grpc-message")
+				info->grpc_message = percent_decode(f->second);
+		}
+	}
+	if (d.request)
+	{
+		if (info->request_headers)
+		{
+			// trailers
+			emit(d, id, "", 0, false, end);
+			return;
+		}
+		info->request_headers = true;
+		d.text.append(method).append(" ").append(path).append(" HTTP/2\r\n");
+		if (!authority.empty())
+			d.text.append("host: ").append(authority).append("\r\n");
+		d.text.append(regular).append("\r\n");
+		emit_text(d, id, offset, true, end, false);
+		return;
+	}
+	if (info->response_headers)
+		emit(d, id, "", 0, false, end);
+	else
+	{
+		d.text.append("HTTP/2 ").append(status).append("\r\n").append(regular).append("\r\n");
+		int code = atoi(status.c_str());
+		bool interim = code >= 100 && code < 200;
+		info->response_headers = !interim;
+		emit_text(d, id, offset, true, end && !interim, interim);
+	}
+	if (end)
+		close(id);
+}
+
+///// h2_handler /////
+
+static const char* error_name(int64_t code)
+{
+	static const char* names[] =
+	{
+		"NO_ERROR", "PROTOCOL_ERROR", "INTERNAL_ERROR", "FLOW_CONTROL_ERROR", "SETTINGS_TIMEOUT", "STREAM_CLOSED",
+		"FRAME_SIZE_ERROR", "REFUSED_STREAM", "CANCEL", "COMPRESSION_ERROR", "CONNECT_ERROR", "ENHANCE_YOUR_CALM",
+		"INADEQUATE_SECURITY", "HTTP_1_1_REQUIRED"
+	};
+	return code >= 0 && code < int64_t(sizeof(names) / sizeof(names[0])) ? names[code] : NULL;
+}
+
+h2_handler::h2_handler(const string& not_found, field_enum field): _not_found(not_found), _field(field), _id(0)
+{
+}
+
+void h2_handler::update(tcp_stream* pstream)
+{
+	stream* s = static_cast<stream*>(pstream);
+	if (s->segment == NULL || s->segment->id == 0)
+		return;
+	_id = s->segment->id;
+	// the trailers and the resets come with the end of a message
+	if (!s->segment->end)
+		return;
+	const h2_framer* framer = dynamic_cast<const h2_framer*>(s->framer().get());
+	const h2_stream_info* info = framer ? framer->info(_id) : NULL;
+	if (info != NULL)
+		_info = *info;
+}
+
+void h2_handler::onRequest(tcp_stream* pstream, const timeval* t)
+{
+	update(pstream);
+}
+
+void h2_handler::onResponse(tcp_stream* pstream, const timeval* t)
+{
+	update(pstream);
+}
+
+void h2_handler::append(std::basic_ostream<char>& out, const timeval* t)
+{
+	switch (_field)
+	{
+		case stream_id:
+			if (_id)
+				out << _id;
+			else
+				out << _not_found;
+			break;
+		case reset:
+			if (_info.reset < 0)
+				out << _not_found;
+			else if (error_name(_info.reset))
+				out << error_name(_info.reset);
+			else
+				out << _info.reset;
+			break;
+		case grpc_status:
+			if (_info.grpc_status >= 0)
+				out << _info.grpc_status;
+			else
+				out << _not_found;
+			break;
+		case grpc_message:
+			if (_info.grpc_message.empty())
+				out << _not_found;
+			else
+				out << _info.grpc_message;
+			break;
+	}
+}
@@ -0,0 +1,146 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_h2_h
+#define _sniffer_h2_h
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include "formatter.h"
+#include "http.h"
+
+// HPACK (RFC 7541) decoder of the header blocks of one direction. The
+// dynamic table never grows past the size advertised by the decoding peer
+// (SETTINGS_HEADER_TABLE_SIZE, 4096 by default)
+class hpack_decoder
+{
+public:
+	typedef std::pair<std::string, std::string> field;
+	typedef std::vector<field> fields;
+	hpack_decoder();
+	void set_limit(unsigned limit);
+	// false if the block is not valid, the table is not usable anymore
+	bool decode(const unsigned char* data, unsigned len, fields& result);
+private:
+	bool lookup(u_int64_t index, field& result) const;
+	void insert(const field& f);
+	void evict();
+	// newest first
+	std::deque<field> _table;
+	unsigned _size, _max_size, _limit;
+};
+
+// what the %h2 and %grpc keywords print of an HTTP/2 stream
+struct h2_stream_info
+{
+	h2_stream_info(): request_headers(false), response_headers(false), pushed(false), grpc_status(-1), reset(-1){}
+	bool request_headers, response_headers, pushed;
+	int grpc_status;
+	std::string grpc_message;
+	// the RST_STREAM error code, -1 if not reset
+	int64_t reset;
+};
+
+// HTTP/2 without TLS, with prior knowledge or upgraded from HTTP/1.1 (h2c):
+// every stream is a transaction (segments with its stream id). The header
+// blocks are decoded and handed to the handlers as an HTTP/1 header (e.g.
+// "POST /pkg.Service/Method HTTP/2", "HTTP/2 200"), followed by the DATA
+// payloads, so that the request and response keywords apply. Connections
+// that are plain HTTP/1 are framed by an http_framer
+class h2_framer : public message_framer
+{
+public:
+	h2_framer();
+	virtual void requests(const char* data, unsigned len, message_segments& result);
+	virtual void responses(const char* data, unsigned len, message_segments& result);
+	virtual bool failed() const;
+	// the stream of a segment just returned, NULL if not known
+	const h2_stream_info* info(u_int32_t id) const;
+	// the streams open at the same time that are tracked, the others are not logged
+	static const unsigned max_streams = 1024;
+private:
+	enum mode_enum {detect, upgrade, frames, broken};
+	struct direction
+	{
+		direction(bool request): request(request), preface(0), header_len(0), remaining(0), pad(0), padded(false), continuation(false), block_id(0), block_flags(0), promised(0), result(NULL){}
+		bool request;
+		// client: the bytes of the preface matched; server: the state of the 101 response
+		unsigned preface;
+		unsigned char header[9];
+		unsigned header_len;
+		unsigned type, flags;
+		u_int32_t id, length, remaining;
+		// DATA: the padding at the end, the pad length is still to read
+		unsigned pad;
+		bool padded;
+		// the payload of the frames other than DATA
+		std::string payload;
+		// the header block being collected from HEADERS, PUSH_PROMISE and CONTINUATION
+		std::string block;
+		bool continuation;
+		u_int32_t block_id;
+		unsigned block_flags;
+		u_int32_t promised;
+		hpack_decoder decoder;
+		hpack_decoder::fields fields;
+		// the decoded headers of the segments, in HTTP/1 form (see texts)
+		std::string text;
+		// the segments pointing to text: segment index and offset
+		std::vector<std::pair<unsigned, unsigned> > texts;
+		message_segments* result;
+	};
+	void parse(direction& d, const unsigned char* data, unsigned& pos, unsigned len);
+	void on_frame(direction& d);
+	void on_headers(direction& d);
+	void on_settings(const direction& d);
+	void emit(direction& d, u_int32_t id, const char* data, unsigned len, bool start, bool end, bool interim = false);
+	void emit_text(direction& d, u_int32_t id, unsigned offset, bool start, bool end, bool interim);
+	void begin(direction& d, message_segments& result);
+	void finish(direction& d);
+	// the rest of the connection is a single transaction
+	void fail(direction& d, const char* data, unsigned pos, unsigned len);
+	void close(u_int32_t id);
+	h2_stream_info* find(u_int32_t id);
+	mode_enum _mode;
+	bool _failed, _broken_started;
+	direction _client, _server;
+	std::map<u_int32_t, h2_stream_info> _streams;
+	// the streams closed by the last call, until the next one
+	std::vector<std::pair<u_int32_t, h2_stream_info> > _closed;
+	// the first bytes of the client, while the protocol is not known
+	std::string _first;
+	// plain HTTP/1 connections
+	boost::shared_ptr<http_framer> _http;
+};
+
+class h2_handler : public basic_handler
+{
+public:
+	enum field_enum {stream_id, reset, grpc_status, grpc_message};
+	h2_handler(const std::string& not_found, field_enum field);
+	virtual void onRequest(tcp_stream* pstream, const timeval* t);
+	virtual void onResponse(tcp_stream* pstream, const timeval* t);
+	virtual void append(std::basic_ostream<char>& out, const timeval* t);
+private:
+	void update(tcp_stream* pstream);
+	std::string _not_found;
+	field_enum _field;
+	u_int32_t _id;
+	h2_stream_info _info;
+};
+
+template <int field> class h2_field_handler : public h2_handler
+{
+public:
+	h2_field_handler(const std::string& not_found): h2_handler(not_found, field_enum(field)){}
+};
+
+#endif// _sniffer_h2_h
@@ -0,0 +1,414 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "http.h"
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <strings.h>
+
+using namespace std;
+
+///// http_message_framer /////
+
+http_message_framer::http_message_framer(bool request, std::deque<http_request_info>* pending):
+	_request(request), _state(start_line), _pending(pending), _body(NULL), _content_encoding(identity), _remaining(0), _content_length(-1),
+	_chunked(false), _interim(false), _failed(false), _overflowed(false), _in_message(false), _messages(0), _status(0)
+{
+	_current.head = false;
+	_current.connect = false;
+}
+
+void http_message_framer::feed(const char* data, unsigned len, http_segments& result)
+{
+	unsigned pos = 0, begin = 0;
+	bool start = !_in_message;
+	while (pos < len)
+	{
+		bool end = false;
+		switch (_state)
+		{
+			case body_length:
+			case chunk_data:
+			{
+				u_int64_t n = len - pos;
+				if (n > _remaining)
+					n = _remaining;
+				if (_body)
+					_body->on_body(data + pos, n);
+				pos += n;
+				_remaining -= n;
+				if (_remaining == 0)
+				{
+					if (_state == chunk_data)
+						_state = chunk_data_end;
+					else
+					{
+						_state = start_line;
+						end = true;
+					}
+				}
+				break;
+			}
+			case body_until_close:
+				if (_body)
+					_body->on_body(data + pos, len - pos);
+				pos = len;
+				break;
+			case tunnel:
+				pos = len;
+				break;
+			default:
+			{
+				const char* nl = (const char*) memchr(data + pos, '\n', len - pos);
+				unsigned stop = nl ? nl - data : len;
+				if (_line.size() < max_line)
+					_line.append(data + pos, min(stop - pos, unsigned(max_line - _line.size())));
+				pos = nl ? stop + 1 : len;
+				if (nl)
+				{
+					if (!_line.empty() && _line[_line.size() - 1] == '\r')
+						_line.erase(_line.size() - 1);
+					end = !on_line();
+					_line.clear();
+				}
+			}
+		}
+		_in_message = true;
+		if (end)
+		{
+			http_segment segment = {data + begin, pos - begin, start, true, _interim, false, -1, 0};
+			result.push_back(segment);
+			begin = pos;
+			start = true;
+			_in_message = false;
+			// the next message may start in the data to come: its start
+			// line has not told yet if it is interim
+			_interim = false;
+		}
+	}
+	if (pos > begin)
+	{
+		http_segment segment = {data + begin, pos - begin, start, false, _interim, false, -1, 0};
+		result.push_back(segment);
+	}
+}
+
+bool http_message_framer::on_line()
+{
+	switch (_state)
+	{
+		case start_line:
+			// the empty lines between messages are tolerated
+			if (!_line.empty())
+				on_start_line();
+			return true;
+		case headers:
+			if (_line.empty())
+				return !on_headers_end();
+			on_header();
+			return true;
+		case chunk_size:
+			_remaining = strtoull(_line.c_str(), NULL, 16);
+			_state = _remaining ? chunk_data : trailers;
+			return true;
+		case chunk_data_end:
+			_state = chunk_size;
+			return true;
+		case trailers:
+			if (!_line.empty())
+				return true;
+			_state = start_line;
+			return false;
+		default:
+			return true;
+	}
+}
+
+static bool is_method(const string& line, string::size_type end)
+{
+	if (end == 0 || end == string::npos)
+		return false;
+	for (string::size_type i = 0; i < end; i++)
+		if (!isupper(line[i]) && line[i] != '-')
+			return false;
+	return true;
+}
+
+void http_message_framer::on_start_line()
+{
+	_content_length = -1;
+	_chunked = false;
+	_interim = false;
+	_content_encoding = identity;
+	string::size_type space = _line.find(' ');
+	bool valid;
+	if (_request)
+		valid = is_method(_line, space) && _line.find(" HTTP/1.", space) != string::npos;
+	else
+		valid = _line.compare(0, 7, "HTTP/1.") == 0 && space != string::npos;
+	if (!valid)
+	{
+		// not HTTP (anymore): the rest of the connection is opaque
+		_failed = _messages == 0;
+		_state = tunnel;
+		return;
+	}
+	_messages++;
+	_state = headers;
+	if (_request)
+	{
+		http_request_info info;
+		info.head = _line.compare(0, 5, "HEAD ") == 0;
+		info.connect = _line.compare(0, 8, "CONNECT ") == 0;
+		if (_pending->size() < message_framer::max_pipeline)
+			_pending->push_back(info);
+		else
+			_overflowed = true;
+	}
+	else
+	{
+		_status = atoi(_line.c_str() + space + 1);
+		if (_pending->empty())
+		{
+			_current.head = false;
+			_current.connect = false;
+		}
+		else
+			_current = _pending->front();
+	}
+}
+
+void http_message_framer::on_header()
+{
+	string::size_type colon = _line.find(':');
+	if (colon == string::npos)
+		return;
+	string::size_type value = _line.find_first_not_of(" \t", colon + 1);
+	if (value == string::npos)
+		return;
+	if (colon == 14 && strncasecmp(_line.c_str(), "Content-Length", 14) == 0)
+		_content_length = strtoll(_line.c_str() + value, NULL, 10);
+	else if (colon == 17 && strncasecmp(_line.c_str(), "Transfer-Encoding", 17) == 0)
+	{
+		// chunked has to be the last coding
+		string::size_type last = _line.find_last_not_of(" \t");
+		_chunked = last + 1 >= value + 7 && strncasecmp(_line.c_str() + last - 6, "chunked", 7) == 0;
+	}
+	else if (colon == 16 && strncasecmp(_line.c_str(), "Content-Encoding", 16) == 0)
+	{
+		const char* encoding = _line.c_str() + value;
+		if (strncasecmp(encoding, "gzip", 4) == 0 || strncasecmp(encoding, "x-gzip", 6) == 0)
+			_content_encoding = gzip;
+		else if (strncasecmp(encoding, "deflate", 7) == 0)
+			_content_encoding = deflate;
+		else if (strncasecmp(encoding, "identity", 8) != 0)
+			_content_encoding = other;
+	}
+}
+
+bool http_message_framer::on_headers_end()
+{
+	if (_request)
+	{
+		if (_chunked)
+			_state = chunk_size;
+		else if (_content_length > 0)
+		{
+			_state = body_length;
+			_remaining = _content_length;
+		}
+		else
+		{
+			_state = start_line;
+			return true;
+		}
+		return false;
+	}
+	if (_status / 100 == 1 && _status != 101)
+	{
+		// 100 continue and the like: the final response follows
+		_interim = true;
+		_state = start_line;
+		return true;
+	}
+	if (_status == 101 || (_current.connect && _status / 100 == 2))
+	{
+		_state = tunnel;
+		return false;
+	}
+	if (!_pending->empty())
+		_pending->pop_front();
+	if (_current.head || _status == 204 || _status == 304)
+	{
+		_state = start_line;
+		return true;
+	}
+	if (_chunked)
+		_state = chunk_size;
+	else if (_content_length > 0)
+	{
+		_state = body_length;
+		_remaining = _content_length;
+	}
+	else if (_content_length == 0)
+	{
+		_state = start_line;
+		return true;
+	}
+	else
+		_state = body_until_close;
+	return false;
+}
+
+///// http_framer /////
+
+void http_framer::requests(const char* data, unsigned len, http_segments& result)
+{
+	_requests.feed(data, len, result);
+}
+
+void http_framer::responses(const char* data, unsigned len, http_segments& result)
+{
+	_responses.feed(data, len, result);
+	// switching protocols or CONNECT: the requests are not HTTP anymore
+	if (_responses.is_tunnel())
+		_requests.set_tunnel();
+}
+
+///// http_body_decoder /////
+
+http_body_decoder::http_body_decoder(bool request, http_body_sink* sink):
+	_framer(request, &_pending), _sink(sink), _inflating(false), _inflated(false), _raw(false), _done(false), _complete(false)
+{
+	_framer.set_body_listener(this);
+}
+
+http_body_decoder::~http_body_decoder()
+{
+	if (_inflating)
+		inflateEnd(&_zstream);
+}
+
+void http_body_decoder::feed(const char* data, unsigned len, const message_segment* segment)
+{
+	if (_done)
+		return;
+	_segments.clear();
+	_framer.feed(data, len, _segments);
+	if (_framer.failed() || _framer.overflowed() || _framer.is_tunnel())
+		stop();
+	for (http_segments::const_iterator i = _segments.begin(); i != _segments.end(); i++)
+		if (i->end && !i->interim)
+		{
+			if (!_done)
+				_complete = true;
+			stop();
+		}
+	if (segment != NULL && segment->end)
+	{
+		if (!_done)
+			_complete = true;
+		stop();
+	}
+}
+
+void http_body_decoder::on_close()
+{
+	if (!_done && _framer.until_close())
+	{
+		_complete = true;
+		stop();
+	}
+}
+
+void http_body_decoder::stop()
+{
+	if (_done)
+		return;
+	_done = true;
+	_sink->on_end();
+	if (_inflating)
+	{
+		inflateEnd(&_zstream);
+		_inflating = false;
+	}
+}
+
+void http_body_decoder::on_body(const char* data, unsigned len)
+{
+	if (_done || len == 0)
+		return;
+	switch (_framer.content_encoding())
+	{
+		case http_message_framer::identity:
+			if (!_sink->on_decoded(data, len))
+				stop();
+			break;
+		case http_message_framer::gzip:
+		case http_message_framer::deflate:
+			inflate_body(data, len);
+			break;
+		default:
+			stop();
+	}
+}
+
+void http_body_decoder::inflate_body(const char* data, unsigned len)
+{
+	if (!_inflating)
+	{
+		memset(&_zstream, 0, sizeof(_zstream));
+		// 32: gzip or zlib header, detected; -15: raw deflate
+		if (inflateInit2(&_zstream, _raw ? -15 : 15 + 32) != Z_OK)
+		{
+			stop();
+			return;
+		}
+		_inflating = true;
+	}
+	char out[16384];
+	_zstream.next_in = (Bytef*) data;
+	_zstream.avail_in = len;
+	while (!_done)
+	{
+		_zstream.next_out = (Bytef*) out;
+		_zstream.avail_out = sizeof(out);
+		int result = inflate(&_zstream, Z_NO_FLUSH);
+		unsigned produced = sizeof(out) - _zstream.avail_out;
+		if (produced)
+		{
+			_inflated = true;
+			if (!_sink->on_decoded(out, produced))
+			{
+				stop();
+				return;
+			}
+		}
+		if (result == Z_DATA_ERROR && !_inflated && !_raw)
+		{
+			// "deflate" sent without the zlib header, as some servers do
+			inflateEnd(&_zstream);
+			_inflating = false;
+			_raw = true;
+			inflate_body(data, len);
+			return;
+		}
+		if (result == Z_STREAM_END || (result != Z_OK && result != Z_BUF_ERROR))
+		{
+			// the whole compressed stream, the rest of the body is ignored
+			_complete = result == Z_STREAM_END;
+			stop();
+			return;
+		}
+		if (_zstream.avail_in == 0 && _zstream.avail_out != 0)
+			return;
+	}
+}
@@ -0,0 +1,140 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_http_h
+#define _sniffer_http_h
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/types.h>
+#include <zlib.h>
+#include "framer.h"
+
+typedef message_segment http_segment;
+typedef message_segments http_segments;
+
+// the request a response answers
+struct http_request_info
+{
+	bool head, connect;
+};
+
+// receives the body of the messages, without the chunked encoding
+class http_body_listener
+{
+public:
+	virtual ~http_body_listener(){}
+	virtual void on_body(const char* data, unsigned len) = 0;
+};
+
+// incremental HTTP/1.x framing of one direction: start line, headers, and a
+// body delimited by Content-Length, chunked transfer encoding or the
+// connection close. The state is constant, apart from a line buffer bounded
+// to max_line bytes
+class http_message_framer
+{
+public:
+	enum state_enum {start_line, headers, body_length, chunk_size, chunk_data, chunk_data_end, trailers, body_until_close, tunnel};
+	// the request framer pushes to pending, the response framer pops it
+	http_message_framer(bool request, std::deque<http_request_info>* pending);
+	// splits data in segments, at message boundaries
+	void feed(const char* data, unsigned len, http_segments& result);
+	// everything from now on is a single message, till the connection close
+	void set_tunnel(){_state = tunnel;}
+	bool is_tunnel() const {return _state == tunnel;}
+	// the body ends with the connection close
+	bool until_close() const {return _state == body_until_close;}
+	// the first start line did not look like HTTP
+	bool failed() const {return _failed;}
+	// more than max_pipeline requests were waiting for a response
+	bool overflowed() const {return _overflowed;}
+	void set_body_listener(http_body_listener* listener){_body = listener;}
+	enum encoding_enum {identity, gzip, deflate, other};
+	// the Content-Encoding of the current message
+	encoding_enum content_encoding() const {return _content_encoding;}
+	// of the last response seen
+	int status() const {return _status;}
+	static const unsigned max_line = 8192;
+private:
+	// consumes a line (without the line terminator), false when it ends the message
+	bool on_line();
+	void on_start_line();
+	void on_header();
+	bool on_headers_end();
+	bool _request;
+	state_enum _state;
+	std::deque<http_request_info>* _pending;
+	http_body_listener* _body;
+	http_request_info _current;
+	encoding_enum _content_encoding;
+	std::string _line;
+	u_int64_t _remaining;
+	int64_t _content_length;
+	bool _chunked, _interim, _failed, _overflowed, _in_message;
+	unsigned _messages;
+	int _status;
+};
+
+// the two directions of a connection and the requests waiting for a response
+class http_framer : public message_framer
+{
+public:
+	http_framer(): _requests(true, &_pending), _responses(false, &_pending){}
+	virtual void requests(const char* data, unsigned len, http_segments& result);
+	virtual void responses(const char* data, unsigned len, http_segments& result);
+	// the first message was not HTTP
+	virtual bool failed() const {return _requests.failed() || _responses.failed() || _requests.overflowed();}
+private:
+	std::deque<http_request_info> _pending;
+	http_message_framer _requests, _responses;
+};
+
+// wants the decoded body, returns false when it has seen enough
+class http_body_sink
+{
+public:
+	virtual ~http_body_sink(){}
+	virtual bool on_decoded(const char* data, unsigned len) = 0;
+	// the decoding has stopped, nothing more comes
+	virtual void on_end(){}
+};
+
+// the body of the first message of one direction, dechunked and inflated
+// (gzip or deflate Content-Encoding) while it arrives: only the zlib window
+// is kept. The decoding stops at the end of the body, on an unknown encoding
+// or a corrupted stream, or as soon as the sink asks for it. With the
+// segments of the stream framer the message ends where they tell: the
+// framer of the decoder sees only one direction, and a response to HEAD, or
+// a 204 or 304 one, would otherwise wait for the body of its headers
+class http_body_decoder : private http_body_listener
+{
+public:
+	http_body_decoder(bool request, http_body_sink* sink);
+	~http_body_decoder();
+	// segment: the one of the data, if the stream is framed
+	void feed(const char* data, unsigned len, const message_segment* segment = NULL);
+	// the connection has been closed by a FIN
+	void on_close();
+	bool done() const {return _done;}
+	// the whole body has been seen, as delimited by the message
+	bool complete() const {return _complete;}
+private:
+	virtual void on_body(const char* data, unsigned len);
+	void inflate_body(const char* data, unsigned len);
+	void stop();
+	std::deque<http_request_info> _pending;
+	http_message_framer _framer;
+	http_segments _segments;
+	http_body_sink* _sink;
+	z_stream _zstream;
+	bool _inflating, _inflated, _raw, _done, _complete;
+};
+
+#endif// _sniffer_http_h
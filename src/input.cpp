@@ -0,0 +1,185 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "utilities.h"
+#include "input.h"
+
+using namespace std;
+
+static const size_t read_ahead_buffer = 1024 * 1024;
+// seconds between the scans of a watched directory
+static const unsigned scan_interval = 1;
+
+static bool has_wildcards(const string& name)
+{
+	return name.find_first_of("*?[") != string::npos;
+}
+
+volatile sig_atomic_t capture_files::_stopping = 0;
+
+capture_files::capture_files(const vector<string>& files)
+{
+	for (vector<string>::const_iterator i = files.begin(); i != files.end(); i++)
+	{
+		struct stat st;
+		// a name that exists is not a pattern
+		if (!has_wildcards(*i) || stat(i->c_str(), &st) == 0)
+		{
+			_files.push_back(*i);
+			continue;
+		}
+		glob_t found;
+		int result = glob(i->c_str(), 0, NULL, &found);
+		if (result == 0)
+			_files.insert(_files.end(), found.gl_pathv, found.gl_pathv + found.gl_pathc);
+		globfree(&found);
+		check(result == 0, common_exception(string("no capture file matches ").append(*i)));
+	}
+	start();
+}
+
+capture_files::capture_files(const string& directory, const string& pattern): _directory(directory), _pattern(pattern)
+{
+	DIR* dir = opendir(_directory.c_str());
+	check(dir != NULL, common_exception(string("cannot read the directory ").append(_directory).append(": ").append(strerror(errno))));
+	closedir(dir);
+	start();
+}
+
+void capture_files::start()
+{
+	_thread_started = false;
+	_thread_stopping = false;
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_cond_init(&_cond, NULL);
+	// without the thread the files are only read later
+	_thread_started = pthread_create(&_thread, NULL, run, this) == 0;
+}
+
+capture_files::~capture_files()
+{
+	if (_thread_started)
+	{
+		pthread_mutex_lock(&_mutex);
+		_thread_stopping = true;
+		pthread_cond_signal(&_cond);
+		pthread_mutex_unlock(&_mutex);
+		pthread_join(_thread, NULL);
+	}
+	pthread_cond_destroy(&_cond);
+	pthread_mutex_destroy(&_mutex);
+}
+
+bool capture_files::next(string& file)
+{
+	while (_files.empty())
+	{
+		if (_stopping || _directory.empty())
+			return false;
+		scan();
+		if (_files.empty())
+			sleep(scan_interval);
+	}
+	if (_stopping)
+		return false;
+	file = _files.front();
+	_files.pop_front();
+	if (!_directory.empty() && _files.empty())
+		scan();
+	if (!_files.empty())
+		prefetch(_files.front());
+	return true;
+}
+
+void capture_files::scan()
+{
+	DIR* dir = opendir(_directory.c_str());
+	if (dir == NULL)
+		return;
+	vector<string> names;
+	while (struct dirent* entry = readdir(dir))
+	{
+		string name(entry->d_name);
+		if (name[0] == '.' || fnmatch(_pattern.c_str(), name.c_str(), 0) != 0 || name <= _last)
+			continue;
+		struct stat st;
+		if (stat(string(_directory).append("/").append(name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+			names.push_back(name);
+	}
+	closedir(dir);
+	if (names.size() < 2)
+		return;
+	sort(names.begin(), names.end());
+	// the last one is still being written
+	names.pop_back();
+	for (vector<string>::const_iterator i = names.begin(); i != names.end(); i++)
+		_files.push_back(string(_directory).append("/").append(*i));
+	_last = names.back();
+}
+
+void capture_files::prefetch(const string& file)
+{
+	if (!_thread_started)
+		return;
+	pthread_mutex_lock(&_mutex);
+	_ahead = file;
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+// the file is read and dropped: the reads of libpcap find it in the page cache
+void* capture_files::run(void* arg)
+{
+	capture_files* self = static_cast<capture_files*>(arg);
+	vector<char> buffer(read_ahead_buffer);
+	pthread_mutex_lock(&self->_mutex);
+	for (;;)
+	{
+		while (self->_ahead.empty() && !self->_thread_stopping)
+			pthread_cond_wait(&self->_cond, &self->_mutex);
+		if (self->_thread_stopping)
+			break;
+		string file = self->_ahead;
+		self->_ahead.clear();
+		pthread_mutex_unlock(&self->_mutex);
+		int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			for (;;)
+			{
+				ssize_t n = read(fd, &buffer[0], buffer.size());
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					break;
+				// given up when stopping or when another file is asked
+				pthread_mutex_lock(&self->_mutex);
+				bool give_up = self->_thread_stopping || !self->_ahead.empty();
+				pthread_mutex_unlock(&self->_mutex);
+				if (give_up)
+					break;
+			}
+			close(fd);
+		}
+		pthread_mutex_lock(&self->_mutex);
+	}
+	pthread_mutex_unlock(&self->_mutex);
+	return NULL;
+}
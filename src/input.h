@@ -0,0 +1,57 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_input_h
+#define _sniffer_input_h
+#include <string>
+#include <vector>
+#include <deque>
+#include <csignal>
+#include <pthread.h>
+
+// the capture files read one after the other by the same libnids context,
+// so that the connections go on across them (e.g. the files rotated by
+// tcpdump -G). Either a list, where the names with * ? or [ are expanded in
+// name order, or a directory watched for new files: the files matching the
+// pattern are read in name order, each one once a later one appears (the
+// last one is still being written). The file after the one being read is
+// read ahead on a background thread, so that it is in the page cache when
+// its turn comes
+class capture_files
+{
+public:
+	// throws common_exception if a name matches no file
+	capture_files(const std::vector<std::string>& files);
+	// the directory is scanned every second; throws common_exception if it cannot be read
+	capture_files(const std::string& directory, const std::string& pattern);
+	~capture_files();
+	// the next file to read, false when there are no more or after stop();
+	// for a watched directory it waits for the file
+	bool next(std::string& file);
+	// next() returns false from now on, from a signal handler too
+	static void stop(){_stopping = 1;}
+private:
+	void start();
+	// the files of the watched directory ready to be read, after the last one
+	void scan();
+	void prefetch(const std::string& file);
+	static void* run(void* arg);
+	std::deque<std::string> _files;
+	std::string _directory, _pattern, _last;
+	static volatile sig_atomic_t _stopping;
+	// the file to read ahead, for the background thread
+	pthread_t _thread;
+	bool _thread_started, _thread_stopping;
+	pthread_mutex_t _mutex;
+	pthread_cond_t _cond;
+	std::string _ahead;
+};
+
+#endif// _sniffer_input_h
@@ -28,18 +28,21 @@ class BaseImpl(BaseHandler):
             prot = "".join(["\\"+hex(ord(p)) for p in part])
         return prot
     
-    def __update_string_value(self, name, value):
-        values = self.req_resp
+    def __update_string_value(self, name, payload):
+        # one copy per callback, joined once in append
+        self.__chunks.setdefault(name, []).append(payload.copy())
         
-        if not values.has_key(name):
-            values[name]=value
-        else:
-            values[name]+=value
+    def __join_chunks(self):
+        values = self.req_resp
+        for name, chunks in self.__chunks.items():
+            values[name] = values.get(name, "") + "".join(chunks)
+        self.__chunks.clear()
         
     def __init__(self):
         BaseHandler.__init__(self)
         self.values = dict_object()
         self.req_resp = dict_object()
+        self.__chunks = {}
         self.__onRequest_start_time=None
         self.__onRespone_start_time=None
 
@@ -74,14 +77,14 @@ class BaseImpl(BaseHandler):
         if (not values.has_key("request_start_time")):
             values["request_start_time"] = time
         values["request_end_time"] = time
-        self.__update_string_value("request", stream.client_data)
+        self.__update_string_value("request", stream.client_payload)
         
     def onResponse(self, stream, time):
         values = self.values
         if (not values.has_key("response_start_time")):
             values["response_start_time"] = time
         values["response_end_time"] = time
-        self.__update_string_value("response", stream.server_data)
+        self.__update_string_value("response", stream.server_payload)
 
     def __get_val(self, name, time):        
         if self.values.has_key(name):
@@ -162,6 +165,7 @@ class BaseImpl(BaseHandler):
     )
 
     def append(self, outstream, time):
+        self.__join_chunks()
         values = self.values
         for attribute_name, func in self.attributes.items():
             attribute = func(self, attribute_name, time)
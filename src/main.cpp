@@ -25,6 +25,19 @@
 #include <nids2.h>
 #include "formatter.h"
 #include "utilities.h"
+#include "aggregate.h"
+#include "topk.h"
+#include "metrics.h"
+#include "extract.h"
+#include "rotate.h"
+#include "capture.h"
+#include "checkpoint.h"
+#include "input.h"
+#include "sampling.h"
+#include "profile.h"
+#include "regex.h"
+#include "dns.h"
+#include "db.h"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -90,6 +103,48 @@ const char* default_not_found = "-";
 const char* force_read_pcap = "force-read-pcap";
 const char* max_line_cmd = "max-log-number";
 const char* python_cmd = "python";
+const char* python_batch_cmd = "python-batch";
+const char* python_queue_cmd = "python-queue";
+const char* python_queue_bytes_cmd = "python-queue-bytes";
+const char* python_overflow_cmd = "python-overflow";
+const char* aggregate_cmd = "aggregate";
+const char* aggregate_interval_cmd = "aggregate-interval";
+const char* aggregate_max_keys_cmd = "aggregate-max-keys";
+const char* top_k_cmd = "top-k";
+const char* top_k_key_cmd = "top-k-key";
+const char* top_k_weight_cmd = "top-k-weight";
+const char* top_k_capacity_cmd = "top-k-capacity";
+const char* top_k_interval_cmd = "top-k-interval";
+const char* metrics_port_cmd = "metrics-port";
+const char* metrics_address_cmd = "metrics-address";
+const char* metrics_key_cmd = "metrics-key";
+const char* sample_cmd = "sample";
+const char* sample_adaptive_cmd = "sample-adaptive";
+const char* sample_cpu_budget_cmd = "sample-cpu-budget";
+const char* profile_cmd = "profile";
+const char* profile_sample_cmd = "profile-sample";
+const char* http_framing_cmd = "http-framing";
+const char* body_window_cmd = "body-window";
+const char* max_capture_cmd = "max-capture-bytes";
+const char* extract_dir_cmd = "extract-dir";
+const char* output_file_cmd = "output-file";
+const char* rotate_size_cmd = "rotate-size";
+const char* rotate_interval_cmd = "rotate-interval";
+const char* rotate_compress_cmd = "rotate-compress";
+const char* flow_capture_when_cmd = "flow-capture-when";
+const char* flow_capture_dir_cmd = "flow-capture-dir";
+const char* flow_capture_packets_cmd = "flow-capture-packets";
+const char* flow_capture_memory_cmd = "flow-capture-memory";
+const char* checkpoint_cmd = "checkpoint";
+const char* checkpoint_journal_cmd = "checkpoint-journal";
+const char* watch_dir_cmd = "watch-dir";
+const char* watch_pattern_cmd = "watch-pattern";
+const char* dns_cmd = "dns";
+const char* dns_port_cmd = "dns-port";
+const char* dns_timeout_cmd = "dns-timeout";
+const char* dns_max_pending_cmd = "dns-max-pending";
+const char* framing_cmd = "framing";
+const char* db_statement_length_cmd = "db-statement-length";
 
 typedef vector<string>::const_iterator args_type;
 bool check_conflicts( const po::variables_map &vm, const vector<string>& arguments)
@@ -123,6 +178,28 @@ bool check_conflicts( const po::variables_map &vm, const vector<string>& argumen
 
 static int max_concurrent_tcp_stream_v;
 static int max_fragmented_ip_hosts_v;
+static int aggregate_interval_v;
+static unsigned aggregate_max_keys_v;
+static unsigned top_k_v;
+static unsigned top_k_capacity_v;
+static int top_k_interval_v;
+static int metrics_port_v;
+static unsigned sample_v;
+static double sample_cpu_budget_v;
+static unsigned profile_sample_v;
+static unsigned body_window_v;
+static u_int64_t max_capture_v;
+static u_int64_t rotate_size_v;
+static unsigned rotate_interval_v;
+static unsigned flow_capture_packets_v;
+static u_int64_t flow_capture_memory_v;
+static unsigned checkpoint_journal_v;
+static unsigned dns_port_v;
+static unsigned dns_timeout_v;
+static unsigned dns_max_pending_v;
+static unsigned db_statement_length_v;
+static unsigned python_queue_v;
+static unsigned python_queue_bytes_v;
 
 static map<string, const char*> _new_line_map;
 
@@ -138,12 +215,151 @@ void sig_int_handler (int param)
   exit(1);
 }
 
+// with a checkpoint the capture loop ends, the streams are saved; with
+// --dns the pending queries are logged. A second signal exits
+void sig_stop_handler (int param)
+{
+  static volatile sig_atomic_t stopping = 0;
+  if (stopping)
+    exit(1);
+  stopping = 1;
+  capture_files::stop();
+  nids_stop();
+}
+
+// the next capture file, with the same streams; a file that cannot be read is skipped
+static bool open_next_file(const string& file, bool check)
+{
+	try
+	{
+		if (check)
+			check_pcap_file(file);
+	}
+	catch (invalid_pcap_file& e)
+	{
+		cerr << "WARNING: " << file << " skipped, " << e.what() << endl;
+		return false;
+	}
+	if (!nids_next_file((char*) file.c_str()))
+	{
+		cerr << "WARNING: " << file << " skipped, " << nids_errbuf << endl;
+		return false;
+	}
+	return true;
+}
+
+// the packets of the device, or of the file, in batches: between them, and
+// every pcap timeout without traffic, the parser does its idle work
+static void capture_loop()
+{
+	bool live = nids_params.filename == NULL;
+	for (;;)
+	{
+		int result = nids_dispatch(-1);
+		parser::idle();
+		metrics_exporter::idle();
+		// -2: stopped by nids_stop, 0 from a file: the end of it
+		if (result < 0 || (result == 0 && !live))
+			break;
+	}
+}
+
+// reloaded by the capture loop, not in the signal handler
+void sig_hup_handler (int param)
+{
+  parser::request_reload();
+}
+
+// the log format given by the options
+static string log_format(const po::variables_map& vm)
+{
+	if (vm.count(append_logformat_cmd))
+		return string(default_format).append(vm[append_logformat_cmd].as<string>());
+	if (vm.count(python_cmd))
+		return string("%python(") + vm[python_cmd].as<string>() + string(")");
+	if (vm.count(raw_cmd))
+		return raw_format;
+	if (vm.count(logformat_cmd))
+		return vm[logformat_cmd].as<string>();
+	return default_format;
+}
+
+static int _argc;
+static char** _argv;
+// false when only the aggregates are printed
+static bool _reload_format;
+
+// SIGHUP: the log format (and the python handlers) and the packet filter
+// are read again from the command line and the configuration file. The
+// connections already open finish with the old format, the capture goes on
+static void reload_configuration(parser& p)
+{
+	po::variables_map vm;
+	try
+	{
+		po::store(po::parse_command_line(_argc, _argv, desc), vm);
+		po::variable_value config = vm[config_cmd];
+		if (!config.empty())
+		{
+			string filename = config.as<string>();
+			ifstream ifs(filename.c_str());
+			if (!ifs.is_open())
+			{
+				print_error("reload: cannot open the specified configuration file '")<<filename<<"'\n";
+				return;
+			}
+			po::store(po::parse_config_file(ifs, desc), vm);
+		}
+	}
+	catch (std::exception& e)
+	{
+		print_error("reload: ") << e.what() << "\n";
+		return;
+	}
+	bool ok = true;
+	if (_reload_format)
+	{
+		vector<string> args;
+		args.push_back(raw_cmd);
+		args.push_back(logformat_cmd);
+		args.push_back(append_logformat_cmd);
+		args.push_back(python_cmd);
+		if (check_conflicts(vm, args))
+		{
+			ok = false;
+			print_error("reload: the log format is not changed\n");
+		}
+		else
+		{
+			try
+			{
+				p.reload(log_format(vm).c_str());
+			}
+			catch (std::exception& e)
+			{
+				ok = false;
+				print_error("reload: ") << e.what() << ", the log format is not changed\n";
+			}
+		}
+	}
+	string filter = vm.count(packet_filter_cmd) ? vm[packet_filter_cmd].as<string>() : string(default_packet_filter);
+	if (!nids_setfilter((char*) filter.c_str()))
+	{
+		ok = false;
+		print_error("reload: ") << nids_errbuf << ", the packet filter is not changed\n";
+	}
+	if (ok)
+		cerr << "configuration reloaded" << endl;
+}
+
 int main(int argc, char*argv [])
 {
     parser p;
     atexit(at_exit_handler);
     signal (SIGINT,sig_int_handler);
     signal (SIGTERM,sig_int_handler);
+    _argc = argc;
+    _argv = argv;
     int max_lines;
     _new_line_map["LF"]="\x0A";
     _new_line_map["CR+LF"]="\x0D\x0A";
@@ -157,7 +373,7 @@ int main(int argc, char*argv [])
 			(string(version_cmd).append(",V").c_str(), "version")
 			(string(new_line_cmd).append(",T").c_str(), po::value<string>()->default_value("AUTO"), "the trailing newline [LF|CR+LF|LF+CR|CR|NONE|AUTO]")
 			(string(max_line_cmd).append(",C").c_str(), po::value<int>(&max_lines)->default_value(-1), "max log (lines) number, than exit")
-			(string(filecap_cmd).append(",f").c_str(), po::value<string>(), "input file in 'tcpdump capture file format' (e.g. produced by tshark or tcpdump)")
+			(string(filecap_cmd).append(",f").c_str(), po::value<vector<string> >()->composing(), "input file in 'tcpdump capture file format' (e.g. produced by tshark or tcpdump). It can be repeated, or be a pattern (e.g. \"/var/tmp/dump-*.pcap\"): the files are read in order as one capture, the connections go on across them")
 			(string(interface_cmd).append(",i").c_str(), po::value<string>(), "network interface to listen on (e.g. eth0, en1, etc.) 'all' for all interfaces")
 			(string(logformat_cmd).append(",l").c_str(), po::value<string>(), string("log format (see FORMAT KEYWORDS). If missing the CommonLog (apache access log) format will ne used. See man page for further infos\nIt is equivalent to \n").append(default_format).c_str())
 			(string(append_logformat_cmd).append(",a").c_str(), po::value<string>(), "append log format (see FORMAT KEYWORDS) to the default apache log format.")
@@ -167,13 +383,55 @@ int main(int argc, char*argv [])
 			(string(packet_filter_cmd).append(",p").c_str(), po::value<string>(), "packet filter (tcpdump filter syntax)")
 			(string(uprintable_cmd).append(",u").c_str(), "encode as dots (.) unprintable characters")
 			(string(handle_truncated_cmd).append(",t").c_str(), "handle truncated streams (not correctly closed)")
+			(http_framing_cmd, "split the connections in HTTP/1.x messages (Content-Length, chunked encoding, HEAD, 1xx, 204 and 304 responses), so that every pipelined request is logged with its own response. Connections that do not start as HTTP are handled as without it")
+			(body_window_cmd, po::value<unsigned>(&body_window_v)->default_value(65536), "max bytes of decoded body kept by %request.body.grep and %response.body.grep while searching, a longer match is not found")
+			(max_capture_cmd, po::value<u_int64_t>(&max_capture_v)->default_value(0), "max bytes of each request and response kept for %request, %response, the grep, header and part keywords, 0 is unlimited (the keywords see only the first bytes). Each direction keeps only the bytes its keywords need")
+			(extract_dir_cmd, po::value<string>(), "write the decoded HTTP bodies to this directory, once per content: <dir>/blobs/<xx>/<sha1>, with a tab separated line per transaction in <dir>/index (see %request.body.blob and %response.body.blob). It implies --http-framing. Log lines are printed only if -l, -a, -r or -P are given too")
 			(string(uprintable_cmd_ext).append(",x").c_str(), "encode unprintable characters as [<char hexadecimal code>] ")
+			(output_file_cmd, po::value<string>(), "write the log to the files <path>.000000, <path>.000001, ... instead of stdout, a batch of lines at a time (at most a second old). The boundaries of the files are recorded in <path>.index")
+			(rotate_size_cmd, po::value<u_int64_t>(&rotate_size_v)->default_value(0), "with --output-file, start a new file before it exceeds these bytes, 0 disables it")
+			(rotate_interval_cmd, po::value<unsigned>(&rotate_interval_v)->default_value(0), "with --output-file, start a new file every these seconds (capture time), 0 disables it")
+			(rotate_compress_cmd, po::value<string>()->default_value("none"), "compress the finished files of --output-file on a background thread: none or gzip")
 			(string(raw_cmd).append(",r").c_str(), "show raw stream. it is a shortcat for  -l %request%response")
 			(string(not_found_string).append(",n").c_str(), po::value<string>()->default_value(default_not_found), string("default \"not found\" value, default is ").append(default_not_found).c_str())
             (string(max_concurrent_tcp_stream).append(",s").c_str(), po::value<int>(&max_concurrent_tcp_stream_v)->default_value(65536), "Max concurrent tcp streams")
             (string(max_fragmented_ip_hosts).append(",d").c_str(), po::value<int>(&max_fragmented_ip_hosts_v)->default_value(65536), "Max concurrent fragmented ip host")
 			(string(force_read_pcap).append(",F").c_str(), "force the reading of the pcap file ignoring the snaplen value. WARNING: could give unexpected results")
 			(string(python_cmd).append(",P").c_str(), po::value<string>(), "python file and class: <filename>#<handler_name>. Example: -P my_script.py#MyHandler")
+			(python_batch_cmd, po::value<string>(), "<events>[:<milliseconds>]: the python handlers that define handle_batch(stream, events) get their events in batches of this size, or older than the milliseconds (capture time). Default 1")
+			(python_queue_cmd, po::value<unsigned>(&python_queue_v)->default_value(0), "run the python handlers on a worker thread, with a queue of this many events (0: on the capture thread). The log lines are written in order once the worker has rendered their %python fields, a %python in a key waits for it. The counters of the queue are printed on stderr at exit")
+			(python_queue_bytes_cmd, po::value<unsigned>(&python_queue_bytes_v)->default_value(16 << 20), "bytes of payloads the python queue holds (copied only for the classes that read them)")
+			(python_overflow_cmd, po::value<string>()->default_value("block"), "when the python queue is full: block (wait for the worker, the capture may drop packets), drop (the rest of the transaction) or sample (skip the new transactions while the queue is more than half full)")
+			(aggregate_cmd, po::value<string>(), "aggregate the transactions by the key built from this format (see FORMAT KEYWORDS) and periodically print request/response/connection time percentiles and byte counters per key. Log lines are printed only if -l, -a, -r or -P are given too")
+			(aggregate_interval_cmd, po::value<int>(&aggregate_interval_v)->default_value(60), "seconds (capture time) between two aggregation snapshots, 0 prints only at exit")
+			(aggregate_max_keys_cmd, po::value<unsigned>(&aggregate_max_keys_v)->default_value(1000), "max number of distinct aggregation keys per snapshot, exceeding transactions are accounted to \"(other)\"")
+			(top_k_key_cmd, po::value<vector<string> >()->composing(), "print periodically the heaviest keys built from this format (see FORMAT KEYWORDS), e.g. %request.url or %source.ip. It can be repeated. Log lines are printed only if -l, -a, -r or -P are given too")
+			(top_k_cmd, po::value<unsigned>(&top_k_v)->default_value(10), "number of heavy hitters printed for every top-k-key")
+			(top_k_weight_cmd, po::value<string>()->default_value("requests"), "weight of a transaction in the top-k ranking [requests|bytes|latency]")
+			(top_k_capacity_cmd, po::value<unsigned>(&top_k_capacity_v)->default_value(0), "number of counters kept for every top-k-key (fixed memory), default 10 times top-k")
+			(top_k_interval_cmd, po::value<int>(&top_k_interval_v)->default_value(60), "seconds (capture time) between two top-k rankings, 0 prints only at exit")
+			(sample_cmd, po::value<unsigned>(&sample_v)->default_value(1), "keep only 1 tcp flow every N (chosen by the flow hash), the others are not reassembled. See %sample.weight")
+			(sample_adaptive_cmd, "raise the sampling rate automatically (doubling it) while justniffer uses more than the cpu budget, lower it back when the load goes down")
+			(sample_cpu_budget_cmd, po::value<double>(&sample_cpu_budget_v)->default_value(80), "cpu budget for the adaptive sampling, in percent of one cpu")
+			(metrics_port_cmd, po::value<int>(&metrics_port_v)->default_value(0), "serve the live counters in Prometheus text format on http://<metrics-address>:<port>/metrics, 0 disables it")
+			(metrics_address_cmd, po::value<string>()->default_value("127.0.0.1"), "address the metrics endpoint listens on")
+			(metrics_key_cmd, po::value<string>(), "export request, byte counters and response time histograms per key built from this format (see FORMAT KEYWORDS). Log lines are printed only if -l, -a, -r or -P are given too")
+			(flow_capture_when_cmd, po::value<vector<string> >()->composing(), "write the packets of a connection to a pcap file, with the ones before, when this condition holds for one of its transactions: \"<format> <operator> <value>\", operator is <, <=, >, >= (numbers), ==, != (text) or =~ (regular expression), e.g. \"%response.time > 2\" or \"%response.code =~ ^5\". It can be repeated")
+			(flow_capture_dir_cmd, po::value<string>(), "directory of the pcap files of --flow-capture-when")
+			(flow_capture_packets_cmd, po::value<unsigned>(&flow_capture_packets_v)->default_value(1000), "max packets kept for every connection before its trigger, the oldest ones are dropped")
+			(flow_capture_memory_cmd, po::value<u_int64_t>(&flow_capture_memory_v)->default_value(64 << 20), "max bytes of packets kept for all the connections, the ones idle for the longest time are dropped")
+			(checkpoint_cmd, po::value<string>(), "on SIGINT, SIGTERM and at the end of the capture files, write the open connections (tcp state, buffered data and the transaction in progress) to this file instead of logging them; at start they are restored from it, if it exists, and the file is removed")
+			(checkpoint_journal_cmd, po::value<unsigned>(&checkpoint_journal_v)->default_value(65536), "with --checkpoint, max bytes of the transaction in progress kept for every connection to restore it, a bigger transaction is not restored")
+			(watch_dir_cmd, po::value<string>(), "read the capture files of this directory in name order as one capture, waiting for the new ones (e.g. the files rotated by tcpdump -G): a file is read once a later one appears")
+			(watch_pattern_cmd, po::value<string>()->default_value("*"), "with --watch-dir, the names of the capture files (e.g. \"dump-*.pcap\")")
+			(dns_cmd, po::value<string>(), "log the UDP DNS transactions (a query with its response) with this format (see FORMAT KEYWORDS), e.g. \"%source.ip %dns.qname %dns.qtype %dns.rcode %dns.latency\". They are logged besides the tcp connections, with the same output")
+			(dns_port_cmd, po::value<unsigned>(&dns_port_v)->default_value(53), "server port of the DNS transactions")
+			(dns_timeout_cmd, po::value<unsigned>(&dns_timeout_v)->default_value(5), "seconds (capture time) a DNS query waits for its response, then it is logged without it")
+			(dns_max_pending_cmd, po::value<unsigned>(&dns_max_pending_v)->default_value(65536), "max number of DNS queries waiting for a response (fixed memory), the oldest one is logged without response when exceeded")
+			(framing_cmd, po::value<vector<string> >()->composing(), "split the connections to a server port in the messages of a protocol: <protocol>[:<port>], protocol is http, mysql (3306), postgres (5432), redis (6379) or h2 (HTTP/2 without TLS and gRPC, 80), default port in brackets. Every request is logged with its own response, see the %db, %h2 and %grpc keywords. It can be repeated")
+			(db_statement_length_cmd, po::value<unsigned>(&db_statement_length_v)->default_value(256), "max bytes of the statement printed by %db.statement")
+			(profile_cmd, "count the calls of every processing stage (libnids, handlers of each keyword, printers) and time a sample of them; the report is printed on stderr on SIGUSR1 and at exit")
+			(profile_sample_cmd, po::value<unsigned>(&profile_sample_v)->default_value(64), "with --profile, time about 1 call every N of each stage")
 		;
 
 		po::variables_map vm;        
@@ -233,12 +491,24 @@ int main(int argc, char*argv [])
 			print_error("you cannot simultaneously specify capture file and interface\n");
 			return -1;
 		}
+		if (vm.count(watch_dir_cmd) && (!pcapfile_arg.empty() || !device_arg.empty()))
+		{
+			print_error("you cannot simultaneously specify a watched directory and a capture file or interface\n");
+			return -1;
+		}
+		boost::shared_ptr<capture_files> _capture_files;
+		if (vm.count(watch_dir_cmd))
+			_capture_files = boost::shared_ptr<capture_files>(new capture_files(vm[watch_dir_cmd].as<string>(), vm[watch_pattern_cmd].as<string>()));
+		else if (!pcapfile_arg.empty())
+			_capture_files = boost::shared_ptr<capture_files>(new capture_files(pcapfile_arg.as<vector<string> >()));
 		string pcap_filename;
-		if (pcapfile_arg.empty())
+		if (!_capture_files)
 			nids_params.filename= NULL;
 		else
 		{
-			pcap_filename = pcapfile_arg.as<string>();
+			// a watched directory waits for its first file
+			if (!_capture_files->next(pcap_filename))
+				return 0;
             if (!vm.count(force_read_pcap))
                 check_pcap_file(pcap_filename);
 			nids_params.filename=(char*)pcap_filename.c_str();
@@ -287,7 +557,17 @@ int main(int argc, char*argv [])
         if (vm.count(python_cmd))
             new_line="";
 		printer::ptr _printer;
-		if (execute_cmd_arg.empty())
+		if (vm.count(output_file_cmd))
+		{
+			if (!execute_cmd_arg.empty())
+			{
+				print_error(output_file_cmd) << " and " << execute_cmd << " cannot be used together\n";
+				return -1;
+			}
+			rotating_file_printer::compression_enum compression = rotating_file_printer::to_compression(vm[rotate_compress_cmd].as<string>());
+			_printer = printer::ptr(new rotating_file_printer(vm[output_file_cmd].as<string>(), new_line, rotate_size_v, rotate_interval_v, compression));
+		}
+		else if (execute_cmd_arg.empty())
 			_printer = printer::ptr(new outstream_printer(out, new_line));
 		else
 		{
@@ -300,12 +580,46 @@ int main(int argc, char*argv [])
 		p.set_printer(_printer.get());
         
         p.set_handle_truncated(vm.count(handle_truncated_cmd));
+        p.set_http_framing(vm.count(http_framing_cmd) || vm.count(extract_dir_cmd));
+        if (vm.count(framing_cmd))
+        {
+			vector<string> framings = vm[framing_cmd].as<vector<string> >();
+			for (vector<string>::const_iterator i = framings.begin(); i != framings.end(); i++)
+				p.add_framing(*i);
+        }
+        db_handler::set_max_statement(db_statement_length_v);
+        if (vm.count(python_batch_cmd))
+        {
+			string batch = vm[python_batch_cmd].as<string>();
+			char* end;
+			unsigned long events = strtoul(batch.c_str(), &end, 10);
+			unsigned long milliseconds = 0;
+			if (*end == ':')
+				milliseconds = strtoul(end + 1, &end, 10);
+			if (events == 0 || *end)
+			{
+				print_error("invalid python batch '") << batch << "', it must be <events>[:<milliseconds>]\n";
+				return -1;
+			}
+			parser::set_python_batch(events, milliseconds);
+        }
+        string python_overflow = vm[python_overflow_cmd].as<string>();
+        if (python_overflow != "block" && python_overflow != "drop" && python_overflow != "sample")
+        {
+			print_error("invalid python overflow '") << python_overflow << "', it must be block, drop or sample\n";
+			return -1;
+        }
+        if (python_queue_v && python_queue_bytes_v == 0)
+        {
+			print_error("the python queue needs some bytes for the payloads\n");
+			return -1;
+        }
+        parser::set_python_queue(python_queue_v, python_queue_bytes_v, python_overflow == "drop" ? parser::python_drop : python_overflow == "sample" ? parser::python_sample : parser::python_block);
+        regex_handler_body_base::set_max_window(body_window_v);
+        grep_group::set_max_capture(max_capture_v);
 		p.set_max_lines(max_lines);
 		p.set_default_not_found(vm[not_found_string].as<string>());
 		// parse output format specifications
-		po::variable_value raw_arg = vm[raw_cmd];
-		po::variable_value logformat_arg = vm[logformat_cmd];
-		po::variable_value append_logformat_arg = vm[append_logformat_cmd];
 		vector<string> args;
 		args.push_back(raw_cmd);
 		args.push_back(logformat_cmd);
@@ -314,22 +628,98 @@ int main(int argc, char*argv [])
 		if (check_conflicts(vm, args))
 			return -1;
 
-		if (vm.count(append_logformat_cmd))
-			p.parse(string(default_format).append(append_logformat_arg.as<string>()).c_str());
-		else if (vm.count(python_cmd))
-        {
-            po::variable_value python_handler= vm[python_cmd];
-            string python_handler_str = python_handler.as<string>();
-			p.parse((string("%python(")+python_handler_str+string(")")).c_str());
-        }
-		else if (vm.count(raw_cmd))
-			p.parse(raw_format);
+		bool aggregate_only = (vm.count(aggregate_cmd) || vm.count(top_k_key_cmd) || vm.count(metrics_key_cmd) || vm.count(extract_dir_cmd)) && !vm.count(append_logformat_cmd) && !vm.count(python_cmd) && !vm.count(raw_cmd) && !vm.count(logformat_cmd);
+		if (aggregate_only)
+			p.set_printer(NULL);
 		else
+			p.parse(log_format(vm).c_str());
+		_reload_format = !aggregate_only;
+		boost::shared_ptr<flow_sampler> _sampler;
+		if (sample_v > 1 || vm.count(sample_adaptive_cmd))
 		{
-			if (vm.count(logformat_cmd))
-				p.parse(logformat_arg.as<string>().c_str());
-			else
-				p.parse(default_format);
+			_sampler = boost::shared_ptr<flow_sampler>(new flow_sampler(sample_v, vm.count(sample_adaptive_cmd), sample_cpu_budget_v / 100));
+			p.set_sampler(_sampler.get());
+		}
+		printer::ptr _aggregate_printer;
+		if (vm.count(aggregate_cmd))
+		{
+			_aggregate_printer = printer::ptr(new aggregate_printer(out, new_line, aggregate_interval_v, aggregate_max_keys_v));
+			section::ptr psection = p.add_section(_aggregate_printer.get(), vm[aggregate_cmd].as<string>().c_str());
+			psection->factories.push_back(handler_factory::ptr(new handler_factory_t<transaction_metrics>()));
+		}
+		vector<printer::ptr> _top_k_printers;
+		if (vm.count(top_k_key_cmd))
+		{
+			topk_printer::weight_type weight = topk_printer::to_weight_type(vm[top_k_weight_cmd].as<string>());
+			unsigned capacity = top_k_capacity_v ? top_k_capacity_v : 10 * top_k_v;
+			vector<string> keys = vm[top_k_key_cmd].as<vector<string> >();
+			for (args_type it = keys.begin(); it != keys.end(); it++)
+			{
+				printer::ptr _top_k_printer(new topk_printer(out, new_line, *it, top_k_v, capacity, weight, top_k_interval_v));
+				_top_k_printers.push_back(_top_k_printer);
+				section::ptr psection = p.add_section(_top_k_printer.get(), it->c_str());
+				psection->factories.push_back(handler_factory::ptr(new handler_factory_t<transaction_metrics>()));
+			}
+		}
+		boost::shared_ptr<metrics_printer> _metrics_printer;
+		if (vm.count(metrics_key_cmd))
+		{
+			if (!metrics_port_v)
+			{
+				print_error(metrics_key_cmd) << " needs " << metrics_port_cmd << "\n";
+				return -1;
+			}
+			_metrics_printer = boost::shared_ptr<metrics_printer>(new metrics_printer(aggregate_max_keys_v));
+			section::ptr psection = p.add_section(_metrics_printer.get(), vm[metrics_key_cmd].as<string>().c_str());
+			psection->factories.push_back(handler_factory::ptr(new handler_factory_t<transaction_metrics>()));
+		}
+		printer::ptr _extract_printer;
+		if (vm.count(extract_dir_cmd))
+		{
+			_extract_printer = printer::ptr(new extract_printer(vm[extract_dir_cmd].as<string>()));
+			p.add_section(_extract_printer.get(), extract_printer::index_format);
+		}
+		boost::shared_ptr<flow_history> _flow_history;
+		vector<printer::ptr> _trigger_printers;
+		if (vm.count(flow_capture_when_cmd))
+		{
+			if (!vm.count(flow_capture_dir_cmd))
+			{
+				print_error(flow_capture_when_cmd) << " needs " << flow_capture_dir_cmd << "\n";
+				return -1;
+			}
+			_flow_history = boost::shared_ptr<flow_history>(new flow_history(vm[flow_capture_dir_cmd].as<string>(), flow_capture_packets_v, flow_capture_memory_v));
+			vector<string> conditions = vm[flow_capture_when_cmd].as<vector<string> >();
+			for (args_type it = conditions.begin(); it != conditions.end(); it++)
+			{
+				flow_trigger_printer* trigger = new flow_trigger_printer(*it, _flow_history.get());
+				_trigger_printers.push_back(printer::ptr(trigger));
+				section::ptr psection = p.add_section(trigger, trigger->format().c_str());
+				psection->factories.push_back(handler_factory::ptr(new handler_factory_t<flow_address>()));
+			}
+			_flow_history->start();
+		}
+		boost::shared_ptr<metrics_exporter> _metrics_exporter;
+		if (metrics_port_v)
+		{
+			_metrics_exporter = boost::shared_ptr<metrics_exporter>(new metrics_exporter(vm[metrics_address_cmd].as<string>(), metrics_port_v, _metrics_printer.get()));
+			_metrics_exporter->start();
+		}
+		if (vm.count(profile_cmd))
+			profiler::enable(profile_sample_v);
+		sections _dns_sections;
+		boost::shared_ptr<dns_tracker> _dns_tracker;
+		if (vm.count(dns_cmd))
+		{
+			_dns_sections.push_back(p.create_section(_printer.get(), vm[dns_cmd].as<string>().c_str()));
+			_dns_tracker = boost::shared_ptr<dns_tracker>(new dns_tracker(&p, _dns_sections, dns_port_v, dns_timeout_v, dns_max_pending_v));
+			union
+			{
+			  void (*func) (struct tuple4* addr, char* data, int len, char* packet, struct timeval* t);
+			  void* ptr_nids_handler;
+			}udp;
+			udp.func = dns_tracker::nids_handler;
+			nids_register_udp(udp.ptr_nids_handler);
 		}
 		union
 		{
@@ -349,8 +739,34 @@ int main(int argc, char*argv [])
 		chksumctl[0].action = NIDS_DONT_CHKSUM;
 
 		nids_register_chksum_ctl(chksumctl, 1);
-		nids_run();
-		// reached when parsing file
+		parser::set_reload_callback(reload_configuration);
+		signal (SIGHUP,sig_hup_handler);
+		if (vm.count(checkpoint_cmd))
+		{
+			stream::set_journal(checkpoint_journal_v);
+			checkpoint::restore(vm[checkpoint_cmd].as<string>(), p);
+		}
+		if (vm.count(checkpoint_cmd) || _dns_tracker)
+		{
+			signal (SIGINT,sig_stop_handler);
+			signal (SIGTERM,sig_stop_handler);
+		}
+		capture_loop();
+		// reached when parsing files: the next ones go on with the same streams
+		string next_file;
+		while (_capture_files && _capture_files->next(next_file))
+			if (open_next_file(next_file, !vm.count(force_read_pcap)))
+				capture_loop();
+		if (vm.count(checkpoint_cmd))
+		{
+			if (_dns_tracker)
+				_dns_tracker->flush();
+			checkpoint::save(vm[checkpoint_cmd].as<string>(), p);
+			exit(0);
+		}
+		nids_exit();
+		if (_dns_tracker)
+			_dns_tracker->flush();
 		exit(0);
 
     }
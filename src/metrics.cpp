@@ -0,0 +1,304 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "metrics.h"
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const double response_time_buckets[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+static string escape_label(const string& value)
+{
+	string result;
+	for (string::const_iterator it = value.begin(); it != value.end(); it++)
+	{
+		switch (*it)
+		{
+			case '\\':
+				result += "\\\\";
+				break;
+			case '"':
+				result += "\\\"";
+				break;
+			case '\n':
+				result += "\\n";
+				break;
+			default:
+				result += *it;
+		}
+	}
+	return result;
+}
+
+static void type(ostream& out, const char* name, const char* type, const char* help)
+{
+	out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+///// metrics_printer /////
+
+metrics_printer::metrics_printer(unsigned max_keys): _entries(max_keys)
+{
+	pthread_mutex_init(&_mutex, NULL);
+}
+
+metrics_printer::~metrics_printer()
+{
+	pthread_mutex_destroy(&_mutex);
+}
+
+void metrics_printer::doit(handlers::iterator start, handlers::iterator end, const timeval*t)
+{
+	transaction_metrics* metrics = transaction_metrics::get(start, end);
+	if (metrics == NULL || !metrics->request_started)
+		return;
+	string key = aggregation_key(start, end, t);
+	pthread_mutex_lock(&_mutex);
+	_entries.find(key)->add(*metrics);
+	pthread_mutex_unlock(&_mutex);
+}
+
+// what a scrape prints of an entry
+struct metrics_row
+{
+	string key;
+	u_int64_t requests, request_size, response_size;
+	histogram response_time;
+};
+
+void metrics_printer::render(ostream& out) const
+{
+	// copied under the lock, formatted after: the capture thread waits for
+	// the copy only
+	vector<metrics_row> rows;
+	pthread_mutex_lock(&_mutex);
+	for (aggregate_table::const_iterator it = _entries.begin(); it != _entries.end(); it++)
+	{
+		rows.push_back(metrics_row());
+		metrics_row& row = rows.back();
+		row.key = it->first;
+		row.requests = it->second->requests;
+		row.request_size = it->second->request_size;
+		row.response_size = it->second->response_size;
+		row.response_time = it->second->response_time;
+	}
+	pthread_mutex_unlock(&_mutex);
+	for (vector<metrics_row>::iterator it = rows.begin(); it != rows.end(); it++)
+		it->key = escape_label(it->key);
+	type(out, "justniffer_requests_total", "counter", "transactions per key");
+	for (vector<metrics_row>::const_iterator it = rows.begin(); it != rows.end(); it++)
+		out << "justniffer_requests_total{key=\"" << it->key << "\"} " << it->requests << "\n";
+	type(out, "justniffer_request_bytes_total", "counter", "request bytes per key");
+	for (vector<metrics_row>::const_iterator it = rows.begin(); it != rows.end(); it++)
+		out << "justniffer_request_bytes_total{key=\"" << it->key << "\"} " << it->request_size << "\n";
+	type(out, "justniffer_response_bytes_total", "counter", "response bytes per key");
+	for (vector<metrics_row>::const_iterator it = rows.begin(); it != rows.end(); it++)
+		out << "justniffer_response_bytes_total{key=\"" << it->key << "\"} " << it->response_size << "\n";
+	type(out, "justniffer_response_time_seconds", "histogram", "time from the end of the request to the end of the response");
+	for (vector<metrics_row>::const_iterator it = rows.begin(); it != rows.end(); it++)
+	{
+		const string& key = it->key;
+		const histogram& h = it->response_time;
+		for (unsigned i = 0; i < sizeof(response_time_buckets) / sizeof(response_time_buckets[0]); i++)
+			out << "justniffer_response_time_seconds_bucket{key=\"" << key << "\",le=\"" << response_time_buckets[i] << "\"} "
+			    << h.count_below(u_int64_t(response_time_buckets[i] * 1000000)) << "\n";
+		out << "justniffer_response_time_seconds_bucket{key=\"" << key << "\",le=\"+Inf\"} " << h.count() << "\n";
+		out << "justniffer_response_time_seconds_sum{key=\"" << key << "\"} " << std::setprecision(6) << std::fixed << double(h.sum()) / 1000000 << "\n";
+		out << "justniffer_response_time_seconds_count{key=\"" << key << "\"} " << h.count() << "\n";
+		out.unsetf(ios_base::fixed);
+	}
+}
+
+///// metrics_exporter /////
+
+metrics_exporter* metrics_exporter::theOnlyExporter = NULL;
+
+metrics_exporter::metrics_exporter(const string& address, int port, metrics_printer* printer):
+	_address(address), _port(port), _fd(-1), _printer(printer), _last_packet(0), _published(0)
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+void metrics_exporter::start()
+{
+	check(theOnlyExporter == NULL, cannot_start_metrics_exporter("already started"));
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(_port);
+	check(inet_aton(_address.c_str(), &addr.sin_addr) != 0, cannot_start_metrics_exporter(string("invalid address ").append(_address)));
+	_fd = socket(AF_INET, SOCK_STREAM, 0);
+	check(_fd != -1, cannot_start_metrics_exporter(strerror(errno)));
+	int on = 1;
+	setsockopt(_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	check(bind(_fd, (sockaddr*)&addr, sizeof(addr)) == 0, cannot_start_metrics_exporter(strerror(errno)));
+	check(listen(_fd, 16) == 0, cannot_start_metrics_exporter(strerror(errno)));
+	theOnlyExporter = this;
+	parser::set_handler_timing(true);
+	check(pthread_create(&_thread, NULL, serve, this) == 0, cannot_start_metrics_exporter("cannot create the server thread"));
+	union
+	{
+		void (*func) (struct ip* iph, int len, struct timeval* t);
+		void* ptr;
+	} un;
+	un.func = on_packet;
+	nids_register_ip(un.ptr);
+}
+
+void metrics_exporter::on_packet(struct ip* iph, int len, struct timeval* t)
+{
+	// the pcap header of the packet belongs to the capture thread
+	if (theOnlyExporter == NULL || nids_last_pcap_header == NULL)
+		return;
+	const timeval& ts = nids_last_pcap_header->ts;
+	__atomic_store_n(&theOnlyExporter->_last_packet, u_int64_t(ts.tv_sec) * 1000000 + ts.tv_usec, __ATOMIC_RELAXED);
+	// nids_get_stats asks the kernel for the pcap counters: once a second
+	if (ts.tv_sec != theOnlyExporter->_published)
+	{
+		theOnlyExporter->_published = ts.tv_sec;
+		theOnlyExporter->publish();
+	}
+}
+
+void metrics_exporter::idle()
+{
+	if (theOnlyExporter)
+		theOnlyExporter->publish();
+}
+
+void metrics_exporter::publish()
+{
+	nids_stats stats;
+	nids_get_stats(&stats);
+	__atomic_store_n(&_stats.packets, stats.packets, __ATOMIC_RELAXED);
+	__atomic_store_n(&_stats.bytes, stats.bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&_stats.tcp_streams, stats.tcp_streams, __ATOMIC_RELAXED);
+	__atomic_store_n(&_stats.tcp_ooo_bytes, stats.tcp_ooo_bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&_stats.pcap_received, stats.pcap_received, __ATOMIC_RELAXED);
+	__atomic_store_n(&_stats.pcap_dropped, stats.pcap_dropped, __ATOMIC_RELAXED);
+	__atomic_store_n(&_stats.pcap_ifdropped, stats.pcap_ifdropped, __ATOMIC_RELAXED);
+	__atomic_store_n(&_handler_time, u_int64_t(parser::handler_time() * 1000000000), __ATOMIC_RELAXED);
+}
+
+// on the server thread: only the counters published by the capture thread
+void metrics_exporter::render(ostream& out)
+{
+	nids_stats stats;
+	stats.packets = __atomic_load_n(&_stats.packets, __ATOMIC_RELAXED);
+	stats.bytes = __atomic_load_n(&_stats.bytes, __ATOMIC_RELAXED);
+	stats.tcp_streams = __atomic_load_n(&_stats.tcp_streams, __ATOMIC_RELAXED);
+	stats.tcp_ooo_bytes = __atomic_load_n(&_stats.tcp_ooo_bytes, __ATOMIC_RELAXED);
+	stats.pcap_received = __atomic_load_n(&_stats.pcap_received, __ATOMIC_RELAXED);
+	stats.pcap_dropped = __atomic_load_n(&_stats.pcap_dropped, __ATOMIC_RELAXED);
+	stats.pcap_ifdropped = __atomic_load_n(&_stats.pcap_ifdropped, __ATOMIC_RELAXED);
+	double handler_time = double(__atomic_load_n(&_handler_time, __ATOMIC_RELAXED)) / 1000000000;
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	type(out, "justniffer_packets_total", "counter", "packets read from the capture");
+	out << "justniffer_packets_total " << stats.packets << "\n";
+	type(out, "justniffer_captured_bytes_total", "counter", "bytes read from the capture");
+	out << "justniffer_captured_bytes_total " << stats.bytes << "\n";
+	type(out, "justniffer_tcp_streams", "gauge", "tcp streams currently tracked");
+	out << "justniffer_tcp_streams " << stats.tcp_streams << "\n";
+	type(out, "justniffer_tcp_out_of_order_bytes", "gauge", "bytes queued waiting for missing tcp segments");
+	out << "justniffer_tcp_out_of_order_bytes " << stats.tcp_ooo_bytes << "\n";
+	type(out, "justniffer_pcap_received_total", "counter", "packets received by the capture filter");
+	out << "justniffer_pcap_received_total " << stats.pcap_received << "\n";
+	type(out, "justniffer_pcap_dropped_total", "counter", "packets dropped by the kernel buffer");
+	out << "justniffer_pcap_dropped_total " << stats.pcap_dropped << "\n";
+	type(out, "justniffer_pcap_interface_dropped_total", "counter", "packets dropped by the network interface");
+	out << "justniffer_pcap_interface_dropped_total " << stats.pcap_ifdropped << "\n";
+	out << std::setprecision(6) << std::fixed;
+	type(out, "justniffer_handler_seconds_total", "counter", "time spent in the stream handlers");
+	out << "justniffer_handler_seconds_total " << handler_time << "\n";
+	type(out, "process_cpu_seconds_total", "counter", "user and system cpu time");
+	out << "process_cpu_seconds_total " << to_double(usage.ru_utime) + to_double(usage.ru_stime) << "\n";
+	u_int64_t last_packet = __atomic_load_n(&_last_packet, __ATOMIC_RELAXED);
+	if (last_packet)
+	{
+		type(out, "justniffer_last_packet_timestamp_seconds", "gauge", "capture time of the last packet");
+		out << "justniffer_last_packet_timestamp_seconds " << double(last_packet) / 1000000 << "\n";
+	}
+	out.unsetf(ios_base::fixed);
+	if (_printer)
+		_printer->render(out);
+}
+
+void* metrics_exporter::serve(void* arg)
+{
+	metrics_exporter* exporter = (metrics_exporter*) arg;
+	while (true)
+	{
+		int fd = accept(exporter->_fd, NULL, NULL);
+		if (fd == -1)
+		{
+			if (errno != EINTR)
+				usleep(100000);
+			continue;
+		}
+		exporter->reply(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+void metrics_exporter::reply(int fd)
+{
+	// a slow client can only delay the other scrapes, never the capture
+	timeval timeout;
+	timeout.tv_sec = 2;
+	timeout.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	string request;
+	char buffer[1024];
+	while (request.find("\r\n\r\n") == string::npos && request.size() < 8192)
+	{
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			return;
+		request.append(buffer, n);
+	}
+	string body, status = "200 OK";
+	if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0)
+	{
+		ostringstream out;
+		render(out);
+		body = out.str();
+	}
+	else
+	{
+		status = "404 Not Found";
+		body = "not found\n";
+	}
+	ostringstream response;
+	response << "HTTP/1.0 " << status << "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " << body.size() << "\r\nConnection: close\r\n\r\n" << body;
+	string text = response.str();
+	const char* cursor = text.c_str();
+	size_t left = text.size();
+	while (left > 0)
+	{
+		ssize_t n = send(fd, cursor, left, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+		cursor += n;
+		left -= n;
+	}
+}
@@ -0,0 +1,77 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_metrics_h
+#define _sniffer_metrics_h
+#include <string>
+#include <ostream>
+#include <pthread.h>
+#include "aggregate.h"
+
+// cumulative per-key counters and response time histograms, never reset.
+// Updated by the capture thread, copied and rendered by the server thread
+class metrics_printer : public printer
+{
+public:
+	metrics_printer(unsigned max_keys);
+	~metrics_printer();
+	void doit(handlers::iterator start, handlers::iterator end, const timeval*t);
+	void render(std::ostream& out) const;
+private:
+	aggregate_table _entries;
+	// held for a table update only, the key is built outside
+	mutable pthread_mutex_t _mutex;
+};
+
+// serves the metrics (Prometheus text format) on http://<address>:<port>/metrics.
+// The text is rendered by the server thread for every scrape, so it is
+// current even when the traffic stops; the capture thread only locks the
+// per-key table while updating it, and publishes the capture counters once
+// a second of capture time and whenever the capture loop is idle
+class metrics_exporter
+{
+public:
+	metrics_exporter(const std::string& address, int port, metrics_printer* printer);
+	// binds the socket, starts the server thread and hooks the capture loop
+	void start();
+	// called for every captured ip packet
+	static void on_packet(struct ip* iph, int len, struct timeval* t);
+	// called by the capture loop between the reads
+	static void idle();
+private:
+	static void* serve(void* arg);
+	// on the capture thread: copies the libnids counters and the handler
+	// time for the server thread
+	void publish();
+	void render(std::ostream& out);
+	void reply(int fd);
+	static metrics_exporter* theOnlyExporter;
+	std::string _address;
+	int _port, _fd;
+	metrics_printer* _printer;
+	pthread_t _thread;
+	// capture time of the last packet in microseconds (0 before the first
+	// one), written by the capture thread
+	u_int64_t _last_packet;
+	// the counters as of the last publish(), every field written and read
+	// atomically; the handler time is in nanoseconds
+	nids_stats _stats;
+	u_int64_t _handler_time;
+	// capture second of the last publish() from on_packet
+	time_t _published;
+};
+
+class cannot_start_metrics_exporter: public common_exception
+{
+public:
+	cannot_start_metrics_exporter(const string& msg): common_exception(string("cannot start the metrics endpoint: ").append(msg)){}
+};
+
+#endif// _sniffer_metrics_h
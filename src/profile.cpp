@@ -0,0 +1,92 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "profile.h"
+#include <cstring>
+#include <time.h>
+#include <iomanip>
+
+using namespace std;
+
+unsigned profiler::_every = 0;
+vector<nids_stage> profiler::_stages;
+vector<string> profiler::_names;
+volatile sig_atomic_t profiler::_dump_requested = 0;
+u_int64_t profiler::_start_cycles = 0;
+timespec profiler::_start_time;
+
+void profiler::enable(unsigned sample_every)
+{
+	_every = sample_every ? sample_every : 1;
+	nids_profile(_every);
+	if (_stages.empty())
+		add_stage("parser::nids_handler");
+	clock_gettime(CLOCK_MONOTONIC, &_start_time);
+	_start_cycles = nids_cycles();
+	signal(SIGUSR1, on_signal);
+}
+
+unsigned profiler::add_stage(const string& name)
+{
+	// the same keyword in several places of the formats shares the stage
+	for (unsigned i = 0; i < _names.size(); i++)
+		if (_names[i] == name)
+			return i;
+	nids_stage stage;
+	memset(&stage, 0, sizeof(stage));
+	_stages.push_back(stage);
+	_names.push_back(name);
+	return _stages.size() - 1;
+}
+
+void profiler::on_signal(int)
+{
+	_dump_requested = 1;
+}
+
+static void row(ostream& out, const string& name, const nids_stage& stage, u_int64_t packets, double ns_per_cycle)
+{
+	if (stage.events == 0)
+		return;
+	double per_event = stage.sampled ? double(stage.cycles) / stage.sampled : 0;
+	// the untimed calls are assumed to cost as much as the timed ones
+	double total = per_event * stage.events;
+	out << setw(60) << left << name << right
+	    << setw(12) << stage.events
+	    << setw(10) << stage.sampled
+	    << setw(14) << setprecision(0) << per_event
+	    << setw(14) << setprecision(0) << (packets ? total / packets : 0)
+	    << setw(12) << setprecision(1) << per_event * ns_per_cycle
+	    << setw(12) << setprecision(1) << total * ns_per_cycle / 1000000 << "\n";
+}
+
+void profiler::dump(ostream& out)
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = double(now.tv_sec - _start_time.tv_sec) * 1000000000 + double(now.tv_nsec - _start_time.tv_nsec);
+	u_int64_t cycles = nids_cycles() - _start_cycles;
+	double ns_per_cycle = cycles ? ns / cycles : 1;
+	const nids_stage* nids = nids_get_stages();
+	u_int64_t packets = nids[NIDS_STAGE_PCAP_HANDLER].events;
+	ios_base::fmtflags flags = out.flags();
+	out << setiosflags(ios_base::fixed)
+	    << "profile: about 1 call every " << _every << " timed, " << setprecision(3) << 1 / ns_per_cycle << " cycles/ns\n"
+	    << setw(60) << left << "stage" << right
+	    << setw(12) << "calls" << setw(10) << "timed"
+	    << setw(14) << "cycles/call" << setw(14) << "cycles/packet"
+	    << setw(12) << "ns/call" << setw(12) << "total ms" << "\n";
+	for (unsigned i = 0; i < NIDS_STAGES; i++)
+		row(out, nids[i].name, nids[i], packets, ns_per_cycle);
+	for (unsigned i = 0; i < _stages.size(); i++)
+		row(out, _names[i], _stages[i], packets, ns_per_cycle);
+	out << std::flush;
+	out.flags(flags);
+}
@@ -0,0 +1,58 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_profile_h
+#define _sniffer_profile_h
+#include <string>
+#include <vector>
+#include <iostream>
+#include <signal.h>
+#include <nids2.h>
+
+// per-stage counters of the capture pipeline: every call is counted and about
+// one every sample_every is timed with the TSC, so it can stay enabled on a
+// loaded sensor. The libnids stages come from nids_get_stages(), the
+// justniffer ones (dispatch, each keyword's handler, each printer) are
+// registered here. The report goes to stderr on SIGUSR1 and at exit
+class profiler
+{
+public:
+	static void enable(unsigned sample_every);
+	static bool enabled(){return _every != 0;}
+	// returns the stage with this name, creating it if needed
+	static unsigned add_stage(const std::string& name);
+	static u_int64_t begin(unsigned id){return _every ? nids_span_begin(&_stages[id]) : 0;}
+	static void end(unsigned id, u_int64_t start){if (start) nids_span_end(&_stages[id], start);}
+	// dumps the report if SIGUSR1 arrived, from the capture thread
+	static void poll(){if (_dump_requested) {_dump_requested = 0; dump(std::cerr);}}
+	static void dump(std::ostream& out);
+	static const unsigned dispatch_stage = 0;
+private:
+	static void on_signal(int);
+	static unsigned _every;
+	static std::vector<nids_stage> _stages;
+	static std::vector<std::string> _names;
+	static volatile sig_atomic_t _dump_requested;
+	static u_int64_t _start_cycles;
+	static timespec _start_time;
+};
+
+// times the enclosing scope as a call of the stage
+class profile_span
+{
+public:
+	profile_span(unsigned id): _id(id), _start(profiler::begin(id)){}
+	~profile_span(){profiler::end(_id, _start);}
+private:
+	unsigned _id;
+	u_int64_t _start;
+};
+
+#endif// _sniffer_profile_h
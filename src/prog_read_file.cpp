@@ -1,11 +0,0 @@
-#include "python.h"
-#include <iostream>
-#include "utilities.h"
-#include <map>
-#include <nids2.h>
-#include "read_file.h"
-
-void read_file(string filename, string capture_string)
-{
-    cerr << "cannot be called from justniffer program";
-}
\ No newline at end of file
@@ -46,6 +46,9 @@ struct tcp_stream {
 class python_error : public std::exception
 {
 public :
+    python_error()
+    {
+    }
     python_error(python::error_already_set& e)
     {
     }
@@ -56,16 +59,341 @@ public :
     
 };
 
+///// Payload /////
+
+// the new bytes of a callback, read without copying them through len(),
+// slices and the old buffer interface (buffer, re, ...), that raise after the
+// callback. The views of the new buffer interface (memoryview,
+// struct.unpack_from, ...) may outlive the callback: they share a copy, made
+// by the first one and freed with the last one
+struct payload_object
+{
+    PyObject_HEAD
+    const char* data;
+    Py_ssize_t len;
+    bool released;
+    // the copy of the views, and how many views are not released yet
+    char* copy;
+    Py_ssize_t exports;
+};
+
+static PyTypeObject payload_type = {PyObject_HEAD_INIT(NULL) 0, "_justniffer.Payload", sizeof(payload_object)};
+
+static payload_object* readable_payload(PyObject* self)
+{
+    payload_object* payload = (payload_object*) self;
+    if (payload->released)
+    {
+        PyErr_SetString(PyExc_ValueError, "payload used after its callback, copy() it to keep it");
+        return NULL;
+    }
+    return payload;
+}
+
+PyObject* payload_new(const char* data, unsigned len)
+{
+    payload_object* payload = PyObject_New(payload_object, &payload_type);
+    if (payload == NULL)
+        python::throw_error_already_set();
+    payload->data = data;
+    payload->len = len;
+    payload->released = false;
+    payload->copy = NULL;
+    payload->exports = 0;
+    return (PyObject*) payload;
+}
+
+void payload_release(PyObject* self)
+{
+    payload_object* payload = (payload_object*) self;
+    payload->released = true;
+    payload->data = NULL;
+    if (payload->exports == 0)
+    {
+        PyMem_Free(payload->copy);
+        payload->copy = NULL;
+    }
+}
+
+static void payload_dealloc(PyObject* self)
+{
+    PyMem_Free(((payload_object*) self)->copy);
+    PyObject_Del(self);
+}
+
+static Py_ssize_t payload_length(PyObject* self)
+{
+    payload_object* payload = readable_payload(self);
+    return payload ? payload->len : -1;
+}
+
+// payload[i] and payload[i:j] are copies, as for str
+static PyObject* payload_subscript(PyObject* self, PyObject* item)
+{
+    payload_object* payload = readable_payload(self);
+    if (payload == NULL)
+        return NULL;
+    if (PyIndex_Check(item))
+    {
+        Py_ssize_t i = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if (i == -1 && PyErr_Occurred())
+            return NULL;
+        if (i < 0)
+            i += payload->len;
+        if (i < 0 || i >= payload->len)
+        {
+            PyErr_SetString(PyExc_IndexError, "payload index out of range");
+            return NULL;
+        }
+        return PyString_FromStringAndSize(payload->data + i, 1);
+    }
+    if (!PySlice_Check(item))
+    {
+        PyErr_SetString(PyExc_TypeError, "payload indices must be integers or slices");
+        return NULL;
+    }
+    Py_ssize_t start, stop, step, length;
+    if (PySlice_GetIndicesEx((PySliceObject*) item, payload->len, &start, &stop, &step, &length) < 0)
+        return NULL;
+    if (step == 1)
+        return PyString_FromStringAndSize(payload->data + start, length);
+    PyObject* result = PyString_FromStringAndSize(NULL, length);
+    if (result == NULL)
+        return NULL;
+    char* out = PyString_AS_STRING(result);
+    for (Py_ssize_t i = 0; i < length; i++, start += step)
+        out[i] = payload->data[start];
+    return result;
+}
+
+// the bytes a view points to must outlive the callback: it gets the copy.
+// After the callback, only the views already taken can export it again
+// (e.g. memoryview.tobytes())
+static int payload_getbuffer(PyObject* self, Py_buffer* view, int flags)
+{
+    payload_object* payload = (payload_object*) self;
+    if (payload->exports == 0 && readable_payload(self) == NULL)
+        return -1;
+    if (payload->copy == NULL && payload->len > 0)
+    {
+        payload->copy = (char*) PyMem_Malloc(payload->len);
+        if (payload->copy == NULL)
+        {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(payload->copy, payload->data, payload->len);
+    }
+    if (PyBuffer_FillInfo(view, self, payload->copy, payload->len, 1, flags) < 0)
+        return -1;
+    payload->exports++;
+    return 0;
+}
+
+static void payload_releasebuffer(PyObject* self, Py_buffer* view)
+{
+    payload_object* payload = (payload_object*) self;
+    if (--payload->exports == 0 && payload->released)
+    {
+        PyMem_Free(payload->copy);
+        payload->copy = NULL;
+    }
+}
+
+static Py_ssize_t payload_readbuffer(PyObject* self, Py_ssize_t segment, void** ptr)
+{
+    payload_object* payload = readable_payload(self);
+    if (payload == NULL)
+        return -1;
+    if (segment != 0)
+    {
+        PyErr_SetString(PyExc_SystemError, "accessing non-existent payload segment");
+        return -1;
+    }
+    *ptr = (void*) payload->data;
+    return payload->len;
+}
+
+static Py_ssize_t payload_charbuffer(PyObject* self, Py_ssize_t segment, char** ptr)
+{
+    return payload_readbuffer(self, segment, (void**) ptr);
+}
+
+static Py_ssize_t payload_segcount(PyObject* self, Py_ssize_t* len)
+{
+    if (len)
+        *len = ((payload_object*) self)->len;
+    return 1;
+}
+
+static PyObject* payload_copy(PyObject* self, PyObject*)
+{
+    payload_object* payload = readable_payload(self);
+    if (payload == NULL)
+        return NULL;
+    return PyString_FromStringAndSize(payload->data, payload->len);
+}
+
+static PyMappingMethods payload_mapping = {payload_length, payload_subscript, NULL};
+static PySequenceMethods payload_sequence = {payload_length};
+static PyBufferProcs payload_buffer = {payload_readbuffer, NULL, payload_segcount, payload_charbuffer, payload_getbuffer, payload_releasebuffer};
+static PyMethodDef payload_methods[] = {
+    {"copy", payload_copy, METH_NOARGS, "the bytes as a str, valid after the callback"},
+    {NULL, NULL, 0, NULL}
+};
+
+static void init_payload_type()
+{
+    payload_type.tp_dealloc = payload_dealloc;
+    payload_type.tp_as_sequence = &payload_sequence;
+    payload_type.tp_as_mapping = &payload_mapping;
+    payload_type.tp_as_buffer = &payload_buffer;
+    payload_type.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER;
+    payload_type.tp_doc = "read-only bytes of a callback (see copy())";
+    payload_type.tp_methods = payload_methods;
+    if (PyType_Ready(&payload_type) < 0)
+        python::throw_error_already_set();
+}
+
 #define START_PYTHON_CALL try{
 
 #define END_PYTHON_CALL }catch(python::error_already_set& e){PyErr_Print();throw python_error(e);}
+///// overrides /////
+
+// the methods of a Python handler class, looked up once per class: None
+// where the class does not override the one of BaseHandler
+struct python_class
+{
+    // holds the class of the key, so that its address cannot be reused by
+    // another class while the entry exists
+    python::object cls;
+    python::object on_opening, on_open, on_request, on_response, on_close, on_exit, append, handle_batch;
+};
+
+static python::object base_handler_class;
+// by class: the entries are never removed (the handlers point to them), so
+// every key stays referenced by its entry
+static std::map<PyObject*, python_class> python_classes;
+
+static PyObject* function_of(PyObject* method)
+{
+    return PyMethod_Check(method) ? PyMethod_GET_FUNCTION(method) : method;
+}
+
+static python::object class_override(python::object cls, const char* name)
+{
+    if (!PyObject_HasAttrString(cls.ptr(), name))
+        return python::object();
+    python::object method = cls.attr(name);
+    if (PyObject_HasAttrString(base_handler_class.ptr(), name) && function_of(method.ptr()) == function_of(python::object(base_handler_class.attr(name)).ptr()))
+        return python::object();
+    return method;
+}
+
+static const python_class& resolve_class(PyObject* type)
+{
+    std::map<PyObject*, python_class>::iterator i = python_classes.find(type);
+    if (i != python_classes.end())
+        return i->second;
+    // added once complete: a lookup that raises leaves no entry (and no
+    // borrowed key) behind
+    python_class result;
+    result.cls = python::object(python::handle<>(python::borrowed(type)));
+    result.on_opening = class_override(result.cls, "onOpening");
+    result.on_open = class_override(result.cls, "onOpen");
+    result.on_request = class_override(result.cls, "onRequest");
+    result.on_response = class_override(result.cls, "onResponse");
+    result.on_close = class_override(result.cls, "onClose");
+    result.on_exit = class_override(result.cls, "onExit");
+    result.append = class_override(result.cls, "append");
+    result.handle_batch = class_override(result.cls, "handle_batch");
+    return python_classes.insert(std::make_pair(result.cls.ptr(), result)).first->second;
+}
+
+// releases the payloads of a batch when handle_batch returns, even with an error
+class batch_payloads
+{
+public:
+    ~batch_payloads()
+    {
+        for (std::vector<python::object>::iterator i = _payloads.begin(); i != _payloads.end(); i++)
+            payload_release(i->ptr());
+    }
+    python::object add(const char* data, unsigned len)
+    {
+        _payloads.push_back(python::object(python::handle<>(payload_new(data, len))));
+        return _payloads.back();
+    }
+private:
+    std::vector<python::object> _payloads;
+};
+
 class BaseHandlerWrap: public BaseHandler, public python::wrapper<BaseHandler>
 {
 public:
+    BaseHandlerWrap(): _class(NULL), _pstream(NULL){}
+    
+    // a class with handle_batch(stream, events) gets the events queued
+    // instead: (name, time, payload) tuples, payload is None without data
+    virtual void onOpening(tcp_stream* pstream, const timeval* t){
+        if (batched())
+            queue(opening_event, pstream, to_double(*t));
+        else
+            BaseHandler::onOpening(pstream, t);
+    }
+    
+	virtual void onOpen(tcp_stream* pstream, const timeval* t){
+        if (batched())
+            queue(open_event, pstream, to_double(*t));
+        else
+            BaseHandler::onOpen(pstream, t);
+    }
+    
+	virtual void onRequest(tcp_stream* pstream, const timeval* t){
+        if (batched())
+            queue(request_event, pstream, to_double(*t), &pstream->server);
+        else
+            BaseHandler::onRequest(pstream, t);
+    }
+    
+	virtual void onResponse(tcp_stream* pstream, const timeval* t){
+        if (batched())
+            queue(response_event, pstream, to_double(*t), &pstream->client);
+        else
+            BaseHandler::onResponse(pstream, t);
+    }
+    
+	virtual void onClose(tcp_stream* pstream, const timeval* t, unsigned char* packet){
+        if (!batched())
+        {
+            BaseHandler::onClose(pstream, t, packet);
+            return;
+        }
+        // the libnids stream is not valid after the close
+        queue(close_event, pstream, to_double(*t));
+        flush();
+    }
+    
+	virtual void onExit(tcp_stream* pstream){
+        if (!batched())
+        {
+            BaseHandler::onExit(pstream);
+            return;
+        }
+        queue(exit_event, pstream, 0);
+        flush();
+    }
+    
+	virtual void append(std::basic_ostream<char>& out, const timeval* t){
+        if (batched())
+            flush();
+        BaseHandler::append(out, t);
+    }
+    
     virtual void append(OUTStream& s, double time){
         START_PYTHON_CALL
-        if (python::override f = this->get_override("append"))
-            f(boost::ref(s), time);
+        if (!overrides().append.is_none())
+            overrides().append(self(), boost::ref(s), time);
         else
             BaseHandler::append(boost::ref(s), time);
         END_PYTHON_CALL
@@ -73,8 +401,8 @@ public:
 
 	virtual void onOpening(TCPStream& stream, double time){
         START_PYTHON_CALL
-        if (python::override f = this->get_override("onOpening"))
-            f(boost::ref(stream), time);
+        if (!overrides().on_opening.is_none())
+            overrides().on_opening(self(), boost::ref(stream), time);
         else
             BaseHandler::onOpening(boost::ref(stream), time);
         END_PYTHON_CALL
@@ -82,8 +410,8 @@ public:
     
 	virtual void onOpen(TCPStream& stream, double time){
         START_PYTHON_CALL
-        if (python::override f = this->get_override("onOpen"))
-            f(boost::ref(stream), time);
+        if (!overrides().on_open.is_none())
+            overrides().on_open(self(), boost::ref(stream), time);
         else
             BaseHandler::onOpen(boost::ref(stream), time);
         END_PYTHON_CALL
@@ -91,8 +419,8 @@ public:
     
 	virtual void onRequest(TCPStream& stream, double time){
         START_PYTHON_CALL
-        if (python::override f = this->get_override("onRequest"))
-            f(boost::ref(stream), time);
+        if (!overrides().on_request.is_none())
+            overrides().on_request(self(), boost::ref(stream), time);
         else
             BaseHandler::onRequest(boost::ref(stream), time);
         END_PYTHON_CALL
@@ -100,8 +428,8 @@ public:
     
 	virtual void onResponse(TCPStream& stream, double time){
         START_PYTHON_CALL
-        if (python::override f = this->get_override("onResponse"))
-            f(boost::ref(stream), time);
+        if (!overrides().on_response.is_none())
+            overrides().on_response(self(), boost::ref(stream), time);
         else
             BaseHandler::onResponse(boost::ref(stream), time);
         END_PYTHON_CALL
@@ -109,8 +437,8 @@ public:
     
 	virtual void onClose(TCPStream& stream, double time){
         START_PYTHON_CALL
-        if (python::override f = this->get_override("onClose"))
-            f(boost::ref(stream), time);
+        if (!overrides().on_close.is_none())
+            overrides().on_close(self(), boost::ref(stream), time);
         else
             BaseHandler::onClose(boost::ref(stream), time);
         END_PYTHON_CALL
@@ -118,12 +446,77 @@ public:
     
 	virtual void onExit(TCPStream& stream){
         START_PYTHON_CALL
-        if (python::override f = this->get_override("onExit"))
-            f(boost::ref(stream));
+        if (!overrides().on_exit.is_none())
+            overrides().on_exit(self(), boost::ref(stream));
         else
             BaseHandler::onExit(boost::ref(stream));
         END_PYTHON_CALL
     }
+private:
+    enum event_enum {opening_event, open_event, request_event, response_event, close_event, exit_event};
+    // a queued event, its data is in _data
+    struct event
+    {
+        event_enum type;
+        double time;
+        std::string::size_type offset;
+        unsigned len;
+        bool has_data;
+    };
+    
+    python::object self(){
+        return python::object(python::handle<>(python::borrowed(python::detail::wrapper_base_::get_owner(*this))));
+    }
+    
+    const python_class& overrides(){
+        if (_class == NULL)
+            _class = &resolve_class((PyObject*) Py_TYPE(python::detail::wrapper_base_::get_owner(*this)));
+        return *_class;
+    }
+    
+    bool batched(){
+        return !overrides().handle_batch.is_none();
+    }
+    
+    void queue(event_enum type, tcp_stream* pstream, double time, half_stream* half = NULL){
+        _pstream = pstream;
+        event e = {type, time, _data.size(), 0, half != NULL};
+        if (half)
+        {
+            e.len = half->count_new;
+            _data.append(half->data, half->count_new);
+        }
+        _events.push_back(e);
+        unsigned milliseconds = parser::python_batch_time();
+        if (_events.size() >= parser::python_batch_events() || (milliseconds && (time - _events.front().time) * 1000 >= milliseconds))
+            flush();
+    }
+    
+    void flush(){
+        static const char* names[] = {"opening", "open", "request", "response", "close", "exit"};
+        if (_events.empty())
+            return;
+        START_PYTHON_CALL
+        // the batch owns the data while handle_batch runs, the events queued
+        // meanwhile (if any) go to the next one
+        std::string data;
+        data.swap(_data);
+        batch_payloads payloads;
+        python::list events;
+        for (std::vector<event>::const_iterator i = _events.begin(); i != _events.end(); i++)
+            events.append(python::make_tuple(names[i->type], i->time, i->has_data ? payloads.add(data.data() + i->offset, i->len) : python::object()));
+        _events.clear();
+        TCPStream& stream = get_tcp_stream(_pstream);
+        payload_guard guard(stream);
+        overrides().handle_batch(self(), boost::ref(stream), events);
+        END_PYTHON_CALL
+    }
+    
+    const python_class* _class;
+    tcp_stream* _pstream;
+    std::vector<event> _events;
+    // the payloads of the events, the Payload objects of a batch point to it
+    std::string _data;
 }; 
 
 
@@ -131,8 +524,11 @@ BOOST_PYTHON_MODULE(_justniffer)
 {
   //python::def("read_file", read_file);
   python::class_<BaseHandlerWrap, boost::noncopyable> basehandler("BaseHandler");
+  base_handler_class = basehandler;
   python::class_<TCPStream, boost::noncopyable> stream("TCPStream", python::no_init);
   python::class_<OUTStream, boost::noncopyable> out("OUTStream", python::no_init);
+  init_payload_type();
+  python::scope().attr("Payload") = python::object(python::handle<>(python::borrowed((PyObject*) &payload_type)));
   
   basehandler.def("onOpen", &BaseHandlerInterface::onOpen)
         .def("onOpening", &BaseHandlerInterface::onOpening)
@@ -147,7 +543,9 @@ BOOST_PYTHON_MODULE(_justniffer)
         .add_property("src_ip", &TCPStream::src_ip)
         .add_property("dst_ip", &TCPStream::dst_ip)
         .add_property("server_data", &TCPStream::server_data)
-        .add_property("client_data", &TCPStream::client_data);
+        .add_property("client_data", &TCPStream::client_data)
+        .add_property("server_payload", &TCPStream::server_payload)
+        .add_property("client_payload", &TCPStream::client_payload);
 
   out.def("write", &OUTStream::write);
 }
@@ -205,56 +603,478 @@ python::object get_python_class(const std::string& filename, const std::string&
     END_PYTHON_CALL
 }
 
-//class python_handler
-
-python_handler::python_handler(const string& python_ref)
+// <filename>#<classname>
+static python::object get_python_class(const std::string& python_ref)
 {
-    START_PYTHON_CALL
     InitPython();
     std::stringstream ss(python_ref);
     std::string filename, classname;
     std::getline( ss, filename, '#' );
     std::getline( ss, classname, '#' );
-    python::object  py_base_class = get_python_class(filename, classname);
-    py_base= py_base_class();
-    BaseHandler& py = python::extract<BaseHandler&>(py_base) BOOST_EXTRACT_WORKAROUND;
+    return get_python_class(filename, classname);
+}
+
+// the files are executed again by the next get_python_class
+static void forget_python_classes()
+{
+    classes.clear();
+    filenames.clear();
+}
+
+///// python_worker /////
+
+python_worker* python_worker::_instance = NULL;
+
+// the sleep of a thread waiting for the other one
+static void backoff()
+{
+    timespec delay = {0, 50000};
+    nanosleep(&delay, NULL);
+}
+
+python_worker* python_worker::instance()
+{
+    if (_instance == NULL && parser::python_queue_events())
+    {
+        _instance = new python_worker(parser::python_queue_events(), parser::python_queue_bytes());
+        check(pthread_create(&_instance->_thread, NULL, run, _instance) == 0, common_exception("cannot create the python worker thread"));
+    }
+    return _instance;
+}
+
+python_worker::python_worker(unsigned events, unsigned bytes):
+    _head(0), _data_head(0), _last_id(0), _loads(0), _stopped(false), _tail(0), _data_tail(0), _failed(false), _arena(bytes), _bytes(bytes)
+{
+    u_int64_t size = 1;
+    while (size < events)
+        size <<= 1;
+    _ring.resize(size);
+    _mask = size - 1;
+}
+
+void* python_worker::run(void* arg)
+{
+    ((python_worker*) arg)->consume();
+    return NULL;
+}
+
+// the arena space of the payload, contiguous
+bool python_worker::reserve(python_event& e, unsigned len)
+{
+    if (_head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) > _mask)
+        return false;
+    u_int64_t start = _data_head;
+    unsigned offset = start % _bytes;
+    if (offset + len > _bytes)
+        start += _bytes - offset;
+    if (len && start + len - __atomic_load_n(&_data_tail, __ATOMIC_ACQUIRE) > _bytes)
+        return false;
+    e.data = start;
+    e.len = len;
+    return true;
+}
+
+bool python_worker::push(python_event& e, const char* data, unsigned len, bool wait)
+{
+    // too big for the arena, or after the exit
+    if (len > _bytes || _stopped)
+        return false;
+    bool blocked = false;
+    for (;;)
+    {
+        if (__atomic_load_n(&_failed, __ATOMIC_ACQUIRE))
+            throw python_error();
+        if (reserve(e, len))
+            break;
+        if (!wait)
+            return false;
+        if (!blocked)
+            _counters.blocked++;
+        blocked = true;
+        backoff();
+    }
+    if (len)
+    {
+        memcpy(&_arena[e.data % _bytes], data, len);
+        _data_head = e.data + len;
+    }
+    _ring[_head & _mask] = e;
+    __atomic_store_n(&_head, _head + 1, __ATOMIC_RELEASE);
+    _counters.events++;
+    return true;
+}
+
+bool python_worker::crowded() const
+{
+    return (_head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)) * 2 > _ring.size();
+}
+
+void python_worker::wait_for(u_int64_t sequence)
+{
+    while (__atomic_load_n(&_tail, __ATOMIC_ACQUIRE) < sequence)
+    {
+        if (__atomic_load_n(&_failed, __ATOMIC_ACQUIRE))
+            throw python_error();
+        backoff();
+    }
+}
+
+unsigned python_worker::load(const std::string& python_ref, bool& data)
+{
+    std::map<std::string, std::pair<unsigned, bool> >::iterator i = _loaded.find(python_ref);
+    if (i == _loaded.end())
+    {
+        python_event e = python_event();
+        e.type = python_event::load;
+        check(push(e, python_ref.data(), python_ref.size(), true), common_exception("python reference too long"));
+        // the worker fills _class_data before moving the tail
+        wait_for(_head);
+        i = _loaded.insert(make_pair(python_ref, make_pair(_loads, bool(_class_data[_loads])))).first;
+        _loads++;
+    }
+    data = i->second.second;
+    return i->second.first;
+}
+
+void python_worker::reload()
+{
+    python_event e = python_event();
+    e.type = python_event::reload;
+    push(e, NULL, 0, true);
+    _loaded.clear();
+}
+
+bool python_worker::done(u_int64_t sequence) const
+{
+    return __atomic_load_n(&_tail, __ATOMIC_ACQUIRE) >= sequence || __atomic_load_n(&_failed, __ATOMIC_ACQUIRE);
+}
+
+void python_worker::write_output(u_int64_t sequence, std::basic_ostream<char>& out)
+{
+    // the worker fills _output before moving the tail, and the capture
+    // thread waits here for each append: one is processed at a time
+    wait_for(sequence);
+    out << _output;
+    _output.clear();
+}
+
+void python_worker::stop()
+{
+    python_event e = python_event();
+    e.type = python_event::stop;
+    try
+    {
+        push(e, NULL, 0, true);
+        wait_for(_head);
+    }
+    catch (python_error&)
+    {
+    }
+    pthread_join(_thread, NULL);
+    _stopped = true;
+}
+
+void python_worker::consume()
+{
+    unsigned idle = 0;
+    try
+    {
+        for (;;)
+        {
+            if (_tail == __atomic_load_n(&_head, __ATOMIC_ACQUIRE))
+            {
+                // a short sleep once the ring stays empty
+                if (++idle > 100)
+                    backoff();
+                continue;
+            }
+            idle = 0;
+            const python_event& e = _ring[_tail & _mask];
+            process(e);
+            if (e.len)
+                __atomic_store_n(&_data_tail, e.data + e.len, __ATOMIC_RELEASE);
+            bool last = e.type == python_event::stop;
+            __atomic_store_n(&_tail, _tail + 1, __ATOMIC_RELEASE);
+            if (last)
+                return;
+        }
+    }
+    catch (...)
+    {
+        // the capture thread raises it with its next event
+        __atomic_store_n(&_failed, true, __ATOMIC_RELEASE);
+    }
+}
+
+void python_worker::process(const python_event& e)
+{
+    char* data = &_arena[e.data % _bytes];
+    if (e.type == python_event::load)
+    {
+        START_PYTHON_CALL
+        python::object cls = get_python_class(string(data, e.len));
+        const python_class& overrides = resolve_class(cls.ptr());
+        _classes.push_back(cls);
+        _class_data.push_back(!overrides.on_request.is_none() || !overrides.on_response.is_none() || !overrides.handle_batch.is_none());
+        END_PYTHON_CALL
+        return;
+    }
+    if (e.type == python_event::reload)
+    {
+        // the classes already loaded stay in _classes for their transactions
+        START_PYTHON_CALL
+        forget_python_classes();
+        END_PYTHON_CALL
+        return;
+    }
+    if (e.type == python_event::stop)
+    {
+        START_PYTHON_CALL
+        _transactions.clear();
+        if (!exit_handler.is_none())
+            exit_handler();
+        END_PYTHON_CALL
+        return;
+    }
+    if (e.type == python_event::create)
+    {
+        START_PYTHON_CALL
+        transaction& t = _transactions[e.id];
+        memset(&t.stream, 0, sizeof(t.stream));
+        t.py_base = _classes[e.python_class]();
+        BaseHandler& py = python::extract<BaseHandler&>(t.py_base) BOOST_EXTRACT_WORKAROUND;
+        t.handler = &py;
+        END_PYTHON_CALL
+        return;
+    }
+    std::map<u_int64_t, transaction>::iterator i = _transactions.find(e.id);
+    if (i == _transactions.end())
+        return;
+    if (e.type == python_event::destroy)
+    {
+        START_PYTHON_CALL
+        _transactions.erase(i);
+        END_PYTHON_CALL
+        return;
+    }
+    // the stream as the handler would have seen it
+    tcp_stream& stream = i->second.stream;
+    stream.addr = e.addr;
+    stream.server.data = stream.client.data = NULL;
+    stream.server.count_new = stream.client.count_new = 0;
+    if (e.type == python_event::request)
+    {
+        stream.server.data = data;
+        stream.server.count_new = e.len;
+    }
+    else if (e.type == python_event::response)
+    {
+        stream.client.data = data;
+        stream.client.count_new = e.len;
+    }
+    BaseHandler* handler = i->second.handler;
+    const timeval* t = e.has_time ? &e.time : NULL;
+    switch (e.type)
+    {
+        case python_event::opening:
+            handler->onOpening(&stream, t);
+            break;
+        case python_event::open:
+            handler->onOpen(&stream, t);
+            break;
+        case python_event::request:
+            handler->onRequest(&stream, t);
+            break;
+        case python_event::response:
+            handler->onResponse(&stream, t);
+            break;
+        case python_event::close:
+            handler->onClose(&stream, t, NULL);
+            break;
+        case python_event::exit:
+            handler->onExit(&stream);
+            break;
+        case python_event::append:
+        {
+            ostringstream out;
+            out.setf(ios_base::fixed);
+            handler->append(out, t);
+            if (e.output)
+                *e.output = out.str();
+            else
+                _output = out.str();
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+//class python_handler
+
+python_handler::python_handler(const string& python_ref): __handler(NULL), _id(0), _data(false), _dropped(false)
+{
+    if (python_worker* worker = python_worker::instance())
+    {
+        python_event e = python_event();
+        e.type = python_event::create;
+        e.python_class = worker->load(python_ref, _data);
+        if (parser::python_overflow() == parser::python_sample && worker->crowded())
+        {
+            worker->stats().skipped_transactions++;
+            return;
+        }
+        e.id = worker->next_id();
+        if (worker->push(e, NULL, 0, parser::python_overflow() != parser::python_drop))
+            _id = e.id;
+        else
+            worker->stats().dropped_transactions++;
+        return;
+    }
+    START_PYTHON_CALL
+    python::object py_base_class = get_python_class(python_ref);
+    python::object instance = py_base_class();
+    py_base = python::handle<>(python::borrowed(instance.ptr()));
+    BaseHandler& py = python::extract<BaseHandler&>(instance) BOOST_EXTRACT_WORKAROUND;
     __handler = &py;
     END_PYTHON_CALL
 }
 
+python_handler::~python_handler()
+{
+    python_worker* worker = python_worker::running();
+    if (worker == NULL || _id == 0)
+        return;
+    // even a dropped transaction has its python object to release
+    python_event e = python_event();
+    e.type = python_event::destroy;
+    e.id = _id;
+    try
+    {
+        worker->push(e, NULL, 0, true);
+    }
+    catch (python_error&)
+    {
+    }
+}
+
+bool python_handler::queue(python_worker* worker, python_event::type_enum type, tcp_stream* pstream, const timeval* t, half_stream* half, std::string* output)
+{
+    if (_id == 0)
+        return false;
+    if (_dropped)
+    {
+        worker->stats().dropped_events++;
+        return false;
+    }
+    python_event e = python_event();
+    e.type = type;
+    e.id = _id;
+    e.has_time = t != NULL;
+    if (t)
+        e.time = *t;
+    if (pstream)
+        e.addr = pstream->addr;
+    e.output = output;
+    bool data = half && _data;
+    if (!worker->push(e, data ? half->data : NULL, data ? half->count_new : 0, parser::python_overflow() != parser::python_drop))
+    {
+        // too big for the arena, or the ring is full
+        _dropped = true;
+        worker->stats().dropped_transactions++;
+        worker->stats().dropped_events++;
+        return false;
+    }
+    return true;
+}
+
+// the %python field of a log line, written by the worker into text; a
+// transaction skipped or dropped is ready at once, empty
+class python_field: public deferred_field
+{
+public:
+    python_field(python_worker* worker): sequence(0), _worker(worker){}
+    virtual bool ready(){return _worker->done(sequence);}
+    virtual void wait()
+    {
+        while (!ready())
+            backoff();
+    }
+    u_int64_t sequence;
+private:
+    python_worker* _worker;
+};
+
+deferred_field::ptr python_handler::defer(const timeval* t)
+{
+    python_worker* worker = python_worker::instance();
+    if (worker == NULL)
+        return deferred_field::ptr();
+    python_field* field = new python_field(worker);
+    deferred_field::ptr result(field);
+    if (queue(worker, python_event::append, NULL, t, NULL, &field->text))
+        field->sequence = worker->last();
+    return result;
+}
+
 void python_handler::append(std::basic_ostream<char>& out, const timeval* t)
 {
+    if (python_worker* worker = python_worker::instance())
+    {
+        // a key or a command needs the output now
+        if (queue(worker, python_event::append, NULL, t))
+            worker->write_output(worker->last(), out);
+        return;
+    }
     __handler->append(out, t);
 }
 
 void python_handler::onOpening(tcp_stream* pstream, const timeval* t)
 {
-    __handler->onOpening(pstream, t);
+    if (python_worker* worker = python_worker::instance())
+        queue(worker, python_event::opening, pstream, t);
+    else
+        __handler->onOpening(pstream, t);
 }
 
 void python_handler::onOpen(tcp_stream* pstream, const timeval* t)
 {
-    __handler->onOpen(pstream, t);
+    if (python_worker* worker = python_worker::instance())
+        queue(worker, python_event::open, pstream, t);
+    else
+        __handler->onOpen(pstream, t);
 }
 
 void python_handler::onRequest(tcp_stream* pstream, const timeval* t)
 {
-    __handler->onRequest(pstream, t);
+    if (python_worker* worker = python_worker::instance())
+        queue(worker, python_event::request, pstream, t, &pstream->server);
+    else
+        __handler->onRequest(pstream, t);
 }
 
 void python_handler::onResponse(tcp_stream* pstream,const  timeval* t)
 {
-    __handler->onResponse(pstream, t);
+    if (python_worker* worker = python_worker::instance())
+        queue(worker, python_event::response, pstream, t, &pstream->client);
+    else
+        __handler->onResponse(pstream, t);
 }
 
 void python_handler::onClose(tcp_stream* pstream, const timeval*t ,unsigned char* packet)
 {
-    __handler->onClose(pstream, t, packet);
+    if (python_worker* worker = python_worker::instance())
+        queue(worker, python_event::close, pstream, t);
+    else
+        __handler->onClose(pstream, t, packet);
 }
 
 void python_handler::onExit(tcp_stream* pstream)
 {
-    __handler->onExit(pstream);
+    if (python_worker* worker = python_worker::instance())
+        queue(worker, python_event::exit, pstream, NULL);
+    else
+        __handler->onExit(pstream);
 }
 
 class PythonModule: public Module
@@ -265,9 +1085,26 @@ public:
     }
     virtual void on_exit(void)
     {
+        if (python_worker* worker = python_worker::running())
+        {
+            // the worker calls the exit handler after the events left
+            worker->stop();
+            const python_worker::counters& stats = worker->stats();
+            cerr << "python queue: " << stats.events << " events, " << stats.blocked << " blocked, "
+                << stats.dropped_transactions << " transactions dropped (" << stats.dropped_events << " events), "
+                << stats.skipped_transactions << " transactions skipped" << endl;
+            return;
+        }
         if (!exit_handler.is_none())
             exit_handler();
     }
+    virtual void reload(void)
+    {
+        if (python_worker* worker = python_worker::running())
+            worker->reload();
+        else
+            forget_python_classes();
+    }
 };
 
 REGISTER_MODULE(PythonModule);
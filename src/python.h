@@ -13,6 +13,7 @@
 #define _sniffer_python_embedding_h
 
 #include <boost/python.hpp>
+#include <pthread.h>
 #include "formatter.h"
 
 namespace python=boost::python;
@@ -28,6 +29,13 @@ private:
     std::basic_ostream<char>& _out;
 };
 
+// a read-only Payload over the bytes of a callback, without copying them
+// (but for the memoryviews, see payload_object)
+PyObject* payload_new(const char* data, unsigned len);
+// the Payload cannot be read anymore (the bytes are not valid after the
+// callback), its memoryviews still can
+void payload_release(PyObject* payload);
+
 class TCPStream
 {
 public:
@@ -49,6 +57,21 @@ public:
         return std::string(_tcp_stream->client.data, _tcp_stream->client.data + _tcp_stream->client.count_new);
     }
     
+    // client_data and server_data without the copy, valid until the callback returns
+    python::object client_payload(){
+        return payload(_client_payload, _tcp_stream->server);
+    }
+    
+    python::object server_payload(){
+        return payload(_server_payload, _tcp_stream->client);
+    }
+    
+    // at the end of every callback
+    void release(){
+        release(_client_payload);
+        release(_server_payload);
+    }
+    
     std::string src_ip(){
         return ip_to_str(_tcp_stream->addr.saddr);
     }
@@ -67,7 +90,32 @@ public:
     
     //virtual ~TCPStream(){}
 private:
+    python::object payload(python::object& cached, half_stream& half){
+        if (cached.is_none())
+            cached = python::object(python::handle<>(payload_new(half.data, half.count_new)));
+        return cached;
+    }
+    
+    static void release(python::object& cached){
+        if (!cached.is_none())
+        {
+            payload_release(cached.ptr());
+            cached = python::object();
+        }
+    }
+    
     tcp_stream * _tcp_stream;
+    python::object _client_payload, _server_payload;
+};
+
+// releases the payloads of the stream when the callback returns, even with an error
+class payload_guard
+{
+public:
+    payload_guard(TCPStream& stream): _stream(stream){}
+    ~payload_guard(){_stream.release();}
+private:
+    TCPStream& _stream;
 };
 
 class BaseHandlerInterface
@@ -95,27 +143,39 @@ public:
 	}
     
 	virtual void onOpening(tcp_stream* pstream, const timeval* t){
-	    onOpening(get_tcp_stream(pstream), to_double(*t));
+	    TCPStream& stream = get_tcp_stream(pstream);
+	    payload_guard guard(stream);
+	    onOpening(stream, to_double(*t));
 	}
     
 	virtual void onOpen(tcp_stream* pstream, const timeval* t){
-	    onOpen(get_tcp_stream(pstream), to_double(*t));
+	    TCPStream& stream = get_tcp_stream(pstream);
+	    payload_guard guard(stream);
+	    onOpen(stream, to_double(*t));
 	}
     
 	virtual void onRequest(tcp_stream* pstream, const timeval* t){
-	    onRequest(get_tcp_stream(pstream), to_double(*t));
+	    TCPStream& stream = get_tcp_stream(pstream);
+	    payload_guard guard(stream);
+	    onRequest(stream, to_double(*t));
 	}
     
 	virtual void onResponse(tcp_stream* pstream,const  timeval* t){
-	    onResponse(get_tcp_stream(pstream), to_double(*t));
+	    TCPStream& stream = get_tcp_stream(pstream);
+	    payload_guard guard(stream);
+	    onResponse(stream, to_double(*t));
 	}
     
 	virtual void onClose(tcp_stream* pstream, const timeval* t ,unsigned char* packet){
-	    onClose(get_tcp_stream(pstream), to_double(*t));
+	    TCPStream& stream = get_tcp_stream(pstream);
+	    payload_guard guard(stream);
+	    onClose(stream, to_double(*t));
 	}
     
 	virtual void onExit(tcp_stream* pstream){
-        onExit(get_tcp_stream(pstream));
+        TCPStream& stream = get_tcp_stream(pstream);
+        payload_guard guard(stream);
+        onExit(stream);
 	}
     virtual void append(OUTStream& s, double time){};
 	virtual void onOpening(TCPStream& stream, double time){};
@@ -135,7 +195,7 @@ public:
     virtual ~BaseHandler() {
         
     };
-private:
+protected:
     TCPStream& get_tcp_stream(tcp_stream* pstream)
     {
         if (!pTcpstream)
@@ -143,24 +203,133 @@ private:
         return *pTcpstream.get();
     }
         
+private:
     boost::shared_ptr<TCPStream> pTcpstream;
 }; 
 
+// an event of a python handler, queued for the worker thread
+struct python_event
+{
+    enum type_enum {load, create, opening, open, request, response, close, exit, append, destroy, reload, stop};
+    type_enum type;
+    // the transaction (python_handler) it belongs to
+    u_int64_t id;
+    // create: the class, as returned by python_worker::load
+    unsigned python_class;
+    bool has_time;
+    timeval time;
+    tuple4 addr;
+    // the payload (load: the python reference) in the arena, at position data
+    u_int64_t data;
+    unsigned len;
+    // append: where the worker renders the output, NULL for write_output
+    std::string* output;
+};
+
+// with --python-queue the python handlers run on a worker thread, so that
+// slow python code does not stall the capture: their events go through a
+// bounded single producer/single consumer ring, the payloads (only for the
+// classes that read them) through a byte arena. The %python field of a log
+// line is rendered by the worker, the line is written once it is complete
+// (see ordered_lines); in the other formats (e.g. a key) the field waits
+// for the worker. When the ring is full the
+// overflow policy applies: block waits for room, drop discards the rest of
+// the transaction, sample skips the new transactions while the ring is more
+// than half full
+class python_worker
+{
+public:
+    struct counters
+    {
+        counters(): events(0), blocked(0), dropped_events(0), dropped_transactions(0), skipped_transactions(0){}
+        u_int64_t events, blocked, dropped_events, dropped_transactions, skipped_transactions;
+    };
+    // the worker, started on the first call; NULL without --python-queue
+    static python_worker* instance();
+    // the worker if it is running
+    static python_worker* running(){return _instance;}
+    // loads the class (<filename>#<classname>) in the worker, data tells if it reads the payloads
+    unsigned load(const std::string& python_ref, bool& data);
+    // the classes loaded from now on are read again from their files
+    void reload();
+    // false if the ring or the arena is full and wait is false
+    bool push(python_event& e, const char* data, unsigned len, bool wait);
+    bool crowded() const;
+    unsigned capacity() const {return _bytes;}
+    u_int64_t next_id(){return ++_last_id;}
+    counters& stats(){return _counters;}
+    // waits for the event with this sequence, an append, and writes its output
+    void write_output(u_int64_t sequence, std::basic_ostream<char>& out);
+    // the sequence of the last event pushed
+    u_int64_t last() const {return _head;}
+    // the event with this sequence is processed, or the worker failed
+    bool done(u_int64_t sequence) const;
+    // processes the events left and stops the thread
+    void stop();
+private:
+    python_worker(unsigned events, unsigned bytes);
+    static void* run(void* arg);
+    bool reserve(python_event& e, unsigned len);
+    void consume();
+    void process(const python_event& e);
+    void wait_for(u_int64_t sequence);
+    static python_worker* _instance;
+    // the python transactions of the worker, with the stream they see
+    struct transaction
+    {
+        tcp_stream stream;
+        python::object py_base;
+        BaseHandler* handler;
+    };
+    // written by the capture thread
+    u_int64_t _head, _data_head, _last_id;
+    unsigned _loads;
+    bool _stopped;
+    std::map<std::string, std::pair<unsigned, bool> > _loaded;
+    counters _counters;
+    // the two threads do not write to the same cache line
+    char _padding[64];
+    // written by the worker
+    u_int64_t _tail;
+    u_int64_t _data_tail;
+    bool _failed;
+    std::vector<python::object> _classes;
+    std::vector<bool> _class_data;
+    std::map<u_int64_t, transaction> _transactions;
+    // shared
+    std::vector<python_event> _ring;
+    u_int64_t _mask;
+    std::vector<char> _arena;
+    unsigned _bytes;
+    pthread_t _thread;
+    // the output of the append being processed, read once the tail moves past it
+    std::string _output;
+};
+
 class python_handler: public basic_handler
 {
 public:
     python_handler(const string& python_ref);
     virtual void append(std::basic_ostream<char>& out, const timeval* t);
+    virtual bool deferred() const {return python_worker::running() != NULL;}
+    virtual deferred_field::ptr defer(const timeval* t);
 	virtual void onOpening(tcp_stream* pstream, const timeval* t);
 	virtual void onOpen(tcp_stream* pstream, const timeval* t);
 	virtual void onExit(tcp_stream* pstream);
 	virtual void onRequest(tcp_stream* pstream, const timeval* t);
 	virtual void onResponse(tcp_stream* pstream,const  timeval* t);
 	virtual void onClose(tcp_stream* pstream, const timeval* ,unsigned char* packet);
-    virtual ~python_handler(){};
+    virtual ~python_handler();
 private:
+    // with the worker: the event goes to the transaction _id, false if it is not pushed
+    bool queue(python_worker* worker, python_event::type_enum type, tcp_stream* pstream, const timeval* t, half_stream* half = NULL, std::string* output = NULL);
     BaseHandler* __handler;
-    python::object py_base;
+    // not an object: without the worker no python call happens on the capture thread
+    python::handle<> py_base;
+    // the transaction in the worker, 0 if skipped or dropped when created
+    u_int64_t _id;
+    // the class reads the payloads; the rest of the transaction is dropped
+    bool _data, _dropped;
 };
 
 #endif// _sniffer_python_embedding_h
@@ -1,37 +1,408 @@
-#include "python.h"
+/*
+	Copyright (c) 2007-2012 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+
+*/
+
 #include <iostream>
-#include "utilities.h"
-#include <map>
+#include <sstream>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
 #include <nids2.h>
+#include "formatter.h"
+#include "utilities.h"
 #include "read_file.h"
 
-void read_file(string filename, string capture_string)
-{
-    parser p;
-    nids_params.pcap_timeout=10;
-	nids_params.tcp_workarounds=1;
-    nids_params.n_tcp_streams=65535;
-    nids_params.n_hosts= 65535;
-    nids_params.filename=(char*)filename.c_str();
-    nids_chksum_ctl chksumctl[1];
-    chksumctl[0].netaddr = ip_to_ulong(0,0,0,0);
-    chksumctl[0].mask = ip_to_ulong(0,0,0,0);
-    chksumctl[0].action = NIDS_DONT_CHKSUM;
-    union
-	{
-		  void (*func) (struct tcp_stream *ts, void **yoda, struct timeval* t, unsigned char* packet);
-		  void* ptr_nids_handler;
-		  
-	}un;
-	un.func =parser::nids_handler;
-  	nids_register_tcp(un.ptr_nids_handler);
-
-    nids_register_chksum_ctl(chksumctl, 1);
-    
-    if (capture_string.empty())
-        nids_params.pcap_filter = NULL;
-    else
-        nids_params.pcap_filter = (char*)capture_string.c_str();
-    //nids_run();
-        
-} 
+using namespace std;
+
+// the parser thread writes to the socket a header, the status (0 if the
+// file can be read) and the column names or the error message, then the
+// records: the values of the columns, each one prefixed by its length
+
+static const u_int32_t status_ok = 0;
+static const u_int32_t status_error = 1;
+
+static const size_t output_size = 64 * 1024;
+static const size_t input_size = 256 * 1024;
+
+// the packets read between two checks of the end of the reader
+static const int dispatch_packets = 1024;
+
+// a reader is open, guarded by open_mutex
+static pthread_mutex_t open_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool reading = false;
+
+static void release_reading()
+{
+	pthread_mutex_lock(&open_mutex);
+	reading = false;
+	pthread_mutex_unlock(&open_mutex);
+}
+
+static void null_syslog(int type, int errnum, struct ip *iph, void *data)
+{
+}
+
+///// record_printer /////
+
+// the printer of the parser thread
+class record_printer : public printer
+{
+public:
+	record_printer(int fd): _fd(fd), _closed(false){_value.setf(ios_base::fixed);}
+	void set_keywords(const vector<string>& keywords){_keywords = keywords;}
+	// the reader has been closed
+	bool closed() const {return _closed;}
+	void doit(handlers::iterator start, handlers::iterator end, const timeval* t)
+	{
+		if (_closed)
+			return;
+		vector<string>::size_type i = 0;
+		for (handlers::iterator it = start; it != end; ++it, ++i)
+		{
+			if (i < _keywords.size() && _keywords[i].empty())
+				continue;
+			_value.str("");
+			(*it)->append(_value, t);
+			put(_value.str());
+		}
+		if (_buffer.size() >= output_size)
+			flush();
+	}
+	void header(u_int32_t status, const vector<string>& values)
+	{
+		put(status);
+		put(values.size());
+		for (vector<string>::const_iterator it = values.begin(); it != values.end(); ++it)
+			put(*it);
+		flush();
+	}
+	void flush()
+	{
+		const char* data = _buffer.data();
+		size_t left = _buffer.size();
+		while (left && !_closed)
+		{
+			// no SIGPIPE once the reader has been closed
+			ssize_t n = send(_fd, data, left, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				_closed = true;
+			data += n;
+			left -= n;
+		}
+		_buffer.clear();
+	}
+private:
+	void put(u_int32_t value){_buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));}
+	void put(const string& value){put(value.size()); _buffer.append(value);}
+	int _fd;
+	bool _closed;
+	vector<string> _keywords;
+	ostringstream _value;
+	string _buffer;
+};
+
+///// pcap_reader /////
+
+pcap_reader::pcap_reader(const string& filename, const string& format, const string& filter, bool truncated):
+	_filename(filename), _format(format), _filter(filter), _truncated(truncated), _running(false), _ok(false), _fd(-1), _out(-1), _in(input_size), _begin(0), _end(0)
+{
+	pthread_mutex_lock(&open_mutex);
+	bool busy = reading;
+	reading = true;
+	pthread_mutex_unlock(&open_mutex);
+	check(!busy, common_exception("another pcap file is being read"));
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+	{
+		release_reading();
+		throw common_exception(string("cannot create the socket: ").append(strerror(errno)));
+	}
+	_fd = fds[0];
+	_out = fds[1];
+	int error = pthread_create(&_thread, NULL, start, this);
+	if (error)
+	{
+		close(_fd);
+		close(_out);
+		release_reading();
+		throw common_exception(string("cannot start the reader: ").append(strerror(error)));
+	}
+	_running = true;
+	try
+	{
+		if (!fill(2 * sizeof(u_int32_t)))
+			throw common_exception(string("the reader of ").append(filename).append(" failed"));
+		u_int32_t status = get_u32();
+		u_int32_t count = get_u32();
+		for (u_int32_t i = 0; i < count; i++)
+			_columns.push_back(get_string());
+		if (status != status_ok)
+			throw common_exception(_columns.empty() ? string("cannot read ").append(filename) : _columns.front());
+	}
+	catch (...)
+	{
+		close(_fd);
+		wait();
+		throw;
+	}
+	_data.resize(_columns.size());
+	_offsets.resize(_columns.size(), vector<u_int32_t>(1, 0));
+}
+
+pcap_reader::~pcap_reader()
+{
+	// the thread stops at its next write
+	close(_fd);
+	wait();
+}
+
+bool pcap_reader::wait()
+{
+	if (!_running)
+		return _ok;
+	pthread_join(_thread, NULL);
+	_running = false;
+	return _ok;
+}
+
+unsigned pcap_reader::read(unsigned max)
+{
+	for (vector<string>::size_type c = 0; c < _columns.size(); c++)
+	{
+		_data[c].clear();
+		_offsets[c].resize(1);
+	}
+	unsigned records = 0;
+	for (; records < max && !_columns.empty(); records++)
+	{
+		if (!fill(sizeof(u_int32_t)))
+		{
+			// the end of the file, if the thread did not fail
+			if (!wait())
+				throw common_exception(string("the reader of ").append(_filename).append(" failed"));
+			break;
+		}
+		for (vector<string>::size_type c = 0; c < _columns.size(); c++)
+		{
+			u_int32_t len = get_u32();
+			if (!fill(len))
+				throw common_exception(string("the reader of ").append(_filename).append(" failed"));
+			_data[c].append(&_in[_begin], len);
+			_begin += len;
+			_offsets[c].push_back(_data[c].size());
+		}
+	}
+	return records;
+}
+
+bool pcap_reader::fill(size_t n)
+{
+	if (_end - _begin >= n)
+		return true;
+	if (_begin)
+	{
+		memmove(&_in[0], &_in[_begin], _end - _begin);
+		_end -= _begin;
+		_begin = 0;
+	}
+	if (_in.size() < n)
+		_in.resize(n);
+	while (_end < n)
+	{
+		ssize_t len = ::read(_fd, &_in[_end], _in.size() - _end);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return false;
+		_end += len;
+	}
+	return true;
+}
+
+u_int32_t pcap_reader::get_u32()
+{
+	if (!fill(sizeof(u_int32_t)))
+		throw common_exception(string("the reader of ").append(_filename).append(" failed"));
+	u_int32_t value;
+	memcpy(&value, &_in[_begin], sizeof(value));
+	_begin += sizeof(value);
+	return value;
+}
+
+string pcap_reader::get_string()
+{
+	u_int32_t len = get_u32();
+	if (!fill(len))
+		throw common_exception(string("the reader of ").append(_filename).append(" failed"));
+	string value(&_in[_begin], len);
+	_begin += len;
+	return value;
+}
+
+void* pcap_reader::start(void* reader)
+{
+	pcap_reader* r = static_cast<pcap_reader*>(reader);
+	r->_ok = r->run();
+	// the reader sees the end of the socket, another one can start
+	close(r->_out);
+	release_reading();
+	return NULL;
+}
+
+bool pcap_reader::run()
+{
+	record_printer out(_out);
+	bool started = false, initialized = false;
+	try
+	{
+		parser p;
+		p.set_default_not_found("-");
+		p.set_handle_truncated(_truncated);
+		p.parse(_format.c_str());
+		p.set_printer(&out);
+		const vector<string>& keywords = p.get_sections().front()->keywords;
+		vector<string> columns;
+		for (vector<string>::const_iterator it = keywords.begin(); it != keywords.end(); ++it)
+			if (!it->empty())
+				columns.push_back(it->substr(1));
+		out.set_keywords(keywords);
+
+		nids_params.filename = (char*)_filename.c_str();
+		nids_params.device = NULL;
+		nids_params.pcap_filter = _filter.empty() ? NULL : (char*)_filter.c_str();
+		nids_params.scan_num_hosts = 0;
+		nids_params.pcap_timeout = 10;
+		nids_params.tcp_workarounds = 1;
+		nids_params.n_tcp_streams = 65535;
+		nids_params.n_hosts = 65535;
+		nids_params.syslog = reinterpret_cast<void (*)()>(null_syslog);
+		if (!nids_init())
+			throw common_exception(nids_errbuf);
+		initialized = true;
+		union
+		{
+			void (*func) (struct tcp_stream *ts, void **yoda, struct timeval* t, unsigned char* packet);
+			void* ptr_nids_handler;
+		}un;
+		un.func = parser::nids_handler;
+		nids_register_tcp(un.ptr_nids_handler);
+		// as justniffer, see main
+		nids_chksum_ctl chksumctl[1];
+		chksumctl[0].netaddr = ip_to_ulong(0,0,0,0);
+		chksumctl[0].mask = ip_to_ulong(0,0,0,0);
+		chksumctl[0].action = NIDS_DONT_CHKSUM;
+		nids_register_chksum_ctl(chksumctl, 1);
+
+		out.header(status_ok, columns);
+		started = true;
+		int n = 0;
+		while (!out.closed() && (n = nids_dispatch(dispatch_packets)) > 0);
+		check(out.closed() || n == 0, common_exception(nids_errbuf));
+		initialized = false;
+		nids_exit();
+		parser::on_exit();
+		out.flush();
+	}
+	catch (exception& e)
+	{
+		if (initialized)
+			nids_exit();
+		if (started)
+			cerr << _filename << ": " << e.what() << "\n";
+		else
+			out.header(status_error, vector<string>(1, e.what()));
+		return false;
+	}
+	return true;
+}
+
+///// C interface /////
+
+struct justniffer_reader
+{
+	justniffer_reader(pcap_reader* r): reader(r){}
+	boost::shared_ptr<pcap_reader> reader;
+	string error;
+};
+
+static void copy_error(const string& message, char* error, unsigned error_size)
+{
+	if (error == NULL || error_size == 0)
+		return;
+	strncpy(error, message.c_str(), error_size - 1);
+	error[error_size - 1] = 0;
+}
+
+justniffer_reader* justniffer_open(const char* filename, const char* format, const char* filter, int truncated, char* error, unsigned error_size)
+{
+	try
+	{
+		return new justniffer_reader(new pcap_reader(filename, format, filter ? filter : "", truncated != 0));
+	}
+	catch (exception& e)
+	{
+		copy_error(e.what(), error, error_size);
+	}
+	catch (...)
+	{
+		copy_error("unknown error", error, error_size);
+	}
+	return NULL;
+}
+
+unsigned justniffer_columns(justniffer_reader* reader)
+{
+	return reader->reader->columns().size();
+}
+
+const char* justniffer_column(justniffer_reader* reader, unsigned column)
+{
+	return reader->reader->columns()[column].c_str();
+}
+
+int justniffer_read(justniffer_reader* reader, unsigned max_records)
+{
+	try
+	{
+		return reader->reader->read(max_records);
+	}
+	catch (exception& e)
+	{
+		reader->error = e.what();
+	}
+	return -1;
+}
+
+const char* justniffer_data(justniffer_reader* reader, unsigned column, unsigned* size)
+{
+	const string& data = reader->reader->data(column);
+	*size = data.size();
+	return data.data();
+}
+
+const unsigned* justniffer_offsets(justniffer_reader* reader, unsigned column)
+{
+	return &reader->reader->offsets(column)[0];
+}
+
+const char* justniffer_error(justniffer_reader* reader)
+{
+	return reader->error.c_str();
+}
+
+void justniffer_close(justniffer_reader* reader)
+{
+	delete reader;
+}
@@ -1 +1,88 @@
-void read_file(string filename, string capture_string);
+/*
+	Copyright (c) 2007-2012 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+
+*/
+
+#ifndef _sniffer_read_file_h
+#define _sniffer_read_file_h
+
+// libjustniffer: the records of a pcap file, for the format keywords
+// (the plain text of the format is not a column)
+
+#ifdef __cplusplus
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <pthread.h>
+
+// libnids and the parser are one per process: the reader analyzes its
+// file in a thread of its own and receives the records through a socket,
+// and only one reader at a time can be open in a process
+class pcap_reader
+{
+public:
+	// throws common_exception if the format or the file cannot be read, or
+	// if another reader is open
+	pcap_reader(const std::string& filename, const std::string& format, const std::string& filter, bool truncated);
+	~pcap_reader();
+	const std::vector<std::string>& columns() const {return _columns;}
+	// reads up to max records in the batch, 0 at the end of the file
+	unsigned read(unsigned max);
+	// the values of a column in the batch, one after the other: the value
+	// of the record i is between offsets(column)[i] and offsets(column)[i+1]
+	const std::string& data(unsigned column) const {return _data[column];}
+	const std::vector<u_int32_t>& offsets(unsigned column) const {return _offsets[column];}
+private:
+	pcap_reader(const pcap_reader&);
+	pcap_reader& operator=(const pcap_reader&);
+	static void* start(void* reader);
+	// the parser thread, false if it failed
+	bool run();
+	// at least n bytes in the input buffer, false at the end of the pipe
+	bool fill(size_t n);
+	u_int32_t get_u32();
+	std::string get_string();
+	// joins the parser thread, false if it failed
+	bool wait();
+	std::string _filename, _format, _filter;
+	bool _truncated;
+	pthread_t _thread;
+	bool _running, _ok;
+	// the end of the socket read by the reader, written by the thread
+	int _fd, _out;
+	std::vector<std::string> _columns;
+	std::vector<std::string> _data;
+	std::vector<std::vector<u_int32_t> > _offsets;
+	std::vector<char> _in;
+	size_t _begin, _end;
+};
+
+extern "C" {
+#endif
+
+typedef struct justniffer_reader justniffer_reader;
+
+// NULL on error, with the message in error; one reader at a time
+justniffer_reader* justniffer_open(const char* filename, const char* format, const char* filter, int truncated, char* error, unsigned error_size);
+unsigned justniffer_columns(justniffer_reader* reader);
+const char* justniffer_column(justniffer_reader* reader, unsigned column);
+// the records in the batch, 0 at the end of the file, -1 on error (see justniffer_error)
+int justniffer_read(justniffer_reader* reader, unsigned max_records);
+const char* justniffer_data(justniffer_reader* reader, unsigned column, unsigned* size);
+// an offset more than the records of the batch, in the data of the column
+const unsigned* justniffer_offsets(justniffer_reader* reader, unsigned column);
+const char* justniffer_error(justniffer_reader* reader);
+void justniffer_close(justniffer_reader* reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _sniffer_read_file_h
@@ -12,11 +12,10 @@
 
 using namespace std;
 
-string regex(const boost::regex& re, const string& text)
+// the last group of the match
+static string last_group(const boost::smatch& what)
 {
 	string result;
-	boost::smatch what;
-	if (boost::regex_search(text, what, re))
 	for (boost::smatch::const_iterator it = what.begin(); it != what.end(); it++)
 	{
 		result.assign(*it);
@@ -24,6 +23,14 @@ string regex(const boost::regex& re, const string& text)
 	return result;
 }
 
+string regex(const boost::regex& re, const string& text)
+{
+	boost::smatch what;
+	if (boost::regex_search(text, what, re))
+		return last_group(what);
+	return string();
+}
+
 void regex_handler_base::append(std::basic_ostream<char>& out, const timeval*)
 {
 	string res = ::regex(_re, get_text());
@@ -31,4 +38,68 @@ void regex_handler_base::append(std::basic_ostream<char>& out, const timeval*)
 		out << _not_found;
 	else
 		out<<res;
-}
\ No newline at end of file
+}
+///// grep keywords /////
+
+void regex_handler_grep::append(std::basic_ostream<char>& out, const timeval*)
+{
+	string res;
+	boost::smatch what;
+	if (_scan && _scan->match(_member, what))
+		res = last_group(what);
+	if (res.empty())
+		out << _not_found;
+	else
+		out << res;
+}
+
+///// regex_handler_body_base /////
+
+unsigned regex_handler_body_base::_max_window = 65536;
+
+regex_handler_body_base::regex_handler_body_base(bool request, const boost::regex& re, const string& not_found):
+	_decoder(request, this)
+{
+	_re = re;
+	_not_found = not_found;
+}
+
+bool regex_handler_body_base::on_decoded(const char* data, unsigned len)
+{
+	_window.append(data, len);
+	boost::smatch what;
+	if (boost::regex_search(_window, what, _re, boost::match_default | boost::match_partial))
+	{
+		// a match up to the end of the window may go on in the data to come
+		if (what[0].matched && what[0].second != _window.end())
+		{
+			_result = last_group(what);
+			_window.clear();
+			return false;
+		}
+		// a match could start here, or grow, with the data still to come
+		_window.erase(0, what[0].first - _window.begin());
+	}
+	else
+		_window.clear();
+	if (_window.size() > _max_window)
+		_window.erase(0, _window.size() - _max_window);
+	return true;
+}
+
+// the end of the body, or of the transaction: the window is complete
+void regex_handler_body_base::on_end()
+{
+	if (!_window.empty())
+		_result = ::regex(_re, _window);
+	_window.clear();
+}
+
+void regex_handler_body_base::append(std::basic_ostream<char>& out, const timeval*)
+{
+	on_end();
+	if (_result.empty())
+		out << _not_found;
+	else
+		out << _result;
+}
@@ -15,16 +15,29 @@
 std::string regex(const boost::regex& re, const std::string& text);
 
 template <class handler_t>
-class regex_handler_factory_t :public handler_factory
+class regex_handler_factory_t :public handler_factory, public grep_member
 {
 public:
 	regex_handler_factory_t(const std::string& arg,  boost::regex_constants::syntax_option_type options = boost::regex::icase):_re(arg, options){}
 	regex_handler_factory_t(const std::string& arg,  const string& not_found, boost::regex_constants::syntax_option_type options = boost::regex::icase):_re(arg, options), _not_found(not_found){}
 	virtual handler::ptr create_handler()
 	{
-		return handler::ptr(new handler_t(_re, _not_found));
+		return create(_not_found);
+	}
+	virtual grep_scope_enum grep_scope() const {return grep_scope_enum(handler_t::grep_scope);}
+	virtual unsigned grep_add(grep_group& group) const
+	{
+		return group.add(_re, grep_scope() == grep_request_headers || grep_scope() == grep_response_headers);
 	}
 protected:
+	handler::ptr create(const string& not_found)
+	{
+		handler_t* h = new handler_t(_re, not_found);
+		handler::ptr result(h);
+		if (_group)
+			grep_join(h, _group->scan(_member), _member);
+		return result;
+	}
 	boost::regex _re;
 	string _not_found;
 };
@@ -45,6 +58,7 @@ public:
 class regex_handler_base: public basic_handler
 {
 public:
+	enum {grep_scope = grep_none};
 	regex_handler_base() {}
 	virtual void append(std::basic_ostream<char>& out, const timeval* );
 
@@ -54,40 +68,102 @@ protected:
 	 string _not_found;
 };
 
-class regex_handler_request: public request_header_collector<regex_handler_base>
+// a grep keyword: the text is collected and scanned once for all the grep
+// keywords of the section (see grep_scan), by the first of them; the
+// expressions are kept by the grep_group
+class regex_handler_grep: public capture_handler
 {
 public:
-	regex_handler_request(const boost::regex& re, const std::string& not_found){_re=re; _not_found= not_found;}
-	regex_handler_request(const boost::regex& re){_re=re;}
+	regex_handler_grep(const boost::regex& re, const string& not_found): _not_found(not_found){}
+	virtual void append(std::basic_ostream<char>& out, const timeval* );
 protected:
-	virtual string& get_text() {return text;};
+	string _not_found;
+};
 
+// the request headers
+class regex_handler_request: public regex_handler_grep
+{
+public:
+	enum {grep_scope = grep_request_headers};
+	regex_handler_request(const boost::regex& re, const std::string& not_found): regex_handler_grep(re, not_found){}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t)
+	{
+		feed(pstream->server.data, pstream->server.count_new);
+	}
 };
 
-class regex_handler_response: public response_header_collector<regex_handler_base>
+// the response headers
+class regex_handler_response: public regex_handler_grep
 {
 public:
-	regex_handler_response(const boost::regex& re, const std::string& not_found){_re=re; _not_found= not_found;}
-	regex_handler_response(const boost::regex& re){_re=re;}
-protected:
-	virtual string& get_text() {return text;};
+	enum {grep_scope = grep_response_headers};
+	regex_handler_response(const boost::regex& re, const std::string& not_found): regex_handler_grep(re, not_found){}
+	virtual void onResponse(tcp_stream* pstream, const timeval* t)
+	{
+		feed(pstream->client.data, pstream->client.count_new);
+	}
 };
 
-class regex_handler_all_request: public request_collector<regex_handler_base>
+class regex_handler_all_request: public regex_handler_grep
 {
 public:
-	regex_handler_all_request(const boost::regex& re, const string& not_found ){_re=re; _not_found= not_found;}
-protected:
-	virtual string& get_text() {return text;};
+	enum {grep_scope = grep_request};
+	regex_handler_all_request(const boost::regex& re, const string& not_found): regex_handler_grep(re, not_found){}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t)
+	{
+		feed(pstream->server.data, pstream->server.count_new);
+	}
+};
 
+class regex_handler_all_response: public regex_handler_grep
+{
+public:
+	enum {grep_scope = grep_response};
+	regex_handler_all_response(const boost::regex& re, const string& not_found): regex_handler_grep(re, not_found){}
+	virtual void onResponse(tcp_stream* pstream, const timeval* t)
+	{
+		feed(pstream->client.data, pstream->client.count_new);
+	}
 };
 
-class regex_handler_all_response: public response_collector<regex_handler_base>
+// grep on the decoded body (see http_body_decoder), scanned while it arrives
+// in a window of at most max_window bytes: only the part that could still be
+// the start of a match is kept, and the decoding stops at the first match
+// that the data still to come cannot make longer
+class regex_handler_body_base: public regex_handler_base, protected http_body_sink
 {
 public:
-	regex_handler_all_response(const boost::regex& re, const string& not_found){_re=re; _not_found=not_found;}
+	regex_handler_body_base(bool request, const boost::regex& re, const string& not_found);
+	virtual void append(std::basic_ostream<char>& out, const timeval* );
+	static void set_max_window(unsigned max_window){_max_window = max_window;}
 protected:
-	virtual string& get_text() {return text;};
+	virtual string& get_text() {return _result;};
+	virtual bool on_decoded(const char* data, unsigned len);
+	virtual void on_end();
+	http_body_decoder _decoder;
+	string _window;
+	string _result;
+	static unsigned _max_window;
+};
+
+class regex_handler_body_request: public regex_handler_body_base
+{
+public:
+	regex_handler_body_request(const boost::regex& re, const string& not_found): regex_handler_body_base(true, re, not_found){}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t)
+	{
+		_decoder.feed(pstream->server.data, pstream->server.count_new, static_cast<stream*>(pstream)->segment);
+	}
+};
+
+class regex_handler_body_response: public regex_handler_body_base
+{
+public:
+	regex_handler_body_response(const boost::regex& re, const string& not_found): regex_handler_body_base(false, re, not_found){}
+	virtual void onResponse(tcp_stream* pstream, const timeval* t)
+	{
+		_decoder.feed(pstream->client.data, pstream->client.count_new, static_cast<stream*>(pstream)->segment);
+	}
 };
 
 template <class handler_t>
@@ -103,7 +179,7 @@ public:
 	virtual handler::ptr create_handler()
 	{
 		//cout << "header_handler_factory_t "<< this->_re<< " "<< _not_found<< endl;
-		return handler::ptr(new handler_t( this->_re, _not_found));
+		return this->create(_not_found);
 	}
 
 private:
@@ -0,0 +1,389 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include "utilities.h"
+#include "rotate.h"
+
+using namespace std;
+
+static const size_t batch_bytes = 64 * 1024;
+static const unsigned batch_lines = IOV_MAX < 1024 ? IOV_MAX : 1024;
+static const size_t compress_buffer = 256 * 1024;
+
+static bool exists(const string& path)
+{
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+static bool write_all(int fd, const char* data, size_t len)
+{
+	while (len)
+	{
+		ssize_t n = ::write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+rotating_file_printer::compression_enum rotating_file_printer::to_compression(const string& name)
+{
+	if (name == "none")
+		return compress_none;
+	if (name == "gzip")
+		return compress_gzip;
+	throw common_exception(string("invalid compression '").append(name).append("', it must be none or gzip"));
+}
+
+rotating_file_printer::rotating_file_printer(const string& path, const string& eol, u_int64_t max_size, unsigned interval, compression_enum compression):
+	_path(path), _eol(eol), _max_size(max_size), _interval(interval), _compression(compression), _fd(-1), _index_fd(-1), _sequence(0),
+	_segment_size(0), _segment_lines(0), _segment_end(0), _batch(batch_lines), _batch_lines(0), _batch_bytes(0), _batch_time(0),
+	_closed(false), _thread_started(false), _stopping(false)
+{
+	_last_time.tv_sec = _last_time.tv_usec = 0;
+	_line.setf(ios_base::fixed);
+	pthread_mutex_init(&_mutex, NULL);
+	pthread_mutex_init(&_batch_mutex, NULL);
+	pthread_cond_init(&_cond, NULL);
+	string index = string(_path).append(".index");
+	_index_fd = open(index.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	check(_index_fd >= 0, common_exception(string("cannot open ").append(index).append(": ").append(strerror(errno))));
+	open_segment();
+	check(pthread_create(&_thread, NULL, run, this) == 0, common_exception("cannot create the log writer thread"));
+	_thread_started = true;
+}
+
+rotating_file_printer::~rotating_file_printer()
+{
+	on_exit();
+	if (_index_fd >= 0)
+		close(_index_fd);
+	pthread_cond_destroy(&_cond);
+	pthread_mutex_destroy(&_batch_mutex);
+	pthread_mutex_destroy(&_mutex);
+}
+
+// on the background thread
+void rotating_file_printer::write_index(const string& line)
+{
+	if (write_all(_index_fd, line.data(), line.size()))
+		fdatasync(_index_fd);
+}
+
+void rotating_file_printer::queue(const segment_job& job)
+{
+	pthread_mutex_lock(&_mutex);
+	_jobs.push_back(job);
+	pthread_cond_signal(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+// on the background thread
+void rotating_file_printer::finish(const segment_job& job)
+{
+	if (job.fd >= 0)
+	{
+		// the preallocated blocks not used are released
+		if (_max_size)
+			ftruncate(job.fd, job.size);
+		fdatasync(job.fd);
+		close(job.fd);
+	}
+	write_index(job.index);
+	if (job.compress)
+	{
+		pthread_mutex_lock(&_mutex);
+		_queue.push_back(job.segment);
+		pthread_mutex_unlock(&_mutex);
+	}
+}
+
+void rotating_file_printer::open_segment()
+{
+	for (;;)
+	{
+		ostringstream name;
+		name << _path << "." << setw(6) << setfill('0') << _sequence++;
+		_segment = name.str();
+		// the segments of a previous run are kept
+		if (exists(string(_segment).append(".gz")))
+			continue;
+		_fd = open(_segment.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (_fd >= 0)
+			break;
+		check(errno == EEXIST, common_exception(string("cannot create ").append(_segment).append(": ").append(strerror(errno))));
+	}
+	// the blocks are reserved without changing the size, the readers do not see them
+	if (_max_size)
+		fallocate(_fd, FALLOC_FL_KEEP_SIZE, 0, _max_size);
+	_segment_size = 0;
+	_segment_lines = 0;
+	_segment_end = 0;
+	segment_job job;
+	job.fd = -1;
+	job.size = 0;
+	job.segment = _segment;
+	job.index = string("open\t").append(_segment).append("\n");
+	job.compress = false;
+	queue(job);
+}
+
+void rotating_file_printer::close_segment()
+{
+	flush();
+	ostringstream line;
+	line.setf(ios_base::fixed);
+	line << "close\t" << _segment << "\t" << _segment_size << "\t" << _segment_lines << "\t" << setprecision(6) << to_double(_last_time) << "\n";
+	segment_job job;
+	job.fd = _fd;
+	job.size = _segment_size;
+	job.segment = _segment;
+	job.index = line.str();
+	job.compress = _compression != compress_none;
+	queue(job);
+	_fd = -1;
+}
+
+void rotating_file_printer::flush()
+{
+	if (_batch_lines == 0)
+		return;
+	iovec iov[batch_lines];
+	for (unsigned i = 0; i < _batch_lines; i++)
+	{
+		iov[i].iov_base = const_cast<char*>(_batch[i].data());
+		iov[i].iov_len = _batch[i].size();
+	}
+	iovec* first = iov;
+	unsigned count = _batch_lines;
+	size_t written = 0;
+	while (count)
+	{
+		ssize_t n = writev(_fd, first, count);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			cerr << "WARNING: cannot write " << _segment << ": " << strerror(errno) << "\n";
+			break;
+		}
+		written += n;
+		// a partial write: the rest of the batch
+		while (count && size_t(n) >= first->iov_len)
+		{
+			n -= first->iov_len;
+			first++;
+			count--;
+		}
+		if (count)
+		{
+			first->iov_base = (char*) first->iov_base + n;
+			first->iov_len -= n;
+		}
+	}
+	// the lines not written are lost, the size is the one of the file
+	_segment_size += written;
+	_batch_lines = 0;
+	_batch_bytes = 0;
+}
+
+void rotating_file_printer::flush_idle()
+{
+	pthread_mutex_lock(&_batch_mutex);
+	if (!_closed && _batch_lines && time(NULL) != _batch_time)
+		flush();
+	pthread_mutex_unlock(&_batch_mutex);
+}
+
+void rotating_file_printer::doit(handlers::iterator start, handlers::iterator end, const timeval* t)
+{
+	if (!_lines.empty() || ordered_lines::deferred(start, end))
+	{
+		// the line waits for its fields, after the ones before it
+		_lines.add(start, end, t, _eol);
+		write_lines(false);
+		return;
+	}
+	_line.str("");
+	for (handlers::iterator i = start; i != end; i++)
+		(*i)->append(_line, t);
+	_line << _eol;
+	pthread_mutex_lock(&_batch_mutex);
+	if (!_closed)
+		add_line(_line.str(), t);
+	pthread_mutex_unlock(&_batch_mutex);
+}
+
+void rotating_file_printer::write_lines(bool wait)
+{
+	ordered_lines::line l;
+	while (_lines.next(l, wait))
+	{
+		pthread_mutex_lock(&_batch_mutex);
+		if (!_closed)
+			add_line(l.text, l.has_time ? &l.time : NULL);
+		pthread_mutex_unlock(&_batch_mutex);
+	}
+}
+
+// with _batch_mutex
+void rotating_file_printer::add_line(const string& line, const timeval* t)
+{
+	string::size_type size = line.size();
+	if (_fd < 0)
+		open_segment();
+	if (t && _interval)
+	{
+		if (_segment_end && t->tv_sec >= _segment_end && _segment_size + _batch_bytes)
+		{
+			close_segment();
+			open_segment();
+		}
+		if (!_segment_end || t->tv_sec >= _segment_end)
+			_segment_end = (t->tv_sec / _interval + 1) * _interval;
+	}
+	if (_max_size && _segment_size + _batch_bytes + size > _max_size && _segment_size + _batch_bytes)
+	{
+		close_segment();
+		open_segment();
+	}
+	if (t)
+		_last_time = *t;
+	time_t now = time(NULL);
+	if (_batch_lines == 0)
+		_batch_time = now;
+	_batch[_batch_lines++] = line;
+	_batch_bytes += size;
+	_segment_lines++;
+	if (_batch_lines == batch_lines || _batch_bytes >= batch_bytes || now != _batch_time)
+		flush();
+}
+
+void rotating_file_printer::on_exit()
+{
+	write_lines(true);
+	pthread_mutex_lock(&_batch_mutex);
+	bool closed = _closed;
+	_closed = true;
+	if (!closed && _fd >= 0)
+		close_segment();
+	pthread_mutex_unlock(&_batch_mutex);
+	if (_thread_started)
+	{
+		pthread_mutex_lock(&_mutex);
+		_stopping = true;
+		pthread_cond_signal(&_cond);
+		pthread_mutex_unlock(&_mutex);
+		pthread_join(_thread, NULL);
+		_thread_started = false;
+	}
+}
+
+// finishes the segments opened and closed, compresses the closed ones and,
+// once a second, writes the lines of a batch the capture left behind (e.g.
+// when the traffic stops). The segments are finished before the next
+// compression, so the index is not held back by it
+void* rotating_file_printer::run(void* arg)
+{
+	rotating_file_printer* self = static_cast<rotating_file_printer*>(arg);
+	pthread_mutex_lock(&self->_mutex);
+	for (;;)
+	{
+		if (self->_jobs.empty() && self->_queue.empty() && !self->_stopping)
+		{
+			timespec wake;
+			clock_gettime(CLOCK_REALTIME, &wake);
+			wake.tv_sec += 1;
+			pthread_cond_timedwait(&self->_cond, &self->_mutex, &wake);
+		}
+		if (self->_jobs.empty() && self->_queue.empty() && self->_stopping)
+			break;
+		while (!self->_jobs.empty())
+		{
+			segment_job job = self->_jobs.front();
+			self->_jobs.pop_front();
+			pthread_mutex_unlock(&self->_mutex);
+			self->finish(job);
+			pthread_mutex_lock(&self->_mutex);
+		}
+		string segment;
+		if (!self->_queue.empty())
+		{
+			segment = self->_queue.front();
+			self->_queue.pop_front();
+		}
+		pthread_mutex_unlock(&self->_mutex);
+		if (!segment.empty())
+			self->compress(segment);
+		self->flush_idle();
+		pthread_mutex_lock(&self->_mutex);
+	}
+	pthread_mutex_unlock(&self->_mutex);
+	return NULL;
+}
+
+// <segment>.gz, written aside and renamed, then the segment is removed
+void rotating_file_printer::compress(const string& segment)
+{
+	string compressed = string(segment).append(".gz");
+	string temp = string(compressed).append(".tmp");
+	int in = open(segment.c_str(), O_RDONLY | O_CLOEXEC);
+	int out = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	gzFile gz = out >= 0 ? gzdopen(dup(out), "wb6") : NULL;
+	bool ok = in >= 0 && gz != NULL;
+	vector<char> buffer(compress_buffer);
+	while (ok)
+	{
+		ssize_t n = read(in, &buffer[0], buffer.size());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			ok = n == 0;
+			break;
+		}
+		ok = gzwrite(gz, &buffer[0], n) == n;
+	}
+	if (gz != NULL && gzclose(gz) != Z_OK)
+		ok = false;
+	if (ok && fdatasync(out) != 0)
+		ok = false;
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	if (ok && rename(temp.c_str(), compressed.c_str()) == 0)
+	{
+		write_index(string("compressed\t").append(segment).append("\t").append(compressed).append("\n"));
+		unlink(segment.c_str());
+	}
+	else
+	{
+		// the segment is left as it is
+		unlink(temp.c_str());
+		cerr << "WARNING: cannot compress " << segment << endl;
+	}
+}
@@ -0,0 +1,102 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_rotate_h
+#define _sniffer_rotate_h
+#include <string>
+#include <vector>
+#include <deque>
+#include <sstream>
+#include <pthread.h>
+#include <time.h>
+#include "formatter.h"
+
+// the log written to files <path>.<sequence> instead of stdout, rotated when
+// a segment would exceed max_size bytes or at every interval seconds of
+// capture time (0 disables either). The lines are not flushed one by one:
+// they are collected and written with a single writev per batch (64KB, 1024
+// lines or a second old; a background thread writes the batch left when the
+// traffic stops). The segments are preallocated with fallocate. A finished
+// segment is truncated, synced and compressed on the same thread, so the
+// capture never waits for the disk (a batch left waits for the compression
+// in progress). <path>.index records the boundaries of the segments for the
+// readers that follow the log, each line is written and synced by that
+// thread, in order:
+//   open <tab> <segment>
+//   close <tab> <segment> <tab> <bytes> <tab> <lines> <tab> <capture time of the last line>
+//   compressed <tab> <segment> <tab> <compressed segment>
+// a segment is complete (and synced) once closed; an open segment without
+// its close is the one being written, or the one cut by a crash
+class rotating_file_printer : public printer
+{
+public:
+	enum compression_enum {compress_none, compress_gzip};
+	// throws common_exception if the index or the first segment cannot be created
+	rotating_file_printer(const std::string& path, const std::string& eol, u_int64_t max_size, unsigned interval, compression_enum compression);
+	~rotating_file_printer();
+	void doit(handlers::iterator start, handlers::iterator end, const timeval* t);
+	// writes the lines left, closes the segment and waits for the compressions
+	virtual void on_exit();
+	virtual void on_idle(){write_lines(false);}
+	static compression_enum to_compression(const std::string& name);
+private:
+	void write_lines(bool wait);
+	void add_line(const std::string& line, const timeval* t);
+	void open_segment();
+	void close_segment();
+	void flush();
+	// the batch if it is a second old, from the background thread
+	void flush_idle();
+	void write_index(const std::string& line);
+	// the work on a segment left to the background thread: the blocks not
+	// used released and the data synced (if fd is open), then the line of
+	// the index
+	struct segment_job
+	{
+		int fd;
+		u_int64_t size;
+		std::string segment, index;
+		bool compress;
+	};
+	void queue(const segment_job& job);
+	void finish(const segment_job& job);
+	static void* run(void* arg);
+	void compress(const std::string& segment);
+	std::string _path, _eol;
+	u_int64_t _max_size;
+	unsigned _interval;
+	compression_enum _compression;
+	int _fd, _index_fd;
+	unsigned _sequence;
+	std::string _segment;
+	u_int64_t _segment_size, _segment_lines;
+	// capture time of the next rotation by interval, 0 if not known yet
+	time_t _segment_end;
+	timeval _last_time;
+	// the lines not written yet, the strings are reused
+	std::vector<std::string> _batch;
+	unsigned _batch_lines;
+	size_t _batch_bytes;
+	time_t _batch_time;
+	std::ostringstream _line;
+	ordered_lines _lines;
+	bool _closed;
+	// the batch is written by the capture and by the background thread
+	pthread_mutex_t _batch_mutex;
+	// the segments to finish and to compress, for the background thread
+	pthread_t _thread;
+	bool _thread_started, _stopping;
+	pthread_mutex_t _mutex;
+	pthread_cond_t _cond;
+	std::deque<segment_job> _jobs;
+	std::deque<std::string> _queue;
+};
+
+#endif// _sniffer_rotate_h
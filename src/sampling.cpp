@@ -0,0 +1,88 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "sampling.h"
+#include <sys/resource.h>
+#include "formatter.h"
+
+static const unsigned max_rate = 1 << 20;
+
+static u_int64_t mix(u_int64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static double cpu_time()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return to_double(usage.ru_utime) + to_double(usage.ru_stime);
+}
+
+static double elapsed(const timespec& from, const timespec& to)
+{
+	return double(to.tv_sec - from.tv_sec) + double(to.tv_nsec - from.tv_nsec) / 1000000000;
+}
+
+flow_sampler::flow_sampler(unsigned rate, bool adaptive, double cpu_budget):
+	_min_rate(rate ? rate : 1), _rate(rate ? rate : 1), _adaptive(adaptive), _cpu_budget(cpu_budget)
+{
+	clock_gettime(CLOCK_MONOTONIC, &_last_check);
+	_last_cpu = cpu_time();
+	_last_busy = parser::handler_time();
+	// the busy time of the handlers includes the time blocked on the output
+	if (_adaptive)
+		parser::set_handler_timing(true);
+}
+
+u_int64_t flow_sampler::hash(const tuple4& addr)
+{
+	u_int64_t a = (u_int64_t(addr.saddr) << 16) | addr.source;
+	u_int64_t b = (u_int64_t(addr.daddr) << 16) | addr.dest;
+	if (a > b)
+	{
+		u_int64_t tmp = a;
+		a = b;
+		b = tmp;
+	}
+	return mix(mix(a) ^ b);
+}
+
+bool flow_sampler::keep(const tuple4& addr)
+{
+	if (_adaptive)
+		adapt();
+	return _rate == 1 || hash(addr) % _rate == 0;
+}
+
+void flow_sampler::adapt()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double wall = elapsed(_last_check, now);
+	if (wall < 1)
+		return;
+	double cpu = cpu_time(), busy = parser::handler_time();
+	double load = (cpu - _last_cpu) / wall;
+	if ((busy - _last_busy) / wall > load)
+		load = (busy - _last_busy) / wall;
+	if (load > _cpu_budget && _rate < max_rate)
+		_rate *= 2;
+	else if (load < _cpu_budget / 2 && _rate / 2 >= _min_rate)
+		_rate /= 2;
+	_last_check = now;
+	_last_cpu = cpu;
+	_last_busy = busy;
+}
@@ -0,0 +1,38 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_sampling_h
+#define _sniffer_sampling_h
+#include <sys/types.h>
+#include <time.h>
+#include <nids2.h>
+
+// keeps 1 flow every rate() by the symmetric hash of the connection, so both
+// directions and every packet of a flow get the same decision. In adaptive
+// mode the rate doubles (and the kept flows are a subset of the previous
+// ones) while justniffer uses more than the cpu budget, and halves back when
+// the load is below half of it
+class flow_sampler
+{
+public:
+	flow_sampler(unsigned rate, bool adaptive, double cpu_budget);
+	bool keep(const tuple4& addr);
+	unsigned rate() const {return _rate;}
+	static u_int64_t hash(const tuple4& addr);
+private:
+	void adapt();
+	unsigned _min_rate, _rate;
+	bool _adaptive;
+	double _cpu_budget;
+	timespec _last_check;
+	double _last_cpu, _last_busy;
+};
+
+#endif// _sniffer_sampling_h
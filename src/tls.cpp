@@ -0,0 +1,395 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "tls.h"
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+// the handshake messages longer than this are not parsed
+static const unsigned max_hello = 65536;
+
+///// md5 /////
+
+// RFC 1321, only for the fingerprints
+static string md5_hex(const string& message)
+{
+	static const u_int32_t k[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+	static const unsigned r[64] = {
+		7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+		5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+		4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+		6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+	u_int32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	string padded(message);
+	padded += char(0x80);
+	while (padded.size() % 64 != 56)
+		padded += char(0);
+	u_int64_t bits = u_int64_t(message.size()) * 8;
+	for (unsigned i = 0; i < 8; i++)
+		padded += char(bits >> (8 * i));
+	for (string::size_type chunk = 0; chunk < padded.size(); chunk += 64)
+	{
+		u_int32_t w[16];
+		for (unsigned i = 0; i < 16; i++)
+		{
+			const unsigned char* p = (const unsigned char*) padded.data() + chunk + i * 4;
+			w[i] = p[0] | (p[1] << 8) | (p[2] << 16) | (u_int32_t(p[3]) << 24);
+		}
+		u_int32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		for (unsigned i = 0; i < 64; i++)
+		{
+			u_int32_t f;
+			unsigned g;
+			if (i < 16)
+			{
+				f = (b & c) | (~b & d);
+				g = i;
+			}
+			else if (i < 32)
+			{
+				f = (d & b) | (~d & c);
+				g = (5 * i + 1) % 16;
+			}
+			else if (i < 48)
+			{
+				f = b ^ c ^ d;
+				g = (3 * i + 5) % 16;
+			}
+			else
+			{
+				f = c ^ (b | ~d);
+				g = (7 * i) % 16;
+			}
+			u_int32_t t = d;
+			d = c;
+			c = b;
+			u_int32_t x = a + f + k[i] + w[g];
+			b = b + ((x << r[i]) | (x >> (32 - r[i])));
+			a = t;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+	}
+	ostringstream out;
+	out << hex << setfill('0');
+	for (unsigned i = 0; i < 16; i++)
+		out << setw(2) << ((h[i / 4] >> (8 * (i % 4))) & 0xff);
+	return out.str();
+}
+
+///// tls_session /////
+
+// bounds checked reader of a handshake message
+class tls_reader
+{
+public:
+	tls_reader(const string& data, string::size_type start = 0, string::size_type end = string::npos):
+		_data((const unsigned char*) data.data()), _pos(start), _end(min(end, data.size())), _ok(true){}
+	unsigned u8() {return need(1) ? _data[_pos++] : 0;}
+	unsigned u16() {unsigned v = need(2) ? (_data[_pos] << 8) | _data[_pos + 1] : 0; skip(2); return v;}
+	unsigned u24() {unsigned v = need(3) ? (_data[_pos] << 16) | (_data[_pos + 1] << 8) | _data[_pos + 2] : 0; skip(3); return v;}
+	void skip(string::size_type n) {if (need(n)) _pos += n;}
+	string bytes(string::size_type n) {string v; if (need(n)) v.assign((const char*) _data + _pos, n); skip(n); return v;}
+	// a reader of the next n bytes, skipped here
+	tls_reader sub(const string& data, string::size_type n) {tls_reader r(data, _pos, need(n) ? _pos + n : _pos); skip(n); return r;}
+	bool more() const {return _ok && _pos < _end;}
+	bool ok() const {return _ok;}
+private:
+	bool need(string::size_type n) {if (_end - _pos < n) _ok = false; return _ok;}
+	const unsigned char* _data;
+	string::size_type _pos, _end;
+	bool _ok;
+};
+
+// the reserved GREASE values (RFC 8701) are left out of the fingerprints
+static bool grease(unsigned value)
+{
+	return (value & 0x0f0f) == 0x0a0a && (value >> 8) == (value & 0xff);
+}
+
+tls_session::tls_session(): client_hello(false), server_hello(false), handshake_end(false), version(-1), cipher(-1)
+{
+}
+
+boost::shared_ptr<tls_session> tls_session::of(tcp_stream* pstream)
+{
+	// the handlers are always given their stream
+	stream* s = static_cast<stream*>(pstream);
+	if (!s->tls)
+		s->tls = boost::shared_ptr<tls_session>(new tls_session());
+	return s->tls;
+}
+
+void tls_session::feed(bool client, const char* data, unsigned len, u_int64_t offset, const timeval* t)
+{
+	direction& d = client ? _client : _server;
+	if (d.stopped || offset + len <= d.fed)
+		return;
+	// the part already fed by another keyword
+	unsigned seen = d.fed > offset ? d.fed - offset : 0;
+	d.fed = offset + len;
+	parse(d, client, (const unsigned char*) data + seen, len - seen, t);
+}
+
+void tls_session::parse(direction& d, bool client, const unsigned char* data, unsigned len, const timeval* t)
+{
+	while (len && !d.stopped)
+	{
+		if (d.header_len < 5)
+		{
+			unsigned n = min(len, 5 - d.header_len);
+			memcpy(d.header + d.header_len, data, n);
+			d.header_len += n;
+			data += n;
+			len -= n;
+			if (d.header_len < 5)
+				return;
+			d.type = d.header[0];
+			d.remaining = (d.header[3] << 8) | d.header[4];
+			// a record: change_cipher_spec, alert, handshake or application_data, SSL 3 or TLS
+			bool valid = d.type >= 20 && d.type <= 23 && d.header[1] == 3;
+			// the first one has to be the hello
+			if (!valid || (!d.hello_done && d.handshake.empty() && d.type != 22))
+			{
+				d.stopped = true;
+				return;
+			}
+			if (client && !d.hello_done && d.handshake.empty())
+				hello_time = *t;
+			if (client && d.type == 23)
+			{
+				handshake_end = client_hello;
+				handshake_end_time = *t;
+				d.stopped = true;
+				return;
+			}
+		}
+		unsigned n = min(len, d.remaining);
+		if (d.type == 22 && !d.hello_done)
+		{
+			d.handshake.append((const char*) data, n);
+			tls_reader reader(d.handshake);
+			unsigned type = reader.u8();
+			unsigned length = reader.u24();
+			if (reader.ok() && d.handshake.size() >= length + 4)
+			{
+				d.handshake.resize(length + 4);
+				if (client && type == 1)
+					on_client_hello(d.handshake);
+				else if (!client && type == 2)
+				{
+					on_server_hello(d.handshake);
+					server_hello_time = *t;
+				}
+				d.hello_done = true;
+				string().swap(d.handshake);
+				// nothing else is needed from the server, the client is
+				// followed till the first application data record
+				if (!client || !client_hello)
+					d.stopped = true;
+			}
+			else if (reader.ok() && length + 4 > max_hello)
+				d.stopped = true;
+		}
+		d.remaining -= n;
+		data += n;
+		len -= n;
+		if (d.remaining == 0)
+			d.header_len = 0;
+	}
+}
+
+void tls_session::on_client_hello(const string& message)
+{
+	tls_reader reader(message, 4);
+	unsigned legacy_version = reader.u16();
+	reader.skip(32);
+	reader.skip(reader.u8());
+	ostringstream ciphers, extensions, groups, formats;
+	tls_reader cipher_list = reader.sub(message, reader.u16());
+	while (cipher_list.more())
+	{
+		unsigned suite = cipher_list.u16();
+		if (!grease(suite))
+			ciphers << (ciphers.tellp() > 0 ? "-" : "") << suite;
+	}
+	reader.skip(reader.u8());
+	tls_reader extension_list = reader.sub(message, reader.u16());
+	while (extension_list.more())
+	{
+		unsigned type = extension_list.u16();
+		tls_reader extension = extension_list.sub(message, extension_list.u16());
+		if (!grease(type))
+			extensions << (extensions.tellp() > 0 ? "-" : "") << type;
+		if (type == 0)
+		{
+			// server_name: the host_name entry
+			tls_reader names = extension.sub(message, extension.u16());
+			while (names.more())
+			{
+				unsigned name_type = names.u8();
+				string name = names.bytes(names.u16());
+				if (name_type == 0 && sni.empty())
+					sni = name;
+			}
+		}
+		else if (type == 10)
+		{
+			tls_reader list = extension.sub(message, extension.u16());
+			while (list.more())
+			{
+				unsigned group = list.u16();
+				if (!grease(group))
+					groups << (groups.tellp() > 0 ? "-" : "") << group;
+			}
+		}
+		else if (type == 11)
+		{
+			tls_reader list = extension.sub(message, extension.u8());
+			while (list.more())
+				formats << (formats.tellp() > 0 ? "-" : "") << list.u8();
+		}
+		else if (type == 16)
+		{
+			tls_reader list = extension.sub(message, extension.u16());
+			while (list.more())
+			{
+				string protocol = list.bytes(list.u8());
+				alpn_offered += (alpn_offered.empty() ? "" : ",") + protocol;
+			}
+		}
+	}
+	ostringstream ja3;
+	ja3 << legacy_version << "," << ciphers.str() << "," << extensions.str() << "," << groups.str() << "," << formats.str();
+	fingerprint = md5_hex(ja3.str());
+	client_hello = true;
+}
+
+void tls_session::on_server_hello(const string& message)
+{
+	tls_reader reader(message, 4);
+	version = reader.u16();
+	reader.skip(32);
+	reader.skip(reader.u8());
+	cipher = reader.u16();
+	reader.skip(1);
+	tls_reader extension_list = reader.sub(message, reader.u16());
+	while (extension_list.more())
+	{
+		unsigned type = extension_list.u16();
+		tls_reader extension = extension_list.sub(message, extension_list.u16());
+		if (type == 43)
+			// supported_versions: TLS 1.3 and later
+			version = extension.u16();
+		else if (type == 16)
+		{
+			tls_reader list = extension.sub(message, extension.u16());
+			alpn = list.bytes(list.u8());
+		}
+	}
+	if (!reader.ok())
+		cipher = -1;
+	server_hello = true;
+}
+
+///// tls_handler /////
+
+void tls_handler::onRequest(tcp_stream* pstream, const timeval* t)
+{
+	if (!_session)
+		_session = tls_session::of(pstream);
+	_session->feed(true, pstream->server.data, pstream->server.count_new, pstream->server.count - pstream->server.count_new, t);
+}
+
+void tls_handler::onResponse(tcp_stream* pstream, const timeval* t)
+{
+	if (!_session)
+		_session = tls_session::of(pstream);
+	_session->feed(false, pstream->client.data, pstream->client.count_new, pstream->client.count - pstream->client.count_new, t);
+}
+
+static string version_name(int version)
+{
+	switch (version)
+	{
+		case 0x0300: return "SSLv3";
+		case 0x0301: return "TLSv1.0";
+		case 0x0302: return "TLSv1.1";
+		case 0x0303: return "TLSv1.2";
+		case 0x0304: return "TLSv1.3";
+	}
+	ostringstream out;
+	out << "0x" << hex << setw(4) << setfill('0') << version;
+	return out.str();
+}
+
+void tls_handler::append(std::basic_ostream<char>& out, const timeval* t)
+{
+	if (!_session)
+	{
+		out << _not_found;
+		return;
+	}
+	const tls_session& s = *_session;
+	switch (_field)
+	{
+		case sni:
+			out << (s.sni.empty() ? _not_found : s.sni);
+			break;
+		case alpn:
+			// the choice of the server is encrypted in TLS 1.3: what the client offered
+			if (!s.alpn.empty())
+				out << s.alpn;
+			else
+				out << (s.alpn_offered.empty() ? _not_found : s.alpn_offered);
+			break;
+		case version:
+			out << (s.server_hello ? version_name(s.version) : _not_found);
+			break;
+		case cipher:
+			if (s.server_hello && s.cipher >= 0)
+			{
+				ostringstream suite;
+				suite << "0x" << hex << setw(4) << setfill('0') << s.cipher;
+				out << suite.str();
+			}
+			else
+				out << _not_found;
+			break;
+		case fingerprint:
+			out << (s.client_hello ? s.fingerprint : _not_found);
+			break;
+		case hello_time:
+			if (s.client_hello && s.server_hello)
+				out << to_double(s.server_hello_time - s.hello_time);
+			else
+				out << _not_found;
+			break;
+		case handshake_time:
+			if (s.client_hello && s.handshake_end)
+				out << to_double(s.handshake_end_time - s.hello_time);
+			else
+				out << _not_found;
+			break;
+	}
+}
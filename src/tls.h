@@ -0,0 +1,75 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_tls_h
+#define _sniffer_tls_h
+#include <string>
+#include "formatter.h"
+
+// the handshake of a TLS connection, read from the records of the first
+// client and server flights: the ClientHello, the ServerHello and the first
+// application data record of the client. After that, and for connections
+// that are not TLS, the data is not looked at anymore
+class tls_session
+{
+public:
+	tls_session();
+	// data of one direction, offset is its position in the direction (data
+	// already seen is skipped, so every tls keyword can feed it)
+	void feed(bool client, const char* data, unsigned len, u_int64_t offset, const timeval* t);
+	// the session of the connection, created the first time
+	static boost::shared_ptr<tls_session> of(tcp_stream* pstream);
+	bool client_hello, server_hello, handshake_end;
+	std::string sni, alpn;
+	// the protocols of the ClientHello, separated by commas
+	std::string alpn_offered;
+	int version, cipher;
+	// JA3: md5 of version,ciphers,extensions,groups,point formats
+	std::string fingerprint;
+	timeval hello_time, server_hello_time, handshake_end_time;
+private:
+	struct direction
+	{
+		direction(): fed(0), header_len(0), remaining(0), type(0), hello_done(false), stopped(false){}
+		u_int64_t fed;
+		unsigned char header[5];
+		unsigned header_len, remaining;
+		unsigned char type;
+		// the first handshake message, reassembled from the records
+		std::string handshake;
+		bool hello_done, stopped;
+	};
+	void parse(direction& d, bool client, const unsigned char* data, unsigned len, const timeval* t);
+	void on_client_hello(const std::string& message);
+	void on_server_hello(const std::string& message);
+	direction _client, _server;
+};
+
+class tls_handler : public basic_handler
+{
+public:
+	enum field_enum {sni, alpn, version, cipher, fingerprint, hello_time, handshake_time};
+	tls_handler(const std::string& not_found, field_enum field): _not_found(not_found), _field(field){}
+	virtual void onRequest(tcp_stream* pstream, const timeval* t);
+	virtual void onResponse(tcp_stream* pstream, const timeval* t);
+	virtual void append(std::basic_ostream<char>& out, const timeval* t);
+private:
+	boost::shared_ptr<tls_session> _session;
+	std::string _not_found;
+	field_enum _field;
+};
+
+template <int field> class tls_field_handler : public tls_handler
+{
+public:
+	tls_field_handler(const std::string& not_found): tls_handler(not_found, field_enum(field)){}
+};
+
+#endif// _sniffer_tls_h
@@ -0,0 +1,176 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include "topk.h"
+#include <algorithm>
+#include <cstdio>
+
+using namespace std;
+
+///// space_saving /////
+
+space_saving::space_saving(unsigned capacity): _capacity(capacity ? capacity : 1), _total(0)
+{
+	_heap.reserve(_capacity);
+}
+
+void space_saving::swap(unsigned a, unsigned b)
+{
+	std::swap(_heap[a], _heap[b]);
+	_index[_heap[a].key] = a;
+	_index[_heap[b].key] = b;
+}
+
+void space_saving::sift_up(unsigned pos)
+{
+	while (pos > 0)
+	{
+		unsigned parent = (pos - 1) / 2;
+		if (_heap[parent].count <= _heap[pos].count)
+			break;
+		swap(parent, pos);
+		pos = parent;
+	}
+}
+
+void space_saving::sift_down(unsigned pos)
+{
+	unsigned size = _heap.size();
+	while (true)
+	{
+		unsigned smallest = pos, left = 2 * pos + 1, right = left + 1;
+		if (left < size && _heap[left].count < _heap[smallest].count)
+			smallest = left;
+		if (right < size && _heap[right].count < _heap[smallest].count)
+			smallest = right;
+		if (smallest == pos)
+			break;
+		swap(smallest, pos);
+		pos = smallest;
+	}
+}
+
+void space_saving::add(const string& key, double weight)
+{
+	_total += weight;
+	index::iterator it = _index.find(key);
+	if (it != _index.end())
+	{
+		// counts only grow, so the counter can only move towards the leaves
+		_heap[it->second].count += weight;
+		sift_down(it->second);
+		return;
+	}
+	if (_heap.size() < _capacity)
+	{
+		counter c;
+		c.key = key;
+		c.count = weight;
+		c.error = 0;
+		_heap.push_back(c);
+		_index[key] = _heap.size() - 1;
+		sift_up(_heap.size() - 1);
+		return;
+	}
+	// replace the smallest counter
+	counter& min = _heap[0];
+	_index.erase(min.key);
+	min.key = key;
+	min.error = min.count;
+	min.count += weight;
+	_index[key] = 0;
+	sift_down(0);
+}
+
+static bool heavier(const space_saving::counter& a, const space_saving::counter& b)
+{
+	return a.count > b.count;
+}
+
+void space_saving::top(unsigned k, vector<counter>& result) const
+{
+	result = _heap;
+	if (k < result.size())
+	{
+		partial_sort(result.begin(), result.begin() + k, result.end(), heavier);
+		result.resize(k);
+	}
+	else
+		sort(result.begin(), result.end(), heavier);
+}
+
+void space_saving::clear()
+{
+	_heap.clear();
+	_index.clear();
+	_total = 0;
+}
+
+///// topk_printer /////
+
+topk_printer::topk_printer(Out out, const string& eol, const string& name, unsigned k, unsigned capacity, weight_type weight, int interval):
+	_out(out), _eol(eol), _name(name), _k(k), _weight(weight), _clock(interval), _counters(capacity)
+{
+	_out.setf(ios_base::fixed);
+}
+
+topk_printer::weight_type topk_printer::to_weight_type(const string& str)
+{
+	if (str == "requests")
+		return requests;
+	if (str == "bytes")
+		return bytes;
+	if (str == "latency")
+		return latency;
+	throw invalid_top_k_weight(str);
+}
+
+void topk_printer::doit(handlers::iterator start, handlers::iterator end, const timeval*t)
+{
+	transaction_metrics* metrics = transaction_metrics::get(start, end);
+	if (metrics == NULL || !metrics->request_started)
+		return;
+	if (_clock.tick(t))
+	{
+		dump(&_clock.due());
+		_counters.clear();
+	}
+	double weight = 1;
+	if (_weight == bytes)
+		weight = double(metrics->request_size + metrics->response_size);
+	else if (_weight == latency)
+		weight = metrics->response_time();
+	_counters.add(aggregation_key(start, end, t), weight * metrics->weight);
+}
+
+void topk_printer::dump(const timeval* t)
+{
+	static const char* weight_names[] = {"requests", "bytes", "latency"};
+	vector<space_saving::counter> top;
+	_counters.top(_k, top);
+	for (unsigned i = 0; i < top.size(); i++)
+	{
+		_out << std::setprecision(6) << to_double(*t)
+		     << " \"" << _name << "\" " << i + 1
+		     << " \"" << top[i].key << "\" "
+		     << weight_names[_weight] << "=" << std::setprecision(_weight == latency ? 6 : 0) << top[i].count
+		     << " error=" << top[i].error
+		     << std::setprecision(6) << " share=" << (_counters.total() > 0 ? top[i].count / _counters.total() : 0)
+		     << _eol;
+	}
+	_out << std::flush;
+	fflush(stdout);
+}
+
+void topk_printer::on_exit()
+{
+	dump(&_clock.last());
+	_counters.clear();
+}
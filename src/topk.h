@@ -0,0 +1,72 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_topk_h
+#define _sniffer_topk_h
+#include <string>
+#include <vector>
+#include <boost/unordered_map.hpp>
+#include "aggregate.h"
+
+// space-saving heavy hitters (Metwally et al.): a fixed number of counters,
+// a new key replaces the smallest counter and inherits its value as error.
+// Every key heavier than total/capacity is guaranteed to be monitored
+class space_saving
+{
+public:
+	struct counter
+	{
+		std::string key;
+		double count, error;
+	};
+	space_saving(unsigned capacity);
+	void add(const std::string& key, double weight);
+	// the k heaviest counters, heaviest first
+	void top(unsigned k, std::vector<counter>& result) const;
+	void clear();
+	double total() const {return _total;}
+private:
+	typedef boost::unordered_map<std::string, unsigned> index;
+	void sift_down(unsigned pos);
+	void sift_up(unsigned pos);
+	void swap(unsigned a, unsigned b);
+	unsigned _capacity;
+	double _total;
+	// min-heap on count, _index maps a key to its heap position
+	std::vector<counter> _heap;
+	index _index;
+};
+
+class topk_printer : public printer
+{
+public:
+	enum weight_type {requests, bytes, latency};
+	typedef std::basic_ostream<char>& Out;
+	topk_printer(Out out, const string& eol, const string& name, unsigned k, unsigned capacity, weight_type weight, int interval);
+	void doit(handlers::iterator start, handlers::iterator end, const timeval*t);
+	virtual void on_exit();
+	static weight_type to_weight_type(const string& str);
+private:
+	void dump(const timeval* t);
+	Out _out;
+	string _eol, _name;
+	unsigned _k;
+	weight_type _weight;
+	snapshot_clock _clock;
+	space_saving _counters;
+};
+
+class invalid_top_k_weight: public common_exception
+{
+public:
+	invalid_top_k_weight(const string& str): common_exception(string("invalid top-k weight '").append(str).append("', it must be requests, bytes or latency")){}
+};
+
+#endif// _sniffer_topk_h
@@ -209,9 +209,15 @@ bool get_first_line (const char* start , const char* end, string& out)
 }
 
 bool get_headers(const char* start, const char* end,  string& str)
+{
+	const char* stop = headers_end(start, end);
+	str.append(start, stop);
+	return stop != end;
+}
+
+const char* headers_end(const char* start, const char* end)
 {
 	int counter = 0;
-	bool complete = false;
 	for (const char* it = start; it != end; it++)
 	{
 		if (*it == 13)
@@ -220,13 +226,9 @@ bool get_headers(const char* start, const char* end,  string& str)
 			if (counter && (*it !=10))
 				counter = 0;
 		if (counter >=2)
-		{
-			complete = true;
-			break;
-		}
-		str+=*it;
+			return it;
 	}
-	return complete;
+	return end;
 }
 
 timeval operator -(const timeval& x, const timeval& y)
@@ -77,6 +77,8 @@ void check_pcap_file(const string& str) throw (invalid_pcap_file);
 bool operator < (const struct tuple4& a, const struct tuple4& b);
 timeval operator -(const timeval& x, const timeval& y);
 bool get_headers(const char* start, const char* end,  string& str);
+// where get_headers stops: the empty line ending the headers, or end
+const char* headers_end(const char* start, const char* end);
 bool get_first_line (const char* start , const char* end, string& out);
 std::string timestamp(const timeval* tv, const string& frm);
 void change_current_user(const char* username);
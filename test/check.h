@@ -0,0 +1,32 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#ifndef _sniffer_check_h
+#define _sniffer_check_h
+#include <iostream>
+
+// the checks of the unit tests (make check): a failed one is reported and
+// counted, the test goes on; main returns check_result()
+static int check_failures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { check_failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed\n"; } } while (0)
+
+#define CHECK_EQUAL(a, b) \
+	do { if (!((a) == (b))) { check_failures++; std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQUAL(" #a ", " #b "): " << (a) << " != " << (b) << "\n"; } } while (0)
+
+static int check_result()
+{
+	if (check_failures)
+		std::cerr << check_failures << " checks failed\n";
+	return check_failures ? 1 : 0;
+}
+
+#endif// _sniffer_check_h
@@ -0,0 +1,184 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <string>
+#include <vector>
+#include "db.h"
+#include "check.h"
+
+using namespace std;
+
+// what the segments of a direction complete: a message, with its rows for
+// the responses (-1 if not known)
+struct framed
+{
+	framed(): bytes(0){}
+	vector<int64_t> rows;
+	unsigned bytes;
+};
+
+// data given to the framer in pieces of the size
+static void feed(message_framer& framer, bool request, const string& data, unsigned piece, framed& result)
+{
+	message_segments segments;
+	for (unsigned pos = 0; pos < data.size(); pos += piece)
+	{
+		unsigned len = min<size_t>(piece, data.size() - pos);
+		segments.clear();
+		if (request)
+			framer.requests(data.data() + pos, len, segments);
+		else
+			framer.responses(data.data() + pos, len, segments);
+		for (message_segments::const_iterator i = segments.begin(); i != segments.end(); i++)
+		{
+			result.bytes += i->len;
+			if (i->end)
+				result.rows.push_back(i->rows);
+		}
+	}
+}
+
+static string le(unsigned value, unsigned bytes)
+{
+	string result;
+	for (unsigned i = 0; i < bytes; i++)
+		result += char(value >> (8 * i));
+	return result;
+}
+
+static string be(unsigned value, unsigned bytes)
+{
+	string result;
+	for (unsigned i = bytes; i > 0; i--)
+		result += char(value >> (8 * (i - 1)));
+	return result;
+}
+
+///// mysql /////
+
+static string packet(unsigned sequence, const string& payload)
+{
+	return le(payload.size(), 3) + char(sequence) + payload;
+}
+
+static string lenenc(const string& value)
+{
+	return char(value.size()) + value;
+}
+
+static string ok(unsigned sequence)
+{
+	return packet(sequence, string("\x00\x00\x00\x02\x00\x00\x00", 7));
+}
+
+static string eof(unsigned sequence)
+{
+	return packet(sequence, string("\xfe\x00\x00\x02\x00", 5));
+}
+
+static string column(unsigned sequence, const string& name)
+{
+	return packet(sequence, lenenc("def") + lenenc("") + lenenc("") + lenenc("") + lenenc(name) + lenenc("")
+		+ string("\x0c\x21\x00\x00\x00\x00\x00\xfd\x00\x00\x00\x00\x00", 13));
+}
+
+// a result set of one column, classic EOF packets
+static string result_set(unsigned rows)
+{
+	string result = packet(1, "\x01") + column(2, "id") + eof(3);
+	for (unsigned i = 0; i < rows; i++)
+		result += packet(4 + i, lenenc("1"));
+	return result + eof(4 + rows);
+}
+
+// the connection phase, then a query with its result set, an update and an error
+static void test_mysql(unsigned piece)
+{
+	// protocol 10, no CLIENT_SSL nor CLIENT_DEPRECATE_EOF
+	string greeting = packet(0, string("\x0a" "8.0.36\x00" "\x01\x00\x00\x00" "abcdefgh\x00", 22) + le(0xf7ff, 2) + "\x21" + le(2, 2)
+		+ le(0x0000, 2) + "\x15" + string(10, '\0') + string("ijklmnopqrst\x00", 13) + string("mysql_native_password\x00", 22));
+	string handshake = packet(1, le(0x000fa20f, 4) + le(16777216, 4) + "\x21" + string(23, '\0') + string("app\x00\x00", 5));
+	string query = packet(0, "\x03SELECT id FROM t");
+	string update = packet(0, "\x03UPDATE t SET x = 1");
+	string error = packet(1, "\xff\x28\x04#42000syntax error");
+	mysql_framer framer;
+	framed client, server;
+	feed(framer, false, greeting, piece, server);
+	feed(framer, true, handshake, piece, client);
+	feed(framer, false, ok(2), piece, server);
+	feed(framer, true, query, piece, client);
+	feed(framer, false, result_set(3), piece, server);
+	feed(framer, true, update, piece, client);
+	feed(framer, false, ok(1), piece, server);
+	feed(framer, true, query, piece, client);
+	feed(framer, false, error, piece, server);
+	CHECK(!framer.failed());
+	CHECK_EQUAL(client.rows.size(), 4u);
+	CHECK_EQUAL(client.bytes, handshake.size() + 2 * query.size() + update.size());
+	CHECK_EQUAL(server.rows.size(), 4u);
+	CHECK_EQUAL(server.bytes, greeting.size() + ok(2).size() + result_set(3).size() + ok(1).size() + error.size());
+	if (server.rows.size() == 4)
+		CHECK_EQUAL(server.rows[1], 3);
+}
+
+///// postgres /////
+
+static string message(char type, const string& body)
+{
+	return type + be(body.size() + 4, 4) + body;
+}
+
+static string ready()
+{
+	return message('Z', "I");
+}
+
+// the startup, a simple query and two extended queries sent at once
+static void test_postgres(unsigned piece)
+{
+	string parameters = string("\x00\x03\x00\x00user\x00" "alice\x00\x00", 17);
+	string startup = be(parameters.size() + 4, 4) + parameters;
+	string authentication = message('R', be(0, 4)) + message('S', string("server_version\x00" "16\x00", 18)) + ready();
+	string query = message('Q', string("SELECT id FROM t\x00", 17));
+	string row = message('D', be(1, 2) + be(1, 4) + "1");
+	string rows = message('T', be(1, 2) + string("id\x00", 3) + string(18, '\0')) + row + row + message('C', string("SELECT 2\x00", 9)) + ready();
+	string extended = message('B', string("\x00s1\x00\x00\x00\x00\x00\x00\x00", 10)) + message('E', string(5, '\0')) + message('S', "");
+	string executed = message('2', "") + row + message('C', string("SELECT 1\x00", 9)) + ready();
+	postgres_framer framer;
+	framed client, server;
+	feed(framer, true, startup, piece, client);
+	feed(framer, false, authentication, piece, server);
+	feed(framer, true, query, piece, client);
+	feed(framer, false, rows, piece, server);
+	feed(framer, true, extended + extended, piece, client);
+	feed(framer, false, executed + executed, piece, server);
+	CHECK(!framer.failed());
+	CHECK_EQUAL(client.rows.size(), 4u);
+	CHECK_EQUAL(client.bytes, startup.size() + query.size() + 2 * extended.size());
+	CHECK_EQUAL(server.rows.size(), 4u);
+	CHECK_EQUAL(server.bytes, authentication.size() + rows.size() + 2 * executed.size());
+	if (server.rows.size() == 4)
+	{
+		CHECK_EQUAL(server.rows[1], 2);
+		CHECK_EQUAL(server.rows[2], 1);
+		CHECK_EQUAL(server.rows[3], 1);
+	}
+}
+
+int main()
+{
+	unsigned pieces[] = {1, 2, 5, 4096};
+	for (unsigned i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+	{
+		test_mysql(pieces[i]);
+		test_postgres(pieces[i]);
+	}
+	return check_result();
+}
@@ -0,0 +1,133 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include "dns.h"
+#include "check.h"
+
+using namespace std;
+
+class lines_printer : public printer
+{
+public:
+	void doit(handlers::iterator start, handlers::iterator end, const timeval* t)
+	{
+		ostringstream line;
+		for (handlers::iterator i = start; i != end; i++)
+			(*i)->append(line, t);
+		lines.push_back(line.str());
+	}
+	vector<string> lines;
+};
+
+// a query, or its response, for the name with a single label
+static string message(u_short id, const string& label, bool response)
+{
+	string result;
+	result += char(id >> 8);
+	result += char(id);
+	result += response ? "\x81\x80" : string("\x01\x00", 2);
+	result += string("\x00\x01\x00\x00\x00\x00\x00\x00", 8);
+	result += char(label.size());
+	result += label;
+	result += string("\x00\x00\x01\x00\x01", 5);
+	return result;
+}
+
+struct query
+{
+	u_short port, id;
+	string label;
+};
+
+static void send(const query& q, bool response, const timeval* t)
+{
+	tuple4 addr;
+	addr.saddr = 0x0100000a;
+	addr.daddr = 0x08080808;
+	addr.source = q.port;
+	addr.dest = 53;
+	if (response)
+	{
+		swap(addr.saddr, addr.daddr);
+		swap(addr.source, addr.dest);
+	}
+	string data = message(q.id, q.label, response);
+	dns_tracker::nids_handler(&addr, const_cast<char*>(data.data()), data.size(), NULL, const_cast<timeval*>(t));
+}
+
+// the queries are answered in random order, the same ports and ids come
+// back: the entries of the pending table are deleted from the middle of
+// their clusters and inserted again, every response must still find its
+// query
+static void test_delete_reinsert()
+{
+	parser p;
+	p.set_default_not_found("-");
+	lines_printer out;
+	sections format;
+	format.push_back(p.create_section(&out, "%dns.id %dns.qname %dns.rcode"));
+	// a table of 16 slots
+	const unsigned max_pending = 8;
+	dns_tracker tracker(&p, format, 53, 5, max_pending);
+	timeval t = {1000, 0};
+	vector<query> pending;
+	vector<string> expected;
+	u_int32_t random = 12345;
+	for (unsigned i = 0; i < 20000; i++)
+	{
+		random = random * 1103515245 + 12345;
+		unsigned r = random >> 16;
+		if (pending.size() < max_pending && (pending.empty() || r % 2))
+		{
+			query q;
+			q.port = 1024 + r % 4;
+			q.id = r / 4 % 8;
+			ostringstream label;
+			label << "q" << i;
+			q.label = label.str();
+			bool duplicate = false;
+			for (vector<query>::const_iterator j = pending.begin(); j != pending.end(); j++)
+				duplicate |= j->port == q.port && j->id == q.id;
+			if (duplicate)
+				continue;
+			send(q, false, &t);
+			pending.push_back(q);
+		}
+		else
+		{
+			unsigned index = r / 2 % pending.size();
+			const query& q = pending[index];
+			send(q, true, &t);
+			ostringstream line;
+			line << q.id << " " << q.label << " NOERROR";
+			expected.push_back(line.str());
+			pending.erase(pending.begin() + index);
+		}
+	}
+	tracker.flush();
+	for (vector<query>::const_iterator i = pending.begin(); i != pending.end(); i++)
+	{
+		ostringstream line;
+		line << i->id << " " << i->label << " -";
+		expected.push_back(line.str());
+	}
+	CHECK_EQUAL(out.lines.size(), expected.size());
+	for (unsigned i = 0; i < out.lines.size() && i < expected.size(); i++)
+		CHECK_EQUAL(out.lines[i], expected[i]);
+}
+
+int main()
+{
+	test_delete_reinsert();
+	return check_result();
+}
@@ -0,0 +1,46 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <string>
+#include "extract.h"
+#include "check.h"
+
+using namespace std;
+
+// the data given to update in pieces of the size
+static string hash(const string& data, unsigned piece)
+{
+	sha1 h;
+	for (unsigned pos = 0; pos < data.size(); pos += piece)
+		h.update(data.data() + pos, min<size_t>(piece, data.size() - pos));
+	return h.hex();
+}
+
+// FIPS 180-2 appendix A, with the empty message
+static void test_sha1()
+{
+	const string two_blocks("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq");
+	const string million(1000000, 'a');
+	unsigned pieces[] = {1, 3, 55, 56, 63, 64, 65, 1000};
+	for (unsigned i = 0; i < sizeof(pieces) / sizeof(pieces[0]); i++)
+	{
+		CHECK_EQUAL(hash("", pieces[i]), "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+		CHECK_EQUAL(hash("abc", pieces[i]), "a9993e364706816aba3e25717850c26c9cd0d89d");
+		CHECK_EQUAL(hash(two_blocks, pieces[i]), "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+	}
+	CHECK_EQUAL(hash(million, 1000), "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+	CHECK_EQUAL(hash(million, 4099), "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+}
+
+int main()
+{
+	test_sha1();
+	return check_result();
+}
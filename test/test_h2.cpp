@@ -0,0 +1,127 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <string>
+#include <cstdlib>
+#include "h2.h"
+#include "check.h"
+
+using namespace std;
+
+// the bytes of a hex dump, the spaces are skipped
+static string unhex(const char* text)
+{
+	string result;
+	for (const char* p = text; *p; p++)
+	{
+		if (*p == ' ')
+			continue;
+		result += char(strtoul(string(p, 2).c_str(), NULL, 16));
+		p++;
+	}
+	return result;
+}
+
+// the fields of the block as "name: value" lines
+static string decode(hpack_decoder& decoder, const char* block)
+{
+	string data = unhex(block);
+	hpack_decoder::fields fields;
+	CHECK(decoder.decode((const unsigned char*) data.data(), data.size(), fields));
+	string result;
+	for (hpack_decoder::fields::const_iterator i = fields.begin(); i != fields.end(); i++)
+		result.append(i->first).append(": ").append(i->second).append("\n");
+	return result;
+}
+
+static const char* requests[] =
+{
+	":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+	":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+	":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n"
+};
+
+static const char* responses[] =
+{
+	":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+	":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+	":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\n"
+		"content-encoding: gzip\nset-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n"
+};
+
+// RFC 7541 C.3: requests without Huffman coding, on the same dynamic table
+static void test_requests()
+{
+	hpack_decoder decoder;
+	CHECK_EQUAL(decode(decoder, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d"), requests[0]);
+	CHECK_EQUAL(decode(decoder, "8286 84be 5808 6e6f 2d63 6163 6865"), requests[1]);
+	CHECK_EQUAL(decode(decoder, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"), requests[2]);
+}
+
+// RFC 7541 C.4: the same requests with Huffman coding
+static void test_requests_huffman()
+{
+	hpack_decoder decoder;
+	CHECK_EQUAL(decode(decoder, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff"), requests[0]);
+	CHECK_EQUAL(decode(decoder, "8286 84be 5886 a8eb 1064 9cbf"), requests[1]);
+	CHECK_EQUAL(decode(decoder, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"), requests[2]);
+}
+
+// RFC 7541 C.5: responses without Huffman coding, with a dynamic table of
+// 256 bytes: the entries are evicted
+static void test_responses()
+{
+	hpack_decoder decoder;
+	decoder.set_limit(256);
+	CHECK_EQUAL(decode(decoder,
+		"4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 "
+		"2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 "
+		"6c65 2e63 6f6d"), responses[0]);
+	CHECK_EQUAL(decode(decoder, "4803 3330 37c1 c0bf"), responses[1]);
+	CHECK_EQUAL(decode(decoder,
+		"88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d "
+		"54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 "
+		"5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e "
+		"3d31"), responses[2]);
+}
+
+// RFC 7541 C.6: the same responses with Huffman coding
+static void test_responses_huffman()
+{
+	hpack_decoder decoder;
+	decoder.set_limit(256);
+	CHECK_EQUAL(decode(decoder,
+		"4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 "
+		"2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3"), responses[0]);
+	CHECK_EQUAL(decode(decoder, "4883 640e ffc1 c0bf"), responses[1]);
+	CHECK_EQUAL(decode(decoder,
+		"88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab "
+		"77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f "
+		"9587 3160 65c0 03ed 4ee5 b106 3d50 07"), responses[2]);
+}
+
+// an index past the dynamic table is not valid
+static void test_bad_index()
+{
+	hpack_decoder decoder;
+	string data = unhex("be");
+	hpack_decoder::fields fields;
+	CHECK(!decoder.decode((const unsigned char*) data.data(), data.size(), fields));
+}
+
+int main()
+{
+	test_requests();
+	test_requests_huffman();
+	test_responses();
+	test_responses_huffman();
+	test_bad_index();
+	return check_result();
+}
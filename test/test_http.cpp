@@ -0,0 +1,162 @@
+/*
+	Copyright (c) 2007 Plecno s.r.l. All Rights Reserved
+	info@plecno.com
+	via Giovio 8, 20144 Milano, Italy
+
+	Released under the terms of the GPLv3 or later
+
+	Author: Oreste Notelli <oreste.notelli@plecno.com>
+*/
+
+#include <string>
+#include "http.h"
+#include "check.h"
+
+using namespace std;
+
+static void requests(http_framer& framer, const string& data, http_segments& result)
+{
+	result.clear();
+	framer.requests(data.data(), data.size(), result);
+}
+
+static void responses(http_framer& framer, const string& data, http_segments& result)
+{
+	result.clear();
+	framer.responses(data.data(), data.size(), result);
+}
+
+// a final response whose start line arrives in two pieces after a 100
+// Continue is not taken for another interim response
+static void test_continue_split_start_line()
+{
+	http_framer framer;
+	http_segments segments;
+	requests(framer, "POST /a HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 2\r\n\r\n", segments);
+	CHECK_EQUAL(segments.size(), 1u);
+	responses(framer, "HTTP/1.1 100 Continue\r\n\r\n", segments);
+	CHECK_EQUAL(segments.size(), 1u);
+	CHECK(segments[0].start && segments[0].end && segments[0].interim);
+	requests(framer, "ok", segments);
+	CHECK(segments.size() == 1 && segments[0].end);
+	responses(framer, "HTTP/1.1 2", segments);
+	CHECK_EQUAL(segments.size(), 1u);
+	CHECK(segments[0].start && !segments[0].end && !segments[0].interim);
+	responses(framer, "00 OK\r\nContent-Length: 2\r\n\r\nok", segments);
+	CHECK_EQUAL(segments.size(), 1u);
+	CHECK(!segments[0].start && segments[0].end && !segments[0].interim);
+	CHECK(!framer.failed());
+}
+
+// the messages completed by the segments, whose bytes must be the data
+static unsigned ends(const http_segments& segments, const string& data)
+{
+	unsigned count = 0, len = 0;
+	for (http_segments::const_iterator i = segments.begin(); i != segments.end(); i++)
+	{
+		CHECK(i->data == data.data() + len);
+		len += i->len;
+		if (i->end)
+			count++;
+	}
+	CHECK_EQUAL(len, data.size());
+	return count;
+}
+
+static const string pipelined_requests =
+	"GET /a HTTP/1.1\r\nHost: h\r\n\r\n"
+	"POST /b HTTP/1.1\r\nHost: h\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n0\r\n\r\n"
+	"HEAD /c HTTP/1.1\r\nHost: h\r\n\r\n"
+	"GET /d HTTP/1.1\r\nHost: h\r\n\r\n";
+
+// the response to HEAD has a Content-Length but no body
+static const string pipelined_responses =
+	"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"
+	"HTTP/1.1 201 Created\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nid\r\n0\r\n\r\n"
+	"HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n"
+	"HTTP/1.1 304 Not Modified\r\nContent-Length: 1000\r\n\r\n";
+
+// the requests sent at once are answered in order by the responses sent at once
+static void test_pipelined()
+{
+	http_framer framer;
+	http_segments segments;
+	requests(framer, pipelined_requests, segments);
+	CHECK_EQUAL(ends(segments, pipelined_requests), 4u);
+	CHECK_EQUAL(segments.size(), 4u);
+	responses(framer, pipelined_responses, segments);
+	CHECK_EQUAL(ends(segments, pipelined_responses), 4u);
+	CHECK_EQUAL(segments.size(), 4u);
+	for (unsigned i = 0; i < segments.size(); i++)
+		CHECK(segments[i].start && segments[i].end && !segments[i].interim);
+	CHECK(!framer.failed());
+}
+
+// the same messages in pieces of every size give the same pairing
+static void test_split()
+{
+	for (unsigned piece = 1; piece <= 17; piece++)
+	{
+		http_framer framer;
+		http_segments segments;
+		unsigned request_ends = 0, response_ends = 0;
+		for (unsigned pos = 0; pos < pipelined_requests.size(); pos += piece)
+		{
+			string part = pipelined_requests.substr(pos, piece);
+			requests(framer, part, segments);
+			request_ends += ends(segments, part);
+		}
+		for (unsigned pos = 0; pos < pipelined_responses.size(); pos += piece)
+		{
+			string part = pipelined_responses.substr(pos, piece);
+			responses(framer, part, segments);
+			response_ends += ends(segments, part);
+		}
+		CHECK_EQUAL(request_ends, 4u);
+		CHECK_EQUAL(response_ends, 4u);
+		CHECK(!framer.failed());
+	}
+}
+
+class body_sink : public http_body_sink
+{
+public:
+	body_sink(): ended(false){}
+	virtual bool on_decoded(const char* data, unsigned len)
+	{
+		body.append(data, len);
+		return true;
+	}
+	virtual void on_end(){ended = true;}
+	string body;
+	bool ended;
+};
+
+// the response to HEAD announces a body that does not come: the decoder
+// sees only the response, it is complete at the end of its segment
+static void test_decoder_head()
+{
+	http_framer framer;
+	http_segments segments;
+	requests(framer, "HEAD / HTTP/1.1\r\nHost: a\r\n\r\n", segments);
+	string response = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n";
+	segments.clear();
+	framer.responses(response.data(), response.size(), segments);
+	CHECK_EQUAL(segments.size(), 1u);
+	body_sink sink;
+	http_body_decoder decoder(false, &sink);
+	for (http_segments::const_iterator i = segments.begin(); i != segments.end(); i++)
+		decoder.feed(i->data, i->len, &*i);
+	CHECK(decoder.complete());
+	CHECK(sink.ended);
+	CHECK_EQUAL(sink.body, "");
+}
+
+int main()
+{
+	test_continue_split_start_line();
+	test_pipelined();
+	test_split();
+	test_decoder_head();
+	return check_result();
+}